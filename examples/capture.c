@@ -0,0 +1,167 @@
+/*
+ * libusbx example program to stream an IN endpoint to a file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libusb.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s seconds] [-d] [-o] vid:pid endpoint file\n", name);
+	fprintf(stderr, "  -s <seconds>  capture duration (default 10)\n");
+	fprintf(stderr, "  -d            write with direct I/O\n");
+	fprintf(stderr, "  -o            drop data rather than stall when the disk falls behind\n");
+}
+
+/* find the interface of the active configuration that has the endpoint */
+static int endpoint_interface(libusb_device *dev, unsigned char endpoint)
+{
+	struct libusb_config_descriptor *config;
+	int i, j, k, r = -1;
+
+	if (libusb_get_active_config_descriptor(dev, &config) < 0)
+		return -1;
+	for (i = 0; i < config->bNumInterfaces && r < 0; i++) {
+		for (j = 0; j < config->interface[i].num_altsetting && r < 0; j++) {
+			const struct libusb_interface_descriptor *altsetting =
+				&config->interface[i].altsetting[j];
+
+			for (k = 0; k < altsetting->bNumEndpoints; k++) {
+				if (altsetting->endpoint[k].bEndpointAddress == endpoint) {
+					r = altsetting->bInterfaceNumber;
+					break;
+				}
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_device_handle *handle;
+	struct libusb_capture *capture;
+	struct libusb_capture_config config;
+	struct libusb_capture_stats stats;
+	unsigned int vid, pid, seconds = 10, i;
+	unsigned char endpoint;
+	uint64_t last_bytes = 0;
+	int arg, iface, fd, r;
+
+	memset(&config, 0, sizeof(config));
+	for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (!strcmp(argv[arg], "-s") && arg + 1 < argc)
+			seconds = (unsigned int) strtoul(argv[++arg], NULL, 0);
+		else if (!strcmp(argv[arg], "-d"))
+			config.flags |= LIBUSB_CAPTURE_DIRECT_IO;
+		else if (!strcmp(argv[arg], "-o"))
+			config.flags |= LIBUSB_CAPTURE_DROP_ON_OVERRUN;
+		else
+			break;
+	}
+	if (argc - arg != 3 || sscanf(argv[arg], "%x:%x", &vid, &pid) != 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	endpoint = (unsigned char) strtoul(argv[arg + 1], NULL, 0);
+
+	r = libusb_init(NULL);
+	if (r < 0) {
+		fprintf(stderr, "failed to initialise libusb: %s\n", libusb_error_name(r));
+		return EXIT_FAILURE;
+	}
+
+	handle = libusb_open_device_with_vid_pid(NULL, (uint16_t) vid, (uint16_t) pid);
+	if (!handle) {
+		fprintf(stderr, "device %04x:%04x not found\n", vid, pid);
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out_exit;
+	}
+	iface = endpoint_interface(libusb_get_device(handle), endpoint);
+	if (iface < 0) {
+		fprintf(stderr, "endpoint 0x%02x not found\n", endpoint);
+		r = LIBUSB_ERROR_NOT_FOUND;
+		goto out_close;
+	}
+	if (libusb_kernel_driver_active(handle, iface) == 1)
+		libusb_detach_kernel_driver(handle, iface);
+	r = libusb_claim_interface(handle, iface);
+	if (r < 0) {
+		fprintf(stderr, "failed to claim interface %d: %s\n", iface, libusb_error_name(r));
+		goto out_close;
+	}
+
+	fd = open(argv[arg + 2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(argv[arg + 2]);
+		r = LIBUSB_ERROR_ACCESS;
+		goto out_release;
+	}
+
+	/* the capture transfers complete through the event handling */
+	r = libusb_start_event_thread(NULL, 0, -1, 0);
+	if (r < 0) {
+		fprintf(stderr, "failed to start the event thread: %s\n", libusb_error_name(r));
+		goto out_file;
+	}
+
+	r = libusb_capture_start(handle, endpoint, fd, &config, &capture);
+	if (r < 0) {
+		fprintf(stderr, "failed to start the capture: %s\n", libusb_error_name(r));
+		goto out_thread;
+	}
+	printf("capturing endpoint 0x%02x to %s for %u s\n", endpoint, argv[arg + 2], seconds);
+
+	for (i = 0; i < seconds; i++) {
+		sleep(1);
+		libusb_capture_get_stats(capture, &stats);
+		printf("%4u s: %8.2f MB/s, %d/%d buffers queued, %lu overruns\n", i + 1,
+			(double) (stats.bytes_captured - last_bytes) / 1000000.0,
+			stats.buffers_queued, stats.max_buffers_queued,
+			(unsigned long) stats.overruns);
+		last_bytes = stats.bytes_captured;
+		if (stats.status < 0)
+			break;
+	}
+
+	r = libusb_capture_stop(capture, &stats);
+	printf("%s: %lu bytes captured, %lu written, %lu dropped, %lu transfer errors, "
+		"%lu iso packets lost, longest write %lu us\n",
+		r < 0 ? libusb_error_name(r) : "done",
+		(unsigned long) stats.bytes_captured, (unsigned long) stats.bytes_written,
+		(unsigned long) stats.bytes_dropped, (unsigned long) stats.transfer_errors,
+		(unsigned long) stats.iso_packets_lost,
+		(unsigned long) (stats.max_write_nsecs / 1000));
+
+out_thread:
+	libusb_stop_event_thread(NULL);
+out_file:
+	close(fd);
+out_release:
+	libusb_release_interface(handle, iface);
+out_close:
+	libusb_close(handle);
+out_exit:
+	libusb_exit(NULL);
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
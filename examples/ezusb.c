@@ -25,6 +25,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if !defined(_WIN32) || defined(__CYGWIN__)
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <process.h>
+#define getpid _getpid
+#endif
 
 #include "libusb.h"
 #include "ezusb.h"
@@ -106,6 +117,57 @@ static bool fx2lp_is_external(uint32_t addr, size_t len)
 		return true;
 }
 
+/*
+ * EZ-USB original/FX and FX2 devices differ, apart from the 8051 core.
+ * The boundaries are the addresses where memory switches between on-chip
+ * and external RAM, which a single write request must not straddle.
+ */
+struct fx_memory {
+	uint32_t cpucs_addr;
+	bool (*is_external)(uint32_t addr, size_t len);
+	const uint32_t *boundaries;
+	int nboundaries;
+};
+
+static const uint32_t fx_boundaries[] = { 0x1b40 };
+static const uint32_t fx2_boundaries[] = { 0x2000, 0xe000, 0xe200 };
+static const uint32_t fx2lp_boundaries[] = { 0x4000, 0xe000, 0xe200 };
+
+static const struct fx_memory fx_memories[] = {
+	{ 0x7f92, fx_is_external, fx_boundaries, 1 },
+	{ 0xe600, fx2_is_external, fx2_boundaries, 3 },
+	{ 0xe600, fx2lp_is_external, fx2lp_boundaries, 3 },
+};
+
+static const struct fx_memory *fx_memory(int fx_type)
+{
+	switch(fx_type) {
+	case FX_TYPE_FX2LP:
+		return &fx_memories[2];
+	case FX_TYPE_FX2:
+		return &fx_memories[1];
+	default:
+		return &fx_memories[0];
+	}
+}
+
+uint64_t ezusb_time_us(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 
 /*****************************************************************************/
 
@@ -331,9 +393,9 @@ static int parse_ihex(FILE *image, void *context,
 			return -4;
 		}
 
-		/* FIXME check for _physically_ contiguous not just virtually
-		 * e.g. on FX2 0x1f00-0x2100 includes both on-chip and external
-		 * memory so it's not really contiguous */
+		/* Segments that are only virtually contiguous, e.g. on FX2
+		 * 0x1f00-0x2100 includes both on-chip and external memory, are
+		 * split again by compile_image() */
 
 		/* flush the saved data if it's not contiguous,
 		* or when we've buffered as much as we can.
@@ -477,6 +539,645 @@ int (*parse[IMG_TYPE_MAX])(FILE *image, void *context, bool (*is_external)(uint3
 
 /*****************************************************************************/
 
+/*
+ * Append a segment to an in-memory image. Used as the poke() function of
+ * the parsers above, so that a file is only ever parsed once.
+ */
+static int image_poke(void *context, uint32_t addr, bool external,
+	const unsigned char *data, size_t len)
+{
+	struct ezusb_image *img = (struct ezusb_image*)context;
+	struct ezusb_segment *seg;
+
+	if (img->count == img->size) {
+		int size = img->size ? 2 * img->size : 64;
+		seg = realloc(img->segments, size * sizeof(*seg));
+		if (seg == NULL) {
+			logerror("could not allocate image segments\n");
+			return -ENOMEM;
+		}
+		img->segments = seg;
+		img->size = size;
+	}
+
+	seg = &img->segments[img->count];
+	seg->data = malloc(len ? len : 1);
+	if (seg->data == NULL) {
+		logerror("could not allocate image segment\n");
+		return -ENOMEM;
+	}
+	memcpy(seg->data, data, len);
+	seg->addr = addr;
+	seg->external = external;
+	seg->len = len;
+	img->count++;
+	img->total += len;
+	if (len > img->max_len)
+		img->max_len = len;
+	return 0;
+}
+
+/*
+ * Read the sections of a Cypress FX3 IMG file, checking the image
+ * checksum along the way.
+ * See http://www.cypress.com/?docID=41351 (AN76405 PDF) for more info.
+ */
+static int fx3_parse_image(FILE *image, struct ezusb_image *img)
+{
+	uint32_t dCheckSum, dExpectedCheckSum, dAddress, i, dLength;
+	uint32_t* dImageBuf;
+	unsigned char hBuf[4];
+
+	// Read header
+	if (fread(hBuf, sizeof(char), sizeof(hBuf), image) != sizeof(hBuf)) {
+		logerror("could not read image header");
+		return -3;
+	}
+
+	// check "CY" signature byte and format
+	if ((hBuf[0] != 'C') || (hBuf[1] != 'Y')) {
+		logerror("image doesn't have a CYpress signature\n");
+		return -3;
+	}
+
+	// Check bImageType
+	switch(hBuf[3]) {
+	case 0xB0:
+		if (verbose)
+			logerror("normal FW binary %s image with checksum\n", (hBuf[2]&0x01)?"data":"executable");
+		break;
+	case 0xB1:
+		logerror("security binary image is not currently supported\n");
+		return -3;
+	case 0xB2:
+		logerror("VID:PID image is not currently supported\n");
+		return -3;
+	default:
+		logerror("invalid image type 0x%02X\n", hBuf[3]);
+		return -3;
+	}
+
+	dCheckSum = 0;
+	while (1) {
+		if ((fread(&dLength, sizeof(uint32_t), 1, image) != 1) ||  // read dLength
+			(fread(&dAddress, sizeof(uint32_t), 1, image) != 1)) { // read dAddress
+			logerror("could not read image");
+			return -3;
+		}
+		if (dLength == 0)
+			break; // done
+
+		dImageBuf = calloc(dLength, sizeof(uint32_t));
+		if (dImageBuf == NULL) {
+			logerror("could not allocate buffer for image chunk\n");
+			return -4;
+		}
+
+		// read sections
+		if (fread(dImageBuf, sizeof(uint32_t), dLength, image) != dLength) {
+			logerror("could not read image");
+			free(dImageBuf);
+			return -3;
+		}
+		for (i = 0; i < dLength; i++)
+			dCheckSum += dImageBuf[i];
+		dLength <<= 2; // convert to Byte length
+
+		// compile_image() splits sections into requests
+		if (image_poke(img, dAddress, false, (unsigned char*)dImageBuf, dLength) < 0) {
+			free(dImageBuf);
+			return -4;
+		}
+		free(dImageBuf);
+	}
+
+	// read pre-computed checksum data
+	if ((fread(&dExpectedCheckSum, sizeof(uint32_t), 1, image) != 1) ||
+		(dCheckSum != dExpectedCheckSum)) {
+		logerror("checksum error\n");
+		return -7;
+	}
+
+	// the terminating section holds the Program Entry
+	img->entry = dAddress;
+	return 0;
+}
+
+/*
+ * Compile a freshly parsed image into the form it gets uploaded in:
+ * segments sorted by address, with overlapping or contiguous ones merged
+ * (data that comes later in the file wins), then split into requests of
+ * at most EZUSB_MAX_PAYLOAD bytes that never straddle an on-chip/external
+ * memory boundary. All segments then share a single data buffer.
+ *
+ * mem is NULL for FX3 images, which have no external memory.
+ */
+struct image_run {
+	uint64_t start;
+	uint64_t end;
+	size_t offset;
+};
+
+static int compare_segments(const void *a, const void *b)
+{
+	const struct ezusb_segment *sa = (const struct ezusb_segment *)a;
+	const struct ezusb_segment *sb = (const struct ezusb_segment *)b;
+
+	if (sa->addr != sb->addr)
+		return (sa->addr < sb->addr) ? -1 : 1;
+	return 0;
+}
+
+static uint64_t next_boundary(const struct fx_memory *mem, uint64_t addr)
+{
+	int i;
+
+	if (mem != NULL) {
+		for (i = 0; i < mem->nboundaries; i++) {
+			if (mem->boundaries[i] > addr)
+				return mem->boundaries[i];
+		}
+	}
+	return UINT64_MAX;
+}
+
+static int compile_image(struct ezusb_image *img, const struct fx_memory *mem)
+{
+	struct ezusb_segment *sorted = NULL, *segments = NULL;
+	struct image_run *runs = NULL;
+	unsigned char *data = NULL;
+	uint64_t addr, end;
+	size_t total = 0, max_len = 0;
+	int i, lo, hi, nruns = 0, count = 0;
+
+	if (img->count == 0)
+		return 0;
+
+	/* sort a copy, so that the original file order is kept for the data */
+	sorted = malloc(img->count * sizeof(*sorted));
+	runs = malloc(img->count * sizeof(*runs));
+	if ((sorted == NULL) || (runs == NULL))
+		goto nomem;
+	memcpy(sorted, img->segments, img->count * sizeof(*sorted));
+	qsort(sorted, img->count, sizeof(*sorted), compare_segments);
+
+	for (i = 0; i < img->count; i++) {
+		addr = sorted[i].addr;
+		end = addr + sorted[i].len;
+		if ((nruns != 0) && (addr <= runs[nruns - 1].end)) {
+			if (end > runs[nruns - 1].end)
+				runs[nruns - 1].end = end;
+			continue;
+		}
+		runs[nruns].start = addr;
+		runs[nruns].end = end;
+		nruns++;
+	}
+	for (i = 0; i < nruns; i++) {
+		runs[i].offset = total;
+		total += (size_t)(runs[i].end - runs[i].start);
+		for (addr = runs[i].start; addr < runs[i].end; count++) {
+			end = runs[i].end;
+			if (end > addr + EZUSB_MAX_PAYLOAD)
+				end = addr + EZUSB_MAX_PAYLOAD;
+			if (end > next_boundary(mem, addr))
+				end = next_boundary(mem, addr);
+			addr = end;
+		}
+	}
+
+	data = malloc(total ? total : 1);
+	segments = malloc(count * sizeof(*segments));
+	if ((data == NULL) || (segments == NULL))
+		goto nomem;
+
+	/* copy the data in file order, into the run each segment belongs to */
+	for (i = 0; i < img->count; i++) {
+		lo = 0;
+		hi = nruns - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (runs[mid].start <= img->segments[i].addr)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		memcpy(data + runs[lo].offset + (img->segments[i].addr - runs[lo].start),
+			img->segments[i].data, img->segments[i].len);
+	}
+
+	count = 0;
+	for (i = 0; i < nruns; i++) {
+		for (addr = runs[i].start; addr < runs[i].end; count++) {
+			end = runs[i].end;
+			if (end > addr + EZUSB_MAX_PAYLOAD)
+				end = addr + EZUSB_MAX_PAYLOAD;
+			if (end > next_boundary(mem, addr))
+				end = next_boundary(mem, addr);
+			segments[count].addr = (uint32_t)addr;
+			segments[count].len = (size_t)(end - addr);
+			segments[count].data = data + runs[i].offset + (size_t)(addr - runs[i].start);
+			segments[count].external = (mem != NULL)
+				&& mem->is_external((uint32_t)addr, segments[count].len);
+			if (segments[count].len > max_len)
+				max_len = segments[count].len;
+			addr = end;
+		}
+	}
+
+	if (verbose > 1)
+		logerror("compiled %d segments (%d bytes) into %d requests (%d bytes)\n",
+			img->count, (int)img->total, count, (int)total);
+
+	for (i = 0; i < img->count; i++)
+		free(img->segments[i].data);
+	free(img->segments);
+	img->segments = segments;
+	img->count = img->size = count;
+	img->total = total;
+	img->max_len = max_len;
+	img->data = data;
+	img->data_size = total;
+	free(sorted);
+	free(runs);
+	return 0;
+
+nomem:
+	logerror("could not allocate compiled image\n");
+	free(segments);
+	free(data);
+	free(sorted);
+	free(runs);
+	return -4;
+}
+
+int ezusb_parse_image(const char *path, int fx_type, int img_type,
+	struct ezusb_image **image)
+{
+	FILE *file;
+	struct ezusb_image *img;
+	const struct fx_memory *mem = NULL;
+	uint8_t iic_header[8] = { 0 };
+	int status;
+
+	if ((img_type < 0) || (img_type >= IMG_TYPE_MAX)
+		|| ((fx_type == FX_TYPE_FX3) != (img_type == IMG_TYPE_IMG))) {
+		logerror("%s: image type is not supported for this device\n", path);
+		return -1;
+	}
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		logerror("%s: unable to open for input.\n", path);
+		return -2;
+	} else if (verbose > 1)
+		logerror("open firmware image %s for RAM upload\n", path);
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		fclose(file);
+		return -4;
+	}
+	img->fx_type = fx_type;
+	img->img_type = img_type;
+
+	if (fx_type == FX_TYPE_FX3) {
+		status = fx3_parse_image(file, img);
+	} else {
+		status = 0;
+		if (img_type == IMG_TYPE_IIC) {
+			if ( (fread(iic_header, 1, sizeof(iic_header), file) != sizeof(iic_header))
+			  || (((fx_type == FX_TYPE_FX2LP) || (fx_type == FX_TYPE_FX2)) && (iic_header[0] != 0xC2))
+			  || ((fx_type == FX_TYPE_AN21) && (iic_header[0] != 0xB2))
+			  || ((fx_type == FX_TYPE_FX1) && (iic_header[0] != 0xB6)) ) {
+				logerror("IIC image does not contain executable code - cannot load to RAM.\n");
+				status = -1;
+			}
+		}
+		if (status == 0) {
+			mem = fx_memory(fx_type);
+			status = parse[img_type](file, img, mem->is_external, image_poke);
+			if (status < 0)
+				logerror("unable to parse %s\n", path);
+		}
+	}
+	fclose(file);
+
+	if (status == 0)
+		status = compile_image(img, mem);
+	if (status < 0) {
+		ezusb_free_image(img);
+		return status;
+	}
+	if (verbose > 1)
+		logerror("%s: %d bytes in %d segments\n", path, (int)img->total, img->count);
+	*image = img;
+	return 0;
+}
+
+void ezusb_free_image(struct ezusb_image *image)
+{
+	int i;
+
+	if (image == NULL)
+		return;
+	if (image->mapped) {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+		munmap(image->data, image->data_size);
+#endif
+	} else if (image->data != NULL) {
+		free(image->data);
+	} else {
+		for (i = 0; i < image->count; i++)
+			free(image->segments[i].data);
+	}
+	free(image->segments);
+	free(image);
+}
+
+/*
+ * Compiled images can be kept in a cache file, which is memory-mapped
+ * where possible. The cache records the path, device, inode, size and
+ * modification time (in nanoseconds where available) of the source file,
+ * and is rebuilt whenever any of those change. It is meant to be used on
+ * the machine that wrote it, so values are in host order.
+ *
+ * The file is laid out as the header, the source path padded to 8 bytes,
+ * the segment table and the segment data. It is never modified in place,
+ * but replaced with a rename() once fully written, so that concurrent
+ * loaders that have it mapped keep a consistent copy.
+ */
+#define EZUSB_CACHE_MAGIC	0x43425a45	/* "EZBC" */
+#define EZUSB_CACHE_VERSION	2
+
+#if defined(__APPLE__)
+#define EZUSB_MTIME_NSEC(st)	((int64_t)(st)->st_mtimespec.tv_nsec)
+#elif !defined(_WIN32) || defined(__CYGWIN__)
+#define EZUSB_MTIME_NSEC(st)	((int64_t)(st)->st_mtim.tv_nsec)
+#else
+#define EZUSB_MTIME_NSEC(st)	((int64_t)0)
+#endif
+
+struct ezusb_cache_header {
+	uint64_t source_size;
+	int64_t source_mtime;
+	int64_t source_mtime_nsec;
+	uint64_t source_dev;
+	uint64_t source_ino;
+	uint64_t total;
+	uint32_t magic;
+	uint32_t version;
+	int32_t fx_type;
+	int32_t img_type;
+	uint32_t count;
+	uint32_t entry;
+	uint32_t path_len;	/* including the NUL and padding */
+	uint32_t reserved;
+};
+
+struct ezusb_cache_segment {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t offset;	/* from the start of the segment data */
+	uint32_t external;
+};
+
+static size_t cache_path_len(const char *path)
+{
+	return (strlen(path) + 1 + 7) & ~(size_t)7;
+}
+
+static int read_cache(const char *cache_path, const char *path,
+	const struct stat *source, int fx_type, int img_type,
+	struct ezusb_image **image)
+{
+	struct ezusb_image *img;
+	struct ezusb_cache_header header;
+	const struct ezusb_cache_segment *cseg;
+	unsigned char *base, *data;
+	size_t size, rest, path_len;
+	uint32_t i;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	struct stat st;
+	int fd;
+
+	fd = open(cache_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(header))) {
+		close(fd);
+		return -1;
+	}
+	size = (size_t)st.st_size;
+	base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+#else
+	FILE *file;
+	long len;
+
+	file = fopen(cache_path, "rb");
+	if (file == NULL)
+		return -1;
+	fseek(file, 0L, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0L, SEEK_SET);
+	base = (len >= (long)sizeof(header)) ? malloc(len) : NULL;
+	if ((base == NULL) || (fread(base, 1, len, file) != (size_t)len)) {
+		free(base);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	size = (size_t)len;
+#endif
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL)
+		goto stale;
+	img->data = base;
+	img->data_size = size;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	img->mapped = true;
+#endif
+
+	/* every length is checked against what is left of the file, so that
+	 * a damaged header cannot make the sums below wrap around */
+	memcpy(&header, base, sizeof(header));
+	rest = size - sizeof(header);
+	path_len = cache_path_len(path);
+	if ((header.magic != EZUSB_CACHE_MAGIC) || (header.version != EZUSB_CACHE_VERSION)
+		|| (header.fx_type != fx_type) || (header.img_type != img_type)
+		|| (header.source_size != (uint64_t)source->st_size)
+		|| (header.source_mtime != (int64_t)source->st_mtime)
+		|| (header.source_mtime_nsec != EZUSB_MTIME_NSEC(source))
+		|| (header.source_dev != (uint64_t)source->st_dev)
+		|| (header.source_ino != (uint64_t)source->st_ino)
+		|| (header.path_len != path_len) || (path_len > rest)
+		|| (strncmp((const char *)base + sizeof(header), path, path_len) != 0))
+		goto stale;
+	rest -= path_len;
+	if ((header.count > rest / sizeof(*cseg))
+		|| (header.total != rest - header.count * sizeof(*cseg)))
+		goto stale;
+
+	img->segments = calloc(header.count ? header.count : 1, sizeof(*img->segments));
+	if (img->segments == NULL)
+		goto stale;
+	cseg = (const struct ezusb_cache_segment *)(base + sizeof(header) + path_len);
+	data = (unsigned char *)(cseg + header.count);
+	for (i = 0; i < header.count; i++) {
+		if ((cseg[i].len > EZUSB_MAX_PAYLOAD)
+			|| ((uint64_t)cseg[i].offset + cseg[i].len > header.total))
+			goto stale;
+		img->segments[i].addr = cseg[i].addr;
+		img->segments[i].len = cseg[i].len;
+		img->segments[i].external = (cseg[i].external != 0);
+		img->segments[i].data = data + cseg[i].offset;
+		if (cseg[i].len > img->max_len)
+			img->max_len = cseg[i].len;
+	}
+	img->fx_type = fx_type;
+	img->img_type = img_type;
+	img->count = img->size = (int)header.count;
+	img->total = (size_t)header.total;
+	img->entry = header.entry;
+
+	if (verbose > 1)
+		logerror("using cached image %s: %d bytes in %d segments\n",
+			cache_path, (int)img->total, img->count);
+	*image = img;
+	return 0;
+
+stale:
+	if (img != NULL) {
+		/* ezusb_free_image() must not look at the segment data */
+		img->count = 0;
+		ezusb_free_image(img);
+	} else {
+#if !defined(_WIN32) || defined(__CYGWIN__)
+		munmap(base, size);
+#else
+		free(base);
+#endif
+	}
+	return -1;
+}
+
+static int write_cache(const char *cache_path, const char *path,
+	const struct stat *source, const struct ezusb_image *img)
+{
+	struct ezusb_cache_header header;
+	struct ezusb_cache_segment cseg;
+	static const char padding[8];
+	size_t path_len = cache_path_len(path);
+	char *tmp_path;
+	FILE *file;
+	int i;
+	bool ok;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = EZUSB_CACHE_MAGIC;
+	header.version = EZUSB_CACHE_VERSION;
+	header.fx_type = img->fx_type;
+	header.img_type = img->img_type;
+	header.source_size = (uint64_t)source->st_size;
+	header.source_mtime = (int64_t)source->st_mtime;
+	header.source_mtime_nsec = EZUSB_MTIME_NSEC(source);
+	header.source_dev = (uint64_t)source->st_dev;
+	header.source_ino = (uint64_t)source->st_ino;
+	header.count = (uint32_t)img->count;
+	header.total = img->total;
+	header.entry = img->entry;
+	header.path_len = (uint32_t)path_len;
+
+	/* written next to the cache, so that it can be renamed over it */
+	tmp_path = malloc(strlen(cache_path) + 16);
+	if (tmp_path == NULL)
+		return -1;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+	{
+		mode_t mask;
+		int fd;
+
+		sprintf(tmp_path, "%s.XXXXXX", cache_path);
+		fd = mkstemp(tmp_path);
+		/* mkstemp() creates the file for the owner only */
+		mask = umask(0);
+		umask(mask);
+		if (fd >= 0)
+			fchmod(fd, 0666 & ~mask);
+		file = (fd < 0) ? NULL : fdopen(fd, "wb");
+		if ((file == NULL) && (fd >= 0)) {
+			close(fd);
+			remove(tmp_path);
+		}
+	}
+#else
+	sprintf(tmp_path, "%s.%d", cache_path, (int)getpid());
+	file = fopen(tmp_path, "wb");
+#endif
+	if (file == NULL) {
+		free(tmp_path);
+		return -1;
+	}
+
+	ok = (fwrite(&header, sizeof(header), 1, file) == 1)
+		&& (fwrite(path, 1, strlen(path), file) == strlen(path))
+		&& (fwrite(padding, 1, path_len - strlen(path), file)
+			== path_len - strlen(path));
+	for (i = 0; ok && (i < img->count); i++) {
+		memset(&cseg, 0, sizeof(cseg));
+		cseg.addr = img->segments[i].addr;
+		cseg.len = (uint32_t)img->segments[i].len;
+		cseg.offset = (uint32_t)(img->segments[i].data - img->data);
+		cseg.external = img->segments[i].external ? 1 : 0;
+		ok = (fwrite(&cseg, sizeof(cseg), 1, file) == 1);
+	}
+	if (ok && (img->total != 0))
+		ok = (fwrite(img->data, 1, img->total, file) == img->total);
+	if ((fclose(file) != 0) || !ok)
+		goto fail;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	/* rename() does not replace an existing file there */
+	remove(cache_path);
+#endif
+	if (rename(tmp_path, cache_path) != 0)
+		goto fail;
+	free(tmp_path);
+	return 0;
+
+fail:
+	remove(tmp_path);
+	free(tmp_path);
+	return -1;
+}
+
+int ezusb_open_image(const char *path, const char *cache_path, int fx_type,
+	int img_type, struct ezusb_image **image)
+{
+	struct stat source;
+	int status;
+
+	if ((cache_path == NULL) || (stat(path, &source) < 0))
+		return ezusb_parse_image(path, fx_type, img_type, image);
+
+	if (read_cache(cache_path, path, &source, fx_type, img_type, image) == 0)
+		return 0;
+
+	status = ezusb_parse_image(path, fx_type, img_type, image);
+	if (status < 0)
+		return status;
+	if (write_cache(cache_path, path, &source, *image) < 0)
+		logerror("%s: unable to write image cache\n", cache_path);
+	else if (verbose > 1)
+		logerror("wrote image cache %s\n", cache_path);
+	return 0;
+}
+
+/*****************************************************************************/
+
 /*
  * For writing to RAM using a first (hardware) or second (software)
  * stage loader and 0xA0 or 0xA3 vendor requests
@@ -557,48 +1258,11 @@ static int ram_poke(void *context, uint32_t addr, bool external,
  * Load a Cypress Image file into target RAM.
  * See http://www.cypress.com/?docID=41351 (AN76405 PDF) for more info.
  */
-static int fx3_load_ram(libusb_device_handle *device, const char *path)
+static int fx3_load_image(libusb_device_handle *device, const struct ezusb_image *img)
 {
-	uint32_t dCheckSum, dExpectedCheckSum, dAddress, i, dLen, dLength;
-	uint32_t* dImageBuf;
-	unsigned char *bBuf, hBuf[4], blBuf[4], rBuf[4096];
-	FILE *image;
-
-	image = fopen(path, "rb");
-	if (image == NULL) {
-		logerror("unable to open '%s' for input\n", path);
-		return -2;
-	} else if (verbose)
-		logerror("open firmware image %s for RAM upload\n", path);
-
-	// Read header
-	if (fread(hBuf, sizeof(char), sizeof(hBuf), image) != sizeof(hBuf)) {
-		logerror("could not read image header");
-		return -3;
-	}
-
-	// check "CY" signature byte and format
-	if ((hBuf[0] != 'C') || (hBuf[1] != 'Y')) {
-		logerror("image doesn't have a CYpress signature\n");
-		return -3;
-	}
-
-	// Check bImageType
-	switch(hBuf[3]) {
-	case 0xB0:
-		if (verbose)
-			logerror("normal FW binary %s image with checksum\n", (hBuf[2]&0x01)?"data":"executable");
-		break;
-	case 0xB1:
-		logerror("security binary image is not currently supported\n");
-		return -3;
-	case 0xB2:
-		logerror("VID:PID image is not currently supported\n");
-		return -3;
-	default:
-		logerror("invalid image type 0x%02X\n", hBuf[3]);
-		return -3;
-	}
+	const struct ezusb_segment *seg;
+	unsigned char blBuf[4] = { 0 }, rBuf[EZUSB_MAX_PAYLOAD];
+	int i;
 
 	// Read the bootloader version
 	if (verbose) {
@@ -609,80 +1273,47 @@ static int fx3_load_ram(libusb_device_handle *device, const char *path)
 		logerror("FX3 bootloader version: 0x%02X%02X%02X%02X\n", blBuf[3], blBuf[2], blBuf[1], blBuf[0]);
 	}
 
-	dCheckSum = 0;
 	if (verbose)
 		logerror("writing image...\n");
-	while (1) {
-		if ((fread(&dLength, sizeof(uint32_t), 1, image) != 1) ||  // read dLength
-			(fread(&dAddress, sizeof(uint32_t), 1, image) != 1)) { // read dAddress
-			logerror("could not read image");
-			return -3;
-		}
-		if (dLength == 0)
-			break; // done
-
-		dImageBuf = calloc(dLength, sizeof(uint32_t));
-		if (dImageBuf == NULL) {
-			logerror("could not allocate buffer for image chunk\n");
-			return -4;
+	for (i = 0; i < img->count; i++) {
+		seg = &img->segments[i];
+		if ((ezusb_write(device, "write firmware", RW_INTERNAL, seg->addr, seg->data, seg->len) < 0) ||
+			(ezusb_read(device, "read firmware", RW_INTERNAL, seg->addr, rBuf, seg->len) < 0)) {
+			logerror("R/W error\n");
+			return -5;
 		}
-
-		// read sections
-		if (fread(dImageBuf, sizeof(uint32_t), dLength, image) != dLength) {
-			logerror("could not read image");
-			free(dImageBuf);
-			return -3;
+		// Verify data: rBuf with the segment
+		if (memcmp(rBuf, seg->data, seg->len) != 0) {
+			logerror("verify error");
+			return -6;
 		}
-		for (i = 0; i < dLength; i++)
-			dCheckSum += dImageBuf[i];
-		dLength <<= 2; // convert to Byte length
-		bBuf = (unsigned char*) dImageBuf;
-
-		while (dLength > 0) {
-			dLen = 4096; // 4K max
-			if (dLen > dLength)
-				dLen = dLength;
-			if ((ezusb_write(device, "write firmware", RW_INTERNAL, dAddress, bBuf, dLen) < 0) ||
-				(ezusb_read(device, "read firmware", RW_INTERNAL, dAddress, rBuf, dLen) < 0)) {
-				logerror("R/W error\n");
-				free(dImageBuf);
-				return -5;
-			}
-			// Verify data: rBuf with bBuf
-			for (i = 0; i < dLen; i++) {
-				if (rBuf[i] != bBuf[i]) {
-					logerror("verify error");
-					free(dImageBuf);
-					return -6;
-				}
-			}
-
-			dLength -= dLen;
-			bBuf += dLen;
-			dAddress += dLen;
-		}
-		free(dImageBuf);
-	}
-
-	// read pre-computed checksum data
-	if ((fread(&dExpectedCheckSum, sizeof(uint32_t), 1, image) != 1) ||
-		(dCheckSum != dExpectedCheckSum)) {
-		logerror("checksum error\n");
-		return -7;
 	}
 
 	// transfer execution to Program Entry
-	if (!ezusb_fx3_jump(device, dAddress)) {
+	if (!ezusb_fx3_jump(device, img->entry))
 		return -6;
-	}
 
 	return 0;
 }
 
 /*
- * Load a firmware file into target RAM. device is the open libusbx
- * device, and the path is the name of the source file. Open the file,
- * parse the bytes, and write them in one or two phases.
+ * Write every segment of an image, as filtered by the poke context mode.
+ */
+static int poke_image(struct ram_poke_context *ctx, const struct ezusb_image *img)
+{
+	int i, status;
+
+	for (i = 0; i < img->count; i++) {
+		status = ram_poke(ctx, img->segments[i].addr, img->segments[i].external,
+			img->segments[i].data, img->segments[i].len);
+		if (status < 0)
+			return status;
+	}
+	return 0;
+}
+
+/*
+ * Load a parsed image into target RAM, in one or two phases.
  *
  * If stage == 0, this uses the first stage loader, built into EZ-USB
  * hardware but limited to writing on-chip memory or CPUCS.  Everything
@@ -691,59 +1322,25 @@ static int fx3_load_ram(libusb_device_handle *device, const char *path)
  *
  * Otherwise, things are written in two stages.  First the external
  * memory is written, expecting a second stage loader to have already
- * been loaded.  Then file is re-parsed and on-chip memory is written.
+ * been loaded.  Then on-chip memory is written from the same image.
  */
-int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type, int img_type, int stage)
+int ezusb_load_ram_image(libusb_device_handle *device, const struct ezusb_image *img, int stage)
 {
-	FILE *image;
-	uint32_t cpucs_addr;
-	bool (*is_external)(uint32_t off, size_t len);
+	const struct fx_memory *mem;
 	struct ram_poke_context ctx;
 	int status;
-	uint8_t iic_header[8] = { 0 };
 
-	if (fx_type == FX_TYPE_FX3)
-		return fx3_load_ram(device, path);
-
-	image = fopen(path, "rb");
-	if (image == NULL) {
-		logerror("%s: unable to open for input.\n", path);
-		return -2;
-	} else if (verbose > 1)
-		logerror("open firmware image %s for RAM upload\n", path);
+	if (img->fx_type == FX_TYPE_FX3)
+		return fx3_load_image(device, img);
 
-	if (img_type == IMG_TYPE_IIC) {
-		if ( (fread(iic_header, 1, sizeof(iic_header), image) != sizeof(iic_header))
-		  || (((fx_type == FX_TYPE_FX2LP) || (fx_type == FX_TYPE_FX2)) && (iic_header[0] != 0xC2))
-		  || ((fx_type == FX_TYPE_AN21) && (iic_header[0] != 0xB2))
-		  || ((fx_type == FX_TYPE_FX1) && (iic_header[0] != 0xB6)) ) {
-			logerror("IIC image does not contain executable code - cannot load to RAM.\n");
-			return -1;
-		}
-	}
-
-	/* EZ-USB original/FX and FX2 devices differ, apart from the 8051 core */
-	switch(fx_type) {
-	case FX_TYPE_FX2LP:
-		cpucs_addr = 0xe600;
-		is_external = fx2lp_is_external;
-		break;
-	case FX_TYPE_FX2:
-		cpucs_addr = 0xe600;
-		is_external = fx2_is_external;
-		break;
-	default:
-		cpucs_addr = 0x7f92;
-		is_external = fx_is_external;
-		break;
-	}
+	mem = fx_memory(img->fx_type);
 
 	/* use only first stage loader? */
 	if (stage == 0) {
 		ctx.mode = internal_only;
 
 		/* if required, halt the CPU while we overwrite its code/data */
-		if (cpucs_addr && !ezusb_cpucs(device, cpucs_addr, false))
+		if (mem->cpucs_addr && !ezusb_cpucs(device, mem->cpucs_addr, false))
 			return -1;
 
 		/* 2nd stage, first part? loader was already uploaded */
@@ -755,42 +1352,423 @@ int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type,
 			logerror("2nd stage: write external memory\n");
 	}
 
-	/* scan the image, first (maybe only) time */
+	/* walk the image, first (maybe only) time */
 	ctx.device = device;
 	ctx.total = ctx.count = 0;
-	status = parse[img_type](image, &ctx, is_external, ram_poke);
+	status = poke_image(&ctx, img);
 	if (status < 0) {
-		logerror("unable to upload %s\n", path);
+		logerror("unable to upload firmware\n");
 		return status;
 	}
 
-	/* second part of 2nd stage: rescan */
-	// TODO: what should we do for non HEX images there?
+	/* second part of 2nd stage: walk the image again */
 	if (stage) {
 		ctx.mode = skip_external;
 
 		/* if needed, halt the CPU while we overwrite the 1st stage loader */
-		if (cpucs_addr && !ezusb_cpucs(device, cpucs_addr, false))
+		if (mem->cpucs_addr && !ezusb_cpucs(device, mem->cpucs_addr, false))
 			return -1;
 
 		/* at least write the interrupt vectors (at 0x0000) for reset! */
-		rewind(image);
 		if (verbose)
 			logerror("2nd stage: write on-chip memory\n");
-		status = parse_ihex(image, &ctx, is_external, ram_poke);
+		status = poke_image(&ctx, img);
 		if (status < 0) {
-			logerror("unable to completely upload %s\n", path);
+			logerror("unable to completely upload firmware\n");
 			return status;
 		}
 	}
 
-	if (verbose)
+	if (verbose && ctx.count)
 		logerror("... WROTE: %d bytes, %d segments, avg %d\n",
 		(int)ctx.total, (int)ctx.count, (int)(ctx.total/ctx.count));
 
 	/* if required, reset the CPU so it runs what we just uploaded */
-	if (cpucs_addr && !ezusb_cpucs(device, cpucs_addr, true))
+	if (mem->cpucs_addr && !ezusb_cpucs(device, mem->cpucs_addr, true))
 		return -1;
 
 	return 0;
 }
+
+/*
+ * Load a firmware file into target RAM. device is the open libusbx
+ * device, and the path is the name of the source file. The file is
+ * parsed once, then written as ezusb_load_ram_image() does.
+ */
+int ezusb_load_ram(libusb_device_handle *device, const char *path, int fx_type, int img_type, int stage)
+{
+	struct ezusb_image *img;
+	int status;
+
+	status = ezusb_parse_image(path, fx_type, img_type, &img);
+	if (status < 0)
+		return status;
+	status = ezusb_load_ram_image(device, img, stage);
+	if (status < 0)
+		logerror("unable to upload %s\n", path);
+	ezusb_free_image(img);
+	return status;
+}
+
+/*****************************************************************************/
+
+/*
+ * Loading the same image into several devices at once. Each device runs
+ * through the phases below, with up to depth requests of the current
+ * phase in flight. Requests on a control endpoint complete in the order
+ * they were issued, so pipelining within a phase is safe; a phase only
+ * starts once every request of the previous one has been acknowledged,
+ * so that the CPU is never restarted on a partial image.
+ */
+enum multi_phase {
+	PHASE_HALT,		/* stop the CPU (not for FX3) */
+	PHASE_WRITE,		/* write every segment */
+	PHASE_VERIFY,		/* read every segment back (FX3 only) */
+	PHASE_RUN,		/* reset the CPU, or jump to the FX3 entry point */
+	PHASE_DONE
+};
+
+struct multi_load {
+	const struct ezusb_image *image;
+	uint32_t cpucs_addr;
+	int depth;
+	int remaining;		/* devices not done yet */
+	int completed;		/* for libusb_handle_events_completed() */
+	ezusb_progress_cb progress;
+	void *user_data;
+};
+
+struct multi_slot;
+
+struct multi_device {
+	struct multi_load *load;
+	int index;
+	libusb_device_handle *handle;
+	struct ezusb_load_status *status;
+	enum multi_phase phase;
+	int next;		/* next request of the phase to submit */
+	int pending;		/* requests of the phase not acknowledged yet */
+	int in_flight;
+	struct multi_slot *slots;
+};
+
+struct multi_slot {
+	struct multi_device *dev;
+	struct libusb_transfer *transfer;
+	int op;			/* request of the phase this slot carries */
+	unsigned retry;
+	bool busy;
+};
+
+static int multi_phase_ops(struct multi_device *dev)
+{
+	switch (dev->phase) {
+	case PHASE_HALT:
+	case PHASE_RUN:
+		return 1;
+	case PHASE_WRITE:
+	case PHASE_VERIFY:
+		return dev->load->image->count;
+	default:
+		return 0;
+	}
+}
+
+static void LIBUSB_CALL multi_cb(struct libusb_transfer *transfer);
+
+static int multi_submit(struct multi_slot *slot)
+{
+	struct multi_device *dev = slot->dev;
+	const struct ezusb_image *image = dev->load->image;
+	const struct ezusb_segment *seg = NULL;
+	unsigned char *buffer = slot->transfer->buffer;
+	uint8_t request_type = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+	uint8_t opcode = RW_INTERNAL;
+	uint32_t addr;
+	uint16_t len;
+	int r;
+
+	switch (dev->phase) {
+	case PHASE_HALT:
+	case PHASE_RUN:
+		if (image->fx_type == FX_TYPE_FX3) {
+			addr = image->entry;
+			len = 0;
+		} else {
+			addr = dev->load->cpucs_addr;
+			buffer[LIBUSB_CONTROL_SETUP_SIZE] = (dev->phase == PHASE_HALT) ? 0x01 : 0x00;
+			len = 1;
+		}
+		break;
+	case PHASE_WRITE:
+		seg = &image->segments[slot->op];
+		addr = seg->addr;
+		len = (uint16_t)seg->len;
+		if (seg->external)
+			opcode = RW_MEMORY;
+		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, seg->data, seg->len);
+		break;
+	case PHASE_VERIFY:
+		seg = &image->segments[slot->op];
+		addr = seg->addr;
+		len = (uint16_t)seg->len;
+		request_type = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+		break;
+	default:
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	if ((verbose > 2) && (seg != NULL))
+		logerror("[%d] %s, addr 0x%08x len %4u (0x%04x)\n", dev->index,
+			(dev->phase == PHASE_VERIFY) ? "read firmware" :
+			(seg->external ? "write external" : "write on-chip"),
+			addr, (unsigned)len, (unsigned)len);
+
+	libusb_fill_control_setup(buffer, request_type, opcode,
+		addr & 0xFFFF, addr >> 16, len);
+	libusb_fill_control_transfer(slot->transfer, dev->handle, buffer,
+		multi_cb, slot, 1000);
+	r = libusb_submit_transfer(slot->transfer);
+	if (r == 0) {
+		slot->busy = true;
+		dev->in_flight++;
+	}
+	return r;
+}
+
+static void multi_finish(struct multi_device *dev)
+{
+	struct multi_load *load = dev->load;
+
+	dev->status->end_us = ezusb_time_us();
+	if (load->progress)
+		load->progress(dev->index, dev->status, load->image, load->user_data);
+	if (--load->remaining == 0)
+		load->completed = 1;
+}
+
+static void multi_fail(struct multi_device *dev, int error)
+{
+	int i;
+
+	if (dev->status->status == 0) {
+		dev->status->status = error;
+		logerror("[%d] firmware upload failed: %s\n", dev->index, libusb_error_name(error));
+	}
+	dev->phase = PHASE_DONE;
+	for (i = 0; i < dev->load->depth; i++) {
+		if (dev->slots[i].busy)
+			libusb_cancel_transfer(dev->slots[i].transfer);
+	}
+	if (dev->in_flight == 0)
+		multi_finish(dev);
+}
+
+/*
+ * Keep the pipeline of a device full, moving on to the next phase once
+ * the current one has been fully acknowledged.
+ */
+static void multi_advance(struct multi_device *dev)
+{
+	int i, r;
+
+	while ((dev->pending == 0) && (dev->phase != PHASE_DONE)) {
+		dev->phase++;
+		if ((dev->phase == PHASE_VERIFY) && (dev->load->image->fx_type != FX_TYPE_FX3))
+			dev->phase++;
+		dev->next = 0;
+		dev->pending = multi_phase_ops(dev);
+		if (dev->phase == PHASE_DONE) {
+			multi_finish(dev);
+			return;
+		}
+	}
+
+	for (i = 0; (i < dev->load->depth) && (dev->next < multi_phase_ops(dev)); i++) {
+		if (dev->slots[i].busy)
+			continue;
+		dev->slots[i].op = dev->next++;
+		dev->slots[i].retry = 0;
+		r = multi_submit(&dev->slots[i]);
+		if (r < 0) {
+			multi_fail(dev, r);
+			return;
+		}
+	}
+}
+
+static void LIBUSB_CALL multi_cb(struct libusb_transfer *transfer)
+{
+	struct multi_slot *slot = (struct multi_slot*)transfer->user_data;
+	struct multi_device *dev = slot->dev;
+	const struct ezusb_image *image = dev->load->image;
+	struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+	int r;
+
+	slot->busy = false;
+	dev->in_flight--;
+
+	if (dev->phase == PHASE_DONE) {
+		/* draining the requests of a failed device */
+		if (dev->in_flight == 0)
+			multi_finish(dev);
+		return;
+	}
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (transfer->actual_length != libusb_le16_to_cpu(setup->wLength)) {
+			multi_fail(dev, LIBUSB_ERROR_IO);
+			return;
+		}
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		/* Control messages are not NAKed (just dropped), so retry
+		 * this till we get a real error, as ram_poke() does.
+		 */
+		if (((dev->phase == PHASE_WRITE) || (dev->phase == PHASE_VERIFY))
+			&& (slot->retry < RETRY_LIMIT)) {
+			slot->retry++;
+			dev->status->retries++;
+			r = multi_submit(slot);
+			if (r < 0)
+				multi_fail(dev, r);
+			return;
+		}
+		multi_fail(dev, LIBUSB_ERROR_TIMEOUT);
+		return;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		/* We may get an I/O error from libusbx as the device disappears */
+		if (dev->phase == PHASE_RUN)
+			break;
+		multi_fail(dev, (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) ?
+			LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO);
+		return;
+	case LIBUSB_TRANSFER_STALL:
+		multi_fail(dev, LIBUSB_ERROR_PIPE);
+		return;
+	default:
+		multi_fail(dev, LIBUSB_ERROR_IO);
+		return;
+	}
+
+	if (dev->phase == PHASE_WRITE) {
+		dev->status->bytes += image->segments[slot->op].len;
+		dev->status->segments++;
+		if (dev->load->progress)
+			dev->load->progress(dev->index, dev->status, image, dev->load->user_data);
+	} else if ((dev->phase == PHASE_VERIFY)
+		&& (memcmp(libusb_control_transfer_get_data(transfer),
+			image->segments[slot->op].data, image->segments[slot->op].len) != 0)) {
+		logerror("[%d] verify error at 0x%08x\n", dev->index, image->segments[slot->op].addr);
+		multi_fail(dev, LIBUSB_ERROR_OTHER);
+		return;
+	}
+
+	dev->pending--;
+	multi_advance(dev);
+}
+
+int ezusb_load_ram_multi(libusb_context *ctx, libusb_device_handle **devices,
+	int count, const struct ezusb_image *image, int depth,
+	struct ezusb_load_status *status, ezusb_progress_cb progress, void *user_data)
+{
+	struct multi_load load;
+	struct multi_device *devs;
+	struct multi_slot *slots;
+	size_t buffer_len;
+	int i, j, r, failed = 0;
+
+	if ((count <= 0) || (image == NULL) || (image->max_len > EZUSB_MAX_PAYLOAD))
+		return -EINVAL;
+
+	/* only the first stage loader is used, as ram_poke() does for stage 0 */
+	for (i = 0; i < image->count; i++) {
+		if (image->segments[i].external) {
+			logerror("can't write %u bytes external memory at 0x%08x\n",
+				(unsigned)image->segments[i].len, image->segments[i].addr);
+			return -EINVAL;
+		}
+	}
+
+	if (depth < 1)
+		depth = 1;
+	if ((image->count > 0) && (depth > image->count))
+		depth = image->count;
+
+	memset(&load, 0, sizeof(load));
+	load.image = image;
+	load.depth = depth;
+	load.progress = progress;
+	load.user_data = user_data;
+	if (image->fx_type != FX_TYPE_FX3)
+		load.cpucs_addr = fx_memory(image->fx_type)->cpucs_addr;
+
+	devs = calloc(count, sizeof(*devs));
+	slots = calloc(count * depth, sizeof(*slots));
+	if ((devs == NULL) || (slots == NULL)) {
+		free(devs);
+		free(slots);
+		return -ENOMEM;
+	}
+
+	/* large enough for any segment, and for the 1 byte CPUCS writes */
+	buffer_len = LIBUSB_CONTROL_SETUP_SIZE + (image->max_len ? image->max_len : 1);
+	for (i = 0; i < count * depth; i++) {
+		slots[i].dev = &devs[i / depth];
+		slots[i].transfer = libusb_alloc_transfer(0);
+		if (slots[i].transfer != NULL)
+			slots[i].transfer->buffer = malloc(buffer_len);
+		if ((slots[i].transfer == NULL) || (slots[i].transfer->buffer == NULL)) {
+			r = -ENOMEM;
+			goto out;
+		}
+		slots[i].transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	if (verbose)
+		logerror("loading %d bytes in %d segments to %d device(s), %d request(s) in flight each\n",
+			(int)image->total, image->count, count, depth);
+
+	load.remaining = count;
+	for (i = 0; i < count; i++) {
+		memset(&status[i], 0, sizeof(status[i]));
+		devs[i].load = &load;
+		devs[i].index = i;
+		devs[i].handle = devices[i];
+		devs[i].status = &status[i];
+		devs[i].slots = &slots[i * depth];
+		/* the FX3 bootloader doesn't need its CPU halted */
+		devs[i].phase = (image->fx_type == FX_TYPE_FX3) ? PHASE_WRITE : PHASE_HALT;
+		devs[i].pending = multi_phase_ops(&devs[i]);
+		status[i].start_us = ezusb_time_us();
+		multi_advance(&devs[i]);
+	}
+
+	while (!load.completed) {
+		r = libusb_handle_events_completed(ctx, &load.completed);
+		if (r < 0) {
+			if (r == LIBUSB_ERROR_INTERRUPTED)
+				continue;
+			logerror("libusb_handle_events() failed: %s\n", libusb_error_name(r));
+			for (i = 0; i < count; i++) {
+				if (devs[i].phase != PHASE_DONE)
+					multi_fail(&devs[i], r);
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (status[i].status != 0)
+			failed++;
+	}
+	r = failed;
+
+out:
+	for (j = 0; j < count * depth; j++)
+		libusb_free_transfer(slots[j].transfer);
+	free(slots);
+	free(devs);
+	return r;
+}
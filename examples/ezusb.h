@@ -55,6 +55,9 @@
 #define IMG_TYPE_MAX       4
 #define IMG_TYPE_NAMES     { "Intel HEX", "Cypress 8051 IIC", "Cypress 8051 BIX", "Cypress IMG format" }
 
+/* Largest payload of a single firmware write or read request */
+#define EZUSB_MAX_PAYLOAD  4096
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -110,6 +113,95 @@ extern int ezusb_load_ram(libusb_device_handle *device,
 extern int ezusb_load_eeprom(libusb_device_handle *device,
 	const char *path, int fx_type, int img_type, int config);
 
+/*
+ * A firmware image compiled into memory, so that it can be uploaded to
+ * any number of devices, and for both stages of a two stage load, without
+ * going back to the file. Segments are sorted by address and coalesced,
+ * then split so that each one is a single request of at most
+ * EZUSB_MAX_PAYLOAD bytes that is either wholly on-chip or wholly
+ * external. For FX3 images, entry holds the program entry point.
+ */
+struct ezusb_segment {
+	uint32_t addr;
+	bool external;
+	size_t len;
+	unsigned char *data;
+};
+
+struct ezusb_image {
+	int fx_type;
+	int img_type;
+	int count;		/* segments in use */
+	int size;		/* segments allocated */
+	size_t total;		/* bytes across all segments */
+	size_t max_len;		/* largest segment */
+	uint32_t entry;		/* FX3 program entry point */
+	struct ezusb_segment *segments;
+	unsigned char *data;	/* storage shared by all segments */
+	size_t data_size;
+	bool mapped;		/* data is a mapping of a cache file */
+};
+
+/*
+ * Parse a firmware file into a newly allocated image, which must be
+ * released with ezusb_free_image(). Returns 0 on success, or the same
+ * negative values as ezusb_load_ram() when the file can't be read.
+ */
+extern int ezusb_parse_image(const char *path, int fx_type, int img_type,
+	struct ezusb_image **image);
+extern void ezusb_free_image(struct ezusb_image *image);
+
+/*
+ * Same as ezusb_parse_image(), but if cache_path is not NULL the compiled
+ * image is read (memory-mapped where possible) from that file when it is
+ * up to date with the firmware file, and written to it otherwise.
+ */
+extern int ezusb_open_image(const char *path, const char *cache_path,
+	int fx_type, int img_type, struct ezusb_image **image);
+
+/*
+ * Same as ezusb_load_ram(), from an image that has already been parsed.
+ */
+extern int ezusb_load_ram_image(libusb_device_handle *device,
+	const struct ezusb_image *image, int stage);
+
+/*
+ * Per-device outcome of ezusb_load_ram_multi(). Times are taken from
+ * ezusb_time_us().
+ */
+struct ezusb_load_status {
+	int status;		/* 0, or the libusbx error that stopped the load */
+	size_t bytes;		/* bytes acknowledged by the device */
+	int segments;		/* segments acknowledged by the device */
+	unsigned retries;	/* timed out requests that were reissued */
+	uint64_t start_us;
+	uint64_t end_us;
+};
+
+/*
+ * Called from the event loop each time a device acknowledges a segment
+ * and once more when the device is done (end_us is then non zero).
+ */
+typedef void (*ezusb_progress_cb)(int index, const struct ezusb_load_status *status,
+	const struct ezusb_image *image, void *user_data);
+
+/*
+ * This function uploads a parsed image into the RAM of several devices
+ * at once, using the hardware first stage loader. Every device gets up
+ * to depth asynchronous control requests in flight, and all devices are
+ * serviced from the same event loop, so the upload time is close to that
+ * of the slowest device rather than the sum of all of them.
+ *
+ * Returns the number of devices that failed (see status[] for details),
+ * or a negative value if the image can't be loaded with this method.
+ */
+extern int ezusb_load_ram_multi(libusb_context *ctx, libusb_device_handle **devices,
+	int count, const struct ezusb_image *image, int depth,
+	struct ezusb_load_status *status, ezusb_progress_cb progress, void *user_data);
+
+/* Monotonic-enough timestamp in microseconds, for timing reports */
+extern uint64_t ezusb_time_us(void);
+
 /* Verbosity level (default 1). Can be increased or decreased with options v/q  */
 extern int verbose;
 
@@ -47,6 +47,10 @@ static bool dosyslog = false;
 #define ARRAYSIZE(A) (sizeof(A)/sizeof((A)[0]))
 #endif
 
+/* devices that can be given with -p, and requests in flight for each */
+#define MAX_TARGETS 128
+#define DEFAULT_DEPTH 4
+
 void logerror(const char *format, ...)
 	__attribute__ ((format (__printf__, 1, 2)));
 
@@ -65,23 +69,236 @@ void logerror(const char *format, ...)
 }
 
 static int print_usage(int error_code) {
-	fprintf(stderr, "\nUsage: fxload [-v] [-V] [-t type] [-d vid:pid] [-p bus,addr] -i firmware\n");
+	fprintf(stderr, "\nUsage: fxload [-v] [-V] [-a] [-j depth] [-c cache] [-t type] [-d vid:pid] [-p bus,addr]... -i firmware\n");
 	fprintf(stderr, "  -i <path>       -- Firmware to upload\n");
+	fprintf(stderr, "  -c <path>       -- Compiled image cache, reused while the firmware is unchanged\n");
 	fprintf(stderr, "  -t <type>       -- Target type: an21, fx, fx2, fx2lp, fx3\n");
 	fprintf(stderr, "  -d <vid:pid>    -- Target device, as an USB VID:PID\n");
 	fprintf(stderr, "  -p <bus,addr>   -- Target device, as a libusbx bus number and device address path\n");
+	fprintf(stderr, "                     (may be repeated to load several devices at once)\n");
+	fprintf(stderr, "  -a              -- Load all matching devices at once, rather than the first one\n");
+	fprintf(stderr, "  -j <depth>      -- Control requests in flight per device when loading several (default %d)\n", DEFAULT_DEPTH);
 	fprintf(stderr, "  -v              -- Increase verbosity\n");
 	fprintf(stderr, "  -q              -- Decrease verbosity (silent mode)\n");
 	fprintf(stderr, "  -V              -- Print program version\n");
 	return error_code;
 }
 
+/* Claim the first interface, detaching the kernel driver if needed */
+static int claim_device(libusb_device_handle *device)
+{
+	int status;
+
+	status = libusb_claim_interface(device, 0);
+#if defined(__linux__)
+	if (status != LIBUSB_SUCCESS) {
+		/* Maybe we need to detach the driver */
+		libusb_detach_kernel_driver(device, 0);
+		status = libusb_claim_interface(device, 0);
+	}
+#endif
+	if (status != LIBUSB_SUCCESS)
+		logerror("libusb_claim_interface failed: %s\n", libusb_error_name(status));
+	return status;
+}
+
+struct target {
+	unsigned busnum;
+	unsigned devaddr;
+};
+
+struct multi_progress {
+	const struct target *targets;
+	int *percent;
+};
+
+static void multi_progress_cb(int index, const struct ezusb_load_status *status,
+	const struct ezusb_image *image, void *user_data)
+{
+	struct multi_progress *progress = (struct multi_progress*)user_data;
+	const struct target *target = &progress->targets[index];
+	int percent;
+
+	if (status->end_us != 0) {
+		if (verbose)
+			logerror("%u,%u: %s in %.1f ms\n", target->busnum, target->devaddr,
+				status->status ? libusb_error_name(status->status) : "done",
+				(status->end_us - status->start_us) / 1000.0);
+		return;
+	}
+	if ((verbose < 2) || (image->total == 0))
+		return;
+	/* report in steps of 10% */
+	percent = (int)(status->bytes * 10 / image->total) * 10;
+	if (percent != progress->percent[index]) {
+		progress->percent[index] = percent;
+		logerror("%u,%u: %3d%%\n", target->busnum, target->devaddr, percent);
+	}
+}
+
+/*
+ * Load the same firmware into every matching device. The image is only
+ * parsed once, then streamed to all devices concurrently.
+ */
+static int load_multi(const char *path, const char *cache_path, int img_type, int fx_type, const char *device_id,
+	unsigned vid, unsigned pid, const struct target *targets, int ntargets, int depth)
+{
+	fx_known_device known_device[] = FX_KNOWN_DEVICES;
+	const char *fx_name[FX_TYPE_MAX] = FX_TYPE_NAMES;
+	libusb_device *dev, **devs;
+	libusb_device_handle **handles = NULL;
+	struct libusb_device_descriptor desc;
+	struct ezusb_load_status *status = NULL;
+	struct ezusb_image *image = NULL;
+	struct target *found = NULL;
+	struct multi_progress progress = { NULL, NULL };
+	int i, j, k, r, count = 0, set_type = FX_TYPE_UNDEFINED, dev_type, failed = -1;
+	unsigned _busnum, _devaddr;
+	size_t total_bytes = 0;
+	uint64_t start_us, parsed_us, end_us;
+
+	start_us = ezusb_time_us();
+	r = (int)libusb_get_device_list(NULL, &devs);
+	if (r < 0) {
+		logerror("libusb_get_device_list() failed: %s\n", libusb_error_name(r));
+		return -1;
+	}
+	handles = calloc(r, sizeof(*handles));
+	found = calloc(r, sizeof(*found));
+	if ((handles == NULL) || (found == NULL)) {
+		libusb_free_device_list(devs, 1);
+		goto out;
+	}
+
+	for (i = 0; (dev = devs[i]) != NULL; i++) {
+		if (libusb_get_device_descriptor(dev, &desc) < 0)
+			continue;
+		_busnum = libusb_get_bus_number(dev);
+		_devaddr = libusb_get_device_address(dev);
+
+		dev_type = FX_TYPE_UNDEFINED;
+		for (j=0; j<ARRAYSIZE(known_device); j++) {
+			if ((desc.idVendor == known_device[j].vid) && (desc.idProduct == known_device[j].pid)) {
+				dev_type = known_device[j].type;
+				break;
+			}
+		}
+
+		if (ntargets != 0) {
+			for (k = 0; k < ntargets; k++) {
+				if ((targets[k].busnum == _busnum) && (targets[k].devaddr == _devaddr))
+					break;
+			}
+			if (k >= ntargets)
+				continue;
+		} else if (device_id != NULL) {
+			if ((desc.idVendor != vid) || (desc.idProduct != pid))
+				continue;
+		} else if ((dev_type == FX_TYPE_UNDEFINED)
+			|| ((fx_type != FX_TYPE_UNDEFINED) && (dev_type != fx_type))) {
+			/* only pick up known devices (of the requested type) */
+			continue;
+		}
+
+		if (fx_type != FX_TYPE_UNDEFINED)
+			dev_type = fx_type;
+		if (dev_type == FX_TYPE_UNDEFINED) {
+			logerror("%u,%u: unknown microcontroller type - please specify one with -t\n",
+				_busnum, _devaddr);
+			continue;
+		}
+		if (set_type == FX_TYPE_UNDEFINED) {
+			set_type = dev_type;
+		} else if (dev_type != set_type) {
+			logerror("%u,%u: skipping %s device, as %s devices are being loaded\n",
+				_busnum, _devaddr, fx_name[dev_type], fx_name[set_type]);
+			continue;
+		}
+
+		r = libusb_open(dev, &handles[count]);
+		if (r < 0) {
+			logerror("%u,%u: libusb_open() failed: %s\n", _busnum, _devaddr, libusb_error_name(r));
+			continue;
+		}
+		if (claim_device(handles[count]) != LIBUSB_SUCCESS) {
+			libusb_close(handles[count]);
+			continue;
+		}
+		if (verbose > 1)
+			logerror("found %04x:%04x (%u,%u)\n", desc.idVendor, desc.idProduct, _busnum, _devaddr);
+		found[count].busnum = _busnum;
+		found[count].devaddr = _devaddr;
+		count++;
+	}
+	libusb_free_device_list(devs, 1);
+
+	if (count == 0) {
+		logerror("could not find any matching device - please specify type and/or vid:pid and/or bus,dev\n");
+		goto out;
+	}
+	if ((ntargets != 0) && (count < ntargets))
+		logerror("only %d of the %d requested devices could be opened\n", count, ntargets);
+	if (verbose)
+		logerror("microcontroller type: %s, %d device(s)\n", fx_name[set_type], count);
+
+	/* parse the image once, for all devices */
+	r = ezusb_open_image(path, cache_path, set_type, img_type, &image);
+	if (r < 0)
+		goto out;
+	parsed_us = ezusb_time_us();
+
+	status = calloc(count, sizeof(*status));
+	progress.targets = found;
+	progress.percent = calloc(count, sizeof(int));
+	if ((status == NULL) || (progress.percent == NULL))
+		goto out;
+
+	failed = ezusb_load_ram_multi(NULL, handles, count, image, depth, status,
+		multi_progress_cb, &progress);
+	end_us = ezusb_time_us();
+	if (failed < 0)
+		goto out;
+
+	if (verbose) {
+		logerror("\n bus,addr  status              bytes  segs  retries       time      KB/s\n");
+		for (i = 0; i < count; i++) {
+			double ms = (status[i].end_us - status[i].start_us) / 1000.0;
+			logerror(" %3u,%-4u  %-16s %8u %5d %8u %8.1f ms %9.1f\n",
+				found[i].busnum, found[i].devaddr,
+				status[i].status ? libusb_error_name(status[i].status) : "OK",
+				(unsigned)status[i].bytes, status[i].segments, status[i].retries,
+				ms, (ms > 0) ? status[i].bytes / ms * 1000.0 / 1024.0 : 0.0);
+		}
+	}
+	for (i = 0; i < count; i++)
+		total_bytes += status[i].bytes;
+	if (verbose || failed)
+		logerror("%d device(s) loaded, %d failed: %u bytes, parse %.1f ms, upload %.1f ms, "
+			"total wall clock %.1f ms\n", count - failed, failed, (unsigned)total_bytes,
+			(parsed_us - start_us) / 1000.0, (end_us - parsed_us) / 1000.0,
+			(end_us - start_us) / 1000.0);
+
+out:
+	for (i = 0; i < count; i++) {
+		libusb_release_interface(handles[i], 0);
+		libusb_close(handles[i]);
+	}
+	ezusb_free_image(image);
+	free(progress.percent);
+	free(status);
+	free(found);
+	free(handles);
+	return (failed == 0) ? 0 : -1;
+}
+
 #define FIRMWARE 0
 #define LOADER 1
 int main(int argc, char*argv[])
 {
 	fx_known_device known_device[] = FX_KNOWN_DEVICES;
 	const char *path[] = { NULL, NULL };
+	const char *cache_path = NULL;
+	struct ezusb_image *image;
 	const char *device_id = NULL;
 	const char *device_path = getenv("DEVICE");
 	const char *type = NULL;
@@ -89,13 +306,16 @@ int main(int argc, char*argv[])
 	const char *ext, *img_name[] = IMG_TYPE_NAMES;
 	int fx_type = FX_TYPE_UNDEFINED, img_type[ARRAYSIZE(path)];
 	int i, j, opt, status;
+	bool all_devices = false;
+	int depth = DEFAULT_DEPTH, ntargets = 0;
+	struct target targets[MAX_TARGETS];
 	unsigned vid = 0, pid = 0;
 	unsigned busnum = 0, devaddr = 0, _busnum, _devaddr;
 	libusb_device *dev, **devs;
 	libusb_device_handle *device = NULL;
 	struct libusb_device_descriptor desc;
 
-	while ((opt = getopt(argc, argv, "qvV?hd:p:i:I:t:")) != EOF)
+	while ((opt = getopt(argc, argv, "aqvV?hc:d:p:i:I:j:t:")) != EOF)
 		switch (opt) {
 
 		case 'd':
@@ -112,6 +332,29 @@ int main(int argc, char*argv[])
 				fputs ("please specify bus number & device number as \"bus,dev\" in decimal format\n", stderr);
 				return -1;
 			}
+			if (ntargets >= MAX_TARGETS) {
+				fprintf(stderr, "at most %d devices can be specified\n", MAX_TARGETS);
+				return -1;
+			}
+			targets[ntargets].busnum = busnum;
+			targets[ntargets].devaddr = devaddr;
+			ntargets++;
+			break;
+
+		case 'a':
+			all_devices = true;
+			break;
+
+		case 'j':
+			depth = atoi(optarg);
+			if (depth <= 0) {
+				fputs ("please specify a positive number of requests in flight\n", stderr);
+				return -1;
+			}
+			break;
+
+		case 'c':
+			cache_path = optarg;
 			break;
 
 		case 'i':
@@ -147,7 +390,11 @@ int main(int argc, char*argv[])
 		return print_usage(-1);
 	}
 	if ((device_id != NULL) && (device_path != NULL)) {
-		logerror("only one of -d or -a can be specified\n");
+		logerror("only one of -d or -p can be specified\n");
+		return print_usage(-1);
+	}
+	if (all_devices && (ntargets != 0)) {
+		logerror("-a can't be combined with -p\n");
 		return print_usage(-1);
 	}
 
@@ -165,6 +412,26 @@ int main(int argc, char*argv[])
 		}
 	}
 
+	for (i=0; i<ARRAYSIZE(path); i++) {
+		if (path[i] != NULL) {
+			ext = path[i] + strlen(path[i]) - 4;
+			if ((_stricmp(ext, ".hex") == 0) || (strcmp(ext, ".ihx") == 0))
+				img_type[i] = IMG_TYPE_HEX;
+			else if (_stricmp(ext, ".iic") == 0)
+				img_type[i] = IMG_TYPE_IIC;
+			else if (_stricmp(ext, ".bix") == 0)
+				img_type[i] = IMG_TYPE_BIX;
+			else if (_stricmp(ext, ".img") == 0)
+				img_type[i] = IMG_TYPE_IMG;
+			else {
+				logerror("%s is not a recognized image type\n", path[i]);
+				return print_usage(-1);
+			}
+		}
+		if (verbose && path[i] != NULL)
+			logerror("%s: type %s\n", path[i], img_name[img_type[i]]);
+	}
+
 	/* open the device using libusbx */
 	status = libusb_init(NULL);
 	if (status < 0) {
@@ -173,6 +440,15 @@ int main(int argc, char*argv[])
 	}
 	libusb_set_debug(NULL, verbose);
 
+	/* several devices, loaded concurrently */
+	if (all_devices || (ntargets > 1)) {
+		status = load_multi(path[FIRMWARE], cache_path, img_type[FIRMWARE],
+			(type != NULL) ? fx_type : FX_TYPE_UNDEFINED,
+			device_id, vid, pid, targets, ntargets, depth);
+		libusb_exit(NULL);
+		return status;
+	}
+
 	/* try to pick up missing parameters from known devices */
 	if ((type == NULL) || (device_id == NULL) || (device_path != NULL)) {
 		if (libusb_get_device_list(NULL, &devs) < 0) {
@@ -242,46 +518,20 @@ int main(int argc, char*argv[])
 	}
 
 	/* We need to claim the first interface */
-	status = libusb_claim_interface(device, 0);
-#if defined(__linux__)
-	if (status != LIBUSB_SUCCESS) {
-		/* Maybe we need to detach the driver */
-		libusb_detach_kernel_driver(device, 0);
-		status = libusb_claim_interface(device, 0);
-	}
-#endif
-	if (status != LIBUSB_SUCCESS) {
-		logerror("libusb_claim_interface failed: %s\n", libusb_error_name(status));
+	if (claim_device(device) != LIBUSB_SUCCESS)
 		goto err;
-	}
 
 	if (verbose)
 		logerror("microcontroller type: %s\n", fx_name[fx_type]);
 
-	for (i=0; i<ARRAYSIZE(path); i++) {
-		if (path[i] != NULL) {
-			ext = path[i] + strlen(path[i]) - 4;
-			if ((_stricmp(ext, ".hex") == 0) || (strcmp(ext, ".ihx") == 0))
-				img_type[i] = IMG_TYPE_HEX;
-			else if (_stricmp(ext, ".iic") == 0)
-				img_type[i] = IMG_TYPE_IIC;
-			else if (_stricmp(ext, ".bix") == 0)
-				img_type[i] = IMG_TYPE_BIX;
-			else if (_stricmp(ext, ".img") == 0)
-				img_type[i] = IMG_TYPE_IMG;
-			else {
-				logerror("%s is not a recognized image type\n", path[i]);
-				goto err;
-			}
-		}
-		if (verbose && path[i] != NULL)
-			logerror("%s: type %s\n", path[i], img_name[img_type[i]]);
-	}
-
 	/* single stage, put into internal memory */
 	if (verbose > 1)
 		logerror("single stage: load on-chip memory\n");
-	status = ezusb_load_ram(device, path[FIRMWARE], fx_type, img_type[FIRMWARE], 0);
+	status = ezusb_open_image(path[FIRMWARE], cache_path, fx_type, img_type[FIRMWARE], &image);
+	if (status == 0) {
+		status = ezusb_load_ram_image(device, image, 0);
+		ezusb_free_image(image);
+	}
 
 	libusb_release_interface(device, 0);
 	libusb_close(device);
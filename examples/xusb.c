@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
@@ -30,6 +31,7 @@
 #define msleep(msecs) Sleep(msecs)
 #else
 #include <unistd.h>
+#include <sys/time.h>
 #define msleep(msecs) usleep(1000*msecs)
 #endif
 
@@ -51,6 +53,13 @@
 bool binary_dump = false;
 bool extra_info = false;
 const char* binary_name = NULL;
+// Mass Storage benchmark settings (-t, -z, -R, -w)
+unsigned bench_seconds = 0;
+unsigned bench_size = 65536;
+bool bench_random = false;
+bool bench_write = false;
+// Interrupt IN latency benchmark settings (-l)
+unsigned latency_count = 0;
 
 static int perr(char const *format, ...)
 {
@@ -70,6 +79,8 @@ static int perr(char const *format, ...)
 #define be_to_int32(buf) (((buf)[0]<<24)|((buf)[1]<<16)|((buf)[2]<<8)|(buf)[3])
 
 #define RETRY_MAX                     5
+#define CBW_LENGTH                    31
+#define CSW_LENGTH                    13
 #define REQUEST_SENSE_LENGTH          0x12
 #define INQUIRY_LENGTH                0x24
 #define READ_CAPACITY_LENGTH          0x08
@@ -438,6 +449,317 @@ static void get_sense(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t
 	get_mass_storage_status(handle, endpoint_in, expected_tag);
 }
 
+static uint64_t get_time_us(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000
+		+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+// Mass Storage benchmark: sustained READ(10) or WRITE(10) commands.
+// Bulk-Only Transport allows a single command at a time, so the overlap
+// is within a command: the CBW, data and CSW transfers of a command are
+// all submitted at once (the data and CSW stages queue up on their
+// endpoints), and the next command is submitted straight from the CSW
+// completion. There is thus no round trip through the host between the
+// phases, nor between commands.
+struct ms_bench {
+	libusb_device_handle *handle;
+	uint8_t endpoint_in, endpoint_out, lun;
+	uint32_t max_lba, block_size, blocks;	// blocks per command
+	uint32_t lba, tag;
+	uint64_t seed;
+	struct libusb_transfer *cbw_xfer, *data_xfer, *csw_xfer;
+	struct command_block_wrapper cbw;
+	struct command_status_wrapper csw;
+	unsigned char *data;
+	int pending;		// transfers of the current command not yet completed
+	int error;		// first error, which stops the run
+	uint8_t stalled_endpoint;	// data or CSW endpoint that stalled, if any
+	bool csw_received;	// the CSW of the current command was read
+	int done;
+	uint64_t start_us, end_us, cmd_start_us, report_us;
+	uint64_t commands, bytes, report_bytes;
+	uint32_t *latency;	// per command, in microseconds
+	size_t nb_latency, latency_size;
+};
+
+static void LIBUSB_CALL ms_bench_cb(struct libusb_transfer *transfer);
+
+static uint32_t ms_bench_next_lba(struct ms_bench *b)
+{
+	uint64_t nb_slots = ((uint64_t)b->max_lba + 1) / b->blocks;
+	uint32_t lba;
+
+	if (bench_random) {
+		// xorshift64*, as rand() may only have 15 bits
+		b->seed ^= b->seed >> 12;
+		b->seed ^= b->seed << 25;
+		b->seed ^= b->seed >> 27;
+		return (uint32_t)(((b->seed * 2685821657736338717ULL) >> 32) % nb_slots) * b->blocks;
+	}
+	lba = b->lba;
+	b->lba += b->blocks;
+	if ((uint64_t)b->lba + b->blocks > (uint64_t)b->max_lba + 1)
+		b->lba = 0;
+	return lba;
+}
+
+static void ms_bench_cancel(struct ms_bench *b)
+{
+	libusb_cancel_transfer(b->cbw_xfer);
+	libusb_cancel_transfer(b->data_xfer);
+	libusb_cancel_transfer(b->csw_xfer);
+}
+
+static void ms_bench_submit(struct ms_bench *b)
+{
+	struct libusb_transfer *xfers[3];
+	uint32_t lba = ms_bench_next_lba(b);
+	int i, r;
+
+	memset(&b->cbw, 0, sizeof(b->cbw));
+	b->cbw.dCBWSignature[0] = 'U';
+	b->cbw.dCBWSignature[1] = 'S';
+	b->cbw.dCBWSignature[2] = 'B';
+	b->cbw.dCBWSignature[3] = 'C';
+	b->cbw.dCBWTag = ++b->tag;
+	b->cbw.dCBWDataTransferLength = b->blocks * b->block_size;
+	b->cbw.bmCBWFlags = bench_write ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN;
+	b->cbw.bCBWLUN = b->lun;
+	b->cbw.bCBWCBLength = 10;
+	b->cbw.CBWCB[0] = bench_write ? 0x2A : 0x28;	// Write(10) / Read(10)
+	b->cbw.CBWCB[2] = (uint8_t)(lba >> 24);
+	b->cbw.CBWCB[3] = (uint8_t)(lba >> 16);
+	b->cbw.CBWCB[4] = (uint8_t)(lba >> 8);
+	b->cbw.CBWCB[5] = (uint8_t)lba;
+	b->cbw.CBWCB[7] = (uint8_t)(b->blocks >> 8);
+	b->cbw.CBWCB[8] = (uint8_t)b->blocks;
+	b->csw_received = false;
+
+	// Transfers complete in submission order on each endpoint, so the
+	// data stage always precedes the CSW on the IN endpoint
+	xfers[0] = b->cbw_xfer;
+	xfers[1] = b->data_xfer;
+	xfers[2] = b->csw_xfer;
+	b->cmd_start_us = get_time_us();
+	for (i = 0; i < 3; i++) {
+		r = libusb_submit_transfer(xfers[i]);
+		if (r < 0) {
+			perr("   benchmark: unable to submit transfer: %s\n", libusb_error_name(r));
+			b->error = r;
+			if (i == 0)
+				b->done = true;
+			else
+				ms_bench_cancel(b);
+			return;
+		}
+		b->pending++;
+	}
+}
+
+static void LIBUSB_CALL ms_bench_cb(struct libusb_transfer *transfer)
+{
+	struct ms_bench *b = (struct ms_bench*)transfer->user_data;
+	uint64_t now;
+
+	// A CSW that completes despite an earlier error must still be taken
+	// into account, as the device will not send it again
+	if ((transfer == b->csw_xfer) && (transfer->status == LIBUSB_TRANSFER_COMPLETED))
+		b->csw_received = true;
+
+	if ((transfer->status != LIBUSB_TRANSFER_COMPLETED) && (b->error == 0)) {
+		perr("   benchmark: %s stage failed (status %d)\n", (transfer == b->cbw_xfer) ? "CBW" :
+			((transfer == b->data_xfer) ? "data" : "CSW"), transfer->status);
+		b->error = (transfer->status == LIBUSB_TRANSFER_STALL) ? LIBUSB_ERROR_PIPE : LIBUSB_ERROR_IO;
+		if ((transfer->status == LIBUSB_TRANSFER_STALL) && (transfer != b->cbw_xfer))
+			b->stalled_endpoint = transfer->endpoint;
+		ms_bench_cancel(b);
+	} else if ((transfer == b->csw_xfer) && (b->error == 0)) {
+		if ((transfer->actual_length != CSW_LENGTH) || (b->csw.dCSWTag != b->cbw.dCBWTag)) {
+			perr("   benchmark: invalid CSW (%d bytes, tag %08X, expected %08X)\n",
+				transfer->actual_length, b->csw.dCSWTag, b->cbw.dCBWTag);
+			b->error = LIBUSB_ERROR_IO;
+		} else if (b->csw.bCSWStatus != 0) {
+			perr("   benchmark: command failed (status %02X)\n", b->csw.bCSWStatus);
+			b->error = (b->csw.bCSWStatus == 1) ? -2 : LIBUSB_ERROR_IO;
+		}
+	} else if ((transfer == b->data_xfer) && (b->error == 0)
+		&& (transfer->actual_length != transfer->length)) {
+		perr("   benchmark: short data stage (%d of %d bytes)\n",
+			transfer->actual_length, transfer->length);
+		b->error = LIBUSB_ERROR_IO;
+	}
+
+	if (--b->pending > 0)
+		return;
+
+	// The command is complete
+	now = get_time_us();
+	if (b->error != 0) {
+		b->done = true;
+		return;
+	}
+	b->commands++;
+	b->bytes += b->data_xfer->length;
+	if (b->nb_latency == b->latency_size) {
+		size_t size = b->latency_size ? 2 * b->latency_size : 4096;
+		uint32_t *latency = (uint32_t*)realloc(b->latency, size * sizeof(uint32_t));
+		if (latency != NULL) {
+			b->latency = latency;
+			b->latency_size = size;
+		}
+	}
+	if (b->nb_latency < b->latency_size)
+		b->latency[b->nb_latency++] = (uint32_t)(now - b->cmd_start_us);
+
+	if (now - b->report_us >= 1000000) {
+		printf("   %3u s: %8.2f MB/s\n", (unsigned)((now - b->start_us) / 1000000),
+			(double)(b->bytes - b->report_bytes) / (double)(now - b->report_us));
+		b->report_us = now;
+		b->report_bytes = b->bytes;
+	}
+	if (now >= b->end_us) {
+		b->end_us = now;
+		b->done = true;
+		return;
+	}
+	ms_bench_submit(b);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t*)a, lb = *(const uint32_t*)b;
+
+	return (la < lb) ? -1 : ((la > lb) ? 1 : 0);
+}
+
+// latency must be sorted, with nb_latency > 0
+static uint32_t latency_percentile(const uint32_t *latency, size_t nb_latency, double percentile)
+{
+	size_t i = (size_t)(percentile / 100.0 * (double)nb_latency);
+
+	if (i >= nb_latency)
+		i = nb_latency - 1;
+	return latency[i];
+}
+
+static int benchmark_mass_storage(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out,
+	uint8_t lun, uint32_t max_lba, uint32_t block_size)
+{
+	struct ms_bench b;
+	uint32_t i;
+	double secs;
+	int r;
+
+	if ((block_size == 0) || (block_size > bench_size)) {
+		perr("   benchmark: block size %u is not usable with %u bytes per command\n", block_size, bench_size);
+		return -1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.handle = handle;
+	b.endpoint_in = endpoint_in;
+	b.endpoint_out = endpoint_out;
+	b.lun = lun;
+	b.max_lba = max_lba;
+	b.block_size = block_size;
+	b.blocks = bench_size / block_size;
+	if (b.blocks > 0xFFFF)
+		b.blocks = 0xFFFF;
+	if ((uint64_t)b.blocks > (uint64_t)max_lba + 1)
+		b.blocks = max_lba + 1;
+	b.seed = get_time_us() | 1;
+
+	b.data = (unsigned char*) malloc(b.blocks * block_size);
+	b.cbw_xfer = libusb_alloc_transfer(0);
+	b.data_xfer = libusb_alloc_transfer(0);
+	b.csw_xfer = libusb_alloc_transfer(0);
+	if ((b.data == NULL) || (b.cbw_xfer == NULL) || (b.data_xfer == NULL) || (b.csw_xfer == NULL)) {
+		perr("   benchmark: unable to allocate transfers\n");
+		r = -1;
+		goto out;
+	}
+	for (i = 0; i < b.blocks * block_size; i++)
+		b.data[i] = (uint8_t)(i ^ (i >> 8));
+
+	libusb_fill_bulk_transfer(b.cbw_xfer, handle, endpoint_out, (unsigned char*)&b.cbw,
+		CBW_LENGTH, ms_bench_cb, &b, 1000);
+	libusb_fill_bulk_transfer(b.data_xfer, handle, bench_write ? endpoint_out : endpoint_in,
+		b.data, b.blocks * block_size, ms_bench_cb, &b, 5000);
+	libusb_fill_bulk_transfer(b.csw_xfer, handle, endpoint_in, (unsigned char*)&b.csw,
+		CSW_LENGTH, ms_bench_cb, &b, 5000);
+
+	printf("Benchmarking %s %s, %u bytes per command, for %u s:\n",
+		bench_random ? "random" : "sequential", bench_write ? "WRITE(10)" : "READ(10)",
+		b.blocks * block_size, bench_seconds);
+	b.start_us = b.report_us = get_time_us();
+	b.end_us = b.start_us + (uint64_t)bench_seconds * 1000000;
+	ms_bench_submit(&b);
+	while (!b.done) {
+		r = libusb_handle_events_completed(NULL, &b.done);
+		if ((r < 0) && (r != LIBUSB_ERROR_INTERRUPTED)) {
+			perr("   benchmark: %s\n", libusb_error_name(r));
+			b.error = r;
+			ms_bench_cancel(&b);
+			// let the cancelled transfers complete
+			while (b.pending > 0)
+				libusb_handle_events_completed(NULL, NULL);
+			break;
+		}
+	}
+	if (b.stalled_endpoint != 0) {
+		// Bulk-Only Transport recovery: clear the stalled endpoint, then
+		// read the CSW of the failed command before issuing anything else,
+		// or the next command would get that CSW instead of its own
+		libusb_clear_halt(handle, b.stalled_endpoint);
+		if (!b.csw_received)
+			r = get_mass_storage_status(handle, endpoint_in, b.cbw.dCBWTag);
+		else
+			r = (b.csw.bCSWStatus == 1) ? -2 : 0;
+		if (r == -2)
+			get_sense(handle, endpoint_in, endpoint_out);
+	} else if (b.error == -2) {
+		get_sense(handle, endpoint_in, endpoint_out);
+	} else if (b.error == LIBUSB_ERROR_PIPE) {
+		libusb_clear_halt(handle, endpoint_in);
+		libusb_clear_halt(handle, endpoint_out);
+	}
+
+	secs = (double)((b.error ? get_time_us() : b.end_us) - b.start_us) / 1000000.0;
+	printf("   commands: %" PRIu64 ", bytes: %" PRIu64 ", time: %.2f s%s\n",
+		b.commands, b.bytes, secs, b.error ? " (stopped on error)" : "");
+	if ((b.nb_latency > 0) && (secs > 0)) {
+		qsort(b.latency, b.nb_latency, sizeof(uint32_t), compare_latency);
+		printf("   throughput: %.2f MB/s, %.1f IOPS\n",
+			(double)b.bytes / secs / 1000000.0, (double)b.commands / secs);
+		printf("   latency (us): min %u, p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+			b.latency[0], latency_percentile(b.latency, b.nb_latency, 50.0),
+			latency_percentile(b.latency, b.nb_latency, 90.0),
+			latency_percentile(b.latency, b.nb_latency, 99.0),
+			latency_percentile(b.latency, b.nb_latency, 99.9), b.latency[b.nb_latency - 1]);
+	}
+	r = b.error ? -1 : 0;
+
+out:
+	libusb_free_transfer(b.cbw_xfer);
+	libusb_free_transfer(b.data_xfer);
+	libusb_free_transfer(b.csw_xfer);
+	free(b.data);
+	free(b.latency);
+	return r;
+}
+
 // Mass Storage device to test bulk transfers (non destructive test)
 static int test_mass_storage(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out)
 {
@@ -534,6 +856,9 @@ static int test_mass_storage(libusb_device_handle *handle, uint8_t endpoint_in,
 	}
 	free(data);
 
+	if (bench_seconds != 0)
+		return benchmark_mass_storage(handle, endpoint_in, endpoint_out, lun, max_lba, block_size);
+
 	return 0;
 }
 
@@ -736,6 +1061,67 @@ static void read_ms_winsub_feature_descriptors(libusb_device_handle *handle, uin
 	}
 }
 
+// Interrupt IN latency benchmark: back to back synchronous reads, first with
+// a blocking poll() and then with busy-polling, to compare the tail latency.
+// Each read waits for the device to answer on its next polling interval, so
+// the absolute figures depend on the device; the difference between the two
+// passes is the wakeup latency saved by busy-polling.
+static int benchmark_latency(libusb_device_handle *handle, uint8_t endpoint, uint16_t size)
+{
+	static const unsigned int busy_poll_usecs[2] = { 0, 1000 };
+	struct libusb_busy_poll_stats before, after;
+	unsigned char buffer[1024];
+	uint32_t *latency;
+	uint64_t start;
+	unsigned pass, n;
+	int r = 0, len;
+
+	if (size > sizeof(buffer))
+		size = sizeof(buffer);
+	latency = (uint32_t*)calloc(latency_count, sizeof(uint32_t));
+	if (latency == NULL)
+		return -1;
+
+	printf("\nBenchmarking interrupt IN latency on endpoint %02X, %u reads of %u bytes per pass...\n",
+		endpoint, latency_count, size);
+	for (pass = 0; pass < 2; pass++) {
+		r = libusb_set_busy_poll(NULL, busy_poll_usecs[pass]);
+		if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+			printf("   busy-poll is not supported on this platform\n");
+			r = 0;
+			break;
+		}
+		libusb_get_busy_poll_stats(NULL, &before);
+		for (n = 0; n < latency_count; n++) {
+			start = get_time_us();
+			r = libusb_interrupt_transfer(handle, endpoint, buffer, size, &len, 1000);
+			if (r < 0)
+				break;
+			latency[n] = (uint32_t)(get_time_us() - start);
+		}
+		libusb_get_busy_poll_stats(NULL, &after);
+		if (r < 0) {
+			perr("   read %u failed: %s\n", n, libusb_error_name(r));
+			break;
+		}
+
+		qsort(latency, latency_count, sizeof(uint32_t), compare_latency);
+		printf("   %-20s latency (us): min %u, p50 %u, p99 %u, p99.9 %u, max %u\n",
+			pass ? "busy-poll 1000 us:" : "blocking poll():", latency[0],
+			latency_percentile(latency, latency_count, 50.0),
+			latency_percentile(latency, latency_count, 99.0),
+			latency_percentile(latency, latency_count, 99.9), latency[latency_count - 1]);
+		if (pass)
+			printf("   %-20s %" PRIu64 " hits, %" PRIu64 " fallbacks, %" PRIu64 " us spinning\n", "",
+				after.hits - before.hits, after.fallbacks - before.fallbacks,
+				after.spin_usecs - before.spin_usecs);
+	}
+
+	libusb_set_busy_poll(NULL, 0);
+	free(latency);
+	return r;
+}
+
 static int test_device(uint16_t vid, uint16_t pid)
 {
 	libusb_device_handle *handle;
@@ -754,6 +1140,8 @@ static int test_device(uint16_t vid, uint16_t pid)
 	char string[128];
 	uint8_t string_index[3];	// indexes of the string descriptors
 	uint8_t endpoint_in = 0, endpoint_out = 0;	// default IN and OUT endpoints
+	uint8_t interrupt_in = 0;	// first interrupt IN endpoint, for -l
+	uint16_t interrupt_in_size = 0;
 
 	printf("Opening device %04X:%04X...\n", vid, pid);
 	handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
@@ -851,6 +1239,11 @@ static int test_device(uint16_t vid, uint16_t pid)
 							endpoint_out = endpoint->bEndpointAddress;
 					}
 				}
+				if (((endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+				  && (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN) && !interrupt_in) {
+					interrupt_in = endpoint->bEndpointAddress;
+					interrupt_in_size = endpoint->wMaxPacketSize;
+				}
 				printf("           max packet size: %04X\n", endpoint->wMaxPacketSize);
 				printf("          polling interval: %02X\n", endpoint->bInterval);
 				if (endpoint->ss_endpoint_companion != NULL) {
@@ -919,6 +1312,13 @@ static int test_device(uint16_t vid, uint16_t pid)
 		break;
 	}
 
+	if (latency_count != 0) {
+		if (interrupt_in)
+			benchmark_latency(handle, interrupt_in, interrupt_in_size);
+		else
+			perr("\nNo interrupt IN endpoint to benchmark latency with\n");
+	}
+
 	printf("\n");
 	for (iface = 0; iface<nb_ifaces; iface++) {
 		printf("Releasing interface %d...\n", iface);
@@ -977,6 +1377,33 @@ int main(int argc, char** argv)
 					binary_name = argv[++j];
 					binary_dump = true;
 					break;
+				case 't':
+					if ((j+1 >= argc) || (sscanf(argv[j+1], "%u", &bench_seconds) != 1) || (bench_seconds == 0)) {
+						printf("   Option -t requires a duration in seconds\n");
+						return 1;
+					}
+					j++;
+					break;
+				case 'z':
+					if ((j+1 >= argc) || (sscanf(argv[j+1], "%u", &bench_size) != 1) || (bench_size == 0)) {
+						printf("   Option -z requires a size in bytes\n");
+						return 1;
+					}
+					j++;
+					break;
+				case 'l':
+					if ((j+1 >= argc) || (sscanf(argv[j+1], "%u", &latency_count) != 1) || (latency_count == 0)) {
+						printf("   Option -l requires a number of reads\n");
+						return 1;
+					}
+					j++;
+					break;
+				case 'R':
+					bench_random = true;
+					break;
+				case 'w':
+					bench_write = true;
+					break;
 				case 'j':
 					// OLIMEX ARM-USB-TINY JTAG, 2 channel composite device - 2 interfaces
 					if (!VID && !PID) {
@@ -1033,14 +1460,22 @@ int main(int argc, char** argv)
 		}
 	}
 
-	if ((show_help) || (argc == 1) || (argc > 7)) {
-		printf("usage: %s [-h] [-d] [-i] [-k] [-b file] [-j] [-x] [-s] [-p] [vid:pid]\n", argv[0]);
+	if (bench_write && (bench_seconds == 0))
+		show_help = true;
+
+	if ((show_help) || (argc == 1) || (argc > 15)) {
+		printf("usage: %s [-h] [-d] [-i] [-k] [-b file] [-t secs [-z bytes] [-R] [-w]] [-l reads] [-j] [-x] [-s] [-p] [vid:pid]\n", argv[0]);
 		printf("   -h      : display usage\n");
 		printf("   -d      : enable debug output\n");
 		printf("   -i      : print topology and speed info\n");
 		printf("   -j      : test composite FTDI based JTAG device\n");
 		printf("   -k      : test Mass Storage device\n");
 		printf("   -b file : dump Mass Storage data to file 'file'\n");
+		printf("   -t secs : benchmark Mass Storage device for 'secs' seconds\n");
+		printf("   -z bytes: benchmark transfer size per command (default 65536)\n");
+		printf("   -R      : benchmark random rather than sequential accesses\n");
+		printf("   -w      : benchmark WRITE(10) - DESTROYS DATA ON THE DEVICE\n");
+		printf("   -l reads: benchmark interrupt IN latency, with and without busy-polling\n");
 		printf("   -p      : test Sony PS3 SixAxis controller\n");
 		printf("   -s      : test Microsoft Sidewinder Precision Pro (HID)\n");
 		printf("   -x      : test Microsoft XBox Controller Type S\n");
@@ -0,0 +1,877 @@
+/*
+ * Stream-to-file capture for libusbx
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef THREADS_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "libusbi.h"
+
+/**
+ * @defgroup capture Stream capture
+ *
+ * This page documents a pipeline that streams an IN endpoint to a file at
+ * full rate, for devices such as logic analysers and software defined
+ * radios.
+ *
+ * libusb_capture_start() keeps a number of bulk, interrupt or isochronous
+ * transfers in flight on the endpoint. As they complete, their data is
+ * copied into large write buffers, and full buffers are handed to an
+ * internal writer thread which writes them to the file, optionally with
+ * direct I/O. The transfers are resubmitted straight from their completion
+ * callback.
+ *
+ * When the disk falls behind and every write buffer is full, completed
+ * transfers are held back until the writer frees a buffer, so no data is
+ * lost but the device may overflow its own buffers. With
+ * LIBUSB_CAPTURE_DROP_ON_OVERRUN the data is dropped instead and the
+ * transfers keep going. Either way the event is counted, see
+ * \ref libusb_capture_stats.
+ *
+ * The transfers complete through the usual event handling, so the
+ * application must handle events while a capture runs, for instance with
+ * libusb_start_event_thread().
+ *
+ * \code
+ * struct libusb_capture *capture;
+ * struct libusb_capture_stats stats;
+ * int fd = open("capture.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+ *
+ * libusb_start_event_thread(ctx, 0, -1, 0);
+ * libusb_capture_start(handle, 0x81, fd, NULL, &capture);
+ * sleep(10);
+ * libusb_capture_stop(capture, &stats);
+ * close(fd);
+ * \endcode
+ *
+ * Capture is only supported on platforms with POSIX threads.
+ */
+
+#ifdef THREADS_POSIX
+
+#define CAPTURE_DEFAULT_TRANSFERS	8
+#define CAPTURE_DEFAULT_TRANSFER_SIZE	(64 * 1024)
+#define CAPTURE_DEFAULT_ISO_PACKETS	32
+#define CAPTURE_DEFAULT_WRITE_SIZE	(4 * 1024 * 1024)
+#define CAPTURE_DEFAULT_BUFFERS		4
+
+/* alignment of the write buffers, and of direct I/O sizes and offsets */
+#define CAPTURE_ALIGNMENT		4096
+
+/* consecutive failed transfers before the capture gives up */
+#define CAPTURE_MAX_ERRORS		16
+
+struct capture_slot {
+	struct libusb_capture *capture;
+	struct libusb_transfer *transfer;
+
+	/* on the parked list while the data waits for a write buffer */
+	struct list_head list;
+
+	/* data received, and how much of it was copied to write buffers */
+	int length;
+	int offset;
+
+	/* submitted and not completed yet */
+	int active;
+};
+
+struct capture_buffer {
+	struct list_head list;
+	unsigned char *data;
+	size_t length;
+};
+
+struct libusb_capture {
+	struct libusb_context *ctx;
+	int fd;
+	int flags;
+
+	/* O_DIRECT is currently set on fd, and the flags to restore */
+	int direct;
+	int fd_flags;
+
+	/* pwrite() at offset, or write() if the file can't seek */
+	int use_pwrite;
+	off_t offset;
+
+	struct capture_slot *slots;
+	int num_slots;
+	unsigned char *transfer_memory;
+	size_t transfer_memory_size;
+
+	struct capture_buffer *buffers;
+	int num_buffers;
+	unsigned char *buffer_memory;
+	size_t write_size;
+
+	pthread_t writer;
+
+	/* lock protects everything below */
+	usbi_mutex_t lock;
+	usbi_cond_t writer_cond;
+	struct list_head free_buffers;
+	struct list_head full_buffers;
+	struct list_head parked;
+
+	/* the buffer being filled, if any */
+	struct capture_buffer *fill;
+
+	/* number of submitted transfers, and whether it is 0, which is what
+	 * libusb_capture_stop() waits for */
+	int active;
+	int idle;
+
+	int stopping;
+	int writer_stop;
+	int overrun;
+	int errors;
+
+	/* a failed write stops the writing for good, while data captured
+	 * before a transfer error is still written out */
+	int write_error;
+	struct libusb_capture_stats stats;
+};
+
+static uint64_t capture_nsecs(void)
+{
+	struct timespec ts;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* lock held. the first error wins */
+static void set_status(struct libusb_capture *capture, int status)
+{
+	if (!capture->stats.status) {
+		usbi_dbg("capture stopped: %s", libusb_error_name(status));
+		capture->stats.status = status;
+	}
+}
+
+/* lock held. copy as much of the slot's data as there is room for in the
+ * write buffers, handing full buffers to the writer. returns 1 if all of it
+ * was copied, 0 if the write buffers ran out */
+static int consume(struct libusb_capture *capture, struct capture_slot *slot)
+{
+	unsigned char *data = slot->transfer->buffer;
+
+	while (slot->offset < slot->length) {
+		struct capture_buffer *buf = capture->fill;
+		size_t len = slot->length - slot->offset;
+
+		if (!buf) {
+			if (list_empty(&capture->free_buffers))
+				return 0;
+			buf = list_entry(capture->free_buffers.next,
+				struct capture_buffer, list);
+			list_del(&buf->list);
+			buf->length = 0;
+			capture->fill = buf;
+		}
+
+		if (len > capture->write_size - buf->length)
+			len = capture->write_size - buf->length;
+		memcpy(buf->data + buf->length, data + slot->offset, len);
+		buf->length += len;
+		slot->offset += (int)len;
+
+		if (buf->length == capture->write_size) {
+			list_add_tail(&buf->list, &capture->full_buffers);
+			capture->fill = NULL;
+			if (++capture->stats.buffers_queued > capture->stats.max_buffers_queued)
+				capture->stats.max_buffers_queued = capture->stats.buffers_queued;
+			usbi_cond_signal(&capture->writer_cond);
+		}
+	}
+	capture->overrun = 0;
+	return 1;
+}
+
+/* lock held. queue the data of a completed transfer for writing. returns 1
+ * if the transfer can be resubmitted, 0 if it is parked until a write
+ * buffer frees up */
+static int queue_slot(struct libusb_capture *capture, struct capture_slot *slot)
+{
+	/* parked data goes first, to keep the stream in order */
+	if (list_empty(&capture->parked) && consume(capture, slot))
+		return 1;
+
+	if (!capture->overrun) {
+		capture->overrun = 1;
+		capture->stats.overruns++;
+	}
+	if (capture->flags & LIBUSB_CAPTURE_DROP_ON_OVERRUN) {
+		capture->stats.bytes_dropped += slot->length - slot->offset;
+		return 1;
+	}
+	list_add_tail(&slot->list, &capture->parked);
+	return 0;
+}
+
+/* lock held. move the data of a completed transfer to the start of its
+ * buffer, and return its length. isochronous packets are packed together
+ * and failed ones skipped */
+static int collect(struct libusb_capture *capture, struct libusb_transfer *transfer)
+{
+	unsigned char *src = transfer->buffer;
+	int length = 0;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		return transfer->actual_length;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+		if (desc->status != LIBUSB_TRANSFER_COMPLETED) {
+			/* packets of a cancelled transfer were never scheduled */
+			if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+				capture->stats.iso_packets_lost++;
+		}
+		else if (desc->actual_length) {
+			if (src != transfer->buffer + length)
+				memmove(transfer->buffer + length, src, desc->actual_length);
+			length += desc->actual_length;
+		}
+		src += desc->length;
+	}
+	return length;
+}
+
+static void submit_slot(struct libusb_capture *capture, struct capture_slot *slot)
+{
+	int r = libusb_submit_transfer(slot->transfer);
+	int cancel = 0;
+
+	usbi_mutex_lock(&capture->lock);
+	if (r < 0) {
+		slot->active = 0;
+		capture->idle = (--capture->active == 0);
+		set_status(capture, r);
+	} else {
+		/* libusb_capture_stop() may have missed it */
+		cancel = capture->stopping;
+	}
+	usbi_mutex_unlock(&capture->lock);
+
+	if (cancel)
+		libusb_cancel_transfer(slot->transfer);
+}
+
+/* lock held. mark a slot as submitted if the capture is still going */
+static int activate_slot(struct libusb_capture *capture, struct capture_slot *slot)
+{
+	if (capture->stopping || capture->stats.status)
+		return 0;
+	slot->active = 1;
+	capture->active++;
+	capture->idle = 0;
+	return 1;
+}
+
+static void LIBUSB_CALL capture_cb(struct libusb_transfer *transfer)
+{
+	struct capture_slot *slot = transfer->user_data;
+	struct libusb_capture *capture = slot->capture;
+	int resubmit;
+
+	usbi_mutex_lock(&capture->lock);
+	slot->active = 0;
+	capture->active--;
+	capture->stats.transfers++;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		capture->errors = 0;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_CANCELLED:
+		/* whatever arrived is still part of the stream */
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		set_status(capture, LIBUSB_ERROR_NO_DEVICE);
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		set_status(capture, LIBUSB_ERROR_PIPE);
+		break;
+	default:
+		capture->stats.transfer_errors++;
+		if (++capture->errors >= CAPTURE_MAX_ERRORS)
+			set_status(capture, LIBUSB_ERROR_IO);
+		break;
+	}
+
+	slot->length = collect(capture, transfer);
+	slot->offset = 0;
+	capture->stats.bytes_captured += slot->length;
+
+	resubmit = queue_slot(capture, slot) && activate_slot(capture, slot);
+	capture->idle = (capture->active == 0);
+	usbi_mutex_unlock(&capture->lock);
+
+	if (resubmit)
+		submit_slot(capture, slot);
+}
+
+static int capture_write(struct libusb_capture *capture, unsigned char *data,
+	size_t length)
+{
+	while (length) {
+		ssize_t r;
+
+		/* a direct I/O write must be a whole number of blocks, which the
+		 * last buffer may not be */
+		if (capture->direct && (length % CAPTURE_ALIGNMENT)) {
+			fcntl(capture->fd, F_SETFL, capture->fd_flags);
+			capture->direct = 0;
+		}
+
+		if (capture->use_pwrite)
+			r = pwrite(capture->fd, data, length, capture->offset);
+		else
+			r = write(capture->fd, data, length);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			usbi_err(capture->ctx, "capture write failed, errno=%d", errno);
+			return LIBUSB_ERROR_IO;
+		}
+		if (r == 0) {
+			usbi_err(capture->ctx, "capture write made no progress");
+			return LIBUSB_ERROR_IO;
+		}
+		capture->offset += r;
+		data += r;
+		length -= r;
+	}
+	return 0;
+}
+
+/* lock held. refill the write buffers from the parked transfers, and put
+ * the ones that can be resubmitted on the resubmit list */
+static void drain_parked(struct libusb_capture *capture, struct list_head *resubmit)
+{
+	struct capture_slot *slot, *next;
+
+	list_for_each_entry_safe(slot, next, &capture->parked, list, struct capture_slot) {
+		if (!consume(capture, slot))
+			break;
+		list_del(&slot->list);
+		if (activate_slot(capture, slot))
+			list_add_tail(&slot->list, resubmit);
+	}
+}
+
+static void *capture_writer(void *arg)
+{
+	struct libusb_capture *capture = arg;
+	struct capture_buffer *buf;
+
+	usbi_mutex_lock(&capture->lock);
+	for (;;) {
+		struct list_head resubmit;
+		struct capture_slot *slot, *next;
+		uint64_t start, elapsed;
+		int skip, r = 0;
+
+		while (list_empty(&capture->full_buffers) && !capture->writer_stop)
+			usbi_cond_wait(&capture->writer_cond, &capture->lock);
+		if (list_empty(&capture->full_buffers))
+			break;
+
+		buf = list_entry(capture->full_buffers.next, struct capture_buffer, list);
+		list_del(&buf->list);
+		capture->stats.buffers_queued--;
+		skip = capture->write_error;
+		usbi_mutex_unlock(&capture->lock);
+
+		start = capture_nsecs();
+		if (!skip)
+			r = capture_write(capture, buf->data, buf->length);
+		elapsed = capture_nsecs() - start;
+
+		usbi_mutex_lock(&capture->lock);
+		if (skip || r < 0) {
+			capture->stats.bytes_dropped += buf->length;
+			if (r < 0) {
+				capture->write_error = r;
+				set_status(capture, r);
+			}
+		} else {
+			capture->stats.bytes_written += buf->length;
+			capture->stats.writes++;
+			if (elapsed > capture->stats.max_write_nsecs)
+				capture->stats.max_write_nsecs = elapsed;
+		}
+		list_add_tail(&buf->list, &capture->free_buffers);
+
+		list_init(&resubmit);
+		drain_parked(capture, &resubmit);
+		if (list_empty(&resubmit))
+			continue;
+		usbi_mutex_unlock(&capture->lock);
+		list_for_each_entry_safe(slot, next, &resubmit, list, struct capture_slot) {
+			list_del(&slot->list);
+			submit_slot(capture, slot);
+		}
+		usbi_mutex_lock(&capture->lock);
+	}
+
+	/* every transfer is done by now, write out the partial buffer */
+	buf = capture->fill;
+	capture->fill = NULL;
+	if (buf && buf->length) {
+		int r = 0;
+
+		if (!capture->write_error)
+			r = capture_write(capture, buf->data, buf->length);
+		if (capture->write_error || r < 0) {
+			capture->stats.bytes_dropped += buf->length;
+			if (r < 0) {
+				capture->write_error = r;
+				set_status(capture, r);
+			}
+		} else {
+			capture->stats.bytes_written += buf->length;
+			capture->stats.writes++;
+		}
+	}
+	if (buf)
+		list_add_tail(&buf->list, &capture->free_buffers);
+	usbi_mutex_unlock(&capture->lock);
+	return NULL;
+}
+
+/* find the transfer type of an endpoint in the active configuration */
+static int endpoint_type(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	struct libusb_config_descriptor *config;
+	int r, i, j, k;
+
+	r = libusb_get_active_config_descriptor(libusb_get_device(dev_handle), &config);
+	if (r < 0)
+		return r;
+
+	r = LIBUSB_ERROR_NOT_FOUND;
+	for (i = 0; i < config->bNumInterfaces && r < 0; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (j = 0; j < iface->num_altsetting && r < 0; j++) {
+			const struct libusb_interface_descriptor *altsetting =
+				&iface->altsetting[j];
+
+			for (k = 0; k < altsetting->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep =
+					&altsetting->endpoint[k];
+
+				if (ep->bEndpointAddress == endpoint) {
+					r = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+					break;
+				}
+			}
+		}
+	}
+
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+static int setup_file(struct libusb_capture *capture)
+{
+	capture->fd_flags = fcntl(capture->fd, F_GETFL);
+	if (capture->fd_flags < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	capture->offset = lseek(capture->fd, 0, SEEK_CUR);
+	capture->use_pwrite = capture->offset >= 0;
+	if (!capture->use_pwrite)
+		capture->offset = 0;
+
+	if (!(capture->flags & LIBUSB_CAPTURE_DIRECT_IO))
+		return 0;
+	if (capture->offset % CAPTURE_ALIGNMENT) {
+		usbi_err(capture->ctx, "direct I/O needs an aligned file position");
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+#if defined(O_DIRECT)
+	if (fcntl(capture->fd, F_SETFL, capture->fd_flags | O_DIRECT) < 0) {
+		usbi_err(capture->ctx, "failed to enable direct I/O, errno=%d", errno);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	capture->direct = 1;
+	return 0;
+#elif defined(F_NOCACHE)
+	/* no alignment constraints, nothing to restore either */
+	if (fcntl(capture->fd, F_NOCACHE, 1) < 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return 0;
+#else
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+static void free_capture(struct libusb_capture *capture)
+{
+	int i;
+
+	if (capture->slots) {
+		for (i = 0; i < capture->num_slots; i++)
+			libusb_free_transfer(capture->slots[i].transfer);
+		usbi_free(capture->slots, capture->num_slots * sizeof(*capture->slots),
+			LIBUSB_ALLOC_SITE_OTHER);
+	}
+	usbi_free(capture->transfer_memory, capture->transfer_memory_size,
+		LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	usbi_free(capture->buffers, capture->num_buffers * sizeof(*capture->buffers),
+		LIBUSB_ALLOC_SITE_OTHER);
+	usbi_aligned_free(capture->buffer_memory,
+		capture->num_buffers * capture->write_size, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	usbi_free(capture, sizeof(*capture), LIBUSB_ALLOC_SITE_OTHER);
+}
+
+/* cancel the transfers, wait for them and for the writer, and restore the
+ * file descriptor */
+static void finish_capture(struct libusb_capture *capture)
+{
+	int i, r;
+
+	usbi_mutex_lock(&capture->lock);
+	capture->stopping = 1;
+	usbi_mutex_unlock(&capture->lock);
+
+	/* a transfer being resubmitted is cancelled by submit_slot() */
+	for (i = 0; i < capture->num_slots; i++)
+		libusb_cancel_transfer(capture->slots[i].transfer);
+	while (!usbi_atomic_load(&capture->idle)) {
+		r = libusb_handle_events_completed(capture->ctx, &capture->idle);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_warn(capture->ctx, "event handling failed (%d)", r);
+	}
+
+	usbi_mutex_lock(&capture->lock);
+	capture->writer_stop = 1;
+	usbi_cond_signal(&capture->writer_cond);
+	usbi_mutex_unlock(&capture->lock);
+	pthread_join(capture->writer, NULL);
+
+	if (capture->direct)
+		fcntl(capture->fd, F_SETFL, capture->fd_flags);
+	/* leave the file position after the data, as write() would have */
+	if (capture->use_pwrite)
+		lseek(capture->fd, capture->offset, SEEK_SET);
+
+	usbi_mutex_destroy(&capture->lock);
+	usbi_cond_destroy(&capture->writer_cond);
+}
+
+#endif
+
+/** \ingroup capture
+ * Start streaming an IN endpoint to a file.
+ *
+ * The endpoint must belong to an interface claimed by the caller, and its
+ * transfer type is taken from the active configuration. Data is written to
+ * fd from its current position; the file descriptor stays owned by the
+ * caller, who must keep it open until libusb_capture_stop(). A file
+ * descriptor that cannot seek, such as a pipe, is written with write()
+ * rather than pwrite().
+ *
+ * Events must be handled while the capture runs, see \ref capture.
+ *
+ * \param dev_handle a handle for the device to capture from
+ * \param endpoint the address of a bulk, interrupt or isochronous IN
+ * endpoint
+ * \param fd the file descriptor to write to
+ * \param config capture parameters, or NULL for the defaults
+ * \param capture output location for the capture, to pass to
+ * libusb_capture_stop()
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is invalid, the
+ * endpoint is not an IN endpoint, the transfer size of a bulk or interrupt
+ * endpoint is not a multiple of its maximum packet size, or direct I/O was
+ * requested and the file position is not a multiple of 4096
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint is not in the active
+ * configuration
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if direct I/O is not available for
+ * the file, or capture is not supported on this platform
+ * \returns another LIBUSB_ERROR code if a transfer could not be submitted
+ */
+int API_EXPORTED libusb_capture_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int fd, const struct libusb_capture_config *config,
+	struct libusb_capture **capture)
+{
+#ifdef THREADS_POSIX
+	struct libusb_capture_config cfg;
+	struct libusb_capture *cap;
+	unsigned char *buffer;
+	int type, packet_size = 0;
+	int i, r;
+
+	if (!dev_handle || fd < 0 || !capture || !(endpoint & LIBUSB_ENDPOINT_IN))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (config)
+		cfg = *config;
+	else
+		memset(&cfg, 0, sizeof(cfg));
+	if (cfg.num_transfers < 0 || cfg.transfer_size < 0 || cfg.num_iso_packets < 0
+			|| cfg.num_buffers < 0 || cfg.num_buffers == 1
+			|| (cfg.flags & ~(LIBUSB_CAPTURE_DIRECT_IO | LIBUSB_CAPTURE_DROP_ON_OVERRUN)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!cfg.num_transfers)
+		cfg.num_transfers = CAPTURE_DEFAULT_TRANSFERS;
+	if (!cfg.transfer_size)
+		cfg.transfer_size = CAPTURE_DEFAULT_TRANSFER_SIZE;
+	if (!cfg.num_iso_packets)
+		cfg.num_iso_packets = CAPTURE_DEFAULT_ISO_PACKETS;
+	if (!cfg.write_size)
+		cfg.write_size = CAPTURE_DEFAULT_WRITE_SIZE;
+	cfg.write_size = (cfg.write_size + CAPTURE_ALIGNMENT - 1) & ~(size_t)(CAPTURE_ALIGNMENT - 1);
+	if (!cfg.num_buffers)
+		cfg.num_buffers = CAPTURE_DEFAULT_BUFFERS;
+
+	type = endpoint_type(dev_handle, endpoint);
+	if (type < 0)
+		return type;
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		/* a transfer that ends within a packet overflows as soon as the
+		 * device sends a full one */
+		packet_size = libusb_get_max_packet_size(libusb_get_device(dev_handle),
+			endpoint);
+		if (packet_size < 0)
+			return packet_size;
+		packet_size &= 0x7ff;
+		if (packet_size == 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (cfg.transfer_size % packet_size) {
+			if (config && config->transfer_size)
+				return LIBUSB_ERROR_INVALID_PARAM;
+			cfg.transfer_size = MAX(cfg.transfer_size / packet_size, 1) * packet_size;
+		}
+		cfg.num_iso_packets = 0;
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		packet_size = libusb_get_max_iso_packet_size(libusb_get_device(dev_handle),
+			endpoint);
+		if (packet_size < 0)
+			return packet_size;
+		if (packet_size == 0 || cfg.num_iso_packets > INT_MAX / packet_size)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		cfg.transfer_size = cfg.num_iso_packets * packet_size;
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	cap = usbi_calloc(1, sizeof(*cap), LIBUSB_ALLOC_SITE_OTHER);
+	if (!cap)
+		return LIBUSB_ERROR_NO_MEM;
+	cap->ctx = HANDLE_CTX(dev_handle);
+	cap->fd = fd;
+	cap->flags = cfg.flags;
+	cap->write_size = cfg.write_size;
+	cap->idle = 1;
+	list_init(&cap->free_buffers);
+	list_init(&cap->full_buffers);
+	list_init(&cap->parked);
+
+	r = LIBUSB_ERROR_NO_MEM;
+	cap->buffers = usbi_calloc(cfg.num_buffers, sizeof(*cap->buffers),
+		LIBUSB_ALLOC_SITE_OTHER);
+	if (!cap->buffers)
+		goto err_free;
+	cap->num_buffers = cfg.num_buffers;
+	cap->buffer_memory = usbi_aligned_alloc(CAPTURE_ALIGNMENT,
+		cfg.num_buffers * cfg.write_size, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	if (!cap->buffer_memory)
+		goto err_free;
+	for (i = 0; i < cfg.num_buffers; i++) {
+		cap->buffers[i].data = cap->buffer_memory + i * cfg.write_size;
+		list_add_tail(&cap->buffers[i].list, &cap->free_buffers);
+	}
+
+	cap->transfer_memory_size = (size_t)cfg.num_transfers * cfg.transfer_size;
+	cap->transfer_memory = usbi_malloc(cap->transfer_memory_size,
+		LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	if (!cap->transfer_memory)
+		goto err_free;
+	cap->slots = usbi_calloc(cfg.num_transfers, sizeof(*cap->slots),
+		LIBUSB_ALLOC_SITE_OTHER);
+	if (!cap->slots)
+		goto err_free;
+	cap->num_slots = cfg.num_transfers;
+	for (i = 0; i < cfg.num_transfers; i++) {
+		struct capture_slot *slot = &cap->slots[i];
+		struct libusb_transfer *transfer;
+
+		transfer = libusb_alloc_transfer(cfg.num_iso_packets);
+		if (!transfer)
+			goto err_free;
+		slot->capture = cap;
+		slot->transfer = transfer;
+		buffer = cap->transfer_memory + (size_t)i * cfg.transfer_size;
+		if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			libusb_fill_iso_transfer(transfer, dev_handle, endpoint, buffer,
+				cfg.transfer_size, cfg.num_iso_packets, capture_cb, slot, 0);
+			libusb_set_iso_packet_lengths(transfer, packet_size);
+		} else {
+			libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+				cfg.transfer_size, capture_cb, slot, cfg.timeout);
+			transfer->type = (unsigned char)type;
+		}
+	}
+
+	r = setup_file(cap);
+	if (r < 0)
+		goto err_file;
+
+	usbi_mutex_init(&cap->lock, NULL);
+	usbi_cond_init(&cap->writer_cond, NULL);
+	r = pthread_create(&cap->writer, NULL, capture_writer, cap);
+	if (r != 0) {
+		usbi_err(cap->ctx, "failed to create capture writer (%d)", r);
+		usbi_mutex_destroy(&cap->lock);
+		usbi_cond_destroy(&cap->writer_cond);
+		r = LIBUSB_ERROR_OTHER;
+		goto err_file;
+	}
+
+	for (i = 0; i < cap->num_slots; i++) {
+		struct capture_slot *slot = &cap->slots[i];
+
+		usbi_mutex_lock(&cap->lock);
+		r = activate_slot(cap, slot);
+		usbi_mutex_unlock(&cap->lock);
+		if (!r)
+			break;
+		submit_slot(cap, slot);
+	}
+
+	usbi_mutex_lock(&cap->lock);
+	r = cap->stats.status;
+	usbi_mutex_unlock(&cap->lock);
+	if (r < 0) {
+		finish_capture(cap);
+		free_capture(cap);
+		return r;
+	}
+
+	usbi_dbg("capturing endpoint 0x%02x, %d transfers of %d bytes, %d buffers of %lu bytes",
+		endpoint, cap->num_slots, cfg.transfer_size, cap->num_buffers,
+		(unsigned long)cap->write_size);
+	*capture = cap;
+	return 0;
+
+err_file:
+	if (cap->direct)
+		fcntl(fd, F_SETFL, cap->fd_flags);
+err_free:
+	free_capture(cap);
+	return r;
+#else
+	UNUSED(dev_handle);
+	UNUSED(endpoint);
+	UNUSED(fd);
+	UNUSED(config);
+	UNUSED(capture);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup capture
+ * Get the statistics of a running capture.
+ *
+ * \param capture a capture started with libusb_capture_start()
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is NULL
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if capture is not supported on this
+ * platform
+ */
+int API_EXPORTED libusb_capture_get_stats(struct libusb_capture *capture,
+	struct libusb_capture_stats *stats)
+{
+#ifdef THREADS_POSIX
+	if (!capture || !stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&capture->lock);
+	*stats = capture->stats;
+	usbi_mutex_unlock(&capture->lock);
+	return 0;
+#else
+	UNUSED(capture);
+	UNUSED(stats);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup capture
+ * Stop a capture and free it.
+ *
+ * The transfers are cancelled, and this function handles events until
+ * they have all completed, so it must not be called from a transfer
+ * callback. The data received so far is then written out, the file
+ * position is left after it, and direct I/O is turned back off.
+ *
+ * \param capture a capture started with libusb_capture_start()
+ * \param stats output location for the final statistics, or NULL
+ * \returns 0 if the capture ran without error
+ * \returns LIBUSB_ERROR_INVALID_PARAM if capture is NULL
+ * \returns the \ref libusb_error that stopped the capture otherwise, such
+ * as LIBUSB_ERROR_NO_DEVICE if the device went away or LIBUSB_ERROR_IO if
+ * writing failed
+ */
+int API_EXPORTED libusb_capture_stop(struct libusb_capture *capture,
+	struct libusb_capture_stats *stats)
+{
+#ifdef THREADS_POSIX
+	int r;
+
+	if (!capture)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	finish_capture(capture);
+	usbi_dbg("capture done, %lu bytes written, %lu dropped",
+		(unsigned long)capture->stats.bytes_written,
+		(unsigned long)capture->stats.bytes_dropped);
+	if (stats)
+		*stats = capture->stats;
+	r = capture->stats.status;
+	free_capture(capture);
+	return r;
+#else
+	UNUSED(capture);
+	UNUSED(stats);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
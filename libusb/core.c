@@ -442,7 +442,8 @@ libusb_free_device_list(list, 1);
 static struct discovered_devs *discovered_devs_alloc(void)
 {
 	struct discovered_devs *ret =
-		malloc(sizeof(*ret) + (sizeof(void *) * DISCOVERED_DEVICES_SIZE_STEP));
+		usbi_malloc(sizeof(*ret) + (sizeof(void *) * DISCOVERED_DEVICES_SIZE_STEP),
+			LIBUSB_ALLOC_SITE_DEVICE_LIST);
 
 	if (ret) {
 		ret->len = 0;
@@ -458,6 +459,7 @@ struct discovered_devs *discovered_devs_append(
 {
 	size_t len = discdevs->len;
 	size_t capacity;
+	struct discovered_devs *new_discdevs;
 
 	/* if there is space, just append the device */
 	if (len < discdevs->capacity) {
@@ -469,14 +471,20 @@ struct discovered_devs *discovered_devs_append(
 	/* exceeded capacity, need to grow */
 	usbi_dbg("need to increase capacity");
 	capacity = discdevs->capacity + DISCOVERED_DEVICES_SIZE_STEP;
-	discdevs = usbi_reallocf(discdevs,
-		sizeof(*discdevs) + (sizeof(void *) * capacity));
-	if (discdevs) {
-		discdevs->capacity = capacity;
-		discdevs->devices[len] = libusb_ref_device(dev);
-		discdevs->len++;
+	new_discdevs = usbi_realloc(discdevs,
+		sizeof(*discdevs) + (sizeof(void *) * discdevs->capacity),
+		sizeof(*discdevs) + (sizeof(void *) * capacity),
+		LIBUSB_ALLOC_SITE_DEVICE_LIST);
+	if (!new_discdevs) {
+		usbi_free(discdevs, 0, LIBUSB_ALLOC_SITE_DEVICE_LIST);
+		return NULL;
 	}
 
+	discdevs = new_discdevs;
+	discdevs->capacity = capacity;
+	discdevs->devices[len] = libusb_ref_device(dev);
+	discdevs->len++;
+
 	return discdevs;
 }
 
@@ -487,7 +495,8 @@ static void discovered_devs_free(struct discovered_devs *discdevs)
 	for (i = 0; i < discdevs->len; i++)
 		libusb_unref_device(discdevs->devices[i]);
 
-	free(discdevs);
+	usbi_free(discdevs, sizeof(*discdevs) +
+		(sizeof(void *) * discdevs->capacity), LIBUSB_ALLOC_SITE_DEVICE_LIST);
 }
 
 /* Allocate a new device with a specific session ID. The returned device has
@@ -496,7 +505,8 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	unsigned long session_id)
 {
 	size_t priv_size = usbi_backend->device_priv_size;
-	struct libusb_device *dev = calloc(1, sizeof(*dev) + priv_size);
+	struct libusb_device *dev = usbi_calloc(1, sizeof(*dev) + priv_size,
+		LIBUSB_ALLOC_SITE_DEVICE);
 	int r;
 
 	if (!dev)
@@ -504,7 +514,7 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 
 	r = usbi_mutex_init(&dev->lock, NULL);
 	if (r) {
-		free(dev);
+		usbi_free(dev, sizeof(*dev) + priv_size, LIBUSB_ALLOC_SITE_DEVICE);
 		return NULL;
 	}
 
@@ -675,7 +685,8 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 
 	/* convert discovered_devs into a list */
 	len = discdevs->len;
-	ret = calloc(len + 1, sizeof(struct libusb_device *));
+	ret = usbi_calloc(len + 1, sizeof(struct libusb_device *),
+		LIBUSB_ALLOC_SITE_DEVICE_LIST);
 	if (!ret) {
 		len = LIBUSB_ERROR_NO_MEM;
 		goto out;
@@ -713,7 +724,7 @@ void API_EXPORTED libusb_free_device_list(libusb_device **list,
 		while ((dev = list[i++]) != NULL)
 			libusb_unref_device(dev);
 	}
-	free(list);
+	usbi_free(list, 0, LIBUSB_ALLOC_SITE_DEVICE_LIST);
 }
 
 /** \ingroup dev
@@ -976,7 +987,8 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 		}
 
 		usbi_mutex_destroy(&dev->lock);
-		free(dev);
+		usbi_free(dev, sizeof(*dev) + usbi_backend->device_priv_size,
+			LIBUSB_ALLOC_SITE_DEVICE);
 	}
 }
 
@@ -993,17 +1005,14 @@ void usbi_fd_notification(struct libusb_context *ctx)
 		return;
 
 	/* record that we are messing with poll fds */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ctx->pollfd_modify++;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	usbi_atomic_inc(&ctx->pollfd_modify);
 
 	/* write some data on control pipe to interrupt event handlers */
 	r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
 	if (r <= 0) {
 		usbi_warn(ctx, "internal signalling write failed");
-		usbi_mutex_lock(&ctx->pollfd_modify_lock);
-		ctx->pollfd_modify--;
-		usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+		usbi_atomic_dec(&ctx->pollfd_modify);
+		usbi_wake_event_waiters(ctx);
 		return;
 	}
 
@@ -1016,9 +1025,7 @@ void usbi_fd_notification(struct libusb_context *ctx)
 		usbi_warn(ctx, "internal signalling read failed");
 
 	/* we're done with modifying poll fds */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ctx->pollfd_modify--;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	usbi_atomic_dec(&ctx->pollfd_modify);
 
 	/* Release event handling lock and wake up event waiters */
 	libusb_unlock_events(ctx);
@@ -1056,18 +1063,24 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_DEVICE;
 	}
 
-	_handle = malloc(sizeof(*_handle) + priv_size);
+	_handle = usbi_malloc(sizeof(*_handle) + priv_size,
+		LIBUSB_ALLOC_SITE_DEVICE_HANDLE);
 	if (!_handle)
 		return LIBUSB_ERROR_NO_MEM;
 
 	r = usbi_mutex_init(&_handle->lock, NULL);
 	if (r) {
-		free(_handle);
+		usbi_free(_handle, sizeof(*_handle) + priv_size,
+			LIBUSB_ALLOC_SITE_DEVICE_HANDLE);
 		return LIBUSB_ERROR_OTHER;
 	}
 
 	_handle->dev = libusb_ref_device(dev);
 	_handle->claimed_interfaces = 0;
+	_handle->reap_weight = 1;
+	list_init(&_handle->read_aheads);
+	list_init(&_handle->write_combiners);
+	_handle->buffer_pool = NULL;
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
@@ -1075,7 +1088,8 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
 		usbi_mutex_destroy(&_handle->lock);
-		free(_handle);
+		usbi_free(_handle, sizeof(*_handle) + priv_size,
+			LIBUSB_ALLOC_SITE_DEVICE_HANDLE);
 		return r;
 	}
 
@@ -1166,10 +1180,11 @@ static void do_close(struct libusb_context *ctx,
 		if (transfer->dev_handle != dev_handle)
 			continue;
 
-		if (!(itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
+		if (!usbi_transfer_test_flags(itransfer,
+				USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
-			if (itransfer->flags & USBI_TRANSFER_CANCELLING)
+			if (usbi_transfer_test_flags(itransfer, USBI_TRANSFER_CANCELLING))
 				usbi_warn(ctx, "A cancellation for an in-flight transfer hasn't completed but closing the device handle");
 			else
 				usbi_err(ctx, "A cancellation hasn't even been scheduled on the transfer for which the device is closing");
@@ -1179,10 +1194,10 @@ static void do_close(struct libusb_context *ctx,
 		 * we don't accidentally use the device handle in the future
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
-		usbi_mutex_lock(&itransfer->lock);
 		list_del(&itransfer->list);
 		transfer->dev_handle = NULL;
-		usbi_mutex_unlock(&itransfer->lock);
+		/* the transfer will never complete */
+		usbi_atomic_store(&itransfer->state, USBI_TRANSFER_IDLE);
 
 		/* it is up to the user to free up the actual transfer struct.  this is
 		 * just making sure that we don't attempt to process the transfer after
@@ -1202,7 +1217,8 @@ static void do_close(struct libusb_context *ctx,
 	usbi_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
 	usbi_mutex_destroy(&dev_handle->lock);
-	free(dev_handle);
+	usbi_free(dev_handle, sizeof(*dev_handle) +
+		usbi_backend->device_handle_priv_size, LIBUSB_ALLOC_SITE_DEVICE_HANDLE);
 }
 
 /** \ingroup dev
@@ -1228,6 +1244,15 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	ctx = HANDLE_CTX(dev_handle);
 
+	/* stop any read-ahead and combined write transfers while we can still
+	 * handle events */
+	usbi_free_read_aheads(dev_handle);
+	usbi_free_write_combiners(dev_handle);
+	libusb_free_buffer_pool(dev_handle);
+
+	/* callbacks of transfers on this handle may still be queued */
+	usbi_wait_for_callbacks(ctx);
+
 	/* Similarly to libusb_open(), we want to interrupt all event handlers
 	 * at this point. More importantly, we want to perform the actual close of
 	 * the device while holding the event handling lock (preventing any other
@@ -1235,18 +1260,15 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	 * descriptor from the polling loop. */
 
 	/* record that we are messing with poll fds */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ctx->pollfd_modify++;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	usbi_atomic_inc(&ctx->pollfd_modify);
 
 	/* write some data on control pipe to interrupt event handlers */
 	r = usbi_write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
 	if (r <= 0) {
 		usbi_warn(ctx, "internal signalling write failed, closing anyway");
 		do_close(ctx, dev_handle);
-		usbi_mutex_lock(&ctx->pollfd_modify_lock);
-		ctx->pollfd_modify--;
-		usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+		usbi_atomic_dec(&ctx->pollfd_modify);
+		usbi_wake_event_waiters(ctx);
 		return;
 	}
 
@@ -1262,9 +1284,7 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 	do_close(ctx, dev_handle);
 
 	/* we're done with modifying poll fds */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ctx->pollfd_modify--;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	usbi_atomic_dec(&ctx->pollfd_modify);
 
 	/* Release event handling lock and wake up event waiters */
 	libusb_unlock_events(ctx);
@@ -1694,6 +1714,251 @@ void API_EXPORTED libusb_set_debug(libusb_context *ctx, int level)
 		ctx->debug = level;
 }
 
+/* allocator installed with libusb_set_allocator(). only changed while no
+ * context exists, so it is read without locking. */
+static struct libusb_allocator usbi_allocator;
+static int usbi_allocator_set = 0;
+static struct libusb_alloc_stats usbi_alloc_stats[LIBUSB_ALLOC_SITE_COUNT];
+
+static void count_alloc(void *ptr, size_t size, enum libusb_alloc_site site)
+{
+	struct libusb_alloc_stats *stats = &usbi_alloc_stats[site];
+
+	if (ptr) {
+		usbi_atomic_add64(&stats->allocs, 1);
+		usbi_atomic_add64(&stats->bytes, size);
+	} else {
+		usbi_atomic_add64(&stats->failures, 1);
+	}
+}
+
+void *usbi_malloc(size_t size, enum libusb_alloc_site site)
+{
+	void *ptr;
+
+	if (usbi_allocator_set)
+		ptr = usbi_allocator.alloc(size, site, usbi_allocator.user_data);
+	else
+		ptr = malloc(size);
+	count_alloc(ptr, size, site);
+	return ptr;
+}
+
+void *usbi_calloc(size_t nmemb, size_t size, enum libusb_alloc_site site)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size) {
+		count_alloc(NULL, 0, site);
+		return NULL;
+	}
+	size *= nmemb;
+
+	if (!usbi_allocator_set) {
+		ptr = calloc(1, size);
+		count_alloc(ptr, size, site);
+		return ptr;
+	}
+
+	ptr = usbi_malloc(size, site);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+void *usbi_realloc(void *ptr, size_t old_size, size_t size,
+	enum libusb_alloc_site site)
+{
+	void *new_ptr;
+
+	if (!usbi_allocator_set) {
+		new_ptr = realloc(ptr, size);
+		count_alloc(new_ptr, size, site);
+		if (new_ptr && ptr)
+			usbi_atomic_add64(&usbi_alloc_stats[site].frees, 1);
+		return new_ptr;
+	}
+
+	new_ptr = usbi_malloc(size, site);
+	if (new_ptr && ptr) {
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		usbi_free(ptr, old_size, site);
+	}
+	return new_ptr;
+}
+
+void usbi_free(void *ptr, size_t size, enum libusb_alloc_site site)
+{
+	if (!ptr)
+		return;
+
+	usbi_atomic_add64(&usbi_alloc_stats[site].frees, 1);
+	if (usbi_allocator_set)
+		usbi_allocator.free(ptr, size, site, usbi_allocator.user_data);
+	else
+		free(ptr);
+}
+
+/* without a user allocator, aligned blocks are carved out of a larger
+ * malloc() block, with the start of that block stored just below the
+ * returned pointer */
+void *usbi_aligned_alloc(size_t alignment, size_t size,
+	enum libusb_alloc_site site)
+{
+	unsigned char *base;
+	uintptr_t addr;
+	void *ptr;
+
+	if (usbi_allocator_set) {
+		ptr = usbi_allocator.aligned_alloc(alignment, size, site,
+			usbi_allocator.user_data);
+		count_alloc(ptr, size, site);
+		return ptr;
+	}
+
+	if (alignment < sizeof(void *))
+		alignment = sizeof(void *);
+	if (size > SIZE_MAX - alignment - sizeof(void *)) {
+		count_alloc(NULL, 0, site);
+		return NULL;
+	}
+
+	base = malloc(size + alignment + sizeof(void *));
+	count_alloc(base, size, site);
+	if (!base)
+		return NULL;
+
+	addr = ((uintptr_t) base + sizeof(void *) + alignment - 1)
+		& ~((uintptr_t) alignment - 1);
+	ptr = (void *) addr;
+	((void **) ptr)[-1] = base;
+	return ptr;
+}
+
+void usbi_aligned_free(void *ptr, size_t size, enum libusb_alloc_site site)
+{
+	if (!ptr)
+		return;
+
+	if (usbi_allocator_set) {
+		usbi_free(ptr, size, site);
+		return;
+	}
+
+	usbi_atomic_add64(&usbi_alloc_stats[site].frees, 1);
+	free(((void **) ptr)[-1]);
+}
+
+/** \ingroup lib
+ * Route the internal memory allocations of libusbx through an application
+ * supplied allocator, e.g. an arena or a hugepage allocator. Every
+ * allocation is tagged with a \ref libusb_alloc_site "site" telling what the
+ * memory is used for.
+ *
+ * The allocator is shared by all contexts, as some objects (transfers,
+ * configuration descriptors) are allocated and released without a context.
+ * It must therefore be installed before libusb_init() is called and before
+ * any other libusbx object is allocated, and it must stay in place until all
+ * of those objects have been released. Memory which libusbx hands to the
+ * application to be released with free(), such as the list returned by
+ * libusb_get_pollfds(), does not use the allocator.
+ *
+ * \param allocator the allocator to use, or NULL to go back to the system
+ * allocator. The structure is copied.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if one of the callbacks is missing
+ * \returns LIBUSB_ERROR_BUSY if a context currently exists
+ */
+int API_EXPORTED libusb_set_allocator(const struct libusb_allocator *allocator)
+{
+	int r = 0;
+
+	if (allocator && (!allocator->alloc || !allocator->aligned_alloc
+			|| !allocator->free))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_static_lock(&default_context_lock);
+	usbi_mutex_static_lock(&active_contexts_lock);
+	if (usbi_default_context || (active_contexts_list.next
+			&& !list_empty(&active_contexts_list))) {
+		r = LIBUSB_ERROR_BUSY;
+	} else if (allocator) {
+		usbi_allocator = *allocator;
+		usbi_allocator_set = 1;
+	} else {
+		usbi_allocator_set = 0;
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+	usbi_mutex_static_unlock(&default_context_lock);
+
+	return r;
+}
+
+/** \ingroup lib
+ * Get the allocation counters of one allocation site. The counters cover
+ * the whole process and are never reset, so an application checking that
+ * its streaming loop does not allocate can compare two snapshots.
+ *
+ * \param site the \ref libusb_alloc_site "allocation site" to query
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if site or stats is invalid
+ */
+int API_EXPORTED libusb_get_alloc_stats(enum libusb_alloc_site site,
+	struct libusb_alloc_stats *stats)
+{
+	struct libusb_alloc_stats *s;
+
+	if ((int) site < 0 || site >= LIBUSB_ALLOC_SITE_COUNT || !stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	s = &usbi_alloc_stats[site];
+	stats->allocs = usbi_atomic_add64(&s->allocs, 0);
+	stats->frees = usbi_atomic_add64(&s->frees, 0);
+	stats->bytes = usbi_atomic_add64(&s->bytes, 0);
+	stats->failures = usbi_atomic_add64(&s->failures, 0);
+	return 0;
+}
+
+/** \ingroup lib
+ * Make the internal mutexes of contexts created from now on use priority
+ * inheritance. A thread holding one of them is then temporarily boosted to
+ * the priority of the highest-priority thread waiting for it, so that a
+ * low-priority thread submitting transfers cannot hold off a real-time
+ * thread handling events, or the other way round.
+ *
+ * The setting applies to the whole process and can only be changed while no
+ * context exists, so call it before libusb_init(). A few process-wide locks
+ * that are statically initialized keep their default protocol.
+ *
+ * \param enable 1 to use priority inheritance, 0 for default mutexes
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if a context exists
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform has no priority
+ * inheritance mutexes
+ * \see libusb_start_event_thread()
+ */
+int API_EXPORTED libusb_set_priority_inheritance(int enable)
+{
+#ifdef USBI_MUTEX_PRIO_INHERIT_AVAILABLE
+	int r = 0;
+
+	usbi_mutex_static_lock(&default_context_lock);
+	usbi_mutex_static_lock(&active_contexts_lock);
+	if (usbi_default_context || (active_contexts_list.next
+			&& !list_empty(&active_contexts_list)))
+		r = LIBUSB_ERROR_BUSY;
+	else
+		usbi_mutex_prio_inherit = enable ? 1 : 0;
+	usbi_mutex_static_unlock(&active_contexts_lock);
+	usbi_mutex_static_unlock(&default_context_lock);
+
+	return r;
+#else
+	return enable ? LIBUSB_ERROR_NOT_SUPPORTED : 0;
+#endif
+}
+
 /** \ingroup lib
  * Initialize libusb. This function must be called before calling any other
  * libusbx function.
@@ -1728,7 +1993,7 @@ int API_EXPORTED libusb_init(libusb_context **context)
 		return 0;
 	}
 
-	ctx = calloc(1, sizeof(*ctx));
+	ctx = usbi_calloc(1, sizeof(*ctx), LIBUSB_ALLOC_SITE_CONTEXT);
 	if (!ctx) {
 		r = LIBUSB_ERROR_NO_MEM;
 		goto err_unlock;
@@ -1804,7 +2069,7 @@ err_free_ctx:
 		libusb_unref_device(dev);
 	}
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
-	free(ctx);
+	usbi_free(ctx, sizeof(*ctx), LIBUSB_ALLOC_SITE_CONTEXT);
 err_unlock:
 	usbi_mutex_static_unlock(&default_context_lock);
 	return r;
@@ -1840,6 +2105,7 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
+	libusb_stop_event_thread(ctx);
 	usbi_hotplug_deregister_all(ctx);
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
@@ -1861,7 +2127,7 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	usbi_mutex_destroy(&ctx->open_devs_lock);
 	usbi_mutex_destroy(&ctx->usb_devs_lock);
 	usbi_mutex_destroy(&ctx->hotplug_cbs_lock);
-	free(ctx);
+	usbi_free(ctx, sizeof(*ctx), LIBUSB_ALLOC_SITE_CONTEXT);
 }
 
 /** \ingroup misc
@@ -1883,6 +2149,10 @@ int API_EXPORTED libusb_has_capability(uint32_t capability)
 		return (usbi_backend->caps & USBI_CAP_HAS_HID_ACCESS);
 	case LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER:
 		return (usbi_backend->caps & USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER);
+	case LIBUSB_CAP_SUPPORTS_AUTO_RESUBMIT:
+		return (usbi_backend->caps & USBI_CAP_SUPPORTS_AUTO_RESUBMIT);
+	case LIBUSB_CAP_SUPPORTS_UNIFORM_ISO:
+		return (usbi_backend->caps & USBI_CAP_SUPPORTS_UNIFORM_ISO);
 	}
 	return 0;
 }
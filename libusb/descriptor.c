@@ -97,9 +97,11 @@ int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
 {
 	if (endpoint->ss_endpoint_companion)
-		free((unsigned char *) endpoint->ss_endpoint_companion);
+		usbi_free(endpoint->ss_endpoint_companion,
+			sizeof(*endpoint->ss_endpoint_companion), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (endpoint->extra)
-		free((unsigned char *) endpoint->extra);
+		usbi_free((unsigned char *) endpoint->extra, endpoint->extra_length,
+			LIBUSB_ALLOC_SITE_DESCRIPTOR);
 }
 
 static int parse_ss_endpoint_companion(struct libusb_context *ctx,
@@ -170,7 +172,8 @@ static int parse_endpoint(struct libusb_context *ctx,
 	usbi_parse_descriptor(buffer, "bb", &header, 0);
 	if (header.bDescriptorType == LIBUSB_DT_SS_ENDPOINT_COMPANION) {
 		endpoint->ss_endpoint_companion = (struct libusb_ss_endpoint_companion_descriptor *)
-			malloc(sizeof(struct libusb_ss_endpoint_companion_descriptor));
+			usbi_malloc(sizeof(struct libusb_ss_endpoint_companion_descriptor),
+				LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		if (!endpoint->ss_endpoint_companion) {
 			usbi_err(ctx, "couldn't allocate memory for endpoint companion");
 			return LIBUSB_ERROR_NO_MEM;
@@ -220,7 +223,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 		return parsed;
 	}
 
-	extra = malloc(len);
+	extra = usbi_malloc(len, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	endpoint->extra = extra;
 	if (!extra) {
 		endpoint->extra_length = 0;
@@ -244,15 +247,18 @@ static void clear_interface(struct libusb_interface *usb_interface)
 				(struct libusb_interface_descriptor *)
 				usb_interface->altsetting + i;
 			if (ifp->extra)
-				free((void *) ifp->extra);
+				usbi_free((void *) ifp->extra, ifp->extra_length, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 			if (ifp->endpoint) {
 				for (j = 0; j < ifp->bNumEndpoints; j++)
 					clear_endpoint((struct libusb_endpoint_descriptor *)
 						ifp->endpoint + j);
-				free((void *) ifp->endpoint);
+				usbi_free((void *) ifp->endpoint, ifp->bNumEndpoints *
+					sizeof(struct libusb_endpoint_descriptor), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 			}
 		}
-		free((void *) usb_interface->altsetting);
+		usbi_free((void *) usb_interface->altsetting,
+			usb_interface->num_altsetting *
+			sizeof(struct libusb_interface_descriptor), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		usb_interface->altsetting = NULL;
 	}
 
@@ -276,9 +282,11 @@ static int parse_interface(libusb_context *ctx,
 	while (size >= INTERFACE_DESC_LENGTH) {
 		struct libusb_interface_descriptor *altsetting =
 			(struct libusb_interface_descriptor *) usb_interface->altsetting;
-		altsetting = usbi_reallocf(altsetting,
+		altsetting = usbi_realloc(altsetting,
 			sizeof(struct libusb_interface_descriptor) *
-			(usb_interface->num_altsetting + 1));
+			usb_interface->num_altsetting,
+			sizeof(struct libusb_interface_descriptor) *
+			(usb_interface->num_altsetting + 1), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		if (!altsetting) {
 			r = LIBUSB_ERROR_NO_MEM;
 			goto err;
@@ -332,7 +340,7 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len) {
-			ifp->extra = malloc(len);
+			ifp->extra = usbi_malloc(len, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 			if (!ifp->extra) {
 				r = LIBUSB_ERROR_NO_MEM;
 				goto err;
@@ -359,7 +367,7 @@ static int parse_interface(libusb_context *ctx,
 		if (ifp->bNumEndpoints > 0) {
 			struct libusb_endpoint_descriptor *endpoint;
 			tmp = ifp->bNumEndpoints * sizeof(struct libusb_endpoint_descriptor);
-			endpoint = malloc(tmp);
+			endpoint = usbi_malloc(tmp, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 			ifp->endpoint = endpoint;
 			if (!endpoint) {
 				r = LIBUSB_ERROR_NO_MEM;
@@ -408,10 +416,11 @@ static void clear_configuration(struct libusb_config_descriptor *config)
 		for (i = 0; i < config->bNumInterfaces; i++)
 			clear_interface((struct libusb_interface *)
 				config->interface + i);
-		free((void *) config->interface);
+		usbi_free((void *) config->interface, config->bNumInterfaces *
+			sizeof(struct libusb_interface), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	}
 	if (config->extra)
-		free((void *) config->extra);
+		usbi_free((void *) config->extra, config->extra_length, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 }
 
 static int parse_configuration(struct libusb_context *ctx,
@@ -434,7 +443,7 @@ static int parse_configuration(struct libusb_context *ctx,
 	}
 
 	tmp = config->bNumInterfaces * sizeof(struct libusb_interface);
-	usb_interface = malloc(tmp);
+	usb_interface = usbi_malloc(tmp, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	config->interface = usb_interface;
 	if (!config->interface)
 		return LIBUSB_ERROR_NO_MEM;
@@ -491,7 +500,7 @@ static int parse_configuration(struct libusb_context *ctx,
 		if (len) {
 			/* FIXME: We should realloc and append here */
 			if (!config->extra_length) {
-				config->extra = malloc(len);
+				config->extra = usbi_malloc(len, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 				if (!config->extra) {
 					r = LIBUSB_ERROR_NO_MEM;
 					goto err;
@@ -570,7 +579,8 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
 int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	struct libusb_config_descriptor **config)
 {
-	struct libusb_config_descriptor *_config = malloc(sizeof(*_config));
+	struct libusb_config_descriptor *_config = usbi_malloc(sizeof(*_config),
+		LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	unsigned char tmp[8];
 	unsigned char *buf = NULL;
 	int host_endian = 0;
@@ -588,7 +598,7 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	_config->wTotalLength = 0;
 	usbi_parse_descriptor(tmp, "bbw", _config, host_endian);
 	if (_config->wTotalLength != 0)
-		buf = malloc(_config->wTotalLength);
+		buf = usbi_malloc(_config->wTotalLength, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (!buf) {
 		r = LIBUSB_ERROR_NO_MEM;
 		goto err;
@@ -607,14 +617,13 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 		usbi_warn(dev->ctx, "descriptor data still left");
 	}
 
-	free(buf);
+	usbi_free(buf, _config->wTotalLength, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	*config = _config;
 	return 0;
 
 err:
-	free(_config);
-	if (buf)
-		free(buf);
+	usbi_free(_config, sizeof(*_config), LIBUSB_ALLOC_SITE_DESCRIPTOR);
+	usbi_free(buf, 0, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	return r;
 }
 
@@ -647,7 +656,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->num_configurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
-	_config = malloc(sizeof(*_config));
+	_config = usbi_malloc(sizeof(*_config), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (!_config)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -657,7 +666,7 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		goto err;
 
 	usbi_parse_descriptor(tmp, "bbw", _config, host_endian);
-	buf = malloc(_config->wTotalLength);
+	buf = usbi_malloc(_config->wTotalLength, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (!buf) {
 		r = LIBUSB_ERROR_NO_MEM;
 		goto err;
@@ -677,14 +686,13 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 		usbi_warn(dev->ctx, "descriptor data still left");
 	}
 
-	free(buf);
+	usbi_free(buf, _config->wTotalLength, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	*config = _config;
 	return 0;
 
 err:
-	free(_config);
-	if (buf)
-		free(buf);
+	usbi_free(_config, sizeof(*_config), LIBUSB_ALLOC_SITE_DESCRIPTOR);
+	usbi_free(buf, 0, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	return r;
 }
 
@@ -761,7 +769,7 @@ void API_EXPORTED libusb_free_config_descriptor(
 		return;
 
 	clear_configuration(config);
-	free(config);
+	usbi_free(config, sizeof(*config), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 }
 
 /** \ingroup desc
@@ -836,7 +844,7 @@ static int parse_bos(struct libusb_context *ctx, struct libusb_bos_descriptor **
 	int i;
 	uint16_t len, parse_len;
 
-	bos_desc = calloc (1, sizeof (*bos_desc));
+	bos_desc = usbi_calloc(1, sizeof(*bos_desc), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (!bos_desc) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
@@ -857,7 +865,7 @@ static int parse_bos(struct libusb_context *ctx, struct libusb_bos_descriptor **
 			if (!bos_desc->usb_2_0_extension) {
 				bos_desc->usb_2_0_extension =
 					(struct libusb_usb_2_0_extension_descriptor *)
-					malloc(sizeof(*bos_desc->usb_2_0_extension));
+					usbi_malloc(sizeof(*bos_desc->usb_2_0_extension), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 				usbi_parse_descriptor(bos_raw, "bbbd", bos_desc->usb_2_0_extension, host_endian);
 			} else
 				usbi_warn(ctx, "usb_2_0_extension was already allocated");
@@ -871,7 +879,7 @@ static int parse_bos(struct libusb_context *ctx, struct libusb_bos_descriptor **
 			if (!bos_desc->ss_usb_dev_cap) {
 				bos_desc->ss_usb_dev_cap =
 					(struct libusb_ss_usb_device_capability_descriptor *)
-					malloc(sizeof(*bos_desc->ss_usb_dev_cap));
+					usbi_malloc(sizeof(*bos_desc->ss_usb_dev_cap), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 				usbi_parse_descriptor(bos_raw, "bbbbwbbw", bos_desc->ss_usb_dev_cap, host_endian);
 			} else
 				usbi_warn(ctx, "ss_usb_dev_cap was already allocated");
@@ -885,7 +893,7 @@ static int parse_bos(struct libusb_context *ctx, struct libusb_bos_descriptor **
 			if (!bos_desc->container_id) {
 				bos_desc->container_id =
 					(struct libusb_container_id_descriptor *)
-					malloc(sizeof(*bos_desc->container_id));
+					usbi_malloc(sizeof(*bos_desc->container_id), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 				usbi_parse_descriptor(bos_raw, "bbbbu", bos_desc->container_id, host_endian);
 			} else
 				usbi_warn(ctx, "container_id was already allocated");
@@ -928,7 +936,7 @@ int API_EXPORTED libusb_get_bos_descriptor(libusb_device_handle *handle, struct
 	bos_size = (bos_header[3]<<8) + bos_header[2];
 	if ((r >= sizeof(bos_header)) && (bos_size >= sizeof(bos_header))) {
 		usbi_dbg("found BOS descriptor: size %d bytes, %d capabilities", bos_size, bos_header[4]);
-		bos_data = calloc(bos_size, 1);
+		bos_data = usbi_calloc(bos_size, 1, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		if (bos_data == NULL) {
 			return LIBUSB_ERROR_NO_MEM;
 		}
@@ -943,8 +951,7 @@ int API_EXPORTED libusb_get_bos_descriptor(libusb_device_handle *handle, struct
 		r = LIBUSB_ERROR_NOT_FOUND;
 	}
 
-	if (bos_data)
-		free(bos_data);
+	usbi_free(bos_data, bos_size, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	return r;
 }
 
@@ -961,16 +968,16 @@ void API_EXPORTED libusb_free_bos_descriptor(struct libusb_bos_descriptor *bos)
 		return;
 
 	if (bos->usb_2_0_extension) {
-		free(bos->usb_2_0_extension);
+		usbi_free(bos->usb_2_0_extension, sizeof(*bos->usb_2_0_extension), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	}
 
 	if (bos->ss_usb_dev_cap) {
-		free(bos->ss_usb_dev_cap);
+		usbi_free(bos->ss_usb_dev_cap, sizeof(*bos->ss_usb_dev_cap), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	}
 
 	if (bos->container_id) {
-		free(bos->container_id);
+		usbi_free(bos->container_id, sizeof(*bos->container_id), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	}
 
-	free(bos);
+	usbi_free(bos, sizeof(*bos), LIBUSB_ALLOC_SITE_DESCRIPTOR);
 }
@@ -176,7 +176,7 @@ void usbi_hotplug_match(struct libusb_device *dev, libusb_hotplug_event event)
 
 		if (ret) {
 			list_del(&hotplug_cb->list);
-			free(hotplug_cb);
+			usbi_free(hotplug_cb, sizeof(*hotplug_cb), LIBUSB_ALLOC_SITE_HOTPLUG);
 		}
 	}
 
@@ -220,7 +220,8 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 
 	USBI_GET_CONTEXT(ctx);
 
-	new_callback = (libusb_hotplug_callback *)calloc(1, sizeof (*new_callback));
+	new_callback = (libusb_hotplug_callback *)usbi_calloc(1,
+		sizeof (*new_callback), LIBUSB_ALLOC_SITE_HOTPLUG);
 	if (!new_callback) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
@@ -294,7 +295,7 @@ void usbi_hotplug_deregister_all(struct libusb_context *ctx) {
 	list_for_each_entry_safe(hotplug_cb, next, &ctx->hotplug_cbs, list,
 	struct libusb_hotplug_callback) {
 		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
+		usbi_free(hotplug_cb, sizeof(*hotplug_cb), LIBUSB_ALLOC_SITE_HOTPLUG);
 	}
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
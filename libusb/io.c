@@ -36,6 +36,10 @@
 #ifdef USBI_TIMERFD_AVAILABLE
 #include <sys/timerfd.h>
 #endif
+#ifdef THREADS_POSIX
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 #include "libusbi.h"
 #include "hotplug.h"
@@ -466,6 +470,12 @@ if (r == 0 && actual_length == sizeof(data)) {
  * libusb_get_iso_packet_buffer() and libusb_get_iso_packet_buffer_simple()
  * functions may help you here.
  *
+ * Transfers with many packets of the same length, as is typical for
+ * streaming, can be submitted with the \ref libusb_transfer_flags
+ * "LIBUSB_TRANSFER_UNIFORM_ISO" flag. They only need a single packet
+ * descriptor, and their packet results are read with
+ * libusb_get_iso_packet_result() instead of from the descriptors.
+ *
  * \section asyncmem Memory caveats
  *
  * In most circumstances, it is not safe to use stack memory for transfer
@@ -1055,12 +1065,20 @@ int usbi_io_init(struct libusb_context *ctx)
 	int r;
 
 	usbi_mutex_init(&ctx->flying_transfers_lock, NULL);
+	usbi_mutex_init(&ctx->deferred_completions_lock, NULL);
+	usbi_mutex_init(&ctx->throttle_lock, NULL);
 	usbi_mutex_init(&ctx->pollfds_lock, NULL);
-	usbi_mutex_init(&ctx->pollfd_modify_lock, NULL);
 	usbi_mutex_init_recursive(&ctx->events_lock, NULL);
 	usbi_mutex_init(&ctx->event_waiters_lock, NULL);
 	usbi_cond_init(&ctx->event_waiters_cond, NULL);
+	usbi_cond_init(&ctx->timers_cond, NULL);
+	usbi_mutex_init(&ctx->callback_lock, NULL);
+	usbi_cond_init(&ctx->callback_idle_cond, NULL);
+	usbi_mutex_init(&ctx->event_thread_lock, NULL);
 	list_init(&ctx->flying_transfers);
+	list_init(&ctx->timers);
+	list_init(&ctx->deferred_completions);
+	list_init(&ctx->throttled_transfers);
 	list_init(&ctx->pollfds);
 
 	/* FIXME should use an eventfd on kernels that support it */
@@ -1088,6 +1106,21 @@ int usbi_io_init(struct libusb_context *ctx)
 	if (r < 0)
 		goto err_close_hp_pipe;
 
+	/* create event pipe */
+	r = usbi_pipe(ctx->event_pipe);
+	if (r < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err_close_hp_pipe;
+	}
+
+#ifndef OS_WINDOWS
+	/* signalling must never block, a full pipe wakes up poll() anyway */
+	fcntl(ctx->event_pipe[1], F_SETFL, O_NONBLOCK);
+#endif
+	r = usbi_add_pollfd(ctx, ctx->event_pipe[0], POLLIN);
+	if (r < 0)
+		goto err_close_ev_pipe;
+
 #ifdef USBI_TIMERFD_AVAILABLE
 	ctx->timerfd = timerfd_create(usbi_backend->get_timerfd_clockid(),
 		TFD_NONBLOCK);
@@ -1097,7 +1130,7 @@ int usbi_io_init(struct libusb_context *ctx)
 		if (r < 0) {
 			usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
 			close(ctx->timerfd);
-			goto err_close_hp_pipe;
+			goto err_close_ev_pipe;
 		}
 	} else {
 		usbi_dbg("timerfd not available (code %d error %d)", ctx->timerfd, errno);
@@ -1107,6 +1140,9 @@ int usbi_io_init(struct libusb_context *ctx)
 
 	return 0;
 
+err_close_ev_pipe:
+	usbi_close(ctx->event_pipe[0]);
+	usbi_close(ctx->event_pipe[1]);
 err_close_hp_pipe:
 	usbi_close(ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[1]);
@@ -1115,22 +1151,31 @@ err_close_pipe:
 	usbi_close(ctx->ctrl_pipe[1]);
 err:
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+	usbi_mutex_destroy(&ctx->deferred_completions_lock);
+	usbi_mutex_destroy(&ctx->throttle_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
-	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_cond_destroy(&ctx->timers_cond);
+	usbi_mutex_destroy(&ctx->callback_lock);
+	usbi_cond_destroy(&ctx->callback_idle_cond);
+	usbi_mutex_destroy(&ctx->event_thread_lock);
 	return r;
 }
 
 void usbi_io_exit(struct libusb_context *ctx)
 {
+	libusb_set_callback_workers(ctx, 0);
 	usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[0]);
 	usbi_close(ctx->ctrl_pipe[1]);
 	usbi_remove_pollfd(ctx, ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[0]);
 	usbi_close(ctx->hotplug_pipe[1]);
+	usbi_remove_pollfd(ctx, ctx->event_pipe[0]);
+	usbi_close(ctx->event_pipe[0]);
+	usbi_close(ctx->event_pipe[1]);
 #ifdef USBI_TIMERFD_AVAILABLE
 	if (usbi_using_timerfd(ctx)) {
 		usbi_remove_pollfd(ctx, ctx->timerfd);
@@ -1138,39 +1183,66 @@ void usbi_io_exit(struct libusb_context *ctx)
 	}
 #endif
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+	usbi_mutex_destroy(&ctx->deferred_completions_lock);
+	usbi_mutex_destroy(&ctx->throttle_lock);
 	usbi_mutex_destroy(&ctx->pollfds_lock);
-	usbi_mutex_destroy(&ctx->pollfd_modify_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_cond_destroy(&ctx->timers_cond);
+	usbi_mutex_destroy(&ctx->callback_lock);
+	usbi_cond_destroy(&ctx->callback_idle_cond);
+	usbi_mutex_destroy(&ctx->event_thread_lock);
+	usbi_free(ctx->poll_fds, 0, LIBUSB_ALLOC_SITE_POLLFD);
+}
+
+/* Timeouts and timer expiries are kept as monotonic times in nanoseconds,
+ * with 0 meaning none. An event handling pass reads the clock once and
+ * hands the time to all the timeout checks it makes. */
+
+#define NSECS_PER_USEC		1000ULL
+#define NSECS_PER_MSEC		1000000ULL
+#define NSECS_PER_SEC		1000000000ULL
+
+static uint64_t monotonic_nsecs(void)
+{
+	struct timespec ts;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t timeval_to_nsecs(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * NSECS_PER_SEC
+		+ (uint64_t)tv->tv_usec * NSECS_PER_USEC;
+}
+
+static void nsecs_to_timeval(uint64_t nsecs, struct timeval *tv)
+{
+	tv->tv_sec = (long)(nsecs / NSECS_PER_SEC);
+	tv->tv_usec = (long)((nsecs % NSECS_PER_SEC) / NSECS_PER_USEC);
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
 {
-	int r;
-	struct timespec current_time;
+	uint64_t now;
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
 
+	transfer->timeout_nsecs = 0;
 	if (!timeout)
 		return 0;
 
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &current_time);
-	if (r < 0) {
+	now = monotonic_nsecs();
+	if (!now) {
 		usbi_err(ITRANSFER_CTX(transfer),
 			"failed to read monotonic clock, errno=%d", errno);
-		return r;
-	}
-
-	current_time.tv_sec += timeout / 1000;
-	current_time.tv_nsec += (timeout % 1000) * 1000000;
-
-	while (current_time.tv_nsec >= 1000000000) {
-		current_time.tv_nsec -= 1000000000;
-		current_time.tv_sec++;
+		return LIBUSB_ERROR_OTHER;
 	}
 
-	TIMESPEC_TO_TIMEVAL(&transfer->timeout, &current_time);
+	transfer->timeout_nsecs = now + timeout * NSECS_PER_MSEC;
 	return 0;
 }
 
@@ -1180,7 +1252,7 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 static int add_to_flying_list(struct usbi_transfer *transfer)
 {
 	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
+	uint64_t timeout = transfer->timeout_nsecs;
 	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
 	int r = 0;
 	int first = 1;
@@ -1194,7 +1266,7 @@ static int add_to_flying_list(struct usbi_transfer *transfer)
 	}
 
 	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
+	if (!timeout) {
 		list_add_tail(&transfer->list, &ctx->flying_transfers);
 		/* first is irrelevant in this case */
 		goto out;
@@ -1203,11 +1275,7 @@ static int add_to_flying_list(struct usbi_transfer *transfer)
 	/* otherwise, find appropriate place in list */
 	list_for_each_entry(cur, &ctx->flying_transfers, list, struct usbi_transfer) {
 		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
-
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
+		if (!cur->timeout_nsecs || cur->timeout_nsecs > timeout) {
 			list_add_tail(&transfer->list, &cur->list);
 			goto out;
 		}
@@ -1219,11 +1287,11 @@ static int add_to_flying_list(struct usbi_transfer *transfer)
 	list_add_tail(&transfer->list, &ctx->flying_transfers);
 out:
 #ifdef USBI_TIMERFD_AVAILABLE
-	if (first && usbi_using_timerfd(ctx) && timerisset(timeout)) {
+	if (first && usbi_using_timerfd(ctx) && timeout) {
 		/* if this transfer has the lowest timeout of all active transfers,
 		 * rearm the timerfd with this transfer's timeout */
 		const struct itimerspec it = { {0, 0},
-			{ timeout->tv_sec, timeout->tv_usec * 1000 } };
+			{ timeout / NSECS_PER_SEC, timeout % NSECS_PER_SEC } };
 		usbi_dbg("arm timerfd for timeout in %dms (first in line)",
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
 		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
@@ -1240,6 +1308,39 @@ out:
 	return r;
 }
 
+/* size of the backend data of a transfer, rounded up so that the iso
+ * packet offset table following it is aligned */
+static size_t transfer_os_alloc_size(int iso_packets)
+{
+	return USBI_CACHELINE_ALIGN(usbi_backend->transfer_priv_size
+		+ (usbi_backend->add_iso_packet_size * iso_packets));
+}
+
+/* offset of each iso packet in the transfer buffer, so that packets can be
+ * located without summing the lengths of all those before them */
+static unsigned int *transfer_iso_offsets(struct usbi_transfer *itransfer)
+{
+	return (unsigned int *) (((unsigned char *)
+		usbi_transfer_get_os_priv(itransfer))
+		+ transfer_os_alloc_size(itransfer->num_iso_packets));
+}
+
+static void build_iso_offsets(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	unsigned int *offsets = transfer_iso_offsets(itransfer);
+	unsigned int offset = 0;
+	int num_packets = MIN(transfer->num_iso_packets, itransfer->num_iso_packets);
+	int i;
+
+	for (i = 0; i < num_packets; i++) {
+		offsets[i] = offset;
+		offset += transfer->iso_packet_desc[i].length;
+	}
+	itransfer->iso_offsets_packets = num_packets;
+}
+
 /** \ingroup asyncio
  * Allocate a libusbx transfer with a specified number of isochronous packet
  * descriptors. The returned transfer is pre-initialized for you. When the new
@@ -1267,18 +1368,20 @@ DEFAULT_VISIBILITY
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	int iso_packets)
 {
-	size_t os_alloc_size = usbi_backend->transfer_priv_size
-		+ (usbi_backend->add_iso_packet_size * iso_packets);
-	size_t alloc_size = sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * iso_packets)
-		+ os_alloc_size;
-	struct usbi_transfer *itransfer = calloc(1, alloc_size);
+	size_t alloc_size = USBI_TRANSFER_HEADER_SIZE
+		+ USBI_TRANSFER_PUBLIC_SIZE(iso_packets)
+		+ transfer_os_alloc_size(iso_packets)
+		+ iso_packets * sizeof(unsigned int);
+	struct usbi_transfer *itransfer;
+
+	/* see USBI_CACHELINE_SIZE for the layout */
+	itransfer = usbi_aligned_alloc(USBI_CACHELINE_SIZE, alloc_size,
+		LIBUSB_ALLOC_SITE_TRANSFER);
 	if (!itransfer)
 		return NULL;
 
+	memset(itransfer, 0, alloc_size);
 	itransfer->num_iso_packets = iso_packets;
-	usbi_mutex_init(&itransfer->lock, NULL);
 	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
@@ -1289,7 +1392,8 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
  * If the \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
  * "LIBUSB_TRANSFER_FREE_BUFFER" flag is set and the transfer buffer is
  * non-NULL, this function will also free the transfer buffer using the
- * standard system memory allocator (e.g. free()).
+ * standard system memory allocator (e.g. free()), or return it to its pool
+ * if it was obtained with libusb_get_pool_buffer().
  *
  * It is legal to call this function with a NULL transfer. In this case,
  * the function will simply return safely.
@@ -1305,12 +1409,407 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	if (!transfer)
 		return;
 
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer)
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (usbi_backend->destroy_transfer)
+		usbi_backend->destroy_transfer(itransfer);
+	if (itransfer->internal_buffer)
+		usbi_free(transfer->buffer, 0, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	else if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER && transfer->buffer
+			&& libusb_put_pool_buffer(transfer->buffer) == LIBUSB_ERROR_NOT_FOUND)
 		free(transfer->buffer);
 
-	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
-	free(itransfer);
+	usbi_aligned_free(itransfer, 0, LIBUSB_ALLOC_SITE_TRANSFER);
+}
+
+/* Transfer buffer pools.
+ *
+ * A pool is a single region holding num_buffers page-aligned buffers. The
+ * start of every pool buffer is recorded in an index keyed by address, so
+ * that a buffer can be returned from libusb_free_transfer() without going
+ * through the device handle, which may be closed by then. A pool which is
+ * freed while some of its buffers are still out is released when the last
+ * one comes back. */
+
+#define BUFFER_POOL_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+struct usbi_buffer_pool {
+	unsigned char *mem;
+	size_t mem_size;
+	size_t stride;
+	int num_buffers;
+	int buffer_size;
+
+	/* flags in effect, and whether mem came from the backend */
+	int flags;
+	int backend_memory;
+
+	/* everything below is protected by lock */
+	usbi_mutex_t lock;
+
+	/* set once the pool is no longer attached to its handle */
+	int detached;
+
+	/* stack of free buffers, and which buffers are out of the pool */
+	unsigned char **free_buffers;
+	int num_free;
+	unsigned char *out;
+};
+
+/* The index maps the 4 KiB page where a pool buffer starts to its pool. It
+ * is a three-level radix tree whose nodes are allocated on demand and never
+ * freed, so that lookups need no lock: a buffer which is out of its pool
+ * keeps the pool and its entry alive, and no other memory can share a page
+ * with a pool. Updates are made under buffer_index_lock. */
+
+#define BUFFER_INDEX_SHIFT	12
+#define BUFFER_INDEX_BITS	12
+#define BUFFER_INDEX_SIZE	(1 << BUFFER_INDEX_BITS)
+#define BUFFER_INDEX_MASK	(BUFFER_INDEX_SIZE - 1)
+
+struct buffer_index_node {
+	void * volatile slots[BUFFER_INDEX_SIZE];
+};
+
+static usbi_mutex_static_t buffer_index_lock = USBI_MUTEX_INITIALIZER;
+static struct buffer_index_node buffer_index;
+
+static size_t buffer_pool_page_size(void)
+{
+	static size_t page_size;
+
+	if (!page_size) {
+#if defined(OS_WINDOWS) || defined(OS_WINCE)
+		SYSTEM_INFO info;
+
+		GetSystemInfo(&info);
+		page_size = info.dwPageSize;
+#else
+		long r = sysconf(_SC_PAGESIZE);
+
+		page_size = r > 0 ? (size_t) r : 4096;
+#endif
+	}
+	return page_size;
+}
+
+/* slot of a buffer in the last level of the index. with create set, missing
+ * nodes are allocated, which must be done with buffer_index_lock held.
+ * returns NULL if a node is missing. */
+static void * volatile *buffer_index_slot(unsigned char *buffer, int create)
+{
+	uintptr_t page = (uintptr_t) buffer >> BUFFER_INDEX_SHIFT;
+	unsigned int idx[3];
+	struct buffer_index_node *node = &buffer_index;
+	struct buffer_index_node *next;
+	int i;
+
+	idx[0] = (unsigned int) (page >> (2 * BUFFER_INDEX_BITS)) & BUFFER_INDEX_MASK;
+	idx[1] = (unsigned int) (page >> BUFFER_INDEX_BITS) & BUFFER_INDEX_MASK;
+	idx[2] = (unsigned int) page & BUFFER_INDEX_MASK;
+
+	for (i = 0; i < 2; i++) {
+		next = node->slots[idx[i]];
+		if (!next) {
+			if (!create)
+				return NULL;
+			next = usbi_calloc(1, sizeof(*next), LIBUSB_ALLOC_SITE_OTHER);
+			if (!next)
+				return NULL;
+			/* the node must be seen cleared by lock-free readers */
+			usbi_memory_barrier();
+			node->slots[idx[i]] = next;
+		}
+		node = next;
+	}
+	return &node->slots[idx[2]];
+}
+
+static int index_buffer_pool(struct usbi_buffer_pool *pool)
+{
+	void * volatile *slot;
+	int i;
+
+	usbi_mutex_static_lock(&buffer_index_lock);
+	for (i = 0; i < pool->num_buffers; i++) {
+		slot = buffer_index_slot(pool->mem + pool->stride * i, 1);
+		if (!slot)
+			break;
+		*slot = pool;
+	}
+	if (i < pool->num_buffers) {
+		while (i--)
+			*buffer_index_slot(pool->mem + pool->stride * i, 0) = NULL;
+	}
+	usbi_mutex_static_unlock(&buffer_index_lock);
+	return i < pool->num_buffers ? LIBUSB_ERROR_NO_MEM : 0;
+}
+
+static void unindex_buffer_pool(struct usbi_buffer_pool *pool)
+{
+	int i;
+
+	usbi_mutex_static_lock(&buffer_index_lock);
+	for (i = 0; i < pool->num_buffers; i++)
+		*buffer_index_slot(pool->mem + pool->stride * i, 0) = NULL;
+	usbi_mutex_static_unlock(&buffer_index_lock);
+}
+
+static struct usbi_buffer_pool *find_buffer_pool(unsigned char *buffer)
+{
+	void * volatile *slot;
+
+	if ((uintptr_t) buffer & ((1 << BUFFER_INDEX_SHIFT) - 1))
+		return NULL;
+	slot = buffer_index_slot(buffer, 0);
+	return slot ? *slot : NULL;
+}
+
+static void release_buffer_pool(struct usbi_buffer_pool *pool)
+{
+	if (pool->backend_memory)
+		usbi_backend->free_pool_memory(pool->mem, pool->mem_size);
+	else
+		usbi_aligned_free(pool->mem, pool->mem_size,
+			LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	usbi_mutex_destroy(&pool->lock);
+	usbi_free(pool->free_buffers, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(pool->out, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(pool, sizeof(*pool), LIBUSB_ALLOC_SITE_OTHER);
+}
+
+/** \ingroup asyncio
+ * Attach a pool of transfer buffers to a device handle. The buffers are
+ * allocated up front in a single region and pre-faulted, so that streaming
+ * from them causes neither page faults nor allocator calls. Buffers are
+ * taken with libusb_get_pool_buffer(). They go back to the pool with
+ * libusb_put_pool_buffer(), or when a transfer with the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" flag is freed.
+ *
+ * The flags are hints: if hugepages or locked memory are not available, the
+ * pool uses regular memory instead. libusb_get_buffer_pool_flags() tells
+ * which flags are in effect.
+ *
+ * Pages are placed on numa_node when the platform supports it. With -1,
+ * they are placed on the node of the calling thread; call this function
+ * from the thread which handles events to keep the buffers local to it.
+ *
+ * A handle has at most one pool. It is freed by libusb_free_buffer_pool()
+ * or libusb_close(); buffers which are still in use at that point remain
+ * valid until they are returned.
+ *
+ * \param dev_handle a device handle
+ * \param num_buffers number of buffers in the pool
+ * \param buffer_size size of each buffer, in bytes
+ * \param numa_node NUMA node to place the buffers on, or -1
+ * \param flags bitwise or of \ref libusb_buffer_pool_flags
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a size is invalid
+ * \returns LIBUSB_ERROR_BUSY if the handle already has a pool
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_alloc_buffer_pool(libusb_device_handle *dev_handle,
+	int num_buffers, int buffer_size, int numa_node, int flags)
+{
+	struct usbi_buffer_pool *pool;
+	size_t page_size = buffer_pool_page_size();
+	size_t align;
+	int i;
+
+	if (num_buffers <= 0 || buffer_size <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	pool = usbi_calloc(1, sizeof(*pool), LIBUSB_ALLOC_SITE_OTHER);
+	if (!pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	align = page_size;
+	if ((flags & LIBUSB_BUFFER_POOL_HUGEPAGES) &&
+	    align < BUFFER_POOL_HUGEPAGE_SIZE)
+		align = BUFFER_POOL_HUGEPAGE_SIZE;
+	pool->num_buffers = num_buffers;
+	pool->buffer_size = buffer_size;
+	pool->stride = ((size_t) buffer_size + page_size - 1) & ~(page_size - 1);
+	if (pool->stride > (SIZE_MAX - align) / num_buffers) {
+		usbi_free(pool, sizeof(*pool), LIBUSB_ALLOC_SITE_OTHER);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	pool->mem_size = (pool->stride * num_buffers + align - 1) & ~(align - 1);
+
+	pool->free_buffers = usbi_calloc(num_buffers,
+		sizeof(*pool->free_buffers), LIBUSB_ALLOC_SITE_OTHER);
+	pool->out = usbi_calloc(num_buffers, sizeof(*pool->out),
+		LIBUSB_ALLOC_SITE_OTHER);
+	if (!pool->free_buffers || !pool->out)
+		goto err_free;
+
+	if (usbi_backend->alloc_pool_memory) {
+		pool->flags = flags;
+		pool->mem = usbi_backend->alloc_pool_memory(pool->mem_size,
+			numa_node, &pool->flags);
+		pool->backend_memory = pool->mem != NULL;
+	}
+	if (!pool->mem) {
+		pool->flags = 0;
+		pool->mem = usbi_aligned_alloc(page_size, pool->mem_size,
+			LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+	}
+	if (!pool->mem)
+		goto err_free;
+
+	/* fault every page in now rather than on first use. with first-touch
+	 * placement, this also puts the pages on the calling thread's node. */
+	memset(pool->mem, 0, pool->mem_size);
+
+	for (i = 0; i < num_buffers; i++)
+		pool->free_buffers[i] = pool->mem + pool->stride * (num_buffers - 1 - i);
+	pool->num_free = num_buffers;
+	usbi_mutex_init(&pool->lock, NULL);
+
+	if (index_buffer_pool(pool) < 0) {
+		release_buffer_pool(pool);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (dev_handle->buffer_pool) {
+		usbi_mutex_unlock(&dev_handle->lock);
+		unindex_buffer_pool(pool);
+		release_buffer_pool(pool);
+		return LIBUSB_ERROR_BUSY;
+	}
+	dev_handle->buffer_pool = pool;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	usbi_dbg("%d buffers of %d bytes, flags 0x%x", num_buffers, buffer_size,
+		pool->flags);
+	return 0;
+
+err_free:
+	usbi_free(pool->free_buffers, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(pool->out, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(pool, sizeof(*pool), LIBUSB_ALLOC_SITE_OTHER);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+/** \ingroup asyncio
+ * Detach and free the buffer pool of a device handle. Buffers which are
+ * still in use remain valid; the memory is released once all of them have
+ * been returned. It is safe to call this function on a handle without a
+ * pool.
+ *
+ * \param dev_handle a device handle
+ */
+void API_EXPORTED libusb_free_buffer_pool(libusb_device_handle *dev_handle)
+{
+	struct usbi_buffer_pool *pool;
+	int release = 0;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	pool = dev_handle->buffer_pool;
+	if (pool) {
+		dev_handle->buffer_pool = NULL;
+		usbi_mutex_lock(&pool->lock);
+		pool->detached = 1;
+		if (pool->num_free == pool->num_buffers)
+			release = 1;
+		else
+			usbi_dbg("%d buffers still in use",
+				pool->num_buffers - pool->num_free);
+		usbi_mutex_unlock(&pool->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (release) {
+		unindex_buffer_pool(pool);
+		release_buffer_pool(pool);
+	}
+}
+
+/** \ingroup asyncio
+ * Get the \ref libusb_buffer_pool_flags which are in effect for the buffer
+ * pool of a device handle.
+ *
+ * \param dev_handle a device handle
+ * \returns the flags, or LIBUSB_ERROR_NOT_FOUND if the handle has no pool
+ */
+int API_EXPORTED libusb_get_buffer_pool_flags(libusb_device_handle *dev_handle)
+{
+	int r;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	r = dev_handle->buffer_pool ? dev_handle->buffer_pool->flags
+		: LIBUSB_ERROR_NOT_FOUND;
+	usbi_mutex_unlock(&dev_handle->lock);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Take a buffer from the buffer pool of a device handle. The buffer is
+ * page-aligned and holds the buffer_size passed to
+ * libusb_alloc_buffer_pool().
+ *
+ * \param dev_handle a device handle
+ * \returns a buffer, or NULL if the handle has no pool or all of its
+ * buffers are in use
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_get_pool_buffer(
+	libusb_device_handle *dev_handle)
+{
+	struct usbi_buffer_pool *pool;
+	unsigned char *buffer = NULL;
+
+	/* the handle lock keeps the pool attached while we take from it */
+	usbi_mutex_lock(&dev_handle->lock);
+	pool = dev_handle->buffer_pool;
+	if (pool) {
+		usbi_mutex_lock(&pool->lock);
+		if (pool->num_free) {
+			buffer = pool->free_buffers[--pool->num_free];
+			pool->out[(buffer - pool->mem) / pool->stride] = 1;
+		}
+		usbi_mutex_unlock(&pool->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+	return buffer;
+}
+
+/** \ingroup asyncio
+ * Return a buffer obtained with libusb_get_pool_buffer() to its pool.
+ *
+ * \param buffer the buffer
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the buffer does not belong to a pool
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the buffer is already in its pool
+ */
+int API_EXPORTED libusb_put_pool_buffer(unsigned char *buffer)
+{
+	struct usbi_buffer_pool *pool = find_buffer_pool(buffer);
+	int release = 0;
+	int i;
+
+	if (!pool)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	i = (int) ((buffer - pool->mem) / pool->stride);
+	usbi_mutex_lock(&pool->lock);
+	if (!pool->out[i]) {
+		usbi_mutex_unlock(&pool->lock);
+		usbi_warn(NULL, "buffer %p returned to its pool twice", buffer);
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	pool->out[i] = 0;
+	pool->free_buffers[pool->num_free++] = buffer;
+	if (pool->detached && pool->num_free == pool->num_buffers)
+		release = 1;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (release) {
+		unindex_buffer_pool(pool);
+		release_buffer_pool(pool);
+	}
+	return 0;
 }
 
 #ifdef USBI_TIMERFD_AVAILABLE
@@ -1336,29 +1835,40 @@ static int disarm_timerfd(struct libusb_context *ctx)
 static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
 {
 	struct usbi_transfer *transfer;
+	uint64_t next = 0;
 
 	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
 		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!timerisset(cur_tv))
-			goto disarm;
+		 * arming to do for transfers */
+		if (!transfer->timeout_nsecs)
+			break;
 
 		/* act on first transfer that is not already cancelled */
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			int r;
-			const struct itimerspec it = { {0, 0},
-				{ cur_tv->tv_sec, cur_tv->tv_usec * 1000 } };
+		if (!usbi_transfer_test_flags(transfer, USBI_TRANSFER_TIMED_OUT)) {
 			usbi_dbg("next timeout originally %dms", USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-			r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 1;
+			next = transfer->timeout_nsecs;
+			break;
 		}
 	}
 
-disarm:
+	/* internal timers may expire earlier */
+	if (!list_empty(&ctx->timers)) {
+		struct usbi_timer *timer =
+			list_entry(ctx->timers.next, struct usbi_timer, list);
+		if (!next || timer->expiry_nsecs < next)
+			next = timer->expiry_nsecs;
+	}
+
+	if (next) {
+		int r;
+		const struct itimerspec it = { {0, 0},
+			{ next / NSECS_PER_SEC, next % NSECS_PER_SEC } };
+		r = timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL);
+		if (r < 0)
+			return LIBUSB_ERROR_OTHER;
+		return 1;
+	}
+
 	return disarm_timerfd(ctx);
 }
 #else
@@ -1369,117 +1879,1190 @@ static int arm_timerfd_for_next_timeout(struct libusb_context *ctx)
 }
 #endif
 
-/** \ingroup asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns another LIBUSB_ERROR code on other failure
- */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+/* Internal timers, used by features that need to act on their own after a
+ * delay. Armed timers are kept in ctx->timers, sorted by expiry and
+ * protected by flying_transfers_lock, so that they take part in timerfd
+ * arming and in the timeouts reported by libusb_get_next_timeout() along
+ * with transfer timeouts. Callbacks run from event handling, without any
+ * lock held. */
+
+void usbi_init_timer(struct usbi_timer *timer, void (*cb)(void *user_data),
+	void *user_data)
 {
-	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-	int updated_fds;
+	timer->expiry_nsecs = 0;
+	timer->cb = cb;
+	timer->user_data = user_data;
+}
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->transferred = 0;
-	itransfer->flags = 0;
-	r = calculate_timeout(itransfer);
-	if (r < 0) {
-		r = LIBUSB_ERROR_OTHER;
-		goto out;
-	}
+/* arm, or re-arm, a timer to expire usecs from now */
+int usbi_arm_timer(struct libusb_context *ctx, struct usbi_timer *timer,
+	unsigned int usecs)
+{
+	struct usbi_timer *cur;
+	uint64_t expiry;
+	int first, r = 0;
 
-	r = add_to_flying_list(itransfer);
-	if (r)
-		goto out;
-	r = usbi_backend->submit_transfer(itransfer);
-	if (r) {
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		list_del(&itransfer->list);
-		arm_timerfd_for_next_timeout(ctx);
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	expiry = monotonic_nsecs();
+	if (!expiry)
+		return LIBUSB_ERROR_OTHER;
+	expiry += usecs * NSECS_PER_USEC;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (timer->expiry_nsecs)
+		list_del(&timer->list);
+	timer->expiry_nsecs = expiry;
+
+	/* keep the list sorted, later timers go after earlier ones */
+	list_for_each_entry(cur, &ctx->timers, list, struct usbi_timer) {
+		if (expiry < cur->expiry_nsecs)
+			break;
 	}
+	list_add_tail(&timer->list, &cur->list);
+	first = (ctx->timers.next == &timer->list);
 
-out:
-	updated_fds = (itransfer->flags & USBI_TRANSFER_UPDATED_FDS);
-	usbi_mutex_unlock(&itransfer->lock);
-	if (updated_fds)
-		usbi_fd_notification(ctx);
-	return r;
+	if (first && usbi_using_timerfd(ctx))
+		r = arm_timerfd_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	/* without timerfd, the event handler must recompute its poll()
+	 * timeout */
+	if (first && !usbi_using_timerfd(ctx))
+		usbi_signal_event(ctx);
+	return r < 0 ? r : 0;
 }
 
-/** \ingroup asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
- *
- * \param transfer the transfer to cancel
- * \returns 0 on success
- * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
- * cancelled.
- * \returns a LIBUSB_ERROR code on failure
- */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+void usbi_disarm_timer(struct libusb_context *ctx, struct usbi_timer *timer)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	int r;
-
-	usbi_dbg("");
-	usbi_mutex_lock(&itransfer->lock);
-	r = usbi_backend->cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(TRANSFER_CTX(transfer),
-				"cancel transfer failed error %d", r);
-		else
-			usbi_dbg("cancel transfer failed error %d", r);
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (timer->expiry_nsecs) {
+		list_del(&timer->list);
+		timer->expiry_nsecs = 0;
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+}
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+/* disarm a timer, and wait for its callback to return if it is running, so
+ * that the timer can be freed. must not be called from the callback. */
+void usbi_stop_timer(struct libusb_context *ctx, struct usbi_timer *timer)
+{
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (timer->expiry_nsecs) {
+		list_del(&timer->list);
+		timer->expiry_nsecs = 0;
 	}
+	while (ctx->running_timer == timer)
+		usbi_cond_wait(&ctx->timers_cond, &ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+}
 
-	itransfer->flags |= USBI_TRANSFER_CANCELLING;
+/* a transfer is always let through when no other low-priority transfer is
+ * in flight, so that transfers larger than the limit still go out. must be
+ * called with throttle_lock held. */
+static int throttle_fits(struct libusb_context *ctx, unsigned int bytes)
+{
+	unsigned int limit = ctx->low_priority_limit;
+	unsigned int in_flight = ctx->low_priority_in_flight;
 
-	usbi_mutex_unlock(&itransfer->lock);
-	return r;
+	return !limit || !in_flight ||
+		(in_flight < limit && bytes <= limit - in_flight);
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
- * after calling this function, and you should free all backend-specific
- * data before calling it.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+/* account a low-priority transfer being submitted. returns 1 if it must
+ * wait in throttled_transfers instead. the priority cannot change while the
+ * transfer is in flight, so it is safe to test without throttle_lock. */
+static int throttle_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	unsigned int bytes = transfer->length > 0 ? transfer->length : 0;
+	int queued = 0;
+
+	if (itransfer->priority != LIBUSB_TRANSFER_PRIORITY_LOW)
+		return 0;
+
+	usbi_mutex_lock(&ctx->throttle_lock);
+	if (!ctx->low_priority_limit) {
+		usbi_mutex_unlock(&ctx->throttle_lock);
+		return 0;
+	}
+	itransfer->throttle_bytes = bytes;
+	if (!list_empty(&ctx->throttled_transfers) ||
+	    !throttle_fits(ctx, bytes)) {
+		itransfer->throttle_state = USBI_THROTTLE_QUEUED;
+		list_add_tail(&itransfer->completion_list, &ctx->throttled_transfers);
+		queued = 1;
+	} else {
+		itransfer->throttle_state = USBI_THROTTLE_COUNTED;
+		ctx->low_priority_in_flight += bytes;
+	}
+	usbi_mutex_unlock(&ctx->throttle_lock);
+	return queued;
+}
+
+/* submit throttled transfers for as long as they fit. transfers which fail
+ * to submit are completed by the event handler. must be called without
+ * throttle_lock held. */
+static void submit_throttled_transfers(struct libusb_context *ctx)
+{
+	struct usbi_transfer *itransfer;
+	struct list_head failed;
+	int r;
+
+	list_init(&failed);
+	usbi_mutex_lock(&ctx->throttle_lock);
+	while (!list_empty(&ctx->throttled_transfers)) {
+		itransfer = list_entry(ctx->throttled_transfers.next,
+			struct usbi_transfer, completion_list);
+		if (!throttle_fits(ctx, itransfer->throttle_bytes))
+			break;
+
+		list_del(&itransfer->completion_list);
+		itransfer->throttle_state = USBI_THROTTLE_COUNTED;
+		ctx->low_priority_in_flight += itransfer->throttle_bytes;
+
+		/* the transfer is already on the flying list, so its timeout
+		 * includes the time it spent waiting */
+		r = usbi_backend->submit_transfer(itransfer);
+		if (r < 0) {
+			usbi_dbg("throttled transfer failed to submit: %d", r);
+			itransfer->throttle_state = USBI_THROTTLE_NONE;
+			ctx->low_priority_in_flight -= itransfer->throttle_bytes;
+			itransfer->deferred_status = r == LIBUSB_ERROR_NO_DEVICE ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+			list_add_tail(&itransfer->completion_list, &failed);
+		}
+	}
+	usbi_mutex_unlock(&ctx->throttle_lock);
+
+	while (!list_empty(&failed)) {
+		itransfer = list_entry(failed.next, struct usbi_transfer,
+			completion_list);
+		list_del(&itransfer->completion_list);
+		usbi_defer_transfer_completion(itransfer, itransfer->deferred_status);
+	}
+}
+
+/* account the end of a low-priority transfer, or take it off the queue,
+ * letting the next ones through */
+static void unthrottle_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx =
+		TRANSFER_CTX(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+	int throttled;
+
+	if (itransfer->priority != LIBUSB_TRANSFER_PRIORITY_LOW)
+		return;
+
+	usbi_mutex_lock(&ctx->throttle_lock);
+	throttled = itransfer->throttle_state != USBI_THROTTLE_NONE;
+	if (itransfer->throttle_state == USBI_THROTTLE_COUNTED)
+		ctx->low_priority_in_flight -= itransfer->throttle_bytes;
+	else if (itransfer->throttle_state == USBI_THROTTLE_QUEUED)
+		list_del(&itransfer->completion_list);
+	itransfer->throttle_state = USBI_THROTTLE_NONE;
+	usbi_mutex_unlock(&ctx->throttle_lock);
+	if (throttled)
+		submit_throttled_transfers(ctx);
+}
+
+#define STATE_BIT(state)	(1U << (state))
+
+/* move a transfer to lifecycle state "to" if it is in one of the states of
+ * the "from" mask, also clearing the flags in "clear". returns 1 if the
+ * transition was made, and the previous state word in prev if not NULL. */
+static int transfer_transition(struct usbi_transfer *itransfer,
+	unsigned int from, unsigned int to, unsigned int clear, unsigned int *prev)
+{
+	unsigned int old, new;
+
+	do {
+		old = itransfer->state;
+		if (prev)
+			*prev = old;
+		if (!(from & STATE_BIT(old & USBI_TRANSFER_STATE_MASK)))
+			return 0;
+		new = (old & ~(USBI_TRANSFER_STATE_MASK | clear)) | to;
+	} while ((unsigned int) usbi_atomic_cas(&itransfer->state, old, new)
+			!= old);
+	return 1;
+}
+
+/* cancel a transfer which is in the throttle queue or with the backend.
+ * the caller must have set USBI_TRANSFER_CANCELLING. */
+static int cancel_submitted_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	/* a throttled transfer has not been submitted to the backend yet */
+	if (itransfer->priority == LIBUSB_TRANSFER_PRIORITY_LOW) {
+		struct libusb_context *ctx = TRANSFER_CTX(transfer);
+		int queued;
+
+		usbi_mutex_lock(&ctx->throttle_lock);
+		queued = (itransfer->throttle_state == USBI_THROTTLE_QUEUED);
+		if (queued) {
+			list_del(&itransfer->completion_list);
+			itransfer->throttle_state = USBI_THROTTLE_NONE;
+		}
+		usbi_mutex_unlock(&ctx->throttle_lock);
+		if (queued) {
+			usbi_defer_transfer_completion(itransfer,
+				LIBUSB_TRANSFER_CANCELLED);
+			return 0;
+		}
+	}
+
+	r = usbi_backend->cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(TRANSFER_CTX(transfer),
+				"cancel transfer failed error %d", r);
+		else
+			usbi_dbg("cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			usbi_transfer_set_flags(itransfer,
+				USBI_TRANSFER_DEVICE_DISAPPEARED);
+	}
+
+	return r;
+}
+
+/** \ingroup asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer flags cannot be used
+ * with this transfer
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	unsigned int prev;
+	int cancelled = 0;
+	int r;
+
+	if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) {
+		if (!(usbi_backend->caps & USBI_CAP_SUPPORTS_AUTO_RESUBMIT))
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		if ((transfer->type != LIBUSB_TRANSFER_TYPE_BULK &&
+		     transfer->type != LIBUSB_TRANSFER_TYPE_INTERRUPT) ||
+		    !(transfer->endpoint & LIBUSB_ENDPOINT_IN) ||
+		    transfer->timeout || transfer->length <= 0 ||
+		    (transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK))
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO) {
+		if (!(usbi_backend->caps & USBI_CAP_SUPPORTS_UNIFORM_ISO))
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ||
+		    transfer->num_iso_packets <= 0 || itransfer->num_iso_packets < 1 ||
+		    !transfer->iso_packet_desc[0].length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (!transfer_transition(itransfer, STATE_BIT(USBI_TRANSFER_IDLE),
+			USBI_TRANSFER_SUBMITTING, USBI_TRANSFER_FLAGS_MASK, NULL))
+		return LIBUSB_ERROR_BUSY;
+
+	itransfer->transferred = 0;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+	    !(transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO))
+		build_iso_offsets(itransfer);
+	r = calculate_timeout(itransfer);
+	if (r < 0) {
+		r = LIBUSB_ERROR_OTHER;
+		goto err;
+	}
+
+	r = add_to_flying_list(itransfer);
+	if (r)
+		goto err;
+
+	/* a cancellation that came in before the transfer reaches the backend
+	 * is completed without reaching it */
+	if (usbi_transfer_test_flags(itransfer, USBI_TRANSFER_CANCELLING)) {
+		usbi_dbg("transfer cancelled during submission");
+		transfer_transition(itransfer, STATE_BIT(USBI_TRANSFER_SUBMITTING),
+			USBI_TRANSFER_IN_FLIGHT, 0, NULL);
+		usbi_defer_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
+		return 0;
+	}
+
+	if (throttle_transfer(itransfer)) {
+		usbi_dbg("low-priority transfer throttled");
+	} else {
+		r = usbi_backend->submit_transfer(itransfer);
+		if (r) {
+			usbi_mutex_lock(&ctx->flying_transfers_lock);
+			list_del(&itransfer->list);
+			arm_timerfd_for_next_timeout(ctx);
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
+			unthrottle_transfer(itransfer);
+			goto err;
+		}
+	}
+
+	/* once IN_FLIGHT, the transfer may complete and be freed at any time,
+	 * so everything still to do with it is done before */
+	for (;;) {
+		prev = itransfer->state;
+		if ((prev & USBI_TRANSFER_CANCELLING) && !cancelled &&
+		    !(prev & USBI_TRANSFER_EARLY_COMPLETION)) {
+			usbi_dbg("passing on a cancellation made during submission");
+			cancel_submitted_transfer(itransfer);
+			cancelled = 1;
+			continue;
+		}
+		if ((unsigned int) usbi_atomic_cas(&itransfer->state, prev,
+				(prev & ~(USBI_TRANSFER_STATE_MASK |
+					USBI_TRANSFER_EARLY_COMPLETION)) |
+				USBI_TRANSFER_IN_FLIGHT) == prev)
+			break;
+	}
+
+	if (prev & USBI_TRANSFER_EARLY_COMPLETION)
+		usbi_defer_transfer_completion(itransfer, itransfer->deferred_status);
+	if (prev & USBI_TRANSFER_UPDATED_FDS)
+		usbi_fd_notification(ctx);
+	return 0;
+
+err:
+	transfer_transition(itransfer, STATE_BIT(USBI_TRANSFER_SUBMITTING),
+		USBI_TRANSFER_IDLE, 0, NULL);
+	if (usbi_transfer_test_flags(itransfer, USBI_TRANSFER_UPDATED_FDS))
+		usbi_fd_notification(ctx);
+	return r;
+}
+
+/** \ingroup asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * \param transfer the transfer to cancel
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer is already complete or
+ * cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	unsigned int old;
+
+	usbi_dbg("");
+
+	/* claim the cancellation of this submission */
+	do {
+		old = itransfer->state;
+		if ((old & USBI_TRANSFER_CANCELLING) ||
+		    ((old & USBI_TRANSFER_STATE_MASK) != USBI_TRANSFER_SUBMITTING &&
+		     (old & USBI_TRANSFER_STATE_MASK) != USBI_TRANSFER_IN_FLIGHT))
+			return LIBUSB_ERROR_NOT_FOUND;
+	} while ((unsigned int) usbi_atomic_cas(&itransfer->state, old,
+			old | USBI_TRANSFER_CANCELLING) != old);
+
+	/* libusb_submit_transfer() will see the flag, and pass the cancellation
+	 * on once the backend is done submitting */
+	if ((old & USBI_TRANSFER_STATE_MASK) == USBI_TRANSFER_SUBMITTING)
+		return 0;
+
+	return cancel_submitted_transfer(itransfer);
+}
+
+/** \ingroup asyncio
+ * Set the priority class of a transfer.
+ *
+ * Transfers of a latency-critical control loop and background bulk traffic
+ * such as firmware or log uploads often share a context. Marking the
+ * background transfers as \ref LIBUSB_TRANSFER_PRIORITY_LOW has two
+ * effects:
+ * - when event handling finds several completed transfers at once, the
+ *   callbacks of low-priority transfers are invoked after all the others
+ * - with libusb_set_low_priority_limit(), the amount of low-priority data
+ *   in flight can be capped, so that it does not delay other transfers of
+ *   the device
+ *
+ * The priority is kept across submissions of the transfer. It must not be
+ * changed while the transfer is in flight.
+ *
+ * \param transfer the transfer
+ * \param priority a \ref libusb_transfer_priority value
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the priority is invalid
+ */
+int API_EXPORTED libusb_set_transfer_priority(struct libusb_transfer *transfer,
+	int priority)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	if (priority != LIBUSB_TRANSFER_PRIORITY_NORMAL &&
+	    priority != LIBUSB_TRANSFER_PRIORITY_LOW)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	itransfer->priority = priority;
+	return 0;
+}
+
+/* requested length of an iso packet. all the packets of a uniform transfer
+ * have the length of the first one, which is the only descriptor it needs. */
+static unsigned int iso_packet_length(struct libusb_transfer *transfer,
+	int packet)
+{
+	if (transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO)
+		packet = 0;
+	return transfer->iso_packet_desc[packet].length;
+}
+
+/* result of a packet of a completed iso transfer. uniform transfers leave
+ * their results with the backend. */
+static int iso_packet_result(struct libusb_transfer *transfer, int packet,
+	unsigned int *actual_length, enum libusb_transfer_status *status)
+{
+	struct libusb_iso_packet_descriptor *desc;
+
+	if (transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO) {
+		if (!usbi_backend->get_iso_packet_result)
+			return LIBUSB_ERROR_NOT_FOUND;
+		return usbi_backend->get_iso_packet_result(
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer), packet,
+			actual_length, status);
+	}
+
+	desc = &transfer->iso_packet_desc[packet];
+	*actual_length = desc->actual_length;
+	*status = desc->status;
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Get the result of a packet of a completed isochronous transfer. For
+ * transfers submitted with \ref libusb_transfer_flags
+ * "LIBUSB_TRANSFER_UNIFORM_ISO", this is the only way to get at the results,
+ * as they are not copied to \ref libusb_transfer::iso_packet_desc
+ * "iso_packet_desc". For other transfers it returns the contents of the
+ * packet descriptor.
+ *
+ * \param transfer a completed isochronous transfer
+ * \param packet the packet to get the result of
+ * \param actual_length output location for the amount of data that was
+ * transferred
+ * \param status output location for the status of the packet
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not isochronous or
+ * the packet does not exist
+ * \returns LIBUSB_ERROR_BUSY if the transfer is in flight
+ * \returns LIBUSB_ERROR_NOT_FOUND if a uniform transfer holds no results
+ */
+int API_EXPORTED libusb_get_iso_packet_result(struct libusb_transfer *transfer,
+	unsigned int packet, unsigned int *actual_length,
+	enum libusb_transfer_status *status)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	unsigned int state;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			|| packet > INT_MAX || (int) packet >= transfer->num_iso_packets)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	state = usbi_atomic_load(&itransfer->state);
+	if ((state & USBI_TRANSFER_STATE_MASK) != USBI_TRANSFER_IDLE)
+		return LIBUSB_ERROR_BUSY;
+
+	return iso_packet_result(transfer, packet, actual_length, status);
+}
+
+/** \ingroup asyncio
+ * Get a summary of the packet results of an isochronous transfer: the total
+ * number of bytes transferred, and how many packets failed and where the
+ * first of them is. This saves scanning transfer->iso_packet_desc when all
+ * packets completed successfully.
+ *
+ * Backends that copy the packet results back in a single pass compute the
+ * summary on the way; for the others it is computed by this function.
+ *
+ * This function may be called from the transfer callback, or at any time
+ * after the transfer completed and before it is resubmitted.
+ *
+ * \param transfer an isochronous transfer
+ * \param summary output location for the summary
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not isochronous
+ * \returns LIBUSB_ERROR_BUSY if the transfer is in flight
+ * \returns LIBUSB_ERROR_NOT_FOUND if a uniform transfer holds no results
+ */
+int API_EXPORTED libusb_get_iso_packet_summary(struct libusb_transfer *transfer,
+	struct libusb_iso_packet_summary *summary)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	unsigned int state;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	state = usbi_atomic_load(&itransfer->state);
+	if ((state & USBI_TRANSFER_STATE_MASK) != USBI_TRANSFER_IDLE)
+		return LIBUSB_ERROR_BUSY;
+
+	if (state & USBI_TRANSFER_ISO_SUMMARY) {
+		*summary = itransfer->iso_summary;
+		return 0;
+	}
+
+	memset(summary, 0, sizeof(*summary));
+	summary->first_error_index = -1;
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		unsigned int actual_length;
+		enum libusb_transfer_status status;
+
+		if (iso_packet_result(transfer, i, &actual_length, &status) < 0)
+			return LIBUSB_ERROR_NOT_FOUND;
+		summary->total_bytes += actual_length;
+		if (status == LIBUSB_TRANSFER_COMPLETED)
+			continue;
+		if (summary->error_count++ == 0) {
+			summary->first_error_index = i;
+			summary->first_error_status = status;
+		}
+	}
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Locate an isochronous packet within the buffer of an isochronous transfer
+ * in constant time. This gives the same result as
+ * libusb_get_iso_packet_buffer(), but uses a table of packet offsets kept
+ * with the transfer instead of summing the lengths of all earlier packets,
+ * so walking all the packets of a transfer takes linear time.
+ *
+ * The table is rebuilt by libusb_submit_transfer() from the packet lengths
+ * at the time of submission, and stays valid until the next one. For a
+ * transfer that was never submitted it is built on the first call, so fill
+ * in all the packet lengths before calling this function. Transfers with
+ * the \ref libusb_transfer_flags "LIBUSB_TRANSFER_UNIFORM_ISO" flag need no
+ * table.
+ *
+ * \param transfer an isochronous transfer
+ * \param packet the packet to return the address of
+ * \returns the base address of the packet buffer inside the transfer buffer,
+ * or NULL if the packet does not exist.
+ * \see libusb_get_iso_packet_buffer()
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_get_iso_packet_buffer_indexed(
+	struct libusb_transfer *transfer, unsigned int packet)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	if (packet > INT_MAX || (int) packet >= transfer->num_iso_packets)
+		return NULL;
+
+	if (transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO)
+		return transfer->buffer
+			+ (size_t) packet * transfer->iso_packet_desc[0].length;
+
+	if (itransfer->iso_offsets_packets == 0)
+		build_iso_offsets(itransfer);
+	if ((int) packet >= itransfer->iso_offsets_packets)
+		return NULL;
+
+	return transfer->buffer + transfer_iso_offsets(itransfer)[packet];
+}
+
+/** \ingroup asyncio
+ * Get a compacted view of the packets of a completed isochronous transfer,
+ * leaving out those that carried no data. Each view gives the position of
+ * the packet within the transfer and where its data is.
+ *
+ * \param transfer a completed isochronous transfer
+ * \param views output array of views
+ * \param max_views number of entries in views
+ * \returns the number of views filled in, which is the number of packets
+ * with data if it is not more than max_views
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not isochronous
+ * \returns LIBUSB_ERROR_OVERFLOW if more than max_views packets have data;
+ * views then holds the first max_views of them
+ * \returns LIBUSB_ERROR_NOT_FOUND if a uniform transfer holds no results
+ */
+int API_EXPORTED libusb_get_iso_packet_views(struct libusb_transfer *transfer,
+	struct libusb_iso_packet_view *views, int max_views)
+{
+	size_t offset = 0;
+	int num_views = 0;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || max_views < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		unsigned int actual_length;
+		enum libusb_transfer_status status;
+
+		if (iso_packet_result(transfer, i, &actual_length, &status) < 0)
+			return LIBUSB_ERROR_NOT_FOUND;
+		if (actual_length) {
+			if (num_views == max_views)
+				return LIBUSB_ERROR_OVERFLOW;
+			views[num_views].packet = i;
+			views[num_views].status = status;
+			views[num_views].length = actual_length;
+			views[num_views].buffer = transfer->buffer + offset;
+			num_views++;
+		}
+		offset += iso_packet_length(transfer, i);
+	}
+	return num_views;
+}
+
+/** \ingroup asyncio
+ * Copy the data of the successful packets of a completed isochronous
+ * transfer back to back into a contiguous buffer, in a single pass over the
+ * packets. Packets which carried no data or whose status is not
+ * LIBUSB_TRANSFER_COMPLETED are skipped.
+ *
+ * \param transfer a completed isochronous transfer
+ * \param data output buffer
+ * \param length size of data
+ * \returns the number of bytes copied
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the transfer is not isochronous
+ * \returns LIBUSB_ERROR_OVERFLOW if the data does not fit; data then holds
+ * the packets before the first one that did not fit
+ * \returns LIBUSB_ERROR_NOT_FOUND if a uniform transfer holds no results
+ */
+int API_EXPORTED libusb_gather_iso_packets(struct libusb_transfer *transfer,
+	unsigned char *data, int length)
+{
+	size_t offset = 0;
+	int copied = 0;
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		unsigned int actual_length;
+		enum libusb_transfer_status status;
+
+		if (iso_packet_result(transfer, i, &actual_length, &status) < 0)
+			return LIBUSB_ERROR_NOT_FOUND;
+		if (actual_length && status == LIBUSB_TRANSFER_COMPLETED) {
+			if (actual_length > (unsigned int) (length - copied))
+				return LIBUSB_ERROR_OVERFLOW;
+			memcpy(data + copied, transfer->buffer + offset, actual_length);
+			copied += actual_length;
+		}
+		offset += iso_packet_length(transfer, i);
+	}
+	return copied;
+}
+
+/** \ingroup asyncio
+ * Limit the amount of data that low-priority transfers of a context may
+ * have in flight. Low-priority transfers submitted beyond the limit wait
+ * inside the library, in submission order, until enough others have
+ * completed; libusb_submit_transfer() succeeds for them, and they may be
+ * cancelled or time out while waiting as usual. A transfer larger than the
+ * limit is still submitted when no other low-priority transfer is in
+ * flight.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param max_bytes the maximum number of bytes of low-priority transfers in
+ * flight, or 0 for no limit (the default)
+ * \returns 0 on success
+ * \see libusb_set_transfer_priority()
+ */
+int API_EXPORTED libusb_set_low_priority_limit(libusb_context *ctx,
+	unsigned int max_bytes)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->throttle_lock);
+	ctx->low_priority_limit = max_bytes;
+	usbi_mutex_unlock(&ctx->throttle_lock);
+
+	/* a higher limit, or none, may let waiting transfers through */
+	submit_throttled_transfers(ctx);
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Retrieve the state of the transfer memory budget.
+ *
+ * Some operating systems limit the memory that transfers may use in the
+ * kernel; on Linux, usbfs buffers are limited to the usbcore
+ * usbfs_memory_mb module parameter, 16MB by default. libusbx accounts the
+ * memory used by the transfers of the process and, rather than have a
+ * submission fail once the limit is reached, lets transfers which do not
+ * fit wait inside the library until enough others have completed.
+ * libusb_submit_transfer() succeeds for such transfers, which may be
+ * cancelled or time out while waiting as usual. A transfer larger than the
+ * limit is still attempted when nothing else is in flight.
+ *
+ * The budget is shared by all contexts of the process, and the statistics
+ * are cumulative since the library was loaded. Since the limit is shared
+ * with other processes, the kernel may still run out of memory first; such
+ * transfers are made to wait as well, provided other transfers of the
+ * process are in flight.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform does not account
+ * transfer memory
+ */
+int API_EXPORTED libusb_get_transfer_budget_stats(libusb_context *ctx,
+	struct libusb_transfer_budget_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!usbi_backend->get_transfer_budget_stats)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return usbi_backend->get_transfer_budget_stats(stats);
+}
+
+/* invoke the user callback of a completed transfer, then wake up anyone
+ * waiting for events. */
+static void invoke_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	uint8_t flags = transfer->flags;
+
+	/* the callback may resubmit the transfer */
+	transfer_transition(itransfer, STATE_BIT(USBI_TRANSFER_COMPLETING),
+		USBI_TRANSFER_IDLE, 0, NULL);
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	usbi_wake_event_waiters(ctx);
+}
+
+/* Wake up the threads blocked in libusb_wait_for_event(). A thread counts
+ * itself in event_waiters before taking event_waiters_lock and checking
+ * the condition it waits for, and the counter is read with a full barrier
+ * after that condition has been changed, so skipping the broadcast when
+ * the counter is zero cannot lose a wakeup. */
+void usbi_wake_event_waiters(struct libusb_context *ctx)
+{
+	if (!usbi_atomic_load(&ctx->event_waiters))
+		return;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/* Wake up the thread handling events, if any. This is used when something
+ * that the event handler may be waiting for, such as the completion flag of
+ * a synchronous transfer, changed outside of event handling. */
+void usbi_signal_event(struct libusb_context *ctx)
+{
+	unsigned char dummy = 1;
+
+	if (usbi_write(ctx->event_pipe[1], &dummy, sizeof(dummy)) <= 0)
+		usbi_dbg("event pipe write failed, errno=%d", errno);
+}
+
+#ifdef THREADS_POSIX
+struct usbi_callback_worker {
+	struct libusb_context *ctx;
+	pthread_t thread;
+
+	/* completed transfers waiting for their callback, linked through
+	 * usbi_transfer.list, which is unused once off the flying list */
+	struct list_head queue;
+	pthread_cond_t cond;
+	int stop;
+};
+
+static void *callback_worker_main(void *arg)
+{
+	struct usbi_callback_worker *worker = arg;
+	struct libusb_context *ctx = worker->ctx;
+	struct usbi_transfer *itransfer;
+
+	usbi_mutex_lock(&ctx->callback_lock);
+	while (1) {
+		while (list_empty(&worker->queue) && !worker->stop)
+			pthread_cond_wait(&worker->cond, &ctx->callback_lock);
+		if (list_empty(&worker->queue))
+			break;
+
+		itransfer = list_entry(worker->queue.next, struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		usbi_mutex_unlock(&ctx->callback_lock);
+
+		invoke_transfer_callback(itransfer);
+		/* the event handler may be blocked in poll() on behalf of a
+		 * synchronous transfer that just completed */
+		usbi_signal_event(ctx);
+
+		usbi_mutex_lock(&ctx->callback_lock);
+		if (--ctx->callbacks_pending == 0)
+			usbi_cond_broadcast(&ctx->callback_idle_cond);
+	}
+	usbi_mutex_unlock(&ctx->callback_lock);
+	return NULL;
+}
+
+/* hand a completed transfer over to the worker pool. all transfers for a
+ * given endpoint go to the same worker so that their callbacks keep the
+ * order in which they completed. returns 0 if the transfer was queued, or
+ * 1 if there is no worker pool and the callback should be invoked
+ * directly. */
+static int queue_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct usbi_callback_worker *worker;
+	uintptr_t hash;
+
+	usbi_mutex_lock(&ctx->callback_lock);
+	if (!ctx->num_callback_workers) {
+		usbi_mutex_unlock(&ctx->callback_lock);
+		return 1;
+	}
+
+	hash = ((uintptr_t)transfer->dev_handle >> 4) * 31 + transfer->endpoint;
+	worker = &ctx->callback_workers[hash % ctx->num_callback_workers];
+	list_add_tail(&itransfer->list, &worker->queue);
+	ctx->callbacks_pending++;
+	pthread_cond_signal(&worker->cond);
+	usbi_mutex_unlock(&ctx->callback_lock);
+	return 0;
+}
+
+static int is_callback_worker(struct libusb_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < ctx->num_callback_workers; i++)
+		if (pthread_equal(ctx->callback_workers[i].thread, pthread_self()))
+			return 1;
+	return 0;
+}
+
+/* stop the worker pool, running any queued callbacks first */
+static void stop_callback_workers(struct libusb_context *ctx)
+{
+	struct usbi_callback_worker *workers;
+	int i, num_workers;
+
+	usbi_mutex_lock(&ctx->callback_lock);
+	workers = ctx->callback_workers;
+	num_workers = ctx->num_callback_workers;
+	/* from now on, callbacks are invoked by the event handler */
+	ctx->callback_workers = NULL;
+	ctx->num_callback_workers = 0;
+	for (i = 0; i < num_workers; i++) {
+		workers[i].stop = 1;
+		pthread_cond_signal(&workers[i].cond);
+	}
+	usbi_mutex_unlock(&ctx->callback_lock);
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pthread_cond_destroy(&workers[i].cond);
+	}
+	usbi_free(workers, 0, LIBUSB_ALLOC_SITE_OTHER);
+}
+
+static int start_callback_workers(struct libusb_context *ctx, int num_workers)
+{
+	struct usbi_callback_worker *workers;
+	int i, r;
+
+	workers = usbi_calloc(num_workers, sizeof(*workers),
+		LIBUSB_ALLOC_SITE_OTHER);
+	if (!workers)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].ctx = ctx;
+		list_init(&workers[i].queue);
+		pthread_cond_init(&workers[i].cond, NULL);
+		r = pthread_create(&workers[i].thread, NULL, callback_worker_main,
+			&workers[i]);
+		if (r != 0) {
+			usbi_err(ctx, "failed to create callback worker (%d)", r);
+			pthread_cond_destroy(&workers[i].cond);
+			break;
+		}
+	}
+
+	usbi_mutex_lock(&ctx->callback_lock);
+	ctx->callback_workers = workers;
+	ctx->num_callback_workers = i;
+	usbi_mutex_unlock(&ctx->callback_lock);
+
+	if (i < num_workers) {
+		stop_callback_workers(ctx);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	usbi_dbg("started %d callback workers", num_workers);
+	return 0;
+}
+#endif
+
+/* called by the event handler when the event pipe is signalled, to account
+ * for the libusb_interrupt_event_handler() call that caused it */
+static void sample_event_latency(struct libusb_context *ctx, uint64_t now)
+{
+	struct libusb_event_latency_stats *stats = &ctx->event_latency_stats;
+	uint64_t latency;
+
+	usbi_mutex_lock(&ctx->event_thread_lock);
+	if (ctx->interrupt_nsecs) {
+		latency = now - ctx->interrupt_nsecs;
+		ctx->interrupt_nsecs = 0;
+		if (!stats->wakeups || latency < stats->min_latency_nsecs)
+			stats->min_latency_nsecs = latency;
+		if (latency > stats->max_latency_nsecs)
+			stats->max_latency_nsecs = latency;
+		stats->total_latency_nsecs += latency;
+		stats->wakeups++;
+	}
+	usbi_mutex_unlock(&ctx->event_thread_lock);
+}
+
+#ifdef THREADS_POSIX
+/* how much of the event thread's stack to touch before handling events */
+#define EVENT_THREAD_STACK_PREFAULT	(64 * 1024)
+
+struct usbi_event_thread {
+	struct libusb_context *ctx;
+	pthread_t thread;
+	int flags;
+	int stop;
+};
+
+static void prefault_stack(void)
+{
+	unsigned char stack[EVENT_THREAD_STACK_PREFAULT];
+	volatile unsigned char *p = stack;
+	size_t i;
+
+	/* a write every kilobyte touches every page, volatile keeps the
+	 * compiler from dropping the writes */
+	for (i = 0; i < sizeof(stack); i += 1024)
+		p[i] = 0;
+}
+
+static void *event_thread_main(void *arg)
+{
+	struct usbi_event_thread *et = arg;
+	struct libusb_context *ctx = et->ctx;
+	int r;
+
+	if (et->flags & LIBUSB_EVENT_THREAD_LOCK_MEMORY)
+		prefault_stack();
+
+	while (!usbi_atomic_load(&et->stop)) {
+		struct timeval tv = { 60, 0 };
+
+		r = libusb_handle_events_timeout_completed(ctx, &tv, &et->stop);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_dbg("event handling failed (%d)", r);
+	}
+	return NULL;
+}
+
+static void join_event_thread(struct libusb_context *ctx,
+	struct usbi_event_thread *et)
+{
+	usbi_atomic_store(&et->stop, 1);
+	usbi_signal_event(ctx);
+	usbi_wake_event_waiters(ctx);
+	pthread_join(et->thread, NULL);
+}
+
+static int start_event_thread(struct libusb_context *ctx, int priority,
+	int cpu, int flags)
+{
+	struct usbi_event_thread *et;
+	pthread_attr_t attr;
+	int r;
+
+	if (priority > 0 && priority > sched_get_priority_max(SCHED_FIFO))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	et = usbi_calloc(1, sizeof(*et), LIBUSB_ALLOC_SITE_OTHER);
+	if (!et)
+		return LIBUSB_ERROR_NO_MEM;
+	et->ctx = ctx;
+	et->flags = flags;
+
+	pthread_attr_init(&attr);
+	if (priority > 0) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	if (cpu >= 0) {
+#if defined(OS_LINUX) && defined(CPU_SETSIZE)
+		cpu_set_t cpus;
+
+		if (cpu >= CPU_SETSIZE) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			goto out;
+		}
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+#else
+		r = LIBUSB_ERROR_NOT_SUPPORTED;
+		goto out;
+#endif
+	}
+
+	usbi_mutex_lock(&ctx->event_thread_lock);
+	if (ctx->event_thread) {
+		usbi_mutex_unlock(&ctx->event_thread_lock);
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+	r = pthread_create(&et->thread, &attr, event_thread_main, et);
+	if (r != 0) {
+		usbi_mutex_unlock(&ctx->event_thread_lock);
+		usbi_err(ctx, "failed to create event thread (%d)", r);
+		if (r == EPERM)
+			r = LIBUSB_ERROR_ACCESS;
+		else if (r == EINVAL)
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		else
+			r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	/* only lock memory once nothing else can fail, so that a failed call
+	 * leaves the process as it was */
+	if ((flags & LIBUSB_EVENT_THREAD_LOCK_MEMORY)
+			&& mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		usbi_mutex_unlock(&ctx->event_thread_lock);
+		usbi_err(ctx, "failed to lock memory, errno=%d", errno);
+		/* mlockall() may have locked part of the memory */
+		munlockall();
+		join_event_thread(ctx, et);
+		r = LIBUSB_ERROR_ACCESS;
+		goto out;
+	}
+	ctx->event_thread = et;
+	usbi_mutex_unlock(&ctx->event_thread_lock);
+
+	usbi_dbg("started event thread, priority %d cpu %d", priority, cpu);
+	pthread_attr_destroy(&attr);
+	return 0;
+
+out:
+	pthread_attr_destroy(&attr);
+	usbi_free(et, sizeof(*et), LIBUSB_ALLOC_SITE_OTHER);
+	return r;
+}
+#endif
+
+/* wait until all queued transfer callbacks have run. this is a no-op when
+ * callbacks are not dispatched to workers, or when called from a worker. */
+void usbi_wait_for_callbacks(struct libusb_context *ctx)
+{
+#ifdef THREADS_POSIX
+	usbi_mutex_lock(&ctx->callback_lock);
+	if (!is_callback_worker(ctx)) {
+		while (ctx->callbacks_pending)
+			usbi_cond_wait(&ctx->callback_idle_cond, &ctx->callback_lock);
+	}
+	usbi_mutex_unlock(&ctx->callback_lock);
+#endif
+}
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, which may end up
+ * freeing the transfer. Therefore you cannot use the transfer structure
+ * after calling this function, and you should free all backend-specific
+ * data before calling it.
+ * Do not call this function with backend locks held that submission takes.
+ * User-specified callback functions may attempt to directly resubmit the
+ * transfer. */
+int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = TRANSFER_CTX(transfer);
-	uint8_t flags;
+	unsigned int old;
 	int r = 0;
 
+	/* libusb_submit_transfer() may still be using the transfer, leave the
+	 * completion to it */
+	do {
+		old = itransfer->state;
+		if ((old & USBI_TRANSFER_STATE_MASK) != USBI_TRANSFER_SUBMITTING)
+			break;
+		itransfer->deferred_status = status;
+	} while ((unsigned int) usbi_atomic_cas(&itransfer->state, old,
+			old | USBI_TRANSFER_EARLY_COMPLETION) != old);
+	if ((old & USBI_TRANSFER_STATE_MASK) == USBI_TRANSFER_SUBMITTING) {
+		usbi_dbg("transfer completed during submission");
+		return 0;
+	}
+
+	unthrottle_transfer(itransfer);
+
+	/* let the other completions of this pass go first */
+	if (ctx->completion_pass &&
+	    itransfer->priority == LIBUSB_TRANSFER_PRIORITY_LOW) {
+		usbi_mutex_lock(&ctx->deferred_completions_lock);
+		itransfer->deferred_status = status;
+		list_add_tail(&itransfer->completion_list,
+			&ctx->deferred_completions);
+		usbi_mutex_unlock(&ctx->deferred_completions_lock);
+		return 0;
+	}
+
 	/* FIXME: could be more intelligent with the timerfd here. we don't need
 	 * to disarm the timerfd if there was no timer running, and we only need
 	 * to rearm the timerfd if the transfer that expired was the one with
 	 * the shortest timeout. */
 
+	if (!transfer_transition(itransfer, STATE_BIT(USBI_TRANSFER_IN_FLIGHT),
+			USBI_TRANSFER_COMPLETING, 0, NULL))
+		usbi_warn(ctx, "completion of transfer %p which is not in flight",
+			transfer);
+
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 	list_del(&itransfer->list);
 	if (usbi_using_timerfd(ctx))
@@ -1499,32 +3082,45 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
-	flags = transfer->flags;
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+
+#ifdef THREADS_POSIX
+	if (queue_transfer_callback(itransfer) == 0)
+		return 0;
+#endif
+	invoke_transfer_callback(itransfer);
+	return 0;
+}
+
+/* Report data received by a LIBUSB_TRANSFER_AUTO_RESUBMIT transfer, which
+ * stays in flight. The backend must have put the data in the transfer buffer
+ * and its size in itransfer->transferred, and must not touch the buffer
+ * again until this returns. The callback is invoked directly rather than
+ * through the worker pool, since the buffer is reused for the next chunk.
+ * Do not call this function with backend locks held that cancellation
+ * takes. */
+void usbi_handle_transfer_progress(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	transfer->actual_length = itransfer->transferred;
 	if (transfer->callback)
 		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	usbi_mutex_lock(&ctx->event_waiters_lock);
-	usbi_cond_broadcast(&ctx->event_waiters_cond);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
-	return 0;
 }
 
 /* Similar to usbi_handle_transfer_completion() but exclusively for transfers
  * that were asynchronously cancelled. The same concerns w.r.t. freeing of
  * transfers exist here.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
+ * Do not call this function with backend locks held that submission takes.
+ * User-specified callback functions may attempt to directly resubmit the
+ * transfer. */
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 {
 	/* if the URB was cancelled due to timeout, report timeout to the user */
-	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
+	if (usbi_transfer_test_flags(transfer, USBI_TRANSFER_TIMED_OUT)) {
 		usbi_dbg("detected timeout cancellation");
 		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
 	}
@@ -1533,6 +3129,48 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
 	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
+/* Have the completion of a transfer reported by the event handler of its
+ * context. This is for backends that find out about a completion outside of
+ * event handling, e.g. from libusb_cancel_transfer() or while holding
+ * locks, or from a thread handling events for another context. A status of
+ * LIBUSB_TRANSFER_CANCELLED is reported as by
+ * usbi_handle_transfer_cancellation(). The transfer must still be on the
+ * flying list. */
+void usbi_defer_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_context *ctx =
+		TRANSFER_CTX(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+
+	usbi_mutex_lock(&ctx->deferred_completions_lock);
+	itransfer->deferred_status = status;
+	list_add_tail(&itransfer->completion_list, &ctx->deferred_completions);
+	usbi_mutex_unlock(&ctx->deferred_completions_lock);
+	usbi_signal_event(ctx);
+}
+
+static int handle_deferred_completions(struct libusb_context *ctx)
+{
+	struct usbi_transfer *itransfer;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->deferred_completions_lock);
+	while (!list_empty(&ctx->deferred_completions) && r == 0) {
+		itransfer = list_entry(ctx->deferred_completions.next,
+			struct usbi_transfer, completion_list);
+		list_del(&itransfer->completion_list);
+		usbi_mutex_unlock(&ctx->deferred_completions_lock);
+		if (itransfer->deferred_status == LIBUSB_TRANSFER_CANCELLED)
+			r = usbi_handle_transfer_cancellation(itransfer);
+		else
+			r = usbi_handle_transfer_completion(itransfer,
+				itransfer->deferred_status);
+		usbi_mutex_lock(&ctx->deferred_completions_lock);
+	}
+	usbi_mutex_unlock(&ctx->deferred_completions_lock);
+	return r;
+}
+
 /** \ingroup poll
  * Attempt to acquire the event handling lock. This lock is used to ensure that
  * only one thread is monitoring libusbx event sources at any one time.
@@ -1560,9 +3198,7 @@ int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 
 	/* is someone else waiting to modify poll fds? if so, don't let this thread
 	 * start event handling */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	ru = ctx->pollfd_modify;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	ru = usbi_atomic_load(&ctx->pollfd_modify);
 	if (ru) {
 		usbi_dbg("someone else is modifying poll fds");
 		return 1;
@@ -1572,7 +3208,7 @@ int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 	if (r)
 		return 1;
 
-	ctx->event_handler_active = 1;
+	usbi_atomic_store(&ctx->event_handler_active, 1);
 	return 0;
 }
 
@@ -1598,7 +3234,7 @@ void API_EXPORTED libusb_lock_events(libusb_context *ctx)
 {
 	USBI_GET_CONTEXT(ctx);
 	usbi_mutex_lock(&ctx->events_lock);
-	ctx->event_handler_active = 1;
+	usbi_atomic_store(&ctx->event_handler_active, 1);
 }
 
 /** \ingroup poll
@@ -1612,15 +3248,16 @@ void API_EXPORTED libusb_lock_events(libusb_context *ctx)
 void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 {
 	USBI_GET_CONTEXT(ctx);
-	ctx->event_handler_active = 0;
+	usbi_atomic_store(&ctx->event_handler_active, 0);
 	usbi_mutex_unlock(&ctx->events_lock);
 
-	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->pollfd_modify)? */
-	usbi_mutex_lock(&ctx->event_waiters_lock);
-	usbi_cond_broadcast(&ctx->event_waiters_cond);
-	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	/* while poll fds are being modified, waiters could not take over event
+	 * handling anyway. the thread modifying them wakes them up when it
+	 * releases the events lock in turn. */
+	if (usbi_atomic_load(&ctx->pollfd_modify))
+		return;
+
+	usbi_wake_event_waiters(ctx);
 }
 
 /** \ingroup poll
@@ -1651,9 +3288,7 @@ int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
 
 	/* is someone else waiting to modify poll fds? if so, don't let this thread
 	 * continue event handling */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	r = ctx->pollfd_modify;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	r = usbi_atomic_load(&ctx->pollfd_modify);
 	if (r) {
 		usbi_dbg("someone else is modifying poll fds");
 		return 0;
@@ -1679,15 +3314,13 @@ int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 
 	/* is someone else waiting to modify poll fds? if so, don't let this thread
 	 * start event handling -- indicate that event handling is happening */
-	usbi_mutex_lock(&ctx->pollfd_modify_lock);
-	r = ctx->pollfd_modify;
-	usbi_mutex_unlock(&ctx->pollfd_modify_lock);
+	r = usbi_atomic_load(&ctx->pollfd_modify);
 	if (r) {
 		usbi_dbg("someone else is modifying poll fds");
 		return 1;
 	}
 
-	return ctx->event_handler_active;
+	return usbi_atomic_load(&ctx->event_handler_active);
 }
 
 /** \ingroup poll
@@ -1712,6 +3345,7 @@ int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 void API_EXPORTED libusb_lock_event_waiters(libusb_context *ctx)
 {
 	USBI_GET_CONTEXT(ctx);
+	usbi_atomic_inc(&ctx->event_waiters);
 	usbi_mutex_lock(&ctx->event_waiters_lock);
 }
 
@@ -1724,6 +3358,7 @@ void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
 {
 	USBI_GET_CONTEXT(ctx);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	usbi_atomic_dec(&ctx->event_waiters);
 }
 
 /** \ingroup poll
@@ -1786,47 +3421,38 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int r;
 
-	itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+	usbi_transfer_set_flags(itransfer, USBI_TRANSFER_TIMED_OUT);
 	r = libusb_cancel_transfer(transfer);
-	if (r < 0)
+	/* LIBUSB_ERROR_NOT_FOUND: cancelled already, or completing */
+	if (r < 0 && r != LIBUSB_ERROR_NOT_FOUND)
 		usbi_warn(TRANSFER_CTX(transfer),
 			"async cancel failed %d errno=%d", r, errno);
 }
 
-static int handle_timeouts_locked(struct libusb_context *ctx)
+static int handle_timeouts_locked(struct libusb_context *ctx, uint64_t now)
 {
-	int r;
-	struct timespec systime_ts;
-	struct timeval systime;
 	struct usbi_transfer *transfer;
 
 	if (list_empty(&ctx->flying_transfers))
 		return 0;
 
-	/* get current time */
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &systime_ts);
-	if (r < 0)
-		return r;
-
-	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
+	if (!now)
+		return LIBUSB_ERROR_OTHER;
 
 	/* iterate through flying transfers list, finding all transfers that
 	 * have expired timeouts */
 	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		struct timeval *cur_tv = &transfer->timeout;
-
 		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
+		if (!transfer->timeout_nsecs)
 			return 0;
 
 		/* ignore timeouts we've already handled */
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
+		if (usbi_transfer_test_flags(transfer,
+				USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
 			continue;
 
 		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
+		if (transfer->timeout_nsecs > now)
 			return 0;
 
 		/* otherwise, we've got an expired timeout to handle */
@@ -1835,25 +3461,65 @@ static int handle_timeouts_locked(struct libusb_context *ctx)
 	return 0;
 }
 
-static int handle_timeouts(struct libusb_context *ctx)
+/* run the callbacks of all expired internal timers. must be called without
+ * flying_transfers_lock held. */
+static int handle_timers(struct libusb_context *ctx, uint64_t now)
+{
+	struct usbi_timer *timer;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (list_empty(&ctx->timers))
+		goto out;
+
+	if (!now) {
+		r = LIBUSB_ERROR_OTHER;
+		goto out;
+	}
+
+	while (!list_empty(&ctx->timers)) {
+		timer = list_entry(ctx->timers.next, struct usbi_timer, list);
+		if (timer->expiry_nsecs > now)
+			break;
+
+		list_del(&timer->list);
+		timer->expiry_nsecs = 0;
+		ctx->running_timer = timer;
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		timer->cb(timer->user_data);
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		ctx->running_timer = NULL;
+		usbi_cond_broadcast(&ctx->timers_cond);
+	}
+
+	if (usbi_using_timerfd(ctx))
+		r = arm_timerfd_for_next_timeout(ctx);
+out:
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r < 0 ? r : 0;
+}
+
+static int handle_timeouts(struct libusb_context *ctx, uint64_t now)
 {
 	int r;
 	USBI_GET_CONTEXT(ctx);
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	r = handle_timeouts_locked(ctx);
+	r = handle_timeouts_locked(ctx, now);
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	return r;
+	if (r < 0)
+		return r;
+	return handle_timers(ctx, now);
 }
 
 #ifdef USBI_TIMERFD_AVAILABLE
-static int handle_timerfd_trigger(struct libusb_context *ctx)
+static int handle_timerfd_trigger(struct libusb_context *ctx, uint64_t now)
 {
 	int r;
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
 	/* process the timeout that just happened */
-	r = handle_timeouts_locked(ctx);
+	r = handle_timeouts_locked(ctx, now);
 	if (r < 0)
 		goto out;
 
@@ -1862,10 +3528,68 @@ static int handle_timerfd_trigger(struct libusb_context *ctx)
 
 out:
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-	return r;
+	if (r < 0)
+		return r;
+	return handle_timers(ctx, now);
 }
 #endif
 
+/* spin on the backend busy_poll operation for up to ctx->busy_poll_usecs,
+ * but no longer than tv. tv is reduced by the time spent spinning.
+ * returns 1 if any completions were handled, 0 if the spin period expired
+ * without any activity, or a LIBUSB_ERROR code on failure. */
+static int busy_poll(struct libusb_context *ctx, struct timeval *tv)
+{
+	struct libusb_busy_poll_stats *stats = &ctx->busy_poll_stats;
+	uint64_t start, cur;
+	uint64_t budget, elapsed = 0;
+	uint64_t tv_usecs = timeval_to_nsecs(tv) / NSECS_PER_USEC;
+	int r;
+
+	budget = ctx->busy_poll_usecs;
+	if (tv_usecs < budget)
+		budget = tv_usecs;
+	if (budget == 0)
+		return 0;
+
+	start = monotonic_nsecs();
+	if (!start)
+		return LIBUSB_ERROR_OTHER;
+
+	stats->polls++;
+	do {
+		ctx->completion_pass = 1;
+		r = usbi_backend->busy_poll(ctx);
+		ctx->completion_pass = 0;
+		if (r > 0 && handle_deferred_completions(ctx) < 0)
+			usbi_dbg("deferred completion failed");
+		stats->spins++;
+		cur = monotonic_nsecs();
+		if (cur)
+			elapsed = (cur - start) / NSECS_PER_USEC;
+		if (r != 0)
+			break;
+		/* another thread wants to modify the poll set: let it in */
+		if (!libusb_event_handling_ok(ctx))
+			break;
+	} while (elapsed < budget);
+
+	stats->spin_usecs += elapsed;
+	if (r > 0) {
+		stats->hits++;
+		r = 1;
+	} else if (r == 0) {
+		stats->fallbacks++;
+	}
+
+	if (elapsed >= tv_usecs)
+		timerclear(tv);
+	else
+		nsecs_to_timeval((tv_usecs - elapsed) * NSECS_PER_USEC, tv);
+	usbi_dbg("busy-polled for %dus, result %d", (int)elapsed, r);
+	return r;
+}
+
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
 static int handle_events(struct libusb_context *ctx, struct timeval *tv)
@@ -1876,14 +3600,34 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	struct pollfd *fds = NULL;
 	int i = -1;
 	int timeout_ms;
+	struct timeval busy_tv;
+	uint64_t now;
+
+	if (ctx->busy_poll_usecs && usbi_backend->busy_poll) {
+		busy_tv = *tv;
+		r = busy_poll(ctx, &busy_tv);
+		if (r < 0)
+			return r;
+		/* if something completed, still look for other pending events but
+		 * don't block. otherwise, block for whatever time remains. */
+		if (r > 0)
+			timerclear(&busy_tv);
+		tv = &busy_tv;
+	}
 
 	usbi_mutex_lock(&ctx->pollfds_lock);
 	list_for_each_entry(ipollfd, &ctx->pollfds, list, struct usbi_pollfd)
 		nfds++;
 
-	/* TODO: malloc when number of fd's changes, not on every poll */
-	if (nfds != 0)
-		fds = malloc(sizeof(*fds) * nfds);
+	/* the array is only reallocated when the number of fds grows */
+	if (nfds > ctx->poll_fds_capacity) {
+		usbi_free(ctx->poll_fds, sizeof(*fds) * ctx->poll_fds_capacity,
+			LIBUSB_ALLOC_SITE_POLLFD);
+		ctx->poll_fds = usbi_malloc(sizeof(*fds) * nfds,
+			LIBUSB_ALLOC_SITE_POLLFD);
+		ctx->poll_fds_capacity = ctx->poll_fds ? nfds : 0;
+	}
+	fds = ctx->poll_fds;
 	if (!fds) {
 		usbi_mutex_unlock(&ctx->pollfds_lock);
 		return LIBUSB_ERROR_NO_MEM;
@@ -1908,14 +3652,14 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	usbi_dbg("poll() %d fds with timeout in %dms", nfds, timeout_ms);
 	r = usbi_poll(fds, nfds, timeout_ms);
 	usbi_dbg("poll() returned %d", r);
+
+	/* the time of this pass, for all the timeouts handled below */
+	now = monotonic_nsecs();
 	if (r == 0) {
-		free(fds);
-		return handle_timeouts(ctx);
+		return handle_timeouts(ctx, now);
 	} else if (r == -1 && errno == EINTR) {
-		free(fds);
 		return LIBUSB_ERROR_INTERRUPTED;
 	} else if (r < 0) {
-		free(fds);
 		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
@@ -1960,14 +3704,39 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 			goto handled;
 	} /* else there shouldn't be anything on this pipe */
 
+	/* fd[2] is always the event pipe */
+	if (fds[2].revents) {
+		unsigned char dummy[64];
+		int ret;
+
+		/* the write only serves to wake us up. anything left in the pipe
+		 * will simply wake up the next poll() too. */
+		usbi_dbg("event pipe signalled");
+		if (usbi_read(ctx->event_pipe[0], dummy, sizeof(dummy)) <= 0)
+			usbi_dbg("event pipe read failed, errno=%d", errno);
+		sample_event_latency(ctx, now);
+
+		ret = handle_deferred_completions(ctx);
+		if (ret < 0) {
+			r = ret;
+			goto handled;
+		}
+
+		fds[2].revents = 0;
+		if (1 == r--) {
+			r = 0;
+			goto handled;
+		}
+	}
+
 #ifdef USBI_TIMERFD_AVAILABLE
-	/* on timerfd configurations, fds[2] is the timerfd */
-	if (usbi_using_timerfd(ctx) && fds[2].revents) {
+	/* on timerfd configurations, fds[3] is the timerfd */
+	if (usbi_using_timerfd(ctx) && fds[3].revents) {
 		/* timerfd indicates that a timeout has expired */
 		int ret;
 		usbi_dbg("timerfd triggered");
 
-		ret = handle_timerfd_trigger(ctx);
+		ret = handle_timerfd_trigger(ctx, now);
 		if (ret < 0) {
 			/* return error code */
 			r = ret;
@@ -1979,45 +3748,95 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		} else {
 			/* more events pending...
 			 * prevent OS backend from trying to handle events on timerfd */
-			fds[2].revents = 0;
+			fds[3].revents = 0;
 			r--;
 		}
 	}
 #endif
 
+	ctx->completion_pass = 1;
 	r = usbi_backend->handle_events(ctx, fds, nfds, r);
+	ctx->completion_pass = 0;
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
+	/* low-priority completions held back during the pass */
+	if (handle_deferred_completions(ctx) < 0)
+		usbi_dbg("deferred completion failed");
+
 handled:
-	free(fds);
 	return r;
 }
 
+/* the earliest transfer timeout or internal timer expiry that the event
+ * handler has yet to act on, or 0 if there is none */
+static uint64_t get_next_deadline(struct libusb_context *ctx)
+{
+	struct usbi_transfer *transfer;
+	uint64_t next = 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+
+	/* find next transfer which hasn't already been processed as timed out */
+	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
+		if (usbi_transfer_test_flags(transfer,
+				USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
+			continue;
+
+		/* no timeout for this transfer? */
+		if (!transfer->timeout_nsecs)
+			continue;
+
+		next = transfer->timeout_nsecs;
+		break;
+	}
+
+	/* an internal timer may expire first */
+	if (!list_empty(&ctx->timers)) {
+		struct usbi_timer *timer =
+			list_entry(ctx->timers.next, struct usbi_timer, list);
+		if (!next || timer->expiry_nsecs < next)
+			next = timer->expiry_nsecs;
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return next;
+}
+
 /* returns the smallest of:
  *  1. timeout of next URB
  *  2. user-supplied timeout
  * returns 1 if there is an already-expired timeout, otherwise returns 0
- * and populates out
+ * and populates out. now is set to the current time if the clock had to be
+ * read, or to 0.
  */
 static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
-	struct timeval *out)
+	struct timeval *out, uint64_t *now)
 {
-	struct timeval timeout;
-	int r = libusb_get_next_timeout(ctx, &timeout);
-	if (r) {
-		/* timeout already expired? */
-		if (!timerisset(&timeout))
-			return 1;
+	uint64_t next;
 
-		/* choose the smallest of next URB timeout or user specified timeout */
-		if (timercmp(&timeout, tv, <))
-			*out = timeout;
-		else
-			*out = *tv;
-	} else {
-		*out = *tv;
+	*out = *tv;
+	*now = 0;
+	if (usbi_using_timerfd(ctx))
+		return 0;
+
+	next = get_next_deadline(ctx);
+	if (!next)
+		return 0;
+
+	*now = monotonic_nsecs();
+	if (!*now) {
+		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
+		return 0;
 	}
+
+	/* timeout already expired? */
+	if (next <= *now)
+		return 1;
+
+	/* choose the smallest of next URB timeout or user specified timeout */
+	if (next - *now < timeval_to_nsecs(tv))
+		nsecs_to_timeval(next - *now, out);
 	return 0;
 }
 
@@ -2052,12 +3871,13 @@ int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
 {
 	int r;
 	struct timeval poll_timeout;
+	uint64_t now;
 
 	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
+	r = get_next_timeout(ctx, tv, &poll_timeout, &now);
 	if (r) {
 		/* timeout already expired */
-		return handle_timeouts(ctx);
+		return handle_timeouts(ctx, now);
 	}
 
 retry:
@@ -2095,7 +3915,7 @@ already_done:
 	if (r < 0)
 		return r;
 	else if (r == 1)
-		return handle_timeouts(ctx);
+		return handle_timeouts(ctx, monotonic_nsecs());
 	else
 		return 0;
 }
@@ -2189,12 +4009,13 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 {
 	int r;
 	struct timeval poll_timeout;
+	uint64_t now;
 
 	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
+	r = get_next_timeout(ctx, tv, &poll_timeout, &now);
 	if (r) {
 		/* timeout already expired */
-		return handle_timeouts(ctx);
+		return handle_timeouts(ctx, now);
 	}
 
 	return handle_events(ctx, &poll_timeout);
@@ -2270,63 +4091,340 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *transfer;
-	struct timespec cur_ts;
-	struct timeval cur_tv;
-	struct timeval *next_timeout;
-	int r;
-	int found = 0;
+	uint64_t next, now;
 
 	USBI_GET_CONTEXT(ctx);
 	if (usbi_using_timerfd(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
-		if (transfer->flags & (USBI_TRANSFER_TIMED_OUT | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* no timeout for this transfer? */
-		if (!timerisset(&transfer->timeout))
-			continue;
-
-		found = 1;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	if (!found) {
+	next = get_next_deadline(ctx);
+	if (!next) {
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
 		return 0;
 	}
 
-	next_timeout = &transfer->timeout;
-
-	r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &cur_ts);
-	if (r < 0) {
+	now = monotonic_nsecs();
+	if (!now) {
 		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
 		return 0;
 	}
-	TIMESPEC_TO_TIMEVAL(&cur_tv, &cur_ts);
 
-	if (!timercmp(&cur_tv, next_timeout, <)) {
+	if (next <= now) {
 		usbi_dbg("first timeout already expired");
 		timerclear(tv);
 	} else {
-		timersub(next_timeout, &cur_tv, tv);
+		nsecs_to_timeval(next - now, tv);
 		usbi_dbg("next timeout in %d.%06ds", tv->tv_sec, tv->tv_usec);
 	}
 
 	return 1;
 }
 
+/** \ingroup poll
+ * Enable or disable busy-polling for a context.
+ *
+ * When busy-polling is enabled, the event handling functions such as
+ * libusb_handle_events() first spin for up to the given number of
+ * microseconds, repeatedly checking for completed transfers without
+ * sleeping, before falling back to blocking in poll(). This trades CPU time
+ * for lower and more predictable completion latency, which can help
+ * applications running closed control loops over small interrupt or bulk
+ * transfers. The spin period never exceeds the timeout passed to the event
+ * handling function, so non-blocking event handling is unaffected.
+ *
+ * Busy-polling only applies to event handling performed inside libusbx. If
+ * your application polls the libusbx file descriptors itself, this setting
+ * has no effect. It is also ignored on platforms where the backend does not
+ * support it.
+ *
+ * Use libusb_get_busy_poll_stats() to find out how much CPU time was spent
+ * spinning and how often it paid off.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param usecs maximum number of microseconds to spin before blocking, or 0
+ * to disable busy-polling (the default)
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if the platform cannot busy-poll
+ */
+int API_EXPORTED libusb_set_busy_poll(libusb_context *ctx, unsigned int usecs)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (usecs && !usbi_backend->busy_poll)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_dbg("busy-poll for %uus", usecs);
+	ctx->busy_poll_usecs = usecs;
+	return 0;
+}
+
+/** \ingroup poll
+ * Limit the number of completions handled per device in a single event
+ * handling pass.
+ *
+ * When several devices have completions pending at the same time, libusbx
+ * reaps them in round-robin order, so that a device streaming data at a
+ * high rate does not delay the completions of other devices sharing the
+ * same context. The budget additionally caps how many completions are taken
+ * from each device before the event handling function returns, leaving the
+ * rest for the next pass. This bounds the time spent in one pass, so that
+ * timeouts and other devices are serviced promptly.
+ *
+ * The budget is scaled by the weight of each device handle, see
+ * libusb_set_reap_weight(). The default budget of 0 means no limit: all
+ * pending completions are handled in each pass, still in round-robin order.
+ *
+ * Note that a single transfer may be made of several completions on some
+ * platforms, for instance large bulk transfers on Linux.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param budget maximum number of completions per device of weight 1 per
+ * event handling pass, or 0 for no limit
+ * \returns 0 on success
+ */
+int API_EXPORTED libusb_set_reap_budget(libusb_context *ctx,
+	unsigned int budget)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_dbg("reap budget %u", budget);
+	ctx->reap_budget = budget;
+	return 0;
+}
+
+/** \ingroup poll
+ * Set the relative weight of a device handle when handling completions.
+ *
+ * In each round of the round-robin described in libusb_set_reap_budget(),
+ * up to weight completions are taken from the device before moving on to
+ * the next one, and the per-pass budget of the device is multiplied by its
+ * weight. Raising the weight of a latency-sensitive device therefore gives
+ * it a larger share of each event handling pass. Handles have a weight of 1
+ * when opened.
+ *
+ * \param dev_handle a device handle
+ * \param weight the new weight, must be at least 1
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if weight is 0
+ */
+int API_EXPORTED libusb_set_reap_weight(libusb_device_handle *dev_handle,
+	unsigned int weight)
+{
+	if (weight == 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_dbg("handle %p weight %u", dev_handle, weight);
+	dev_handle->reap_weight = weight;
+	return 0;
+}
+
+/** \ingroup poll
+ * Run transfer callbacks on a pool of worker threads.
+ *
+ * By default, transfer callbacks are invoked by the thread handling events,
+ * as part of libusb_handle_events() and friends. A callback that takes a
+ * long time, for instance because it writes data to disk, then delays the
+ * handling of every other transfer in the context, which may cause
+ * isochronous transfers to overrun.
+ *
+ * With a worker pool, the event handling thread only reaps completed
+ * transfers and queues them, and the callbacks run on the workers instead.
+ * Callbacks for transfers on the same endpoint of the same device handle
+ * are always run by the same worker, in the order the transfers completed.
+ * Callbacks for different endpoints may run concurrently, so they must be
+ * thread-safe with respect to each other.
+ *
+ * libusb_close() waits for all queued callbacks to run before closing the
+ * device. Note that with a worker pool, a callback may still be pending or
+ * running when libusb_handle_events() returns.
+ *
+ * Changing the number of workers waits for all queued callbacks to run, and
+ * must not be done from within a transfer callback. This function is only
+ * supported on platforms with POSIX threads.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_workers number of worker threads, or 0 to invoke callbacks
+ * from the event handling thread (the default)
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_workers is negative
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if worker threads are not supported
+ * \returns LIBUSB_ERROR_OTHER if the threads could not be created
+ */
+int API_EXPORTED libusb_set_callback_workers(libusb_context *ctx,
+	int num_workers)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (num_workers < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+#ifdef THREADS_POSIX
+	stop_callback_workers(ctx);
+	if (num_workers)
+		return start_callback_workers(ctx, num_workers);
+	return 0;
+#else
+	return num_workers ? LIBUSB_ERROR_NOT_SUPPORTED : 0;
+#endif
+}
+
+/** \ingroup poll
+ * Retrieve the busy-poll counters for a context. The counters are
+ * cumulative since the context was created and are updated by whichever
+ * thread is handling events, so they may be slightly out of date when read
+ * while event handling is in progress.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ * \see libusb_set_busy_poll()
+ */
+int API_EXPORTED libusb_get_busy_poll_stats(libusb_context *ctx,
+	struct libusb_busy_poll_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*stats = ctx->busy_poll_stats;
+	return 0;
+}
+
+/** \ingroup poll
+ * Start an internal thread that handles events for a context, optionally
+ * with real-time scheduling.
+ *
+ * The thread calls libusb_handle_events_timeout_completed() in a loop, so
+ * the application does not need an event handling thread of its own.
+ * Transfer callbacks run on this thread unless callback workers are used,
+ * see libusb_set_callback_workers().
+ *
+ * With a priority greater than 0, the thread runs under the SCHED_FIFO
+ * policy at that priority, which usually needs CAP_SYS_NICE or a suitable
+ * RLIMIT_RTPRIO. Other threads touching the context can then hold off the
+ * event thread while they hold one of its internal locks; calling
+ * libusb_set_priority_inheritance() before libusb_init() bounds that delay.
+ *
+ * With LIBUSB_EVENT_THREAD_LOCK_MEMORY, all pages of the process, including
+ * ones mapped later such as transfer buffers, are locked into memory once
+ * the thread has started. This applies to the whole process. The memory is
+ * unlocked with munlockall() when the thread stops, which also undoes any
+ * other locking done by the process, including that of buffer pools
+ * allocated with \ref libusb_buffer_pool_flags::LIBUSB_BUFFER_POOL_LOCKED
+ * "LIBUSB_BUFFER_POOL_LOCKED".
+ *
+ * The thread is stopped by libusb_stop_event_thread() or libusb_exit().
+ * This function is only supported on platforms with POSIX threads.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param priority SCHED_FIFO priority, or 0 to inherit the scheduling policy
+ * of the calling thread
+ * \param cpu the CPU to bind the thread to, or -1 for no binding
+ * \param flags bitwise or of \ref libusb_event_thread_flags
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a parameter is out of range
+ * \returns LIBUSB_ERROR_BUSY if the context already has an event thread
+ * \returns LIBUSB_ERROR_ACCESS if the process may not use the requested
+ * priority or lock its memory
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if event threads or CPU binding are
+ * not supported
+ * \returns LIBUSB_ERROR_OTHER if the thread could not be created
+ */
+int API_EXPORTED libusb_start_event_thread(libusb_context *ctx, int priority,
+	int cpu, int flags)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (priority < 0 || cpu < -1 || (flags & ~LIBUSB_EVENT_THREAD_LOCK_MEMORY))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+#ifdef THREADS_POSIX
+	return start_event_thread(ctx, priority, cpu, flags);
+#else
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup poll
+ * Stop the event thread started by libusb_start_event_thread() and wait for
+ * it to exit. Does nothing if the context has no event thread. This must
+ * not be called from a transfer callback running on the event thread.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ */
+void API_EXPORTED libusb_stop_event_thread(libusb_context *ctx)
+{
+#ifdef THREADS_POSIX
+	struct usbi_event_thread *et;
+
+	USBI_GET_CONTEXT(ctx);
+	usbi_mutex_lock(&ctx->event_thread_lock);
+	et = ctx->event_thread;
+	if (et && pthread_equal(et->thread, pthread_self())) {
+		usbi_mutex_unlock(&ctx->event_thread_lock);
+		usbi_err(ctx, "event thread cannot stop itself");
+		return;
+	}
+	ctx->event_thread = NULL;
+	usbi_mutex_unlock(&ctx->event_thread_lock);
+	if (!et)
+		return;
+
+	join_event_thread(ctx, et);
+	if (et->flags & LIBUSB_EVENT_THREAD_LOCK_MEMORY)
+		munlockall();
+	usbi_free(et, sizeof(*et), LIBUSB_ALLOC_SITE_OTHER);
+	usbi_dbg("stopped event thread");
+#else
+	(void)ctx;
+#endif
+}
+
+/** \ingroup poll
+ * Wake up the thread handling events for a context, causing the
+ * libusb_handle_events() call it is blocked in to return. The time until
+ * the event handler notices the interruption is recorded, see
+ * libusb_get_event_latency_stats().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ */
+void API_EXPORTED libusb_interrupt_event_handler(libusb_context *ctx)
+{
+	uint64_t now;
+
+	USBI_GET_CONTEXT(ctx);
+	now = monotonic_nsecs();
+	usbi_mutex_lock(&ctx->event_thread_lock);
+	/* only the oldest pending interruption is measured */
+	if (!ctx->interrupt_nsecs)
+		ctx->interrupt_nsecs = now;
+	usbi_mutex_unlock(&ctx->event_thread_lock);
+	usbi_signal_event(ctx);
+}
+
+/** \ingroup poll
+ * Retrieve the event handler wakeup latency of a context. The counters are
+ * cumulative since the context was created. Comparing the average with the
+ * maximum shows how much jitter a real-time event thread is subject to.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if stats is NULL
+ * \see libusb_interrupt_event_handler()
+ */
+int API_EXPORTED libusb_get_event_latency_stats(libusb_context *ctx,
+	struct libusb_event_latency_stats *stats)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (!stats)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ctx->event_thread_lock);
+	*stats = ctx->event_latency_stats;
+	usbi_mutex_unlock(&ctx->event_thread_lock);
+	return 0;
+}
+
 /** \ingroup poll
  * Register notification functions for file descriptor additions/removals.
  * These functions will be invoked for every new or removed file descriptor
@@ -2363,7 +4461,8 @@ void API_EXPORTED libusb_set_pollfd_notifiers(libusb_context *ctx,
  * POLLIN and/or POLLOUT. */
 int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 {
-	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
+	struct usbi_pollfd *ipollfd = usbi_malloc(sizeof(*ipollfd),
+		LIBUSB_ALLOC_SITE_POLLFD);
 	if (!ipollfd)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -2401,7 +4500,7 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 
 	list_del(&ipollfd->list);
 	usbi_mutex_unlock(&ctx->pollfds_lock);
-	free(ipollfd);
+	usbi_free(ipollfd, sizeof(*ipollfd), LIBUSB_ALLOC_SITE_POLLFD);
 	if (ctx->fd_removed_cb)
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
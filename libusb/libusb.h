@@ -45,6 +45,7 @@
 typedef unsigned __int8   uint8_t;
 typedef unsigned __int16  uint16_t;
 typedef unsigned __int32  uint32_t;
+typedef unsigned __int64  uint64_t;
 #else
 #include <stdint.h>
 #endif
@@ -136,7 +137,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSBX_API_VERSION is defined as follows:
  * (libusbx major << 24) | (libusbx minor << 16) | (16 bit incremental)
  */
-#define LIBUSBX_API_VERSION 0x01000101
+#define LIBUSBX_API_VERSION 0x01000112
 
 #ifdef __cplusplus
 extern "C" {
@@ -1123,6 +1124,60 @@ enum libusb_transfer_flags {
 	 * Available since libusb-1.0.9.
 	 */
 	LIBUSB_TRANSFER_ADD_ZERO_PACKET = 1 << 3,
+
+	/** Keep the transfer running until it is cancelled or fails, instead
+	 * of completing it after the first chunk of data. Each time data is
+	 * received, the callback is invoked with a status of
+	 * \ref libusb_transfer_status::LIBUSB_TRANSFER_COMPLETED
+	 * "LIBUSB_TRANSFER_COMPLETED", the data in the transfer buffer and its
+	 * size in actual_length, while the transfer stays submitted. Both are
+	 * only valid until the callback returns. The library keeps requests
+	 * queued to the device at all times, so there is no gap in which the
+	 * endpoint is not being polled between two callbacks.
+	 *
+	 * The transfer only ends when it is cancelled with
+	 * libusb_cancel_transfer(), or when an error occurs. The callback is
+	 * then invoked a last time with a status other than
+	 * LIBUSB_TRANSFER_COMPLETED, after which the transfer may be freed or
+	 * submitted again.
+	 *
+	 * This flag is intended for polling interrupt endpoints at high rates,
+	 * and can only be used on bulk and interrupt IN transfers with no
+	 * timeout and without \ref LIBUSB_TRANSFER_SHORT_NOT_OK. The callbacks
+	 * reporting data are always invoked by the thread handling events, even
+	 * when a callback worker pool is in use, because the buffer is reused
+	 * for the next chunk. The last callback is an ordinary completion: with
+	 * a worker pool it is queued to a worker like any other, after the data
+	 * callbacks have all returned. See libusb_set_callback_workers().
+	 *
+	 * Check for the \ref libusb_capability
+	 * "LIBUSB_CAP_SUPPORTS_AUTO_RESUBMIT" capability before using this
+	 * flag: on platforms that do not support it, libusb_submit_transfer()
+	 * will return LIBUSB_ERROR_NOT_SUPPORTED.
+	 */
+	LIBUSB_TRANSFER_AUTO_RESUBMIT = 1 << 4,
+
+	/** All packets of this isochronous transfer request the same length,
+	 * that of the first packet descriptor, which is the only one that
+	 * needs to be allocated. The packet results are not copied to
+	 * \ref libusb_transfer::iso_packet_desc "iso_packet_desc" on
+	 * completion, but stay with the operating system requests they came
+	 * in; get them with libusb_get_iso_packet_result(),
+	 * libusb_get_iso_packet_summary(), libusb_get_iso_packet_views() or
+	 * libusb_gather_iso_packets(). They remain valid until the transfer
+	 * is submitted again or freed.
+	 *
+	 * The requests are kept with the transfer and reused when it is
+	 * submitted again with the same number of packets and packet length,
+	 * so this mode suits transfers with many small packets that are
+	 * resubmitted continuously.
+	 *
+	 * Check for the \ref libusb_capability
+	 * "LIBUSB_CAP_SUPPORTS_UNIFORM_ISO" capability before using this
+	 * flag: on platforms that do not support it, libusb_submit_transfer()
+	 * will return LIBUSB_ERROR_NOT_SUPPORTED.
+	 */
+	LIBUSB_TRANSFER_UNIFORM_ISO = 1 << 5,
 };
 
 /** \ingroup asyncio
@@ -1232,7 +1287,13 @@ enum libusb_capability {
 	LIBUSB_CAP_HAS_HID_ACCESS = 0x0100,
 	/** The library supports detaching of the default USB driver, using 
 	 * \ref libusb_detach_kernel_driver(), if one is set by the OS kernel */
-	LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER = 0x0101
+	LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER = 0x0101,
+	/** The library supports the \ref libusb_transfer_flags
+	 * "LIBUSB_TRANSFER_AUTO_RESUBMIT" transfer flag. */
+	LIBUSB_CAP_SUPPORTS_AUTO_RESUBMIT = 0x0102,
+	/** The library supports the \ref libusb_transfer_flags
+	 * "LIBUSB_TRANSFER_UNIFORM_ISO" transfer flag. */
+	LIBUSB_CAP_SUPPORTS_UNIFORM_ISO = 0x0103
 };
 
 /** \ingroup lib
@@ -1253,6 +1314,95 @@ enum libusb_log_level {
 	LIBUSB_LOG_LEVEL_DEBUG,
 };
 
+/** \ingroup lib
+ * Allocation sites, used to tag the memory libusbx allocates internally.
+ * See libusb_set_allocator() and libusb_get_alloc_stats().
+ */
+enum libusb_alloc_site {
+	/** Allocations which do not fit any other category */
+	LIBUSB_ALLOC_SITE_OTHER = 0,
+
+	/** Library contexts */
+	LIBUSB_ALLOC_SITE_CONTEXT = 1,
+
+	/** Devices and their backend private data */
+	LIBUSB_ALLOC_SITE_DEVICE = 2,
+
+	/** Device lists, as returned by libusb_get_device_list() */
+	LIBUSB_ALLOC_SITE_DEVICE_LIST = 3,
+
+	/** Device handles */
+	LIBUSB_ALLOC_SITE_DEVICE_HANDLE = 4,
+
+	/** Transfers, as returned by libusb_alloc_transfer() */
+	LIBUSB_ALLOC_SITE_TRANSFER = 5,
+
+	/** Transfer buffers allocated by libusbx itself, e.g. for the
+	 * synchronous I/O functions */
+	LIBUSB_ALLOC_SITE_TRANSFER_BUFFER = 6,
+
+	/** Operating system request blocks (URBs) */
+	LIBUSB_ALLOC_SITE_URB = 7,
+
+	/** File descriptor bookkeeping of the event handling code */
+	LIBUSB_ALLOC_SITE_POLLFD = 8,
+
+	/** Raw and parsed descriptors */
+	LIBUSB_ALLOC_SITE_DESCRIPTOR = 9,
+
+	/** Hotplug callbacks */
+	LIBUSB_ALLOC_SITE_HOTPLUG = 10,
+
+	/** Number of allocation sites */
+	LIBUSB_ALLOC_SITE_COUNT = 11
+};
+
+/** \ingroup lib
+ * Memory allocator used by libusbx for its internal allocations, see
+ * libusb_set_allocator(). All callbacks are mandatory.
+ */
+struct libusb_allocator {
+	/** Allocate size bytes. Returns NULL on failure. */
+	void *(LIBUSB_CALL *alloc)(size_t size, enum libusb_alloc_site site,
+		void *user_data);
+
+	/** Allocate size bytes aligned to alignment, which is a power of two
+	 * and a multiple of sizeof(void *). Returns NULL on failure. */
+	void *(LIBUSB_CALL *aligned_alloc)(size_t alignment, size_t size,
+		enum libusb_alloc_site site, void *user_data);
+
+	/** Release memory returned by alloc or aligned_alloc. size is the size
+	 * of the allocation when libusbx knows it, or 0 otherwise. */
+	void (LIBUSB_CALL *free)(void *ptr, size_t size,
+		enum libusb_alloc_site site, void *user_data);
+
+	/** User data passed to the callbacks */
+	void *user_data;
+};
+
+/** \ingroup lib
+ * Allocation counters of one allocation site, as returned by
+ * libusb_get_alloc_stats().
+ */
+struct libusb_alloc_stats {
+	/** Number of successful allocations */
+	uint64_t allocs;
+
+	/** Number of releases */
+	uint64_t frees;
+
+	/** Total number of bytes allocated */
+	uint64_t bytes;
+
+	/** Number of failed allocations */
+	uint64_t failures;
+};
+
+int LIBUSB_CALL libusb_set_allocator(const struct libusb_allocator *allocator);
+int LIBUSB_CALL libusb_get_alloc_stats(enum libusb_alloc_site site,
+	struct libusb_alloc_stats *stats);
+int LIBUSB_CALL libusb_set_priority_inheritance(int enable);
+
 int LIBUSB_CALL libusb_init(libusb_context **ctx);
 void LIBUSB_CALL libusb_exit(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_debug(libusb_context *ctx, int level);
@@ -1396,6 +1546,124 @@ int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
 
+/** \ingroup asyncio
+ * State of the transfer memory budget, as returned by
+ * libusb_get_transfer_budget_stats().
+ */
+struct libusb_transfer_budget_stats {
+	/** Amount of transfer memory the operating system allows, in bytes, or
+	 * 0 if there is no limit */
+	uint64_t limit;
+
+	/** Bytes of the transfers currently submitted to the operating
+	 * system */
+	uint64_t in_flight;
+
+	/** Number of transfers which had to wait for memory to become
+	 * available */
+	uint64_t queued_transfers;
+
+	/** Total time spent waiting by those transfers, in microseconds */
+	uint64_t wait_usecs;
+
+	/** Longest time a transfer spent waiting, in microseconds */
+	uint64_t max_wait_usecs;
+
+	/** Number of transfers currently waiting */
+	int queue_depth;
+
+	/** Highest number of transfers that were waiting at the same time */
+	int max_queue_depth;
+};
+
+int LIBUSB_CALL libusb_get_transfer_budget_stats(libusb_context *ctx,
+	struct libusb_transfer_budget_stats *stats);
+
+/** \ingroup asyncio
+ * Transfer priority classes, see libusb_set_transfer_priority().
+ */
+enum libusb_transfer_priority {
+	/** Default priority */
+	LIBUSB_TRANSFER_PRIORITY_NORMAL = 0,
+
+	/** Background transfers, whose completions are dispatched after those
+	 * of other transfers and whose data in flight may be limited */
+	LIBUSB_TRANSFER_PRIORITY_LOW = 1
+};
+
+int LIBUSB_CALL libusb_set_transfer_priority(struct libusb_transfer *transfer,
+	int priority);
+int LIBUSB_CALL libusb_set_low_priority_limit(libusb_context *ctx,
+	unsigned int max_bytes);
+
+/** \ingroup asyncio
+ * Summary of the packet results of a completed isochronous transfer, as
+ * returned by libusb_get_iso_packet_summary().
+ */
+struct libusb_iso_packet_summary {
+	/** Sum of the actual_length of all packets */
+	unsigned int total_bytes;
+
+	/** Number of packets whose status is not LIBUSB_TRANSFER_COMPLETED */
+	int error_count;
+
+	/** Index of the first such packet, or -1 if there is none */
+	int first_error_index;
+
+	/** Status of the first such packet, or LIBUSB_TRANSFER_COMPLETED */
+	enum libusb_transfer_status first_error_status;
+};
+
+int LIBUSB_CALL libusb_get_iso_packet_summary(struct libusb_transfer *transfer,
+	struct libusb_iso_packet_summary *summary);
+int LIBUSB_CALL libusb_get_iso_packet_result(struct libusb_transfer *transfer,
+	unsigned int packet, unsigned int *actual_length,
+	enum libusb_transfer_status *status);
+
+/** \ingroup asyncio
+ * A packet of an isochronous transfer that carried data, as returned by
+ * libusb_get_iso_packet_views().
+ */
+struct libusb_iso_packet_view {
+	/** Index of the packet in the transfer */
+	int packet;
+
+	/** Status of the packet */
+	enum libusb_transfer_status status;
+
+	/** Amount of data in the packet */
+	unsigned int length;
+
+	/** Start of the packet data inside the transfer buffer */
+	unsigned char *buffer;
+};
+
+unsigned char * LIBUSB_CALL libusb_get_iso_packet_buffer_indexed(
+	struct libusb_transfer *transfer, unsigned int packet);
+int LIBUSB_CALL libusb_get_iso_packet_views(struct libusb_transfer *transfer,
+	struct libusb_iso_packet_view *views, int max_views);
+int LIBUSB_CALL libusb_gather_iso_packets(struct libusb_transfer *transfer,
+	unsigned char *data, int length);
+
+/** \ingroup asyncio
+ * Flags for libusb_alloc_buffer_pool().
+ */
+enum libusb_buffer_pool_flags {
+	/** Back the pool with hugepages, to reduce TLB misses */
+	LIBUSB_BUFFER_POOL_HUGEPAGES = 1 << 0,
+
+	/** Lock the pool in memory, so that it is never paged out */
+	LIBUSB_BUFFER_POOL_LOCKED = 1 << 1
+};
+
+int LIBUSB_CALL libusb_alloc_buffer_pool(libusb_device_handle *dev_handle,
+	int num_buffers, int buffer_size, int numa_node, int flags);
+void LIBUSB_CALL libusb_free_buffer_pool(libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_get_buffer_pool_flags(libusb_device_handle *dev_handle);
+unsigned char * LIBUSB_CALL libusb_get_pool_buffer(
+	libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_put_pool_buffer(unsigned char *buffer);
+
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
  * for a control transfer.
@@ -1553,11 +1821,22 @@ static inline void libusb_set_iso_packet_lengths(
  * and hence the above method is sub-optimal. You may wish to use
  * libusb_get_iso_packet_buffer_simple() instead.
  *
+ * This function sums the lengths of all the packets before the requested
+ * one. To walk all the packets of a transfer, use
+ * libusb_get_iso_packet_buffer_indexed(), libusb_get_iso_packet_views() or
+ * libusb_gather_iso_packets().
+ *
+ * Transfers with the \ref libusb_transfer_flags
+ * "LIBUSB_TRANSFER_UNIFORM_ISO" flag only have their first packet
+ * descriptor, so the position of their packets is computed from its length
+ * alone, as libusb_get_iso_packet_buffer_simple() does.
+ *
  * \param transfer a transfer
  * \param packet the packet to return the address of
  * \returns the base address of the packet buffer inside the transfer buffer,
  * or NULL if the packet does not exist.
  * \see libusb_get_iso_packet_buffer_simple()
+ * \see libusb_get_iso_packet_buffer_indexed()
  */
 static inline unsigned char *libusb_get_iso_packet_buffer(
 	struct libusb_transfer *transfer, unsigned int packet)
@@ -1576,6 +1855,11 @@ static inline unsigned char *libusb_get_iso_packet_buffer(
 	if (_packet >= transfer->num_iso_packets)
 		return NULL;
 
+	/* uniform transfers have no descriptors past the first one */
+	if (transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO)
+		return transfer->buffer
+			+ (size_t) transfer->iso_packet_desc[0].length * _packet;
+
 	for (i = 0; i < _packet; i++)
 		offset += transfer->iso_packet_desc[i].length;
 
@@ -1625,6 +1909,81 @@ int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout);
 
+/** \ingroup syncio
+ * Flags for \ref libusb_control_request::flags "libusb_control_request".
+ */
+enum libusb_control_request_flags {
+	/** Do not submit this request before all previous requests of the
+	 * batch have completed */
+	LIBUSB_CONTROL_REQUEST_BARRIER = 1<<0
+};
+
+/** \ingroup syncio
+ * Flags for libusb_control_transfer_batch().
+ */
+enum libusb_control_batch_flags {
+	/** Stop submitting requests once one has failed */
+	LIBUSB_CONTROL_BATCH_STOP_ON_ERROR = 1<<0
+};
+
+struct libusb_control_request;
+
+/** \ingroup syncio
+ * Completion callback of a control request, see
+ * libusb_control_transfer_batch().
+ */
+typedef void (LIBUSB_CALL *libusb_control_request_cb_fn)(
+	struct libusb_control_request *request);
+
+/** \ingroup syncio
+ * A control request, as performed by libusb_control_transfer_batch().
+ * The setup fields have the same meaning as the parameters of
+ * libusb_control_transfer().
+ */
+struct libusb_control_request {
+	/** Request type field of the setup packet */
+	uint8_t bmRequestType;
+
+	/** Request field of the setup packet */
+	uint8_t bRequest;
+
+	/** Value field of the setup packet */
+	uint16_t wValue;
+
+	/** Index field of the setup packet */
+	uint16_t wIndex;
+
+	/** Length field of the setup packet, i.e. the size of data */
+	uint16_t wLength;
+
+	/** Data to send, or buffer for the data to receive */
+	unsigned char *data;
+
+	/** Timeout in milliseconds, or 0 for no timeout */
+	unsigned int timeout;
+
+	/** A bitwise OR of \ref libusb_control_request_flags values */
+	int flags;
+
+	/** Callback invoked when the request completes, or NULL */
+	libusb_control_request_cb_fn callback;
+
+	/** User data for the callback */
+	void *user_data;
+
+	/** Result of the request: 0 on success, or a LIBUSB_ERROR code, as
+	 * for libusb_control_transfer(). Set by the library. */
+	int status;
+
+	/** Number of bytes transferred. Set by the library. */
+	int actual_length;
+};
+
+int LIBUSB_CALL libusb_control_transfer_batch(
+	libusb_device_handle *dev_handle,
+	struct libusb_control_request *requests, int num_requests,
+	int max_in_flight, int flags);
+
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
@@ -1633,6 +1992,99 @@ int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
 
+/** \ingroup syncio
+ * Adjustments made by the read-ahead autotuner, see
+ * libusb_set_bulk_read_ahead_autotune().
+ */
+enum libusb_read_ahead_tune_step {
+	/** No adjustment */
+	LIBUSB_READ_AHEAD_TUNE_NONE = 0,
+
+	/** The number of transfers was increased */
+	LIBUSB_READ_AHEAD_TUNE_GROW_TRANSFERS = 1,
+
+	/** The transfer size was increased */
+	LIBUSB_READ_AHEAD_TUNE_GROW_SIZE = 2,
+
+	/** The number of transfers was decreased */
+	LIBUSB_READ_AHEAD_TUNE_SHRINK_TRANSFERS = 3,
+
+	/** The transfer size was decreased */
+	LIBUSB_READ_AHEAD_TUNE_SHRINK_SIZE = 4,
+
+	/** The previous increase did not improve throughput and was undone */
+	LIBUSB_READ_AHEAD_TUNE_REVERT = 5
+};
+
+/** \ingroup syncio
+ * Statistics of a bulk IN read-ahead, as returned by
+ * libusb_get_bulk_read_ahead_stats(). See libusb_set_bulk_read_ahead().
+ */
+struct libusb_read_ahead_stats {
+	/** Number of reads served by the read-ahead */
+	uint64_t reads;
+
+	/** Number of reads served entirely from buffered data, without
+	 * waiting for the device */
+	uint64_t buffered_reads;
+
+	/** Number of bytes returned by reads */
+	uint64_t bytes;
+
+	/** Number of read-ahead transfers that completed */
+	uint64_t transfers;
+
+	/** Number of read-ahead transfers that ended with a short packet */
+	uint64_t short_transfers;
+
+	/** Current number of transfers kept posted */
+	int num_transfers;
+
+	/** Current size of each transfer, in bytes */
+	int transfer_size;
+
+	/** Throughput measured by the autotuner over its last measurement
+	 * window, in bytes per second. 0 without autotuning. */
+	uint64_t throughput;
+
+	/** Number of adjustments made by the autotuner */
+	uint64_t tune_steps;
+
+	/** Average time between submission and completion of a transfer over
+	 * the last measurement window, in microseconds. 0 without
+	 * autotuning. */
+	unsigned int latency_usecs;
+
+	/** Last adjustment made by the autotuner, a
+	 * \ref libusb_read_ahead_tune_step value */
+	int last_tune_step;
+};
+
+int LIBUSB_CALL libusb_set_bulk_read_ahead(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int num_transfers, int transfer_size);
+int LIBUSB_CALL libusb_set_bulk_read_ahead_autotune(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	int min_transfers, int max_transfers, int min_size, int max_size);
+int LIBUSB_CALL libusb_get_bulk_read_ahead_stats(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	struct libusb_read_ahead_stats *stats);
+
+/** \ingroup syncio
+ * Flags for libusb_set_bulk_write_combining().
+ */
+enum libusb_write_combining_flags {
+	/** Never merge a write that ends with a short packet, or a zero-length
+	 * write, with the data that follows it. Use this for devices which rely
+	 * on short packets to delimit messages. */
+	LIBUSB_WRITE_COMBINING_KEEP_BOUNDARIES = 1<<0
+};
+
+int LIBUSB_CALL libusb_set_bulk_write_combining(
+	libusb_device_handle *dev_handle, unsigned char endpoint,
+	int buffer_size, unsigned int flush_usecs, int flags);
+int LIBUSB_CALL libusb_flush_bulk_writes(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned int timeout);
+
 /** \ingroup desc
  * Retrieve a descriptor from the default control pipe.
  * This is a convenience function which formulates the appropriate control
@@ -1745,6 +2197,177 @@ void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
 
+/** \ingroup poll
+ * Busy-poll counters, as returned by libusb_get_busy_poll_stats(). These
+ * let an application weigh the CPU time spent spinning against the wakeups
+ * it saved. See libusb_set_busy_poll().
+ */
+struct libusb_busy_poll_stats {
+	/** Number of times event handling entered busy-poll mode */
+	uint64_t polls;
+
+	/** Number of non-blocking reap attempts made while spinning */
+	uint64_t spins;
+
+	/** Number of busy-poll periods that found completed transfers */
+	uint64_t hits;
+
+	/** Number of busy-poll periods that expired without finding anything
+	 * and fell back to a blocking poll() */
+	uint64_t fallbacks;
+
+	/** Total time spent spinning, in microseconds */
+	uint64_t spin_usecs;
+};
+
+int LIBUSB_CALL libusb_set_busy_poll(libusb_context *ctx, unsigned int usecs);
+int LIBUSB_CALL libusb_set_reap_budget(libusb_context *ctx,
+	unsigned int budget);
+int LIBUSB_CALL libusb_set_reap_weight(libusb_device_handle *dev_handle,
+	unsigned int weight);
+int LIBUSB_CALL libusb_set_callback_workers(libusb_context *ctx,
+	int num_workers);
+int LIBUSB_CALL libusb_get_busy_poll_stats(libusb_context *ctx,
+	struct libusb_busy_poll_stats *stats);
+
+/** \ingroup poll
+ * Flags for libusb_start_event_thread().
+ */
+enum libusb_event_thread_flags {
+	/** Lock all current and future pages of the process into memory with
+	 * mlockall() and pre-fault the event thread's stack, so that event
+	 * handling never waits for a page fault */
+	LIBUSB_EVENT_THREAD_LOCK_MEMORY = 1 << 0,
+};
+
+/** \ingroup poll
+ * Event handler wakeup latency, as returned by
+ * libusb_get_event_latency_stats(). A sample is the time between a call to
+ * libusb_interrupt_event_handler() and the event handler noticing it.
+ */
+struct libusb_event_latency_stats {
+	/** Number of samples taken */
+	uint64_t wakeups;
+
+	/** Smallest latency seen, in nanoseconds */
+	uint64_t min_latency_nsecs;
+
+	/** Largest latency seen, in nanoseconds */
+	uint64_t max_latency_nsecs;
+
+	/** Sum of all latencies, in nanoseconds */
+	uint64_t total_latency_nsecs;
+};
+
+int LIBUSB_CALL libusb_start_event_thread(libusb_context *ctx, int priority,
+	int cpu, int flags);
+void LIBUSB_CALL libusb_stop_event_thread(libusb_context *ctx);
+void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context *ctx);
+int LIBUSB_CALL libusb_get_event_latency_stats(libusb_context *ctx,
+	struct libusb_event_latency_stats *stats);
+
+/** \ingroup capture
+ * Flags for \ref libusb_capture_config.
+ */
+enum libusb_capture_flags {
+	/** Write with O_DIRECT (F_NOCACHE on Darwin), bypassing the page cache.
+	 * The file position must be a multiple of 4096 bytes. */
+	LIBUSB_CAPTURE_DIRECT_IO = 1 << 0,
+
+	/** When every write buffer is full, drop the incoming data and keep the
+	 * transfers going, instead of holding the completed transfers back
+	 * until the writer catches up */
+	LIBUSB_CAPTURE_DROP_ON_OVERRUN = 1 << 1,
+};
+
+/** \ingroup capture
+ * Capture parameters for libusb_capture_start(). Fields left to 0 get a
+ * default value.
+ */
+struct libusb_capture_config {
+	/** Number of transfers kept in flight. Default 8. */
+	int num_transfers;
+
+	/** Size of each bulk or interrupt transfer, in bytes, which must be a
+	 * multiple of the maximum packet size of the endpoint. Default 65536,
+	 * rounded down to such a multiple. Isochronous transfers are
+	 * num_iso_packets times the maximum packet size of the endpoint. */
+	int transfer_size;
+
+	/** Number of packets per isochronous transfer. Default 32. */
+	int num_iso_packets;
+
+	/** Timeout of each bulk or interrupt transfer, in milliseconds, so that
+	 * a slow stream still reaches the file. Default 0, no timeout. */
+	unsigned int timeout;
+
+	/** Size of each write, in bytes, rounded up to a multiple of 4096.
+	 * Default 4 MiB. */
+	size_t write_size;
+
+	/** Number of write buffers of write_size bytes, at least 2. Default 4. */
+	int num_buffers;
+
+	/** Bitwise or of \ref libusb_capture_flags */
+	int flags;
+};
+
+/** \ingroup capture
+ * Capture statistics, as returned by libusb_capture_get_stats() and
+ * libusb_capture_stop().
+ */
+struct libusb_capture_stats {
+	/** 0 while the capture runs, otherwise the \ref libusb_error that
+	 * stopped it */
+	int status;
+
+	/** Number of full write buffers waiting for the writer */
+	int buffers_queued;
+
+	/** Largest value buffers_queued reached */
+	int max_buffers_queued;
+
+	/** Number of completed transfers */
+	uint64_t transfers;
+
+	/** Number of transfers that failed and were resubmitted */
+	uint64_t transfer_errors;
+
+	/** Number of isochronous packets that failed */
+	uint64_t iso_packets_lost;
+
+	/** Bytes received from the device */
+	uint64_t bytes_captured;
+
+	/** Bytes written to the file */
+	uint64_t bytes_written;
+
+	/** Bytes received but never written, because no write buffer was free
+	 * with LIBUSB_CAPTURE_DROP_ON_OVERRUN, or because writing failed */
+	uint64_t bytes_dropped;
+
+	/** Number of times every write buffer was full. Transfers were held
+	 * back, or data dropped with LIBUSB_CAPTURE_DROP_ON_OVERRUN, until the
+	 * writer caught up. */
+	uint64_t overruns;
+
+	/** Number of writes to the file */
+	uint64_t writes;
+
+	/** Longest write, in nanoseconds */
+	uint64_t max_write_nsecs;
+};
+
+struct libusb_capture;
+
+int LIBUSB_CALL libusb_capture_start(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int fd, const struct libusb_capture_config *config,
+	struct libusb_capture **capture);
+int LIBUSB_CALL libusb_capture_get_stats(struct libusb_capture *capture,
+	struct libusb_capture_stats *stats);
+int LIBUSB_CALL libusb_capture_stop(struct libusb_capture *capture,
+	struct libusb_capture_stats *stats);
+
 /** \ingroup hotplug
  * Callback handle.
  *
@@ -0,0 +1,906 @@
+/*
+ * Public libusbx C++20 header file
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_HPP
+#define LIBUSB_HPP
+
+/*
+ * Header-only bindings over the libusbx C API:
+ *
+ * - move-only RAII owners for contexts, devices, device handles, claimed
+ *   interfaces and transfers;
+ * - co_await-able transfer submission: co_await t.submit() submits the
+ *   transfer and resumes the coroutine from its completion callback. The
+ *   awaiter lives in the coroutine frame, so no memory is allocated per
+ *   I/O;
+ * - a lazy task<T> coroutine type, whose frames come from a
+ *   std::pmr::memory_resource (pass std::allocator_arg and a
+ *   std::pmr::polymorphic_allocator<> as the first coroutine arguments to
+ *   pick one, the default resource is used otherwise);
+ * - an executor which runs spawned tasks by driving
+ *   libusb_handle_events_timeout_completed(). run() may be called from
+ *   several threads; coroutines resume on the thread that handles events,
+ *   or on the callback workers when those are enabled;
+ * - set_memory_resource(), which routes the internal allocations of
+ *   libusbx through a std::pmr::memory_resource.
+ *
+ * Buffers are passed as std::span<unsigned char>, so std::pmr::vector
+ * (see libusb::buffer) and any other contiguous storage can be used.
+ */
+
+#if !defined(__cplusplus) || ((__cplusplus < 202002L) && (!defined(_MSVC_LANG) || (_MSVC_LANG < 202002L)))
+#error "libusb.hpp requires C++20"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "libusb.h"
+
+namespace libusb {
+
+/* Errors ********************************************************************/
+
+class error_category_impl final : public std::error_category {
+public:
+	const char *name() const noexcept override { return "libusb"; }
+	std::string message(int ev) const override { return libusb_error_name(ev); }
+};
+
+inline const std::error_category &error_category() noexcept
+{
+	static const error_category_impl category;
+	return category;
+}
+
+inline std::error_code make_error_code(int r) noexcept
+{
+	return std::error_code(r, error_category());
+}
+
+/* Thrown by the functions which don't return a status */
+class error : public std::system_error {
+public:
+	explicit error(int r) : std::system_error(make_error_code(r)) {}
+};
+
+namespace detail {
+
+inline int check(int r)
+{
+	if (r < 0)
+		throw error(r);
+	return r;
+}
+
+inline timeval to_timeval(std::chrono::microseconds timeout) noexcept
+{
+	timeval tv;
+	tv.tv_sec = static_cast<long>(timeout.count() / 1000000);
+	tv.tv_usec = static_cast<long>(timeout.count() % 1000000);
+	return tv;
+}
+
+} // namespace detail
+
+/* Memory ********************************************************************/
+
+/* Storage for transfer buffers */
+using buffer = std::pmr::vector<unsigned char>;
+
+namespace detail {
+
+/* libusbx doesn't always know the size of what it frees, and
+ * std::pmr::memory_resource needs it, so it is kept in front of the block */
+struct resource_header {
+	std::size_t offset;
+	std::size_t size;
+	std::size_t alignment;
+};
+
+inline void *resource_allocate(std::pmr::memory_resource *mr, std::size_t alignment,
+	std::size_t size) noexcept
+{
+	std::size_t offset = (sizeof(resource_header) + alignment - 1) & ~(alignment - 1);
+	resource_header header = { offset, offset + size, alignment };
+	std::byte *base;
+
+	try {
+		base = static_cast<std::byte *>(mr->allocate(header.size, alignment));
+	} catch (...) {
+		return nullptr;
+	}
+	std::memcpy(base + offset - sizeof(header), &header, sizeof(header));
+	return base + offset;
+}
+
+inline void resource_free(std::pmr::memory_resource *mr, void *ptr) noexcept
+{
+	resource_header header;
+
+	std::memcpy(&header, static_cast<std::byte *>(ptr) - sizeof(header), sizeof(header));
+	mr->deallocate(static_cast<std::byte *>(ptr) - header.offset, header.size, header.alignment);
+}
+
+inline void * LIBUSB_CALL resource_alloc_cb(size_t size, enum libusb_alloc_site,
+	void *user_data)
+{
+	return resource_allocate(static_cast<std::pmr::memory_resource *>(user_data),
+		alignof(std::max_align_t), size);
+}
+
+inline void * LIBUSB_CALL resource_aligned_alloc_cb(size_t alignment, size_t size,
+	enum libusb_alloc_site, void *user_data)
+{
+	return resource_allocate(static_cast<std::pmr::memory_resource *>(user_data),
+		alignment, size);
+}
+
+inline void LIBUSB_CALL resource_free_cb(void *ptr, size_t, enum libusb_alloc_site,
+	void *user_data)
+{
+	if (ptr != nullptr)
+		resource_free(static_cast<std::pmr::memory_resource *>(user_data), ptr);
+}
+
+} // namespace detail
+
+/* Route the internal allocations of libusbx through a memory resource, or
+ * back to the system allocator if mr is nullptr. As for
+ * libusb_set_allocator(), this must happen before any context exists, and
+ * the resource must outlive every libusbx object. */
+inline int set_memory_resource(std::pmr::memory_resource *mr) noexcept
+{
+	libusb_allocator allocator;
+
+	if (mr == nullptr)
+		return libusb_set_allocator(nullptr);
+	allocator.alloc = detail::resource_alloc_cb;
+	allocator.aligned_alloc = detail::resource_aligned_alloc_cb;
+	allocator.free = detail::resource_free_cb;
+	allocator.user_data = mr;
+	return libusb_set_allocator(&allocator);
+}
+
+/* RAII types ****************************************************************/
+
+class device;
+class device_handle;
+
+class context {
+public:
+	context() { detail::check(libusb_init(&ctx_)); }
+	/* Take ownership of an existing context */
+	explicit context(libusb_context *ctx) noexcept : ctx_(ctx) {}
+	~context() { reset(); }
+
+	context(context &&other) noexcept : ctx_(std::exchange(other.ctx_, nullptr)) {}
+	context &operator=(context &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			ctx_ = std::exchange(other.ctx_, nullptr);
+		}
+		return *this;
+	}
+	context(const context &) = delete;
+	context &operator=(const context &) = delete;
+
+	libusb_context *get() const noexcept { return ctx_; }
+	libusb_context *release() noexcept { return std::exchange(ctx_, nullptr); }
+	void reset() noexcept
+	{
+		if (ctx_ != nullptr)
+			libusb_exit(std::exchange(ctx_, nullptr));
+	}
+
+	void set_debug(int level) noexcept { libusb_set_debug(ctx_, level); }
+
+	std::vector<device> devices() const;
+	device_handle open(uint16_t vendor_id, uint16_t product_id) const;
+
+	/* Handle events once, see libusb_handle_events_timeout_completed() */
+	int handle_events(std::chrono::microseconds timeout, int *completed = nullptr) noexcept
+	{
+		timeval tv = detail::to_timeval(timeout);
+		return libusb_handle_events_timeout_completed(ctx_, &tv, completed);
+	}
+	void interrupt_event_handler() noexcept { libusb_interrupt_event_handler(ctx_); }
+
+private:
+	libusb_context *ctx_ = nullptr;
+};
+
+class device {
+public:
+	device() noexcept = default;
+	/* Take a reference on dev, or adopt the caller's if add_ref is false */
+	explicit device(libusb_device *dev, bool add_ref = true) noexcept : dev_(dev)
+	{
+		if ((dev_ != nullptr) && add_ref)
+			libusb_ref_device(dev_);
+	}
+	~device() { reset(); }
+
+	device(device &&other) noexcept : dev_(std::exchange(other.dev_, nullptr)) {}
+	device &operator=(device &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			dev_ = std::exchange(other.dev_, nullptr);
+		}
+		return *this;
+	}
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	libusb_device *get() const noexcept { return dev_; }
+	explicit operator bool() const noexcept { return dev_ != nullptr; }
+	void reset() noexcept
+	{
+		if (dev_ != nullptr)
+			libusb_unref_device(std::exchange(dev_, nullptr));
+	}
+
+	uint8_t bus_number() const noexcept { return libusb_get_bus_number(dev_); }
+	uint8_t port_number() const noexcept { return libusb_get_port_number(dev_); }
+	uint8_t address() const noexcept { return libusb_get_device_address(dev_); }
+	int speed() const noexcept { return libusb_get_device_speed(dev_); }
+
+	libusb_device_descriptor descriptor() const
+	{
+		libusb_device_descriptor desc;
+		detail::check(libusb_get_device_descriptor(dev_, &desc));
+		return desc;
+	}
+
+	device_handle open() const;
+
+private:
+	libusb_device *dev_ = nullptr;
+};
+
+class device_handle {
+public:
+	device_handle() noexcept = default;
+	/* Take ownership of an open handle */
+	explicit device_handle(libusb_device_handle *handle) noexcept : handle_(handle) {}
+	~device_handle() { reset(); }
+
+	device_handle(device_handle &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	device_handle &operator=(device_handle &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+	device_handle(const device_handle &) = delete;
+	device_handle &operator=(const device_handle &) = delete;
+
+	libusb_device_handle *get() const noexcept { return handle_; }
+	explicit operator bool() const noexcept { return handle_ != nullptr; }
+	void reset() noexcept
+	{
+		if (handle_ != nullptr)
+			libusb_close(std::exchange(handle_, nullptr));
+	}
+
+	device get_device() const noexcept { return device(libusb_get_device(handle_)); }
+
+	int kernel_driver_active(int interface_number) noexcept
+	{
+		return libusb_kernel_driver_active(handle_, interface_number);
+	}
+	void detach_kernel_driver(int interface_number)
+	{
+		detail::check(libusb_detach_kernel_driver(handle_, interface_number));
+	}
+	void set_configuration(int configuration)
+	{
+		detail::check(libusb_set_configuration(handle_, configuration));
+	}
+	void clear_halt(unsigned char endpoint)
+	{
+		detail::check(libusb_clear_halt(handle_, endpoint));
+	}
+
+private:
+	libusb_device_handle *handle_ = nullptr;
+};
+
+/* An interface claimed for as long as the object lives */
+class claimed_interface {
+public:
+	claimed_interface() noexcept = default;
+	claimed_interface(device_handle &handle, int interface_number)
+		: handle_(handle.get()), interface_number_(interface_number)
+	{
+		detail::check(libusb_claim_interface(handle_, interface_number_));
+	}
+	~claimed_interface() { reset(); }
+
+	claimed_interface(claimed_interface &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr)), interface_number_(other.interface_number_) {}
+	claimed_interface &operator=(claimed_interface &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			handle_ = std::exchange(other.handle_, nullptr);
+			interface_number_ = other.interface_number_;
+		}
+		return *this;
+	}
+	claimed_interface(const claimed_interface &) = delete;
+	claimed_interface &operator=(const claimed_interface &) = delete;
+
+	int interface_number() const noexcept { return interface_number_; }
+	void reset() noexcept
+	{
+		if (handle_ != nullptr)
+			libusb_release_interface(std::exchange(handle_, nullptr), interface_number_);
+	}
+
+private:
+	libusb_device_handle *handle_ = nullptr;
+	int interface_number_ = -1;
+};
+
+inline std::vector<device> context::devices() const
+{
+	libusb_device **list;
+	ssize_t count = detail::check(static_cast<int>(libusb_get_device_list(ctx_, &list)));
+	std::vector<device> devices;
+
+	try {
+		devices.reserve(static_cast<std::size_t>(count));
+		for (ssize_t i = 0; i < count; i++)
+			devices.emplace_back(list[i]);
+	} catch (...) {
+		libusb_free_device_list(list, 1);
+		throw;
+	}
+	libusb_free_device_list(list, 1);
+	return devices;
+}
+
+inline device_handle context::open(uint16_t vendor_id, uint16_t product_id) const
+{
+	libusb_device_handle *handle = libusb_open_device_with_vid_pid(ctx_, vendor_id, product_id);
+
+	if (handle == nullptr)
+		throw error(LIBUSB_ERROR_NOT_FOUND);
+	return device_handle(handle);
+}
+
+inline device_handle device::open() const
+{
+	libusb_device_handle *handle;
+
+	detail::check(libusb_open(dev_, &handle));
+	return device_handle(handle);
+}
+
+/* Transfers *****************************************************************/
+
+/* Outcome of co_await transfer::submit() */
+struct transfer_result {
+	int error = 0;		/* libusbx error if the transfer couldn't be submitted */
+	enum libusb_transfer_status status = LIBUSB_TRANSFER_ERROR;
+	int actual_length = 0;
+
+	explicit operator bool() const noexcept
+	{
+		return (error == 0) && (status == LIBUSB_TRANSFER_COMPLETED);
+	}
+
+	/* The result as a libusbx error code, as the synchronous API reports it */
+	std::error_code error_code() const noexcept
+	{
+		if (error != 0)
+			return make_error_code(error);
+		switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return std::error_code();
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return make_error_code(LIBUSB_ERROR_TIMEOUT);
+		case LIBUSB_TRANSFER_STALL:
+			return make_error_code(LIBUSB_ERROR_PIPE);
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return make_error_code(LIBUSB_ERROR_NO_DEVICE);
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return make_error_code(LIBUSB_ERROR_OVERFLOW);
+		case LIBUSB_TRANSFER_CANCELLED:
+			return make_error_code(LIBUSB_ERROR_INTERRUPTED);
+		default:
+			return make_error_code(LIBUSB_ERROR_IO);
+		}
+	}
+};
+
+/* Submits a transfer when awaited, and resumes the awaiting coroutine from
+ * the completion callback. The transfer callback and user_data are taken
+ * over for the duration of the I/O. A coroutine can only be resumed once
+ * per suspension, so transfers with LIBUSB_TRANSFER_AUTO_RESUBMIT, whose
+ * callback runs for every completion, are refused with
+ * LIBUSB_ERROR_INVALID_PARAM. */
+class transfer_awaiter {
+public:
+	explicit transfer_awaiter(libusb_transfer *transfer) noexcept : transfer_(transfer) {}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		int r;
+
+		if (transfer_->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT) {
+			error_ = LIBUSB_ERROR_INVALID_PARAM;
+			return false;
+		}
+		handle_ = handle;
+		transfer_->callback = complete;
+		transfer_->user_data = this;
+		r = libusb_submit_transfer(transfer_);
+		if (r == 0)
+			/* the coroutine may already be running again: hands off */
+			return true;
+		error_ = r;
+		return false;
+	}
+	transfer_result await_resume() const noexcept
+	{
+		transfer_result result;
+
+		result.error = error_;
+		if (error_ == 0) {
+			result.status = transfer_->status;
+			result.actual_length = transfer_->actual_length;
+		}
+		return result;
+	}
+
+private:
+	static void LIBUSB_CALL complete(libusb_transfer *transfer)
+	{
+		static_cast<transfer_awaiter *>(transfer->user_data)->handle_.resume();
+	}
+
+	libusb_transfer *transfer_;
+	std::coroutine_handle<> handle_;
+	int error_ = 0;
+};
+
+class transfer {
+public:
+	explicit transfer(int iso_packets = 0) : transfer_(libusb_alloc_transfer(iso_packets))
+	{
+		if (transfer_ == nullptr)
+			throw std::bad_alloc();
+	}
+	~transfer() { reset(); }
+
+	transfer(transfer &&other) noexcept : transfer_(std::exchange(other.transfer_, nullptr)) {}
+	transfer &operator=(transfer &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			transfer_ = std::exchange(other.transfer_, nullptr);
+		}
+		return *this;
+	}
+	transfer(const transfer &) = delete;
+	transfer &operator=(const transfer &) = delete;
+
+	libusb_transfer *get() const noexcept { return transfer_; }
+	libusb_transfer *operator->() const noexcept { return transfer_; }
+
+	/* The transfer must not be in flight. LIBUSB_TRANSFER_FREE_TRANSFER
+	 * must not be set, as the object owns the transfer. */
+	void reset() noexcept
+	{
+		if (transfer_ != nullptr)
+			libusb_free_transfer(std::exchange(transfer_, nullptr));
+	}
+
+	transfer &bulk(device_handle &handle, unsigned char endpoint, std::span<unsigned char> data,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) noexcept
+	{
+		libusb_fill_bulk_transfer(transfer_, handle.get(), endpoint, data.data(),
+			static_cast<int>(data.size()), nullptr, nullptr, static_cast<unsigned int>(timeout.count()));
+		return *this;
+	}
+
+	transfer &interrupt(device_handle &handle, unsigned char endpoint, std::span<unsigned char> data,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) noexcept
+	{
+		libusb_fill_interrupt_transfer(transfer_, handle.get(), endpoint, data.data(),
+			static_cast<int>(data.size()), nullptr, nullptr, static_cast<unsigned int>(timeout.count()));
+		return *this;
+	}
+
+	/* setup_and_data holds the setup packet followed by room for wLength
+	 * bytes, see libusb_fill_control_setup() */
+	transfer &control(device_handle &handle, std::span<unsigned char> setup_and_data,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) noexcept
+	{
+		libusb_fill_control_transfer(transfer_, handle.get(), setup_and_data.data(),
+			nullptr, nullptr, static_cast<unsigned int>(timeout.count()));
+		return *this;
+	}
+
+	transfer &control(device_handle &handle, std::span<unsigned char> setup_and_data,
+		uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) noexcept
+	{
+		libusb_fill_control_setup(setup_and_data.data(), request_type, request, value, index,
+			static_cast<uint16_t>(setup_and_data.size() - LIBUSB_CONTROL_SETUP_SIZE));
+		return control(handle, setup_and_data, timeout);
+	}
+
+	transfer &iso(device_handle &handle, unsigned char endpoint, std::span<unsigned char> data,
+		int num_packets, unsigned int packet_length,
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) noexcept
+	{
+		libusb_fill_iso_transfer(transfer_, handle.get(), endpoint, data.data(),
+			static_cast<int>(data.size()), num_packets, nullptr, nullptr,
+			static_cast<unsigned int>(timeout.count()));
+		libusb_set_iso_packet_lengths(transfer_, packet_length);
+		return *this;
+	}
+
+	enum libusb_transfer_status status() const noexcept { return transfer_->status; }
+	int actual_length() const noexcept { return transfer_->actual_length; }
+	std::span<unsigned char> buffer() const noexcept
+	{
+		return std::span<unsigned char>(transfer_->buffer, static_cast<std::size_t>(transfer_->length));
+	}
+	/* What was transferred, past the setup packet for control transfers */
+	std::span<unsigned char> data() const noexcept
+	{
+		std::size_t offset = (transfer_->type == LIBUSB_TRANSFER_TYPE_CONTROL) ? LIBUSB_CONTROL_SETUP_SIZE : 0;
+		return std::span<unsigned char>(transfer_->buffer + offset, static_cast<std::size_t>(transfer_->actual_length));
+	}
+	std::span<libusb_iso_packet_descriptor> iso_packets() const noexcept
+	{
+		return std::span<libusb_iso_packet_descriptor>(transfer_->iso_packet_desc,
+			static_cast<std::size_t>(transfer_->num_iso_packets));
+	}
+
+	/* co_await t.submit() yields a transfer_result */
+	transfer_awaiter submit() noexcept { return transfer_awaiter(transfer_); }
+	int cancel() noexcept { return libusb_cancel_transfer(transfer_); }
+
+private:
+	libusb_transfer *transfer_ = nullptr;
+};
+
+/* Coroutines ****************************************************************/
+
+namespace detail {
+
+/* Stands for a coroutine parameter that frame allocation doesn't use */
+struct ignored {
+	constexpr ignored() noexcept {}
+	template <typename U>
+	constexpr ignored(U &&) noexcept {}
+};
+
+/* Coroutine frames are allocated from a memory resource, which is kept in
+ * front of the frame along with the size so that it can be released.
+ *
+ * The frames are always released by the usual operator delete, and g++
+ * reports -Wmismatched-new-delete when that is paired with an operator new
+ * template, so the allocator overloads take the remaining parameters as
+ * defaulted non-template ones. Coroutines taking an allocator can thus have
+ * up to max_params more parameters. */
+struct frame_allocation {
+	struct frame_header {
+		std::pmr::memory_resource *mr;
+		std::size_t size;
+	};
+	static constexpr std::size_t header =
+		(sizeof(frame_header) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+	static void *allocate(std::size_t size, std::pmr::memory_resource *mr)
+	{
+		frame_header fh = { mr, size + header };
+		std::byte *base = static_cast<std::byte *>(mr->allocate(fh.size, alignof(std::max_align_t)));
+
+		std::memcpy(base, &fh, sizeof(fh));
+		return base + header;
+	}
+
+	static void deallocate(void *frame) noexcept
+	{
+		std::byte *base = static_cast<std::byte *>(frame) - header;
+		frame_header fh;
+
+		std::memcpy(&fh, base, sizeof(fh));
+		fh.mr->deallocate(base, fh.size, alignof(std::max_align_t));
+	}
+
+	void *operator new(std::size_t size)
+	{
+		return allocate(size, std::pmr::get_default_resource());
+	}
+	/* task<> f(std::allocator_arg_t, const std::pmr::polymorphic_allocator<> &, ...) */
+	void *operator new(std::size_t size, std::allocator_arg_t,
+		const std::pmr::polymorphic_allocator<> &allocator,
+		ignored = {}, ignored = {}, ignored = {}, ignored = {},
+		ignored = {}, ignored = {}, ignored = {}, ignored = {})
+	{
+		return allocate(size, allocator.resource());
+	}
+	/* the same, for member functions */
+	void *operator new(std::size_t size, ignored, std::allocator_arg_t,
+		const std::pmr::polymorphic_allocator<> &allocator,
+		ignored = {}, ignored = {}, ignored = {}, ignored = {},
+		ignored = {}, ignored = {}, ignored = {}, ignored = {})
+	{
+		return allocate(size, allocator.resource());
+	}
+	/* only chosen past max_params, rather than silently falling back to
+	 * the default resource */
+	static constexpr std::size_t max_params = 8;
+	template <typename... Args>
+	void *operator new(std::size_t size, std::allocator_arg_t,
+		const std::pmr::polymorphic_allocator<> &allocator,
+		ignored, ignored, ignored, ignored, ignored, ignored, ignored, ignored,
+		ignored, Args &&...)
+	{
+		static_assert(sizeof...(Args) < 0, "too many coroutine parameters after the allocator");
+		return allocate(size, allocator.resource());
+	}
+	template <typename... Args>
+	void *operator new(std::size_t size, ignored, std::allocator_arg_t,
+		const std::pmr::polymorphic_allocator<> &allocator,
+		ignored, ignored, ignored, ignored, ignored, ignored, ignored, ignored,
+		ignored, Args &&...)
+	{
+		static_assert(sizeof...(Args) < 0, "too many coroutine parameters after the allocator");
+		return allocate(size, allocator.resource());
+	}
+	void operator delete(void *frame) noexcept
+	{
+		deallocate(frame);
+	}
+};
+
+struct promise_base : frame_allocation {
+	struct final_awaiter {
+		bool await_ready() const noexcept { return false; }
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			std::coroutine_handle<> continuation = handle.promise().continuation;
+
+			return continuation ? continuation : std::noop_coroutine();
+		}
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+};
+
+} // namespace detail
+
+/* A lazily started coroutine, which runs when it is first awaited (or
+ * spawned on an executor) and resumes its awaiter when it completes */
+template <typename T = void>
+class [[nodiscard]] task;
+
+namespace detail {
+
+template <typename T, typename Promise>
+class task_base {
+public:
+	task_base(task_base &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	task_base &operator=(task_base &&other) noexcept
+	{
+		if (this != &other) {
+			if (handle_)
+				handle_.destroy();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+	task_base(const task_base &) = delete;
+	task_base &operator=(const task_base &) = delete;
+	~task_base()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+	{
+		handle_.promise().continuation = continuation;
+		return handle_;
+	}
+	T await_resume() { return handle_.promise().result(); }
+
+protected:
+	explicit task_base(std::coroutine_handle<Promise> handle) noexcept : handle_(handle) {}
+
+	std::coroutine_handle<Promise> handle_;
+};
+
+template <typename T>
+struct task_promise : promise_base {
+	task<T> get_return_object() noexcept;
+	template <typename U>
+	void return_value(U &&value) { value_.emplace(std::forward<U>(value)); }
+	T result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+		return std::move(*value_);
+	}
+
+	std::optional<T> value_;
+};
+
+template <>
+struct task_promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+	void return_void() noexcept {}
+	void result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+} // namespace detail
+
+template <typename T>
+class [[nodiscard]] task : public detail::task_base<T, detail::task_promise<T>> {
+public:
+	using promise_type = detail::task_promise<T>;
+
+private:
+	friend promise_type;
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept
+		: detail::task_base<T, promise_type>(handle) {}
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> task_promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/* Eagerly started, self-destroying coroutine used by executor::spawn() */
+struct detached {
+	struct promise_type : frame_allocation {
+		detached get_return_object() const noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+} // namespace detail
+
+/* Runs tasks to completion by handling the events of a context */
+class executor {
+public:
+	explicit executor(context &ctx) noexcept : ctx_(ctx.get()) {}
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	/* Start a task; it runs on the calling thread until it first waits for
+	 * I/O, then on whichever thread handles the completion */
+	void spawn(task<void> t)
+	{
+		work_.fetch_add(1, std::memory_order_relaxed);
+		run_task(*this, std::move(t));
+	}
+
+	/* Handle events until every spawned task has completed, or stop() is
+	 * called. The first exception that escaped a task is rethrown. */
+	void run(std::chrono::microseconds slice = std::chrono::milliseconds(100))
+	{
+		std::exception_ptr exception;
+
+		while (!stopped_.load(std::memory_order_acquire)
+			&& (work_.load(std::memory_order_acquire) != 0)) {
+			int r = poll(slice);
+			if ((r < 0) && (r != LIBUSB_ERROR_INTERRUPTED))
+				throw error(r);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			exception = std::exchange(exception_, nullptr);
+		}
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+
+	/* Handle events once, waiting at most timeout */
+	int poll(std::chrono::microseconds timeout) noexcept
+	{
+		timeval tv = detail::to_timeval(timeout);
+		return libusb_handle_events_timeout_completed(ctx_, &tv, nullptr);
+	}
+
+	void stop() noexcept
+	{
+		stopped_.store(true, std::memory_order_release);
+		libusb_interrupt_event_handler(ctx_);
+	}
+	void restart() noexcept { stopped_.store(false, std::memory_order_release); }
+
+	/* Spawned tasks that haven't completed yet */
+	std::size_t outstanding() const noexcept { return work_.load(std::memory_order_acquire); }
+
+private:
+	static detail::detached run_task(executor &ex, task<void> t)
+	{
+		try {
+			co_await std::move(t);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(ex.mutex_);
+			if (!ex.exception_)
+				ex.exception_ = std::current_exception();
+		}
+		/* wake up run() if that was the last task */
+		if (ex.work_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			libusb_interrupt_event_handler(ex.ctx_);
+	}
+
+	libusb_context *ctx_;
+	std::atomic<std::size_t> work_{0};
+	std::atomic<bool> stopped_{false};
+	std::mutex mutex_;
+	std::exception_ptr exception_;
+};
+
+} // namespace libusb
+
+#endif
@@ -55,6 +55,8 @@
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS					0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_SUPPORTS_AUTO_RESUBMIT			0x00040000
+#define USBI_CAP_SUPPORTS_UNIFORM_ISO			0x00080000
 
 /* The following is used to silence warnings for unused variables */
 #define UNUSED(var)			do { (void)(var); } while(0)
@@ -208,6 +210,9 @@ static inline void usbi_dbg(const char *format, ...)
 
 extern struct libusb_context *usbi_default_context;
 
+struct usbi_callback_worker;
+struct usbi_event_thread;
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
@@ -229,6 +234,10 @@ struct libusb_context {
 	usbi_mutex_t hotplug_cbs_lock;
 	int hotplug_pipe[2];
 
+	/* internal event pipe, written to in order to wake up the event handler
+	 * when something it should look at happened outside of it. */
+	int event_pipe[2];
+
 	/* this is a list of in-flight transfer handles, sorted by timeout
 	 * expiration. URBs to timeout the soonest are placed at the beginning of
 	 * the list, URBs that will time out later are placed after, and urbs with
@@ -236,14 +245,44 @@ struct libusb_context {
 	struct list_head flying_transfers;
 	usbi_mutex_t flying_transfers_lock;
 
+	/* armed internal timers, sorted by expiry, and the timer whose callback
+	 * is running. also protected by flying_transfers_lock, timers_cond is
+	 * signalled when a callback returns. */
+	struct list_head timers;
+	struct usbi_timer *running_timer;
+	usbi_cond_t timers_cond;
+
+	/* transfers whose completion the backend could not report from where
+	 * it noticed it, see usbi_defer_transfer_completion(). the lock ranks
+	 * below flying_transfers_lock, since transfers are cancelled on timeout
+	 * with that lock held. */
+	struct list_head deferred_completions;
+	usbi_mutex_t deferred_completions_lock;
+
+	/* set while the backend handles events, so that the completions of
+	 * low-priority transfers are deferred until it is done */
+	int completion_pass;
+
+	/* throttling of low-priority transfers, see
+	 * libusb_set_low_priority_limit(). throttled_transfers are waiting to be
+	 * submitted. the lock is taken with flying_transfers_lock held, when a
+	 * transfer is cancelled on timeout, and is held itself while throttled
+	 * transfers are passed to the backend, so it ranks below
+	 * flying_transfers_lock and above all backend locks. it is never held
+	 * together with deferred_completions_lock. */
+	usbi_mutex_t throttle_lock;
+	unsigned int low_priority_limit;
+	unsigned int low_priority_in_flight;
+	struct list_head throttled_transfers;
+
 	/* list of poll fds */
 	struct list_head pollfds;
 	usbi_mutex_t pollfds_lock;
 
 	/* a counter that is set when we want to interrupt event handling, in order
-	 * to modify the poll fd set. and a lock to protect it. */
+	 * to modify the poll fd set. only accessed with the usbi_atomic
+	 * operations. */
 	unsigned int pollfd_modify;
-	usbi_mutex_t pollfd_modify_lock;
 
 	/* user callbacks for pollfd changes */
 	libusb_pollfd_added_cb fd_added_cb;
@@ -253,13 +292,52 @@ struct libusb_context {
 	/* ensures that only one thread is handling events at any one time */
 	usbi_mutex_t events_lock;
 
-	/* used to see if there is an active thread doing event handling */
+	/* array handed to poll(), kept across event handling passes and only
+	 * reallocated when the number of fds grows. owned by the thread
+	 * holding events_lock. */
+	struct pollfd *poll_fds;
+	unsigned int poll_fds_capacity;
+
+	/* used to see if there is an active thread doing event handling. only
+	 * accessed with the usbi_atomic operations. */
 	int event_handler_active;
 
 	/* used to wait for event completion in threads other than the one that is
-	 * event handling */
+	 * event handling. event_waiters counts the threads holding or acquiring
+	 * event_waiters_lock, so that nobody is woken up when nobody waits. only
+	 * accessed with the usbi_atomic operations. */
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
+	unsigned int event_waiters;
+
+	/* number of microseconds to spin on the backend busy_poll operation
+	 * before blocking in poll(), 0 to disable. the stats are only updated
+	 * by the thread holding events_lock. */
+	unsigned int busy_poll_usecs;
+	struct libusb_busy_poll_stats busy_poll_stats;
+
+	/* maximum number of completions reaped from a handle of weight 1 in a
+	 * single event handling pass, 0 for no limit */
+	unsigned int reap_budget;
+
+	/* optional pool of threads running transfer callbacks, see
+	 * libusb_set_callback_workers(). callback_lock protects the pool and
+	 * its queues. callback_idle_cond is signalled when callbacks_pending
+	 * drops to zero. */
+	struct usbi_callback_worker *callback_workers;
+	int num_callback_workers;
+	unsigned int callbacks_pending;
+	usbi_mutex_t callback_lock;
+	usbi_cond_t callback_idle_cond;
+
+	/* optional internal event handling thread, see
+	 * libusb_start_event_thread(). event_thread_lock protects the thread
+	 * pointer, the pending interrupt timestamp (monotonic nanoseconds, 0 if
+	 * none) and the latency stats. */
+	struct usbi_event_thread *event_thread;
+	uint64_t interrupt_nsecs;
+	struct libusb_event_latency_stats event_latency_stats;
+	usbi_mutex_t event_thread_lock;
 
 #ifdef USBI_TIMERFD_AVAILABLE
 	/* used for timeout handling, if supported by OS.
@@ -307,10 +385,26 @@ struct libusb_device {
 };
 
 struct libusb_device_handle {
-	/* lock protects claimed_interfaces */
+	/* lock protects claimed_interfaces, read_aheads, write_combiners and
+	 * buffer_pool */
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* relative share of completions reaped from this handle per event
+	 * handling round, see libusb_set_reap_weight() */
+	unsigned int reap_weight;
+
+	/* bulk IN read-aheads, see libusb_set_bulk_read_ahead(). the list is
+	 * protected by lock. */
+	struct list_head read_aheads;
+
+	/* bulk OUT write combiners, see libusb_set_bulk_write_combining(). the
+	 * list is protected by lock. */
+	struct list_head write_combiners;
+
+	/* see libusb_alloc_buffer_pool(). protected by lock. */
+	struct usbi_buffer_pool *buffer_pool;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	unsigned char os_priv
@@ -327,6 +421,28 @@ enum {
   USBI_CLOCK_REALTIME
 };
 
+/* A transfer is allocated on a cache line boundary, and the usbi_transfer,
+ * the libusb_transfer with its iso packet descriptors, and the backend data
+ * each start a new cache line. Within the usbi_transfer, the fields written
+ * as the transfer completes start a line of their own, apart from those set
+ * on submission. The fields the event handler writes on completion then
+ * share no line with another transfer, nor with the fields the submitting
+ * thread or the application fill in. The offset of the iso packet
+ * descriptors within libusb_transfer is part of the ABI, so they are
+ * aligned as far as the libusb_transfer is. */
+#define USBI_CACHELINE_SIZE		64
+#define USBI_CACHELINE_ALIGN(size) \
+	(((size) + USBI_CACHELINE_SIZE - 1) & ~(size_t)(USBI_CACHELINE_SIZE - 1))
+
+/* starts a structure member on a cache line, where the compiler allows */
+#if defined(__GNUC__)
+#define USBI_CACHELINE_ALIGNED	__attribute__((aligned(USBI_CACHELINE_SIZE)))
+#elif defined(_MSC_VER)
+#define USBI_CACHELINE_ALIGNED	__declspec(align(64))
+#else
+#define USBI_CACHELINE_ALIGNED
+#endif
+
 /* in-memory transfer layout:
  *
  * 1. struct usbi_transfer
@@ -341,52 +457,153 @@ enum {
  */
 
 struct usbi_transfer {
+	/* set on allocation or submission, and read by the event handler */
 	int num_iso_packets;
-	struct list_head list;
-	struct timeval timeout;
+	int priority;			/* see libusb_set_transfer_priority() */
+	uint64_t timeout_nsecs;		/* monotonic expiry, 0 for none */
+	struct list_head list;		/* entry in the flying list */
+
+	/* the buffer was allocated by libusbx with usbi_malloc() and is released
+	 * by libusb_free_transfer() */
+	uint8_t internal_buffer;
+
+	/* an enum usbi_throttle_state value, and the bytes accounted. protected
+	 * by the context's throttle_lock. */
+	uint8_t throttle_state;
+	unsigned int throttle_bytes;
+
+	/* number of packets covered by the iso packet offset table, which
+	 * follows the backend data; 0 until it is first built */
+	int iso_offsets_packets;
+
+	/* written as the transfer progresses and completes, on a cache line of
+	 * their own */
+
+	/* an enum usbi_transfer_state value or'ed with enum usbi_transfer_flags.
+	 * only changed with atomic operations. */
+	USBI_CACHELINE_ALIGNED volatile unsigned int state;
 	int transferred;
-	uint8_t flags;
-
-	/* this lock is held during libusb_submit_transfer() and
-	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
-	 * cancellation, submission-during-cancellation, etc). the OS backend
-	 * should also take this lock in the handle_events path, to prevent the user
-	 * cancelling the transfer from another thread while you are processing
-	 * its completion (presumably there would be races within your OS backend
-	 * if this were possible). */
-	usbi_mutex_t lock;
+
+	/* entry in the context's deferred_completions or throttled_transfers,
+	 * and the status to report */
+	struct list_head completion_list;
+	enum libusb_transfer_status deferred_status;
+
+	/* packet summary of an isochronous transfer, valid once the backend
+	 * has set USBI_TRANSFER_ISO_SUMMARY */
+	struct libusb_iso_packet_summary iso_summary;
 };
 
+/* Transfer lifecycle, in the low bits of usbi_transfer.state.
+ *
+ * IDLE -> SUBMITTING: libusb_submit_transfer() starts, clearing all flags.
+ *   Submission fails with LIBUSB_ERROR_BUSY from any other state.
+ * SUBMITTING -> IN_FLIGHT: the backend submit_transfer() has returned, or
+ *   the transfer was throttled. If libusb_cancel_transfer() was called
+ *   before the transfer reached the backend, it is completed as cancelled
+ *   without reaching it.
+ * SUBMITTING -> IDLE: submission failed.
+ * IN_FLIGHT -> COMPLETING: the completion is being reported.
+ * COMPLETING -> IDLE: just before the user callback is invoked, so that it
+ *   can resubmit.
+ *
+ * libusb_cancel_transfer() sets USBI_TRANSFER_CANCELLING in the SUBMITTING
+ * and IN_FLIGHT states only, and only once per submission. In the
+ * SUBMITTING state, it leaves the cancellation to the submitting thread,
+ * which passes it on once the backend submit_transfer() has returned, so
+ * backends never see a cancellation overlap their own submission. They
+ * must still be prepared for it to race with the completion of the
+ * transfer.
+ *
+ * A completion which the backend reports while the transfer is still
+ * SUBMITTING is recorded with USBI_TRANSFER_EARLY_COMPLETION and the status
+ * in deferred_status. The submitting thread then has it reported by the
+ * event handler, so that the callback cannot free the transfer while
+ * libusb_submit_transfer() still uses it. */
+enum usbi_transfer_state {
+	USBI_TRANSFER_IDLE = 0,
+	USBI_TRANSFER_SUBMITTING = 1,
+	USBI_TRANSFER_IN_FLIGHT = 2,
+	USBI_TRANSFER_COMPLETING = 3,
+};
+
+#define USBI_TRANSFER_STATE_MASK	0x03
+
 enum usbi_transfer_flags {
 	/* The transfer has timed out */
-	USBI_TRANSFER_TIMED_OUT = 1 << 0,
+	USBI_TRANSFER_TIMED_OUT = 1 << 2,
 
 	/* Set by backend submit_transfer() if the OS handles timeout */
-	USBI_TRANSFER_OS_HANDLES_TIMEOUT = 1 << 1,
+	USBI_TRANSFER_OS_HANDLES_TIMEOUT = 1 << 3,
 
 	/* Cancellation was requested via libusb_cancel_transfer() */
-	USBI_TRANSFER_CANCELLING = 1 << 2,
+	USBI_TRANSFER_CANCELLING = 1 << 4,
 
 	/* Operation on the transfer failed because the device disappeared */
-	USBI_TRANSFER_DEVICE_DISAPPEARED = 1 << 3,
+	USBI_TRANSFER_DEVICE_DISAPPEARED = 1 << 5,
 
 	/* Set by backend submit_transfer() if the fds in use have been updated */
-	USBI_TRANSFER_UPDATED_FDS = 1 << 4,
+	USBI_TRANSFER_UPDATED_FDS = 1 << 6,
+
+	/* Set by the backend when it filled in iso_summary while copying the
+	 * iso packet results of the completed transfer */
+	USBI_TRANSFER_ISO_SUMMARY = 1 << 7,
+
+	/* The backend reported the completion of the transfer before its
+	 * submission was over, see above */
+	USBI_TRANSFER_EARLY_COMPLETION = 1 << 8,
+};
+
+#define USBI_TRANSFER_FLAGS_MASK	0x1fc
+
+static inline void usbi_transfer_set_flags(struct usbi_transfer *itransfer,
+	unsigned int flags)
+{
+	unsigned int old;
+
+	do {
+		old = itransfer->state;
+	} while ((unsigned int) usbi_atomic_cas(&itransfer->state, old,
+			old | flags) != old);
+}
+
+static inline unsigned int usbi_transfer_test_flags(
+	struct usbi_transfer *itransfer, unsigned int flags)
+{
+	return itransfer->state & flags;
+}
+
+enum usbi_throttle_state {
+	/* not a throttled low-priority transfer */
+	USBI_THROTTLE_NONE = 0,
+
+	/* submitted, its bytes count against the low-priority limit */
+	USBI_THROTTLE_COUNTED,
+
+	/* waiting in throttled_transfers */
+	USBI_THROTTLE_QUEUED,
 };
 
+#define USBI_TRANSFER_HEADER_SIZE \
+	USBI_CACHELINE_ALIGN(sizeof(struct usbi_transfer))
+
 #define USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer) \
 	((struct libusb_transfer *)(((unsigned char *)(transfer)) \
-		+ sizeof(struct usbi_transfer)))
+		+ USBI_TRANSFER_HEADER_SIZE))
 #define LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer) \
 	((struct usbi_transfer *)(((unsigned char *)(transfer)) \
-		- sizeof(struct usbi_transfer)))
+		- USBI_TRANSFER_HEADER_SIZE))
+
+/* size of the libusb_transfer of a transfer with num_iso_packets packets,
+ * rounded up to the start of the backend data */
+#define USBI_TRANSFER_PUBLIC_SIZE(num_iso_packets) \
+	USBI_CACHELINE_ALIGN(sizeof(struct libusb_transfer) \
+		+ (num_iso_packets) * sizeof(struct libusb_iso_packet_descriptor))
 
 static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 {
-	return ((unsigned char *)transfer) + sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (transfer->num_iso_packets
-			* sizeof(struct libusb_iso_packet_descriptor));
+	return ((unsigned char *)transfer) + USBI_TRANSFER_HEADER_SIZE
+		+ USBI_TRANSFER_PUBLIC_SIZE(transfer->num_iso_packets);
 }
 
 /* bus structures */
@@ -399,6 +616,18 @@ struct usb_descriptor_header {
 
 /* shared data and functions */
 
+/* internal allocations, routed through the allocator installed with
+ * libusb_set_allocator(). size arguments of the release functions are
+ * hints and may be 0. */
+void *usbi_malloc(size_t size, enum libusb_alloc_site site);
+void *usbi_calloc(size_t nmemb, size_t size, enum libusb_alloc_site site);
+void *usbi_realloc(void *ptr, size_t old_size, size_t size,
+	enum libusb_alloc_site site);
+void usbi_free(void *ptr, size_t size, enum libusb_alloc_site site);
+void *usbi_aligned_alloc(size_t alignment, size_t size,
+	enum libusb_alloc_site site);
+void usbi_aligned_free(void *ptr, size_t size, enum libusb_alloc_site site);
+
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
 
@@ -412,6 +641,29 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle);
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
+void usbi_handle_transfer_progress(struct usbi_transfer *itransfer);
+void usbi_defer_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status);
+void usbi_signal_event(struct libusb_context *ctx);
+void usbi_wake_event_waiters(struct libusb_context *ctx);
+void usbi_wait_for_callbacks(struct libusb_context *ctx);
+void usbi_free_read_aheads(struct libusb_device_handle *dev_handle);
+void usbi_free_write_combiners(struct libusb_device_handle *dev_handle);
+
+struct usbi_timer {
+	struct list_head list;
+	/* monotonic expiry time in nanoseconds, 0 when not armed */
+	uint64_t expiry_nsecs;
+	void (*cb)(void *user_data);
+	void *user_data;
+};
+
+void usbi_init_timer(struct usbi_timer *timer, void (*cb)(void *user_data),
+	void *user_data);
+int usbi_arm_timer(struct libusb_context *ctx, struct usbi_timer *timer,
+	unsigned int usecs);
+void usbi_disarm_timer(struct libusb_context *ctx, struct usbi_timer *timer);
+void usbi_stop_timer(struct libusb_context *ctx, struct usbi_timer *timer);
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
@@ -904,6 +1156,71 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready);
 
+	/* Reap any transfers that have already completed on any open device,
+	 * without blocking. This is called repeatedly by the event handler
+	 * when busy-polling has been enabled with libusb_set_busy_poll(), in
+	 * order to avoid the wakeup latency of poll().
+	 *
+	 * Completions must be reported exactly as in handle_events().
+	 * Disconnections do not have to be detected here: they will be picked
+	 * up by the next call to handle_events().
+	 *
+	 * This function is optional. Backends that do not implement it will
+	 * always block in poll() regardless of the busy-poll setting.
+	 *
+	 * Return the number of completion events handled (0 if there were
+	 * none), or a LIBUSB_ERROR code on failure.
+	 */
+	int (*busy_poll)(struct libusb_context *ctx);
+
+	/* Retrieve the state of the transfer memory budget, for backends which
+	 * make transfers wait when the operating system would run out of
+	 * memory for them. Optional.
+	 *
+	 * Return 0 on success, or a LIBUSB_ERROR code on failure.
+	 */
+	int (*get_transfer_budget_stats)(
+		struct libusb_transfer_budget_stats *stats);
+
+	/* Allocate page-aligned memory for a transfer buffer pool, see
+	 * libusb_alloc_buffer_pool(). size is a multiple of the page size, and
+	 * of 2 MiB when hugepages are requested.
+	 *
+	 * flags holds the requested \ref libusb_buffer_pool_flags. On success,
+	 * update it to the flags which could actually be honoured. numa_node is
+	 * the NUMA node to place the memory on, or -1 to leave placement to the
+	 * operating system. The memory does not have to be pre-faulted.
+	 *
+	 * Optional. Without it, pool memory comes from the libusbx allocator.
+	 *
+	 * Return the memory, or NULL on failure.
+	 */
+	void *(*alloc_pool_memory)(size_t size, int numa_node, int *flags);
+
+	/* Release memory returned by alloc_pool_memory(). Mandatory if
+	 * alloc_pool_memory() is implemented. */
+	void (*free_pool_memory)(void *mem, size_t size);
+
+	/* Get the result of a packet of a completed LIBUSB_TRANSFER_UNIFORM_ISO
+	 * transfer, whose packet results are not copied to iso_packet_desc.
+	 * Called with the transfer idle, for a packet within num_iso_packets.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the transfer holds no results
+	 *
+	 * Mandatory if the backend sets USBI_CAP_SUPPORTS_UNIFORM_ISO.
+	 */
+	int (*get_iso_packet_result)(struct usbi_transfer *itransfer, int packet,
+		unsigned int *actual_length, enum libusb_transfer_status *status);
+
+	/* Release the resources a backend keeps with a transfer across
+	 * submissions. Called by libusb_free_transfer() for every transfer.
+	 *
+	 * Optional.
+	 */
+	void (*destroy_transfer)(struct usbi_transfer *itransfer);
+
 	/* Get time from specified clock. At least two clocks must be implemented
 	   by the backend: USBI_CLOCK_REALTIME, and USBI_CLOCK_MONOTONIC.
 
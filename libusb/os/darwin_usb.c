@@ -1394,7 +1394,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer) {
       ret = (*(cInterface->interface))->WritePipeAsync(cInterface->interface, pipeRef, transfer->buffer,
                                                        transfer->length, darwin_async_io_callback, itransfer);
   } else {
-    itransfer->flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+    usbi_transfer_set_flags(itransfer, USBI_TRANSFER_OS_HANDLES_TIMEOUT);
 
     if (IS_XFERIN(transfer))
       ret = (*(cInterface->interface))->ReadPipeAsyncTO(cInterface->interface, pipeRef, transfer->buffer,
@@ -1523,7 +1523,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer) {
   tpriv->req.completionTimeout = transfer->timeout;
   tpriv->req.noDataTimeout     = transfer->timeout;
 
-  itransfer->flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+  usbi_transfer_set_flags(itransfer, USBI_TRANSFER_OS_HANDLES_TIMEOUT);
 
   /* all transfers in libusb-1.0 are async */
 
@@ -1677,7 +1677,7 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
 }
 
 static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_t result) {
-  if (itransfer->flags & USBI_TRANSFER_TIMED_OUT)
+  if (usbi_transfer_test_flags(itransfer, USBI_TRANSFER_TIMED_OUT))
     result = kIOUSBTransactionTimeout;
 
   switch (result) {
@@ -1694,7 +1694,7 @@ static int darwin_transfer_status (struct usbi_transfer *itransfer, kern_return_
     return LIBUSB_TRANSFER_OVERFLOW;
   case kIOUSBTransactionTimeout:
     usbi_warn (ITRANSFER_CTX (itransfer), "transfer error: timed out");
-    itransfer->flags |= USBI_TRANSFER_TIMED_OUT;
+    usbi_transfer_set_flags(itransfer, USBI_TRANSFER_TIMED_OUT);
     return LIBUSB_TRANSFER_TIMED_OUT;
   default:
     usbi_warn (ITRANSFER_CTX (itransfer), "transfer error: %s (value = 0x%08x)", darwin_error_str (result), result);
@@ -1830,6 +1830,12 @@ const struct usbi_os_backend darwin_backend = {
         .clear_transfer_priv = darwin_clear_transfer_priv,
 
         .handle_events = op_handle_events,
+        .busy_poll = NULL,
+        .get_transfer_budget_stats = NULL,
+        .alloc_pool_memory = NULL,
+        .free_pool_memory = NULL,
+        .get_iso_packet_result = NULL,
+        .destroy_transfer = NULL,
 
         .clock_gettime = darwin_clock_gettime,
 
@@ -29,7 +29,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
@@ -115,9 +117,47 @@ static volatile int init_count = 0;
 /* lock for init_count */
 static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* the kernel limits the memory that all usbfs users together may have in
+ * URB buffers to usbfs_memory_mb, and fails submissions beyond that with
+ * ENOMEM, possibly halfway through a split transfer. we account the bytes
+ * of the transfers of this process, and queue transfers which would exceed
+ * the limit until enough others have completed. a limit of 0 means that
+ * there is none. all of this is protected by usbfs_budget_lock. */
+static pthread_mutex_t usbfs_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t usbfs_budget_limit = 0;
+static uint64_t usbfs_budget_in_flight = 0;
+static struct list_head usbfs_budget_queue =
+	{ &usbfs_budget_queue, &usbfs_budget_queue };
+static struct libusb_transfer_budget_stats usbfs_budget_stats;
+
+/* the URB bookkeeping of a transfer is shared between the thread submitting
+ * it, libusb_cancel_transfer() and the event handler. rather than a mutex in
+ * every transfer, it is protected by one of these, picked by the address of
+ * the transfer. a thread never holds two of them at once. they are set up by
+ * the first op_init(), so that they follow libusb_set_priority_inheritance().
+ * ranks above usbfs_budget_lock. */
+#define NUM_TRANSFER_LOCKS	64
+static usbi_mutex_t transfer_locks[NUM_TRANSFER_LOCKS];
+static pthread_once_t transfer_locks_once = PTHREAD_ONCE_INIT;
+
 static int linux_start_event_monitor(void);
 static int linux_stop_event_monitor(void);
 static int linux_scan_devices(struct libusb_context *ctx);
+static void usbfs_budget_init(void);
+
+static void init_transfer_locks(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_TRANSFER_LOCKS; i++)
+		usbi_mutex_init(&transfer_locks[i], NULL);
+}
+
+static usbi_mutex_t *transfer_lock(struct usbi_transfer *itransfer)
+{
+	/* transfers are far more than 64 bytes apart */
+	return &transfer_locks[((uintptr_t)itransfer >> 6) % NUM_TRANSFER_LOCKS];
+}
 
 #if !defined(USE_UDEV)
 static int linux_default_scan_devices (struct libusb_context *ctx);
@@ -132,6 +172,10 @@ struct linux_device_priv {
 struct linux_device_handle_priv {
 	int fd;
 	uint32_t caps;
+
+	/* reaping state for the current event handling pass */
+	int reap_ready;
+	unsigned int reap_left;
 };
 
 enum reap_action {
@@ -150,6 +194,17 @@ enum reap_action {
 	ERROR,
 };
 
+enum budget_state {
+	/* not accounted, e.g. not in flight or no limit */
+	BUDGET_NONE = 0,
+
+	/* submitted to the kernel, its bytes count against the budget */
+	BUDGET_ADMITTED,
+
+	/* waiting in usbfs_budget_queue for budget to become available */
+	BUDGET_QUEUED,
+};
+
 struct linux_transfer_priv {
 	union {
 		struct usbfs_urb *urbs;
@@ -161,8 +216,19 @@ struct linux_transfer_priv {
 	int num_retired;
 	enum libusb_transfer_status reap_status;
 
-	/* next iso packet in user-supplied transfer to be populated */
-	int iso_packet_offset;
+	/* geometry of the iso URBs of a LIBUSB_TRANSFER_UNIFORM_ISO transfer,
+	 * which are kept across submissions and hold its packet results.
+	 * uniform_packets is 0 if there are none. */
+	int uniform_packets;
+	unsigned int uniform_packet_length;
+	int uniform_packets_per_urb;
+
+	/* usbfs memory budget accounting, protected by usbfs_budget_lock */
+	enum budget_state budget_state;
+	uint64_t budget_bytes;
+	struct list_head budget_list;
+	struct usbi_transfer *itransfer;
+	struct timespec budget_queued_at;
 };
 
 static void _get_usbfs_path(struct libusb_device *dev, char *path)
@@ -342,6 +408,8 @@ static int op_init(struct libusb_context *ctx)
 		return LIBUSB_ERROR_OTHER;
 	}
 
+	pthread_once(&transfer_locks_once, init_transfer_locks);
+
 	if (monotonic_clkid == -1)
 		monotonic_clkid = find_monotonic_clock();
 
@@ -369,6 +437,8 @@ static int op_init(struct libusb_context *ctx)
 	if (supports_flag_zero_packet)
 		usbi_dbg("zero length packet flag supported");
 
+	usbfs_budget_init();
+
 	r = stat(SYSFS_DEVICE_PATH, &statbuf);
 	if (r == 0 && S_ISDIR(statbuf.st_mode)) {
 		DIR *devices = opendir(SYSFS_DEVICE_PATH);
@@ -912,19 +982,19 @@ static int cache_active_config(struct libusb_device *dev, int fd,
 	}
 
 	usbi_parse_descriptor(tmp, "bbw", &config, 0);
-	buf = malloc(config.wTotalLength);
+	buf = usbi_malloc(config.wTotalLength, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (!buf)
 		return LIBUSB_ERROR_NO_MEM;
 
 	r = get_config_descriptor(DEVICE_CTX(dev), fd, idx, buf,
 		config.wTotalLength);
 	if (r < 0) {
-		free(buf);
+		usbi_free(buf, config.wTotalLength, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		return r;
 	}
 
 	if (priv->config_descriptor)
-		free(priv->config_descriptor);
+		usbi_free(priv->config_descriptor, 0, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	priv->config_descriptor = buf;
 	return 0;
 }
@@ -974,7 +1044,7 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	dev->device_address = devaddr;
 
 	if (sysfs_dir) {
-		priv->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
+		priv->sysfs_dir = usbi_malloc(strlen(sysfs_dir) + 1, LIBUSB_ALLOC_SITE_DEVICE);
 		if (!priv->sysfs_dir)
 			return LIBUSB_ERROR_NO_MEM;
 		strcpy(priv->sysfs_dir, sysfs_dir);
@@ -1056,7 +1126,7 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		}
 	}
 
-	dev_buf = malloc(DEVICE_DESC_LENGTH);
+	dev_buf = usbi_malloc(DEVICE_DESC_LENGTH, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	if (!dev_buf) {
 		close(fd);
 		return LIBUSB_ERROR_NO_MEM;
@@ -1066,12 +1136,12 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	if (r < 0) {
 		usbi_err(DEVICE_CTX(dev),
 			"read descriptor failed ret=%d errno=%d", fd, errno);
-		free(dev_buf);
+		usbi_free(dev_buf, DEVICE_DESC_LENGTH, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		close(fd);
 		return LIBUSB_ERROR_IO;
 	} else if (r < DEVICE_DESC_LENGTH) {
 		usbi_err(DEVICE_CTX(dev), "short descriptor read (%d)", r);
-		free(dev_buf);
+		usbi_free(dev_buf, DEVICE_DESC_LENGTH, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		close(fd);
 		return LIBUSB_ERROR_IO;
 	}
@@ -1084,7 +1154,7 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		r = cache_active_config(dev, fd, active_config);
 		if (r < 0) {
 			close(fd);
-			free(dev_buf);
+			usbi_free(dev_buf, DEVICE_DESC_LENGTH, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 			return r;
 		}
 	}
@@ -1468,7 +1538,7 @@ static int op_set_configuration(struct libusb_device_handle *handle, int config)
 		/* update our cached active config descriptor */
 		if (config == -1) {
 			if (priv->config_descriptor) {
-				free(priv->config_descriptor);
+				usbi_free(priv->config_descriptor, 0, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 				priv->config_descriptor = NULL;
 			}
 		} else {
@@ -1700,12 +1770,12 @@ static void op_destroy_device(struct libusb_device *dev)
 	struct linux_device_priv *priv = _device_priv(dev);
 	if (!sysfs_has_descriptors) {
 		if (priv->dev_descriptor)
-			free(priv->dev_descriptor);
+			usbi_free(priv->dev_descriptor, DEVICE_DESC_LENGTH, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 		if (priv->config_descriptor)
-			free(priv->config_descriptor);
+			usbi_free(priv->config_descriptor, 0, LIBUSB_ALLOC_SITE_DESCRIPTOR);
 	}
 	if (priv->sysfs_dir)
-		free(priv->sysfs_dir);
+		usbi_free(priv->sysfs_dir, 0, LIBUSB_ALLOC_SITE_DEVICE);
 }
 
 /* URBs are discarded in reverse order of submission to avoid races. */
@@ -1745,6 +1815,15 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
+/* each iso URB is allocated behind a small header recording where it sits in
+ * the transfer, so that the reap path does not have to search for it */
+struct iso_urb_header {
+	int urb_idx;		/* index in tpriv->iso_urbs */
+	int packet_offset;	/* first iso packet of the transfer it carries */
+};
+
+#define ISO_URB_HEADER(urb) (((struct iso_urb_header *) (urb)) - 1)
+
 static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 {
 	int i;
@@ -1752,11 +1831,139 @@ static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 		struct usbfs_urb *urb = tpriv->iso_urbs[i];
 		if (!urb)
 			break;
-		free(urb);
+		usbi_free(ISO_URB_HEADER(urb), 0, LIBUSB_ALLOC_SITE_URB);
 	}
 
-	free(tpriv->iso_urbs);
+	usbi_free(tpriv->iso_urbs, 0, LIBUSB_ALLOC_SITE_URB);
 	tpriv->iso_urbs = NULL;
+	tpriv->uniform_packets = 0;
+}
+
+/* requested length of an iso packet. all the packets of a uniform transfer
+ * have the length of the first one, which is the only descriptor it has. */
+static unsigned int iso_packet_length(struct libusb_transfer *transfer,
+	int packet, int uniform)
+{
+	return transfer->iso_packet_desc[uniform ? 0 : packet].length;
+}
+
+/* fill in the fields of an iso URB that come from the transfer, leaving its
+ * packet descriptors alone */
+static void fill_iso_urb(struct usbfs_urb *urb, struct usbi_transfer *itransfer,
+	int num_packets, unsigned char *buffer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	memset(urb, 0, offsetof(struct usbfs_urb, iso_frame_desc));
+	urb->usercontext = itransfer;
+	urb->type = USBFS_URB_TYPE_ISO;
+	/* FIXME: interface for non-ASAP data? */
+	urb->flags = USBFS_URB_ISO_ASAP;
+	urb->endpoint = transfer->endpoint;
+	urb->number_of_packets = num_packets;
+	urb->buffer = buffer;
+}
+
+/* prepare the URBs kept from the previous submission of a uniform iso
+ * transfer to be submitted again. only the packet geometry is known to be
+ * unchanged, so everything else is filled in again from the transfer, which
+ * may now target another endpoint. the device handle is looked up again by
+ * the submission itself. */
+static void reset_uniform_iso_urbs(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	int i;
+
+	/* the kernel rewrites the status and length of each packet on
+	 * completion, so only the URBs themselves are reset */
+	for (i = 0; i < tpriv->num_urbs; i++) {
+		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+		size_t offset = (size_t) ISO_URB_HEADER(urb)->packet_offset
+			* tpriv->uniform_packet_length;
+
+		fill_iso_urb(urb, itransfer, urb->number_of_packets,
+			transfer->buffer + offset);
+	}
+}
+
+/* number of URBs kept queued for a LIBUSB_TRANSFER_AUTO_RESUBMIT transfer,
+ * so that one is always pending while the other is being reaped */
+#define NUM_RESUBMIT_URBS 2
+
+/* each URB of an auto-resubmit transfer reads into its own buffer, and the
+ * data is copied to the transfer buffer before the URB is resubmitted and
+ * the callback is invoked. */
+static int submit_resubmit_transfer(struct usbi_transfer *itransfer,
+	unsigned char urb_type)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		_device_handle_priv(transfer->dev_handle);
+	struct usbfs_urb *urbs;
+	unsigned char *buffers;
+	int r;
+	int i;
+
+	if (tpriv->urbs)
+		return LIBUSB_ERROR_BUSY;
+
+	/* the data must fit in a single URB */
+	if (!(dpriv->caps & (USBFS_CAP_BULK_SCATTER_GATHER|USBFS_CAP_NO_PACKET_SIZE_LIM))
+			&& transfer->length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	urbs = usbi_calloc(NUM_RESUBMIT_URBS,
+		sizeof(struct usbfs_urb) + transfer->length, LIBUSB_ALLOC_SITE_URB);
+	if (!urbs)
+		return LIBUSB_ERROR_NO_MEM;
+	buffers = (unsigned char *)(urbs + NUM_RESUBMIT_URBS);
+	tpriv->urbs = urbs;
+	tpriv->num_urbs = NUM_RESUBMIT_URBS;
+	tpriv->num_retired = 0;
+	tpriv->reap_action = NORMAL;
+	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
+
+	for (i = 0; i < NUM_RESUBMIT_URBS; i++) {
+		struct usbfs_urb *urb = &urbs[i];
+		urb->usercontext = itransfer;
+		urb->type = urb_type;
+		urb->endpoint = transfer->endpoint;
+		urb->buffer = buffers + (i * transfer->length);
+		urb->buffer_length = transfer->length;
+
+		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+		if (r < 0) {
+			if (errno == ENODEV) {
+				r = LIBUSB_ERROR_NO_DEVICE;
+			} else if (errno == ENOMEM) {
+				usbi_dbg("usbfs memory exhausted");
+				r = LIBUSB_ERROR_NO_MEM;
+			} else {
+				usbi_err(TRANSFER_CTX(transfer),
+					"submiturb failed error %d errno=%d", r, errno);
+				r = LIBUSB_ERROR_IO;
+			}
+
+			if (i == 0) {
+				usbi_free(urbs, 0, LIBUSB_ALLOC_SITE_URB);
+				tpriv->urbs = NULL;
+				return r;
+			}
+
+			/* carry on with the URBs we have, at the cost of a small
+			 * gap between resubmissions */
+			usbi_dbg("running with %d URBs only", i);
+			tpriv->num_urbs = i;
+			break;
+		}
+	}
+
+	return 0;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer,
@@ -1775,6 +1982,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	int i;
 	size_t alloc_size;
 
+	if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+		return submit_resubmit_transfer(itransfer, urb_type);
+
 	if (tpriv->urbs)
 		return LIBUSB_ERROR_BUSY;
 
@@ -1836,7 +2046,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
 	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = calloc(1, alloc_size);
+	urbs = usbi_calloc(1, alloc_size, LIBUSB_ALLOC_SITE_URB);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
@@ -1873,6 +2083,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 		if (r < 0) {
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
+			} else if (errno == ENOMEM) {
+				usbi_dbg("usbfs memory exhausted");
+				r = LIBUSB_ERROR_NO_MEM;
 			} else {
 				usbi_err(TRANSFER_CTX(transfer),
 					"submiturb failed error %d errno=%d", r, errno);
@@ -1883,7 +2096,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
+				usbi_free(urbs, 0, LIBUSB_ALLOC_SITE_URB);
 				tpriv->urbs = NULL;
 				return r;
 			}
@@ -1939,8 +2152,34 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	int this_urb_len = 0;
 	int num_urbs = 1;
 	int packet_offset = 0;
-	unsigned int packet_len;
+	unsigned int packet_len = 0;
 	unsigned char *urb_buffer = transfer->buffer;
+	int uniform = transfer->flags & LIBUSB_TRANSFER_UNIFORM_ISO;
+
+	if (uniform) {
+		packet_len = transfer->iso_packet_desc[0].length;
+		if (packet_len == 0 || packet_len > MAX_ISO_BUFFER_LENGTH)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	memset(&itransfer->iso_summary, 0, sizeof(itransfer->iso_summary));
+	itransfer->iso_summary.first_error_index = -1;
+
+	if (tpriv->uniform_packets) {
+		/* the URBs of the previous submission are reused as they are,
+		 * unless the geometry changed */
+		if (uniform && tpriv->uniform_packets == num_packets
+				&& tpriv->uniform_packet_length == packet_len) {
+			usbi_dbg("reusing %d URBs", tpriv->num_urbs);
+			reset_uniform_iso_urbs(itransfer);
+			urbs = tpriv->iso_urbs;
+			num_urbs = tpriv->num_urbs;
+			tpriv->num_retired = 0;
+			tpriv->reap_action = NORMAL;
+			goto submit;
+		}
+		free_iso_urbs(tpriv);
+	}
 
 	if (tpriv->iso_urbs)
 		return LIBUSB_ERROR_BUSY;
@@ -1959,7 +2198,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	/* calculate how many URBs we need */
 	for (i = 0; i < num_packets; i++) {
 		unsigned int space_remaining = MAX_ISO_BUFFER_LENGTH - this_urb_len;
-		packet_len = transfer->iso_packet_desc[i].length;
+		packet_len = iso_packet_length(transfer, i, uniform);
 
 		if (packet_len > space_remaining) {
 			num_urbs++;
@@ -1971,7 +2210,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	usbi_dbg("need %d 32k URBs for transfer", num_urbs);
 
 	alloc_size = num_urbs * sizeof(*urbs);
-	urbs = calloc(1, alloc_size);
+	urbs = usbi_calloc(1, alloc_size, LIBUSB_ALLOC_SITE_URB);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -1979,10 +2218,10 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
 
 	/* allocate + initialize each URB with the correct number of packets */
 	for (i = 0; i < num_urbs; i++) {
+		struct iso_urb_header *hdr;
 		struct usbfs_urb *urb;
 		unsigned int space_remaining_in_urb = MAX_ISO_BUFFER_LENGTH;
 		int urb_packet_offset = 0;
@@ -1992,7 +2231,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		/* swallow up all the packets we can fit into this URB */
 		while (packet_offset < transfer->num_iso_packets) {
-			packet_len = transfer->iso_packet_desc[packet_offset].length;
+			packet_len = iso_packet_length(transfer, packet_offset, uniform);
 			if (packet_len <= space_remaining_in_urb) {
 				/* throw it in */
 				urb_packet_offset++;
@@ -2005,37 +2244,44 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			}
 		}
 
-		alloc_size = sizeof(*urb)
+		alloc_size = sizeof(*hdr) + sizeof(*urb)
 			+ (urb_packet_offset * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
+		hdr = usbi_calloc(1, alloc_size, LIBUSB_ALLOC_SITE_URB);
+		if (!hdr) {
 			free_iso_urbs(tpriv);
 			return LIBUSB_ERROR_NO_MEM;
 		}
+		hdr->urb_idx = i;
+		hdr->packet_offset = packet_offset - urb_packet_offset;
+		urb = (struct usbfs_urb *) (hdr + 1);
 		urbs[i] = urb;
 
 		/* populate packet lengths */
 		for (j = 0, k = packet_offset - urb_packet_offset;
 				k < packet_offset; k++, j++) {
-			packet_len = transfer->iso_packet_desc[k].length;
+			packet_len = iso_packet_length(transfer, k, uniform);
 			urb->iso_frame_desc[j].length = packet_len;
 		}
 
-		urb->usercontext = itransfer;
-		urb->type = USBFS_URB_TYPE_ISO;
-		/* FIXME: interface for non-ASAP data? */
-		urb->flags = USBFS_URB_ISO_ASAP;
-		urb->endpoint = transfer->endpoint;
-		urb->number_of_packets = urb_packet_offset;
-		urb->buffer = urb_buffer_orig;
+		fill_iso_urb(urb, itransfer, urb_packet_offset, urb_buffer_orig);
 	}
 
+	if (uniform) {
+		tpriv->uniform_packets = num_packets;
+		tpriv->uniform_packet_length = packet_len;
+		tpriv->uniform_packets_per_urb = MAX_ISO_BUFFER_LENGTH / packet_len;
+	}
+
+submit:
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
 		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
 		if (r < 0) {
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
+			} else if (errno == ENOMEM) {
+				usbi_dbg("usbfs memory exhausted");
+				r = LIBUSB_ERROR_NO_MEM;
 			} else {
 				usbi_err(TRANSFER_CTX(transfer),
 					"submiturb failed error %d errno=%d", r, errno);
@@ -2095,7 +2341,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
+	urb = usbi_calloc(1, sizeof(struct usbfs_urb), LIBUSB_ALLOC_SITE_URB);
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2110,10 +2356,12 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
+		usbi_free(urb, 0, LIBUSB_ALLOC_SITE_URB);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
+		if (errno == ENOMEM)
+			return LIBUSB_ERROR_NO_MEM;
 
 		usbi_err(TRANSFER_CTX(transfer),
 			"submiturb failed error %d errno=%d", r, errno);
@@ -2122,7 +2370,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	return 0;
 }
 
-static int op_submit_transfer(struct usbi_transfer *itransfer)
+static int do_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -2143,12 +2391,312 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 	}
 }
 
+static void usbfs_budget_init(void)
+{
+	FILE *f;
+	unsigned int mb;
+
+	f = fopen(SYSFS_USBFS_MEMORY_MB, "r");
+	if (!f) {
+		usbi_dbg("no usbfs memory limit");
+		return;
+	}
+	if (fscanf(f, "%u", &mb) == 1) {
+		usbi_dbg("usbfs memory limit %uMB", mb);
+		pthread_mutex_lock(&usbfs_budget_lock);
+		usbfs_budget_limit = (uint64_t)mb * 1024 * 1024;
+		usbfs_budget_stats.limit = usbfs_budget_limit;
+		pthread_mutex_unlock(&usbfs_budget_lock);
+	}
+	fclose(f);
+}
+
+static uint64_t transfer_budget_cost(struct libusb_transfer *transfer)
+{
+	if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+		return (uint64_t)transfer->length * NUM_RESUBMIT_URBS;
+	return transfer->length;
+}
+
+/* a transfer is always let through when nothing else is in flight, so that
+ * transfers larger than the limit are still attempted. must be called with
+ * usbfs_budget_lock held. */
+static int usbfs_budget_fits(uint64_t bytes)
+{
+	return !usbfs_budget_in_flight ||
+		usbfs_budget_in_flight + bytes <= usbfs_budget_limit;
+}
+
+/* must be called with usbfs_budget_lock held */
+static void usbfs_budget_enqueue(struct usbi_transfer *itransfer, int requeue)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	tpriv->itransfer = itransfer;
+	tpriv->budget_state = BUDGET_QUEUED;
+	if (requeue) {
+		/* it was at the head of the queue already, keep it there */
+		list_add(&tpriv->budget_list, &usbfs_budget_queue);
+	} else {
+		list_add_tail(&tpriv->budget_list, &usbfs_budget_queue);
+		clock_gettime(monotonic_clkid, &tpriv->budget_queued_at);
+		usbfs_budget_stats.queued_transfers++;
+	}
+	if (++usbfs_budget_stats.queue_depth > usbfs_budget_stats.max_queue_depth)
+		usbfs_budget_stats.max_queue_depth = usbfs_budget_stats.queue_depth;
+}
+
+/* must be called with usbfs_budget_lock held */
+static void usbfs_budget_admit(struct linux_transfer_priv *tpriv)
+{
+	tpriv->budget_state = BUDGET_ADMITTED;
+	usbfs_budget_in_flight += tpriv->budget_bytes;
+	usbfs_budget_stats.in_flight = usbfs_budget_in_flight;
+}
+
+/* give back the bytes of a transfer, or take it off the queue. must be
+ * called with usbfs_budget_lock held. */
+static void usbfs_budget_put(struct linux_transfer_priv *tpriv)
+{
+	if (tpriv->budget_state == BUDGET_ADMITTED) {
+		usbfs_budget_in_flight -= tpriv->budget_bytes;
+		usbfs_budget_stats.in_flight = usbfs_budget_in_flight;
+	} else if (tpriv->budget_state == BUDGET_QUEUED) {
+		list_del(&tpriv->budget_list);
+		usbfs_budget_stats.queue_depth--;
+	}
+	tpriv->budget_state = BUDGET_NONE;
+}
+
+/* submit queued transfers for as long as they fit. transfers which fail to
+ * submit are completed by the event handler of their context. must not be
+ * called with usbfs_budget_lock or a transfer lock held. */
+static void usbfs_budget_drain(void)
+{
+	struct linux_transfer_priv *tpriv;
+	struct usbi_transfer *itransfer;
+	struct timespec now;
+	uint64_t waited;
+	int r;
+
+	pthread_mutex_lock(&usbfs_budget_lock);
+	while (!list_empty(&usbfs_budget_queue)) {
+		tpriv = list_entry(usbfs_budget_queue.next, struct linux_transfer_priv,
+			budget_list);
+		if (!usbfs_budget_fits(tpriv->budget_bytes))
+			break;
+		itransfer = tpriv->itransfer;
+
+		/* the transfer lock ranks above usbfs_budget_lock, so wait for it
+		 * without the budget lock, which lets priority inheritance boost
+		 * its holder. the transfer may have completed or been cancelled
+		 * meanwhile, but the transfer locks are never freed, so only
+		 * proceed if it is still first in line. */
+		pthread_mutex_unlock(&usbfs_budget_lock);
+		usbi_mutex_lock(transfer_lock(itransfer));
+		pthread_mutex_lock(&usbfs_budget_lock);
+		if (usbfs_budget_queue.next != &tpriv->budget_list
+				|| tpriv->itransfer != itransfer
+				|| !usbfs_budget_fits(tpriv->budget_bytes)) {
+			usbi_mutex_unlock(transfer_lock(itransfer));
+			continue;
+		}
+
+		list_del(&tpriv->budget_list);
+		usbfs_budget_stats.queue_depth--;
+		usbfs_budget_admit(tpriv);
+		if (clock_gettime(monotonic_clkid, &now) == 0) {
+			waited = (uint64_t)(now.tv_sec - tpriv->budget_queued_at.tv_sec)
+				* 1000000 + (now.tv_nsec - tpriv->budget_queued_at.tv_nsec)
+				/ 1000;
+			usbfs_budget_stats.wait_usecs += waited;
+			if (waited > usbfs_budget_stats.max_wait_usecs)
+				usbfs_budget_stats.max_wait_usecs = waited;
+		}
+		pthread_mutex_unlock(&usbfs_budget_lock);
+
+		r = do_submit_transfer(itransfer);
+
+		pthread_mutex_lock(&usbfs_budget_lock);
+		if (r == LIBUSB_ERROR_NO_MEM && usbfs_budget_in_flight >
+				tpriv->budget_bytes) {
+			/* the kernel ran out even though we did not, probably
+			 * because of other processes. wait for more to complete. */
+			usbfs_budget_put(tpriv);
+			usbfs_budget_enqueue(itransfer, 1);
+			usbi_mutex_unlock(transfer_lock(itransfer));
+			break;
+		}
+		if (r < 0)
+			usbfs_budget_put(tpriv);
+		usbi_mutex_unlock(transfer_lock(itransfer));
+
+		if (r < 0) {
+			usbi_dbg("queued transfer failed to submit: %d", r);
+			pthread_mutex_unlock(&usbfs_budget_lock);
+			usbi_defer_transfer_completion(itransfer,
+				r == LIBUSB_ERROR_NO_DEVICE ? LIBUSB_TRANSFER_NO_DEVICE
+				: LIBUSB_TRANSFER_ERROR);
+			pthread_mutex_lock(&usbfs_budget_lock);
+		}
+	}
+	pthread_mutex_unlock(&usbfs_budget_lock);
+}
+
+/* account the end of a transfer, letting queued ones through. must be
+ * called before reporting its completion, without a transfer lock held. */
+static void usbfs_budget_release(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	if (tpriv->budget_state == BUDGET_NONE)
+		return;
+
+	pthread_mutex_lock(&usbfs_budget_lock);
+	usbfs_budget_put(tpriv);
+	pthread_mutex_unlock(&usbfs_budget_lock);
+	usbfs_budget_drain();
+}
+
+static int op_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	usbi_mutex_t *lock = transfer_lock(itransfer);
+	int r;
+
+	usbi_mutex_lock(lock);
+	if (tpriv->budget_state != BUDGET_NONE) {
+		r = LIBUSB_ERROR_BUSY;
+		goto out;
+	}
+	if (!usbfs_budget_limit) {
+		r = do_submit_transfer(itransfer);
+		goto out;
+	}
+
+	tpriv->budget_bytes = transfer_budget_cost(transfer);
+	pthread_mutex_lock(&usbfs_budget_lock);
+	if (!list_empty(&usbfs_budget_queue) ||
+	    !usbfs_budget_fits(tpriv->budget_bytes)) {
+		usbi_dbg("over usbfs memory budget, queueing %u bytes",
+			(unsigned int)tpriv->budget_bytes);
+		usbfs_budget_enqueue(itransfer, 0);
+		pthread_mutex_unlock(&usbfs_budget_lock);
+		r = 0;
+		goto out;
+	}
+	usbfs_budget_admit(tpriv);
+	pthread_mutex_unlock(&usbfs_budget_lock);
+
+	r = do_submit_transfer(itransfer);
+	if (r == 0)
+		goto out;
+
+	pthread_mutex_lock(&usbfs_budget_lock);
+	usbfs_budget_put(tpriv);
+	if (r == LIBUSB_ERROR_NO_MEM && usbfs_budget_in_flight) {
+		/* retry once some of our other transfers have completed */
+		usbi_dbg("usbfs out of memory, queueing %u bytes",
+			(unsigned int)tpriv->budget_bytes);
+		usbfs_budget_enqueue(itransfer, 0);
+		r = 0;
+	}
+	pthread_mutex_unlock(&usbfs_budget_lock);
+	usbi_mutex_unlock(lock);
+
+	/* transfers may have been queued behind our reservation */
+	if (r < 0)
+		usbfs_budget_drain();
+	return r;
+
+out:
+	usbi_mutex_unlock(lock);
+	return r;
+}
+
+static int op_get_transfer_budget_stats(
+	struct libusb_transfer_budget_stats *stats)
+{
+	pthread_mutex_lock(&usbfs_budget_lock);
+	*stats = usbfs_budget_stats;
+	pthread_mutex_unlock(&usbfs_budget_lock);
+	return 0;
+}
+
+/* buffer pool memory is mapped directly, so that it can come from the
+ * hugetlb pool and be bound to a NUMA node without libnuma */
+static void *op_alloc_pool_memory(size_t size, int numa_node, int *flags)
+{
+	int requested = *flags;
+	void *mem = MAP_FAILED;
+
+	*flags = 0;
+#ifdef MAP_HUGETLB
+	if (requested & LIBUSB_BUFFER_POOL_HUGEPAGES) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+			*flags |= LIBUSB_BUFFER_POOL_HUGEPAGES;
+		else
+			usbi_dbg("no hugetlb pages available, errno=%d", errno);
+	}
+#endif
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		/* fall back to transparent hugepages */
+		if (requested & LIBUSB_BUFFER_POOL_HUGEPAGES)
+			madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	}
+
+#ifdef SYS_mbind
+	if (numa_node >= 0) {
+		unsigned long nodemask[4];
+		const int bits = sizeof(nodemask[0]) * 8;
+
+		memset(nodemask, 0, sizeof(nodemask));
+		if (numa_node < (int) sizeof(nodemask) * 8) {
+			nodemask[numa_node / bits] = 1UL << (numa_node % bits);
+			/* MPOL_PREFERRED, so that a full node does not make the
+			 * allocation fail */
+			if (syscall(SYS_mbind, mem, size, 1, nodemask,
+					sizeof(nodemask) * 8 + 1, 0) < 0)
+				usbi_dbg("mbind to node %d failed, errno=%d", numa_node,
+					errno);
+		}
+	}
+#endif
+
+	if (requested & LIBUSB_BUFFER_POOL_LOCKED) {
+		if (mlock(mem, size) == 0)
+			*flags |= LIBUSB_BUFFER_POOL_LOCKED;
+		else
+			usbi_dbg("mlock failed, errno=%d", errno);
+	}
+
+	return mem;
+}
+
+static void op_free_pool_memory(void *mem, size_t size)
+{
+	munmap(mem, size);
+}
+
 static int op_cancel_transfer(struct usbi_transfer *itransfer)
 {
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	usbi_mutex_t *lock = transfer_lock(itransfer);
+	int r;
 
+	usbi_mutex_lock(lock);
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_BULK:
 		if (tpriv->reap_action == ERROR)
@@ -2162,13 +2710,28 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 	default:
 		usbi_err(TRANSFER_CTX(transfer),
 			"unknown endpoint type %d", transfer->type);
-		return LIBUSB_ERROR_INVALID_PARAM;
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto out;
+	}
+
+	/* a transfer still waiting for budget never reached the kernel */
+	if (tpriv->budget_state == BUDGET_QUEUED) {
+		pthread_mutex_lock(&usbfs_budget_lock);
+		usbfs_budget_put(tpriv);
+		pthread_mutex_unlock(&usbfs_budget_lock);
+		usbi_defer_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
+		r = 0;
+		goto out;
 	}
 
 	if (!tpriv->urbs)
-		return LIBUSB_ERROR_NOT_FOUND;
+		r = LIBUSB_ERROR_NOT_FOUND;
+	else
+		r = discard_urbs(itransfer, 0, tpriv->num_urbs);
 
-	return discard_urbs(itransfer, 0, tpriv->num_urbs);
+out:
+	usbi_mutex_unlock(lock);
+	return r;
 }
 
 static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
@@ -2182,22 +2745,24 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		usbi_mutex_lock(&itransfer->lock);
+		usbi_mutex_lock(transfer_lock(itransfer));
 		if (tpriv->urbs)
-			free(tpriv->urbs);
+			usbi_free(tpriv->urbs, 0, LIBUSB_ALLOC_SITE_URB);
 		tpriv->urbs = NULL;
-		usbi_mutex_unlock(&itransfer->lock);
+		usbi_mutex_unlock(transfer_lock(itransfer));
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		usbi_mutex_lock(&itransfer->lock);
+		usbi_mutex_lock(transfer_lock(itransfer));
 		if (tpriv->iso_urbs)
 			free_iso_urbs(tpriv);
-		usbi_mutex_unlock(&itransfer->lock);
+		usbi_mutex_unlock(transfer_lock(itransfer));
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer),
 			"unknown endpoint type %d", transfer->type);
 	}
+
+	usbfs_budget_release(itransfer);
 }
 
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
@@ -2207,7 +2772,7 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int urb_idx = urb - tpriv->urbs;
 
-	usbi_mutex_lock(&itransfer->lock);
+	usbi_mutex_lock(transfer_lock(itransfer));
 	usbi_dbg("handling completion status %d of bulk urb %d/%d", urb->status,
 		urb_idx + 1, tpriv->num_urbs);
 
@@ -2324,88 +2889,266 @@ cancel_remaining:
 	discard_urbs(itransfer, urb_idx + 1, tpriv->num_urbs);
 
 out_unlock:
-	usbi_mutex_unlock(&itransfer->lock);
+	usbi_mutex_unlock(transfer_lock(itransfer));
 	return 0;
 
 completed:
-	free(tpriv->urbs);
+	usbi_free(tpriv->urbs, 0, LIBUSB_ALLOC_SITE_URB);
+	tpriv->urbs = NULL;
+	usbi_mutex_unlock(transfer_lock(itransfer));
+	usbfs_budget_release(itransfer);
+	return CANCELLED == tpriv->reap_action ?
+		usbi_handle_transfer_cancellation(itransfer) :
+		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
+}
+
+static int handle_resubmit_completion(struct usbi_transfer *itransfer,
+	struct usbfs_urb *urb)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		_device_handle_priv(transfer->dev_handle);
+	int urb_idx = urb - tpriv->urbs;
+	int r;
+
+	usbi_mutex_lock(transfer_lock(itransfer));
+	usbi_dbg("handling completion status %d of resubmitting urb %d/%d",
+		urb->status, urb_idx + 1, tpriv->num_urbs);
+
+	switch (urb->status) {
+	case 0:
+	case -EREMOTEIO: /* short transfer */
+		break;
+	case -ENOENT: /* cancelled */
+	case -ECONNRESET:
+		if (tpriv->reap_action != NORMAL)
+			goto retire;
+		/* not by us: the transfer cannot carry on */
+		usbi_dbg("urb unexpectedly cancelled");
+		tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
+		goto cancel_remaining;
+	case -ENODEV:
+	case -ESHUTDOWN:
+		usbi_dbg("device removed");
+		tpriv->reap_status = LIBUSB_TRANSFER_NO_DEVICE;
+		goto cancel_remaining;
+	case -EPIPE:
+		usbi_dbg("detected endpoint stall");
+		if (tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
+			tpriv->reap_status = LIBUSB_TRANSFER_STALL;
+		goto cancel_remaining;
+	case -EOVERFLOW:
+		usbi_dbg("overflow, actual_length=%d", urb->actual_length);
+		if (tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
+			tpriv->reap_status = LIBUSB_TRANSFER_OVERFLOW;
+		goto cancel_remaining;
+	default:
+		usbi_warn(ITRANSFER_CTX(itransfer),
+			"unrecognised urb status %d", urb->status);
+		if (tpriv->reap_status == LIBUSB_TRANSFER_COMPLETED)
+			tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
+		goto cancel_remaining;
+	}
+
+	/* hand the data over to the transfer buffer, so that the URB can go
+	 * straight back to the kernel. data arriving while we are cancelling
+	 * is still reported, but the URB is not resubmitted. */
+	memcpy(transfer->buffer, urb->buffer, urb->actual_length);
+	itransfer->transferred = urb->actual_length;
+	if (tpriv->reap_action == NORMAL) {
+		urb->status = 0;
+		urb->actual_length = 0;
+		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+		if (r < 0) {
+			usbi_dbg("resubmit failed error %d errno=%d", r, errno);
+			tpriv->reap_status = (errno == ENODEV) ?
+				LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+			tpriv->reap_action = ERROR;
+			tpriv->num_retired++;
+			discard_urbs(itransfer, 0, tpriv->num_urbs);
+		}
+	} else {
+		tpriv->num_retired++;
+	}
+	usbi_mutex_unlock(transfer_lock(itransfer));
+
+	usbi_handle_transfer_progress(itransfer);
+	itransfer->transferred = 0;
+
+	usbi_mutex_lock(transfer_lock(itransfer));
+	if (tpriv->num_retired == tpriv->num_urbs)
+		goto completed;
+	usbi_mutex_unlock(transfer_lock(itransfer));
+	return 0;
+
+cancel_remaining:
+	tpriv->reap_action = ERROR;
+	discard_urbs(itransfer, 0, tpriv->num_urbs);
+retire:
+	if (++tpriv->num_retired < tpriv->num_urbs) {
+		usbi_mutex_unlock(transfer_lock(itransfer));
+		return 0;
+	}
+
+completed:
+	usbi_free(tpriv->urbs, 0, LIBUSB_ALLOC_SITE_URB);
 	tpriv->urbs = NULL;
-	usbi_mutex_unlock(&itransfer->lock);
+	usbi_mutex_unlock(transfer_lock(itransfer));
+	usbfs_budget_release(itransfer);
 	return CANCELLED == tpriv->reap_action ?
 		usbi_handle_transfer_cancellation(itransfer) :
 		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
 }
 
+/* per-packet status translation for iso URBs, indexed by the negated errno
+ * the kernel reports. entries hold ISO_STATUS(status); a zero entry is an
+ * unrecognised code, which is reported as LIBUSB_TRANSFER_ERROR. */
+#define ISO_STATUS(status)	(((status) << 1) | 1)
+
+static const unsigned char iso_status_map[] = {
+	[0] = ISO_STATUS(LIBUSB_TRANSFER_COMPLETED),
+	[ENOENT] = ISO_STATUS(LIBUSB_TRANSFER_COMPLETED), /* cancelled */
+	[ECONNRESET] = ISO_STATUS(LIBUSB_TRANSFER_COMPLETED),
+	[ENODEV] = ISO_STATUS(LIBUSB_TRANSFER_NO_DEVICE),
+	[ESHUTDOWN] = ISO_STATUS(LIBUSB_TRANSFER_NO_DEVICE),
+	[EPIPE] = ISO_STATUS(LIBUSB_TRANSFER_STALL),
+	[EOVERFLOW] = ISO_STATUS(LIBUSB_TRANSFER_OVERFLOW),
+	[ETIME] = ISO_STATUS(LIBUSB_TRANSFER_ERROR),
+	[EPROTO] = ISO_STATUS(LIBUSB_TRANSFER_ERROR),
+	[EILSEQ] = ISO_STATUS(LIBUSB_TRANSFER_ERROR),
+	[ECOMM] = ISO_STATUS(LIBUSB_TRANSFER_ERROR),
+	[ENOSR] = ISO_STATUS(LIBUSB_TRANSFER_ERROR),
+	[EXDEV] = ISO_STATUS(LIBUSB_TRANSFER_ERROR),
+};
+
+#define ISO_STATUS_MAP_SIZE (sizeof(iso_status_map) / sizeof(iso_status_map[0]))
+
+/* translate the status of an iso packet */
+static enum libusb_transfer_status iso_packet_status(unsigned int urb_status,
+	int *unknown)
+{
+	unsigned int code = -urb_status;
+	unsigned int entry = code < ISO_STATUS_MAP_SIZE ? iso_status_map[code] : 0;
+
+	if (!entry && !*unknown)
+		*unknown = (int) urb_status;
+	return entry ? (enum libusb_transfer_status) (entry >> 1)
+		: LIBUSB_TRANSFER_ERROR;
+}
+
+/* copy the packet results of an iso URB into the user's descriptors, in one
+ * pass that also accumulates the transfer's packet summary. lib_desc is
+ * NULL for uniform transfers, whose results stay in the URB. returns the
+ * first kernel status that could not be translated, or 0. */
+static int copy_iso_results(struct usbfs_urb *urb,
+	struct libusb_iso_packet_descriptor *lib_desc, int first_packet,
+	struct libusb_iso_packet_summary *summary)
+{
+	const struct usbfs_iso_packet_desc *urb_desc = urb->iso_frame_desc;
+	int num_packets = urb->number_of_packets;
+	unsigned int total_bytes = 0;
+	int error_count = 0;
+	int unknown = 0;
+	int i;
+
+	/* the kernel counts the packets that did not complete successfully, so
+	 * the common case only has lengths to copy */
+	if (urb->error_count == 0) {
+		if (!lib_desc) {
+			for (i = 0; i < num_packets; i++)
+				total_bytes += urb_desc[i].actual_length;
+		} else {
+			for (i = 0; i < num_packets; i++) {
+				lib_desc[i].actual_length = urb_desc[i].actual_length;
+				lib_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+				total_bytes += urb_desc[i].actual_length;
+			}
+		}
+		summary->total_bytes += total_bytes;
+		return 0;
+	}
+
+	for (i = 0; i < num_packets; i++) {
+		enum libusb_transfer_status status =
+			iso_packet_status(urb_desc[i].status, &unknown);
+
+		if (lib_desc) {
+			lib_desc[i].actual_length = urb_desc[i].actual_length;
+			lib_desc[i].status = status;
+		}
+		total_bytes += urb_desc[i].actual_length;
+		if (status != LIBUSB_TRANSFER_COMPLETED && error_count++ == 0
+				&& (summary->first_error_index < 0
+				|| summary->first_error_index > first_packet + i)) {
+			/* keep the lowest failing packet, whatever order the URBs
+			 * are reaped in */
+			summary->first_error_index = first_packet + i;
+			summary->first_error_status = status;
+		}
+	}
+
+	summary->total_bytes += total_bytes;
+	summary->error_count += error_count;
+	return unknown;
+}
+
+static int op_get_iso_packet_result(struct usbi_transfer *itransfer,
+	int packet, unsigned int *actual_length,
+	enum libusb_transfer_status *status)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct usbfs_iso_packet_desc *urb_desc;
+	int unknown = 0;
+
+	if (!tpriv->uniform_packets || packet >= tpriv->uniform_packets)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	urb_desc = &tpriv->iso_urbs[packet / tpriv->uniform_packets_per_urb]
+		->iso_frame_desc[packet % tpriv->uniform_packets_per_urb];
+	*actual_length = urb_desc->actual_length;
+	*status = iso_packet_status(urb_desc->status, &unknown);
+	return 0;
+}
+
+static void op_destroy_transfer(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+
+	/* only uniform iso transfers keep URBs between submissions */
+	if (tpriv->uniform_packets)
+		free_iso_urbs(tpriv);
+}
+
 static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct iso_urb_header *hdr = ISO_URB_HEADER(urb);
 	int num_urbs = tpriv->num_urbs;
-	int urb_idx = 0;
-	int i;
+	int urb_idx = hdr->urb_idx + 1;
+	int unknown;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
 
-	usbi_mutex_lock(&itransfer->lock);
-	for (i = 0; i < num_urbs; i++) {
-		if (urb == tpriv->iso_urbs[i]) {
-			urb_idx = i + 1;
-			break;
-		}
-	}
-	if (urb_idx == 0) {
+	usbi_mutex_lock(transfer_lock(itransfer));
+	if (urb_idx > num_urbs || tpriv->iso_urbs[urb_idx - 1] != urb) {
 		usbi_err(TRANSFER_CTX(transfer), "could not locate urb!");
-		usbi_mutex_unlock(&itransfer->lock);
+		usbi_mutex_unlock(transfer_lock(itransfer));
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
 
-	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
-		urb_idx, num_urbs);
+	usbi_dbg("handling completion status %d of iso urb %d/%d, %d packet errors",
+		urb->status, urb_idx, num_urbs, urb->error_count);
 
 	/* copy isochronous results back in */
-
-	for (i = 0; i < urb->number_of_packets; i++) {
-		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
-		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
-		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
-		switch (urb_desc->status) {
-		case 0:
-			break;
-		case -ENOENT: /* cancelled */
-		case -ECONNRESET:
-			break;
-		case -ENODEV:
-		case -ESHUTDOWN:
-			usbi_dbg("device removed");
-			lib_desc->status = LIBUSB_TRANSFER_NO_DEVICE;
-			break;
-		case -EPIPE:
-			usbi_dbg("detected endpoint stall");
-			lib_desc->status = LIBUSB_TRANSFER_STALL;
-			break;
-		case -EOVERFLOW:
-			usbi_dbg("overflow error");
-			lib_desc->status = LIBUSB_TRANSFER_OVERFLOW;
-			break;
-		case -ETIME:
-		case -EPROTO:
-		case -EILSEQ:
-		case -ECOMM:
-		case -ENOSR:
-		case -EXDEV:
-			usbi_dbg("low-level USB error %d", urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		default:
-			usbi_warn(TRANSFER_CTX(transfer),
-				"unrecognised urb status %d", urb_desc->status);
-			lib_desc->status = LIBUSB_TRANSFER_ERROR;
-			break;
-		}
-		lib_desc->actual_length = urb_desc->actual_length;
-	}
+	unknown = copy_iso_results(urb, tpriv->uniform_packets ? NULL
+		: &transfer->iso_packet_desc[hdr->packet_offset], hdr->packet_offset,
+		&itransfer->iso_summary);
+	if (unknown)
+		usbi_warn(TRANSFER_CTX(transfer),
+			"unrecognised iso packet status %d", unknown);
 
 	tpriv->num_retired++;
 
@@ -2414,12 +3157,16 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg("CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
+			if (!tpriv->uniform_packets)
+				free_iso_urbs(tpriv);
+			usbi_transfer_set_flags(itransfer, USBI_TRANSFER_ISO_SUMMARY);
 			if (tpriv->reap_action == CANCELLED) {
-				usbi_mutex_unlock(&itransfer->lock);
+				usbi_mutex_unlock(transfer_lock(itransfer));
+				usbfs_budget_release(itransfer);
 				return usbi_handle_transfer_cancellation(itransfer);
 			} else {
-				usbi_mutex_unlock(&itransfer->lock);
+				usbi_mutex_unlock(transfer_lock(itransfer));
+				usbfs_budget_release(itransfer);
 				return usbi_handle_transfer_completion(itransfer,
 					LIBUSB_TRANSFER_ERROR);
 			}
@@ -2447,13 +3194,16 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we're the last urb then we're done */
 	if (urb_idx == num_urbs) {
 		usbi_dbg("last URB in transfer --> complete!");
-		free_iso_urbs(tpriv);
-		usbi_mutex_unlock(&itransfer->lock);
+		if (!tpriv->uniform_packets)
+			free_iso_urbs(tpriv);
+		usbi_transfer_set_flags(itransfer, USBI_TRANSFER_ISO_SUMMARY);
+		usbi_mutex_unlock(transfer_lock(itransfer));
+		usbfs_budget_release(itransfer);
 		return usbi_handle_transfer_completion(itransfer, status);
 	}
 
 out:
-	usbi_mutex_unlock(&itransfer->lock);
+	usbi_mutex_unlock(transfer_lock(itransfer));
 	return 0;
 }
 
@@ -2463,7 +3213,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	int status;
 
-	usbi_mutex_lock(&itransfer->lock);
+	usbi_mutex_lock(transfer_lock(itransfer));
 	usbi_dbg("handling completion status %d", urb->status);
 
 	itransfer->transferred += urb->actual_length;
@@ -2472,9 +3222,10 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
+		usbi_free(tpriv->urbs, 0, LIBUSB_ALLOC_SITE_URB);
 		tpriv->urbs = NULL;
-		usbi_mutex_unlock(&itransfer->lock);
+		usbi_mutex_unlock(transfer_lock(itransfer));
+		usbfs_budget_release(itransfer);
 		return usbi_handle_transfer_cancellation(itransfer);
 	}
 
@@ -2513,9 +3264,10 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
+	usbi_free(tpriv->urbs, 0, LIBUSB_ALLOC_SITE_URB);
 	tpriv->urbs = NULL;
-	usbi_mutex_unlock(&itransfer->lock);
+	usbi_mutex_unlock(transfer_lock(itransfer));
+	usbfs_budget_release(itransfer);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
 
@@ -2550,6 +3302,8 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 		return handle_iso_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if (transfer->flags & LIBUSB_TRANSFER_AUTO_RESUBMIT)
+			return handle_resubmit_completion(itransfer, urb);
 		return handle_bulk_completion(itransfer, urb);
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 		return handle_control_completion(itransfer, urb);
@@ -2560,6 +3314,61 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* reap the handles flagged with reap_ready in round-robin order, taking up
+ * to reap_weight URBs from each handle in each round, and no more than
+ * reap_budget * reap_weight URBs from each handle overall. must be called
+ * with open_devs_lock held. returns the number of URBs reaped or a
+ * LIBUSB_ERROR code. */
+static int reap_ready_handles(struct libusb_context *ctx)
+{
+	struct libusb_device_handle *handle;
+	struct linux_device_handle_priv *hpriv;
+	unsigned int budget = ctx->reap_budget;
+	unsigned int quantum;
+	int r, active, reaped = 0;
+
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+		hpriv = _device_handle_priv(handle);
+		if (!budget || budget > UINT_MAX / handle->reap_weight)
+			hpriv->reap_left = UINT_MAX;
+		else
+			hpriv->reap_left = budget * handle->reap_weight;
+	}
+
+	do {
+		active = 0;
+		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
+			hpriv = _device_handle_priv(handle);
+			if (!hpriv->reap_ready)
+				continue;
+
+			for (quantum = handle->reap_weight; quantum; quantum--) {
+				r = reap_for_handle(handle);
+				if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE) {
+					hpriv->reap_ready = 0;
+					break;
+				} else if (r < 0) {
+					goto out;
+				}
+				reaped++;
+				if (--hpriv->reap_left == 0) {
+					usbi_dbg("handle %p exhausted its reap budget", handle);
+					hpriv->reap_ready = 0;
+					break;
+				}
+			}
+			if (hpriv->reap_ready)
+				active = 1;
+		}
+	} while (active);
+
+	r = reaped;
+out:
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle)
+		_device_handle_priv(handle)->reap_ready = 0;
+	return r;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, POLL_NFDS_TYPE nfds, int num_ready)
 {
@@ -2588,17 +3397,27 @@ static int op_handle_events(struct libusb_context *ctx,
 			continue;
 		}
 
-		do {
-			r = reap_for_handle(handle);
-		} while (r == 0);
-		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
-			continue;
-		else if (r < 0)
-			goto out;
+		hpriv->reap_ready = 1;
 	}
 
-	r = 0;
-out:
+	r = reap_ready_handles(ctx);
+	if (r > 0)
+		r = 0;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+	return r;
+}
+
+static int op_busy_poll(struct libusb_context *ctx)
+{
+	struct libusb_device_handle *handle;
+	int r;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle)
+		_device_handle_priv(handle)->reap_ready = 1;
+
+	/* disconnection is reported through POLLERR in op_handle_events */
+	r = reap_ready_handles(ctx);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 	return r;
 }
@@ -2625,7 +3444,8 @@ static clockid_t op_get_timerfd_clockid(void)
 
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|
+		USBI_CAP_SUPPORTS_AUTO_RESUBMIT|USBI_CAP_SUPPORTS_UNIFORM_ISO,
 	.init = op_init,
 	.exit = NULL,
 	.get_device_list = NULL,
@@ -2655,6 +3475,12 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.clear_transfer_priv = op_clear_transfer_priv,
 
 	.handle_events = op_handle_events,
+	.busy_poll = op_busy_poll,
+	.get_transfer_budget_stats = op_get_transfer_budget_stats,
+	.alloc_pool_memory = op_alloc_pool_memory,
+	.free_pool_memory = op_free_pool_memory,
+	.get_iso_packet_result = op_get_iso_packet_result,
+	.destroy_transfer = op_destroy_transfer,
 
 	.clock_gettime = op_clock_gettime,
 
@@ -24,6 +24,7 @@
 #include <linux/types.h>
 
 #define SYSFS_DEVICE_PATH "/sys/bus/usb/devices"
+#define SYSFS_USBFS_MEMORY_MB "/sys/module/usbcore/parameters/usbfs_memory_mb"
 
 struct usbfs_ctrltransfer {
 	/* keep in sync with usbdevice_fs.h:usbdevfs_ctrltransfer */
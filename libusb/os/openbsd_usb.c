@@ -121,6 +121,12 @@ const struct usbi_os_backend openbsd_backend = {
 	obsd_clear_transfer_priv,
 
 	obsd_handle_events,
+	NULL,				/* busy_poll() */
+	NULL,				/* get_transfer_budget_stats() */
+	NULL,				/* alloc_pool_memory() */
+	NULL,				/* free_pool_memory() */
+	NULL,				/* get_iso_packet_result() */
+	NULL,				/* destroy_transfer() */
 
 	obsd_clock_gettime,
 	sizeof(struct device_priv),
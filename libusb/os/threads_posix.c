@@ -35,6 +35,38 @@
 
 #include "threads_posix.h"
 
+int usbi_mutex_prio_inherit = 0;
+
+static int set_prio_inherit(pthread_mutexattr_t *attr)
+{
+#ifdef USBI_MUTEX_PRIO_INHERIT_AVAILABLE
+	if (usbi_mutex_prio_inherit)
+		return pthread_mutexattr_setprotocol(attr, PTHREAD_PRIO_INHERIT);
+#endif
+	return 0;
+}
+
+int usbi_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+	int err;
+	pthread_mutexattr_t pi_attr;
+
+	/* an explicit attribute always wins */
+	if (attr || !usbi_mutex_prio_inherit)
+		return pthread_mutex_init(mutex, attr);
+
+	err = pthread_mutexattr_init(&pi_attr);
+	if (err != 0)
+		return err;
+
+	err = set_prio_inherit(&pi_attr);
+	if (err == 0)
+		err = pthread_mutex_init(mutex, &pi_attr);
+
+	pthread_mutexattr_destroy(&pi_attr);
+	return err;
+}
+
 int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
 {
 	int err;
@@ -51,6 +83,10 @@ int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr)
 	if (err != 0)
 		goto finish;
 
+	err = set_prio_inherit(attr);
+	if (err != 0)
+		goto finish;
+
 	err = pthread_mutex_init(mutex, attr);
 
 finish:
@@ -60,9 +96,34 @@ finish:
 	return err;
 }
 
+/* getting the thread id is a system call on these platforms, and it is
+ * done for every log message, so cache it in thread-local storage. the
+ * thread that forks gets a new id in the child. */
+#if defined(__GNUC__) && (defined(__linux__) || defined(__OpenBSD__))
+#define USBI_CACHE_TID
+
+static __thread int cached_tid = -1;
+static pthread_once_t cached_tid_once = PTHREAD_ONCE_INIT;
+
+static void reset_cached_tid(void)
+{
+	cached_tid = -1;
+}
+
+static void init_cached_tid(void)
+{
+	pthread_atfork(NULL, NULL, reset_cached_tid);
+}
+#endif
+
 int usbi_get_tid(void)
 {
 	int ret = -1;
+#ifdef USBI_CACHE_TID
+	if (cached_tid != -1)
+		return cached_tid;
+	pthread_once(&cached_tid_once, init_cached_tid);
+#endif
 #if defined(__linux__)
 	ret = syscall(SYS_gettid);
 #elif defined(__OpenBSD__)
@@ -76,5 +137,8 @@ int usbi_get_tid(void)
 	ret = GetCurrentThreadId();
 #endif
 /* TODO: NetBSD thread ID support */
+#ifdef USBI_CACHE_TID
+	cached_tid = ret;
+#endif
 	return ret;
 }
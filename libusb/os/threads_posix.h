@@ -22,6 +22,11 @@
 #define LIBUSB_THREADS_POSIX_H
 
 #include <pthread.h>
+#include <unistd.h>
+
+#if defined(_POSIX_THREAD_PRIO_INHERIT) && (_POSIX_THREAD_PRIO_INHERIT > 0)
+#define USBI_MUTEX_PRIO_INHERIT_AVAILABLE
+#endif
 
 #define usbi_mutex_static_t		pthread_mutex_t
 #define USBI_MUTEX_INITIALIZER		PTHREAD_MUTEX_INITIALIZER
@@ -29,7 +34,6 @@
 #define usbi_mutex_static_unlock	pthread_mutex_unlock
 
 #define usbi_mutex_t			pthread_mutex_t
-#define usbi_mutex_init			pthread_mutex_init
 #define usbi_mutex_lock			pthread_mutex_lock
 #define usbi_mutex_unlock		pthread_mutex_unlock
 #define usbi_mutex_trylock		pthread_mutex_trylock
@@ -43,6 +47,25 @@
 #define usbi_cond_destroy		pthread_cond_destroy
 #define usbi_cond_signal		pthread_cond_signal
 
+/* atomic operations with full memory barriers. usbi_atomic_add64 returns
+ * the previous value, usbi_atomic_inc and usbi_atomic_dec the new one.
+ * usbi_atomic_cas stores newval if *ptr equals oldval, and returns the
+ * previous value. */
+#define usbi_atomic_add64(ptr, val)	__sync_fetch_and_add((ptr), (val))
+#define usbi_atomic_inc(ptr)		__sync_add_and_fetch((ptr), 1)
+#define usbi_atomic_dec(ptr)		__sync_sub_and_fetch((ptr), 1)
+#define usbi_atomic_load(ptr)		__sync_fetch_and_add((ptr), 0)
+#define usbi_atomic_cas(ptr, oldval, newval)	\
+	__sync_val_compare_and_swap((ptr), (oldval), (newval))
+#define usbi_atomic_store(ptr, val)	\
+	do { __sync_synchronize(); *(ptr) = (val); __sync_synchronize(); } while (0)
+#define usbi_memory_barrier()		__sync_synchronize()
+
+/* when set, mutexes created through usbi_mutex_init and
+ * usbi_mutex_init_recursive use the PTHREAD_PRIO_INHERIT protocol */
+extern int usbi_mutex_prio_inherit;
+
+extern int usbi_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t *attr);
 
 int usbi_get_tid(void);
@@ -210,3 +210,13 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_get_tid(void) {
 	return GetCurrentThreadId();
 }
+
+uint64_t usbi_atomic_add64(volatile uint64_t *ptr, uint64_t val) {
+	LONGLONG old;
+
+	do {
+		old = *(volatile LONGLONG *)ptr;
+	} while (InterlockedCompareExchange64((volatile LONGLONG *)ptr,
+			old + (LONGLONG)val, old) != old);
+	return (uint64_t)old;
+}
@@ -82,6 +82,19 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 int usbi_cond_broadcast(usbi_cond_t *cond);
 int usbi_cond_signal(usbi_cond_t *cond);
 
+// atomic operations with full memory barriers, on 32-bit words except for
+// usbi_atomic_add64. usbi_atomic_add64 returns the previous value,
+// usbi_atomic_inc and usbi_atomic_dec the new one. usbi_atomic_cas stores
+// newval if *ptr equals oldval, and returns the previous value.
+uint64_t usbi_atomic_add64(volatile uint64_t *ptr, uint64_t val);
+#define usbi_atomic_inc(ptr)        InterlockedIncrement((LONG volatile *)(ptr))
+#define usbi_atomic_dec(ptr)        InterlockedDecrement((LONG volatile *)(ptr))
+#define usbi_atomic_load(ptr)       InterlockedExchangeAdd((LONG volatile *)(ptr), 0)
+#define usbi_atomic_store(ptr, val) InterlockedExchange((LONG volatile *)(ptr), (val))
+#define usbi_atomic_cas(ptr, oldval, newval) \
+	InterlockedCompareExchange((LONG volatile *)(ptr), (newval), (oldval))
+#define usbi_memory_barrier()       MemoryBarrier()
+
 int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_WINDOWS_H */
@@ -663,7 +663,7 @@ static int wince_submit_control_or_bulk_transfer(struct usbi_transfer *itransfer
 		return libusbErr;
 	}
 	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd, direction_in ? POLLIN : POLLOUT);
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
+	usbi_transfer_set_flags(itransfer, USBI_TRANSFER_UPDATED_FDS);
 
 	return LIBUSB_SUCCESS;
 }
@@ -765,7 +765,7 @@ static void wince_transfer_callback(struct usbi_transfer *itransfer, uint32_t io
 		status = LIBUSB_TRANSFER_TIMED_OUT;
 		break;
 	case ERROR_OPERATION_ABORTED:
-		if (itransfer->flags & USBI_TRANSFER_TIMED_OUT) {
+		if (usbi_transfer_test_flags(itransfer, USBI_TRANSFER_TIMED_OUT)) {
 			usbi_dbg("detected timeout");
 			status = LIBUSB_TRANSFER_TIMED_OUT;
 		} else {
@@ -1005,6 +1005,12 @@ const struct usbi_os_backend wince_backend = {
         wince_clear_transfer_priv,
 
         wince_handle_events,
+        NULL,                   /* busy_poll() */
+        NULL,                   /* get_transfer_budget_stats() */
+        NULL,                   /* alloc_pool_memory() */
+        NULL,                   /* free_pool_memory() */
+        NULL,                   /* get_iso_packet_result() */
+        NULL,                   /* destroy_transfer() */
 
         wince_clock_gettime,
         sizeof(struct wince_device_priv),
@@ -1935,7 +1935,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd,
 		(short)(IS_XFERIN(transfer) ? POLLIN : POLLOUT));
 
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
+	usbi_transfer_set_flags(itransfer, USBI_TRANSFER_UPDATED_FDS);
 	return LIBUSB_SUCCESS;
 }
 
@@ -1955,7 +1955,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd,
 		(short)(IS_XFERIN(transfer) ? POLLIN : POLLOUT));
 
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
+	usbi_transfer_set_flags(itransfer, USBI_TRANSFER_UPDATED_FDS);
 	return LIBUSB_SUCCESS;
 }
 
@@ -1974,7 +1974,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	usbi_add_pollfd(ctx, transfer_priv->pollable_fd.fd, POLLIN);
 
-	itransfer->flags |= USBI_TRANSFER_UPDATED_FDS;
+	usbi_transfer_set_flags(itransfer, USBI_TRANSFER_UPDATED_FDS);
 	return LIBUSB_SUCCESS;
 
 }
@@ -2058,7 +2058,7 @@ static void windows_transfer_callback(struct usbi_transfer *itransfer, uint32_t
 		if (istatus != LIBUSB_TRANSFER_COMPLETED) {
 			usbi_dbg("Failed to copy partial data in aborted operation: %d", istatus);
 		}
-		if (itransfer->flags & USBI_TRANSFER_TIMED_OUT) {
+		if (usbi_transfer_test_flags(itransfer, USBI_TRANSFER_TIMED_OUT)) {
 			usbi_dbg("detected timeout");
 			status = LIBUSB_TRANSFER_TIMED_OUT;
 		} else {
@@ -2296,6 +2296,12 @@ const struct usbi_os_backend windows_backend = {
 	windows_clear_transfer_priv,
 
 	windows_handle_events,
+	NULL,				/* busy_poll() */
+	NULL,				/* get_transfer_budget_stats() */
+	NULL,				/* alloc_pool_memory() */
+	NULL,				/* free_pool_memory() */
+	NULL,				/* get_iso_packet_result() */
+	NULL,				/* destroy_transfer() */
 
 	windows_clock_gettime,
 #if defined(USBI_TIMERFD_AVAILABLE)
@@ -33,6 +33,13 @@
  * may wish to consider using the \ref asyncio "asynchronous I/O API" instead.
  */
 
+/* the transfer buffer was allocated with usbi_malloc(), have
+ * libusb_free_transfer() release it */
+static void set_internal_buffer(struct libusb_transfer *transfer)
+{
+	LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->internal_buffer = 1;
+}
+
 static void LIBUSB_CALL ctrl_transfer_cb(struct libusb_transfer *transfer)
 {
 	int *completed = transfer->user_data;
@@ -81,7 +88,8 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	buffer = (unsigned char*) usbi_malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength,
+		LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
 	if (!buffer) {
 		libusb_free_transfer(transfer);
 		return LIBUSB_ERROR_NO_MEM;
@@ -94,7 +102,7 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
 		ctrl_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	set_internal_buffer(transfer);
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
@@ -158,14 +166,88 @@ static void LIBUSB_CALL bulk_transfer_cb(struct libusb_transfer *transfer)
 	/* caller interprets results and frees transfer */
 }
 
-static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
+static int bulk_status_to_error(struct libusb_context *ctx,
+	enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(ctx, "unrecognised status code %d", status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
+/* compute the absolute deadline of an operation with a timeout in
+ * milliseconds */
+static int get_deadline(unsigned int timeout, struct timespec *deadline)
+{
+	int r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, deadline);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+	return 0;
+}
+
+/* handle events until *completed is set or the deadline (if any) passes.
+ * returns LIBUSB_ERROR_TIMEOUT once the deadline has passed. */
+static int wait_for_completion(struct libusb_context *ctx, int *completed,
+	const struct timespec *deadline)
+{
+	struct timespec now;
+	struct timeval tv;
+	int r;
+
+	if (deadline) {
+		r = usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now);
+		if (r < 0)
+			return LIBUSB_ERROR_OTHER;
+		if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec
+		    && now.tv_nsec >= deadline->tv_nsec))
+			return LIBUSB_ERROR_TIMEOUT;
+		tv.tv_sec = deadline->tv_sec - now.tv_sec;
+		tv.tv_usec = (deadline->tv_nsec - now.tv_nsec) / 1000;
+		if (tv.tv_usec < 0) {
+			tv.tv_sec--;
+			tv.tv_usec += 1000000;
+		}
+	} else {
+		tv.tv_sec = 60;
+		tv.tv_usec = 0;
+	}
+
+	r = libusb_handle_events_timeout_completed(ctx, &tv, completed);
+	if (r == LIBUSB_ERROR_INTERRUPTED)
+		r = 0;
+	return r;
+}
+
+/* submit a single bulk or interrupt transfer and wait for it */
+static int sync_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer;
 	int completed = 0;
 	int r;
 
+	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -195,36 +277,1449 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	}
 
 	*transferred = transfer->actual_length;
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
+	r = bulk_status_to_error(HANDLE_CTX(dev_handle), transfer->status);
+
+	libusb_free_transfer(transfer);
+	return r;
+}
+
+/* Pipelined control requests.
+ *
+ * A batch keeps up to max_in_flight control transfers submitted at a time.
+ * Each transfer slot has a buffer large enough for the largest request of
+ * the batch, and is reused as soon as its request completes. */
+
+struct control_batch;
+
+struct control_batch_slot {
+	struct control_batch *batch;
+	struct libusb_transfer *transfer;
+	struct libusb_control_request *request;
+};
+
+struct control_batch {
+	struct libusb_control_request *requests;
+	int num_requests;
+	int flags;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+
+	/* next request to submit, and number of requests in flight */
+	int next;
+	int in_flight;
+	/* slots not in flight */
+	struct control_batch_slot **idle;
+	int idle_count;
+	/* set on each completion, for the submitting thread */
+	int completed;
+	/* error of the first failed request, in submission order */
+	int error;
+	int error_index;
+};
+
+static void control_batch_fail(struct control_batch *batch, int index, int r)
+{
+	if (!batch->error || index < batch->error_index) {
+		batch->error = r;
+		batch->error_index = index;
+	}
+}
+
+static void LIBUSB_CALL control_batch_cb(struct libusb_transfer *transfer)
+{
+	struct control_batch_slot *slot = transfer->user_data;
+	struct control_batch *batch = slot->batch;
+	struct libusb_control_request *request = slot->request;
+	int r;
+
+	r = bulk_status_to_error(TRANSFER_CTX(transfer), transfer->status);
+	request->actual_length = transfer->actual_length;
+	request->status = r;
+	if ((request->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) ==
+			LIBUSB_ENDPOINT_IN && transfer->actual_length)
+		memcpy(request->data, libusb_control_transfer_get_data(transfer),
+			transfer->actual_length);
+
+	if (request->callback)
+		request->callback(request);
+
+	usbi_mutex_lock(&batch->lock);
+	if (r < 0)
+		control_batch_fail(batch, (int)(request - batch->requests), r);
+	batch->idle[batch->idle_count++] = slot;
+	batch->in_flight--;
+	batch->completed = 1;
+	usbi_mutex_unlock(&batch->lock);
+}
+
+/* submit requests for as long as slots are available and barriers allow.
+ * must be called with batch->lock held. */
+static void control_batch_submit(struct control_batch *batch)
+{
+	struct libusb_control_request *request;
+	struct control_batch_slot *slot;
+	unsigned char *buffer;
+	int r;
+
+	while (batch->next < batch->num_requests && batch->idle_count) {
+		if (batch->error &&
+		    (batch->flags & LIBUSB_CONTROL_BATCH_STOP_ON_ERROR))
+			return;
+		request = &batch->requests[batch->next];
+		if ((request->flags & LIBUSB_CONTROL_REQUEST_BARRIER) &&
+		    batch->in_flight)
+			return;
+
+		slot = batch->idle[batch->idle_count - 1];
+		slot->request = request;
+		buffer = slot->transfer->buffer;
+		libusb_fill_control_setup(buffer, request->bmRequestType,
+			request->bRequest, request->wValue, request->wIndex,
+			request->wLength);
+		if ((request->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) ==
+				LIBUSB_ENDPOINT_OUT && request->wLength)
+			memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, request->data,
+				request->wLength);
+		slot->transfer->length = LIBUSB_CONTROL_SETUP_SIZE + request->wLength;
+		slot->transfer->timeout = request->timeout;
+		request->actual_length = 0;
+
+		r = libusb_submit_transfer(slot->transfer);
+		if (r < 0) {
+			usbi_dbg("control request %d failed to submit: %d",
+				batch->next, r);
+			request->status = r;
+			control_batch_fail(batch, batch->next, r);
+		} else {
+			batch->idle_count--;
+			batch->in_flight++;
+		}
+		batch->next++;
+	}
+}
+
+/** \ingroup syncio
+ * Perform a sequence of control requests, keeping several of them in
+ * flight at the same time.
+ *
+ * Configuring a device often takes many vendor requests, each of which
+ * costs a full round trip when done with libusb_control_transfer(). This
+ * function submits up to max_in_flight requests at once instead. The
+ * operating system queues them on the default control pipe, so the device
+ * still sees them one after the other, in array order.
+ *
+ * The result of each request is stored in its \ref
+ * libusb_control_request::status "status" and \ref
+ * libusb_control_request::actual_length "actual_length" fields, and its
+ * callback, if any, is invoked as soon as it completes, from within event
+ * handling. For requests which must not be sent before the previous ones
+ * have completed, e.g. because they depend on their outcome, set
+ * \ref LIBUSB_CONTROL_REQUEST_BARRIER. With
+ * \ref LIBUSB_CONTROL_BATCH_STOP_ON_ERROR, no more requests are submitted
+ * after one failed; requests that were already in flight still complete.
+ * Requests that were never submitted have their status set to
+ * LIBUSB_ERROR_INTERRUPTED.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param requests the requests to perform
+ * \param num_requests the number of requests
+ * \param max_in_flight the maximum number of requests to keep in flight, or
+ * 0 for a default of 8
+ * \param flags a bitwise OR of \ref libusb_control_batch_flags values
+ * \returns 0 if all requests succeeded
+ * \returns the error of the first request that failed, in array order
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the parameters are invalid
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure, in which case
+ * no request was submitted
+ * \returns another LIBUSB_ERROR code if event handling failed, in which case
+ * the requests in flight were cancelled
+ */
+int API_EXPORTED libusb_control_transfer_batch(
+	libusb_device_handle *dev_handle,
+	struct libusb_control_request *requests, int num_requests,
+	int max_in_flight, int flags)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct control_batch batch;
+	struct control_batch_slot *slots;
+	unsigned char *buffer;
+	int max_length = 0;
+	int i, r = 0;
+
+	if (num_requests < 0 || max_in_flight < 0 || (num_requests && !requests))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!max_in_flight)
+		max_in_flight = 8;
+	if (max_in_flight > num_requests)
+		max_in_flight = num_requests;
+
+	for (i = 0; i < num_requests; i++) {
+		requests[i].status = LIBUSB_ERROR_INTERRUPTED;
+		requests[i].actual_length = 0;
+		if (requests[i].wLength > max_length)
+			max_length = requests[i].wLength;
+	}
+	if (!num_requests)
+		return 0;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.requests = requests;
+	batch.num_requests = num_requests;
+	batch.flags = flags;
+	slots = usbi_calloc(max_in_flight, sizeof(*slots), LIBUSB_ALLOC_SITE_OTHER);
+	batch.idle = usbi_calloc(max_in_flight, sizeof(*batch.idle), LIBUSB_ALLOC_SITE_OTHER);
+	if (!slots || !batch.idle) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+	for (i = 0; i < max_in_flight; i++) {
+		slots[i].batch = &batch;
+		slots[i].transfer = libusb_alloc_transfer(0);
+		buffer = usbi_malloc(LIBUSB_CONTROL_SETUP_SIZE + max_length, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+		if (!slots[i].transfer || !buffer) {
+			usbi_free(buffer, 0, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		libusb_fill_control_transfer(slots[i].transfer, dev_handle, buffer,
+			control_batch_cb, &slots[i], 0);
+		set_internal_buffer(slots[i].transfer);
+		batch.idle[batch.idle_count++] = &slots[i];
+	}
+	usbi_mutex_init(&batch.lock, NULL);
+
+	usbi_dbg("%d requests, up to %d in flight", num_requests, max_in_flight);
+	usbi_mutex_lock(&batch.lock);
+	control_batch_submit(&batch);
+	while (batch.in_flight) {
+		batch.completed = 0;
+		usbi_mutex_unlock(&batch.lock);
+		r = libusb_handle_events_completed(ctx, &batch.completed);
+		usbi_mutex_lock(&batch.lock);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
 		r = 0;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
+		control_batch_submit(&batch);
 	}
 
-	libusb_free_transfer(transfer);
+	if (batch.in_flight) {
+		/* event handling failed: take back what is still in flight */
+		for (i = 0; i < max_in_flight; i++)
+			libusb_cancel_transfer(slots[i].transfer);
+		while (batch.in_flight) {
+			batch.completed = 0;
+			usbi_mutex_unlock(&batch.lock);
+			if (libusb_handle_events_completed(ctx, &batch.completed) < 0)
+				usbi_dbg("event handling failed while cancelling batch");
+			usbi_mutex_lock(&batch.lock);
+		}
+	}
+	if (!r)
+		r = batch.error;
+	usbi_mutex_unlock(&batch.lock);
+	usbi_mutex_destroy(&batch.lock);
+
+out:
+	if (slots)
+		for (i = 0; i < max_in_flight; i++)
+			libusb_free_transfer(slots[i].transfer);
+	usbi_free(slots, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(batch.idle, 0, LIBUSB_ALLOC_SITE_OTHER);
+	return r;
+}
+
+/* Bulk IN read-ahead.
+ *
+ * A read-ahead keeps num_transfers transfers of transfer_size bytes posted
+ * on an endpoint at all times. Completed transfers are queued in completion
+ * order, and synchronous reads on the endpoint are served from that queue.
+ * A transfer is resubmitted as soon as all of its data has been consumed.
+ *
+ * Since transfer_size is a multiple of the endpoint's wMaxPacketSize, a
+ * transfer which completes short ended with a short packet, and thus marks
+ * the end of a transfer on the device side. Reads never cross such a
+ * boundary, so that they return exactly what a plain read would have
+ * returned, except that data exceeding the length of the read is kept for
+ * the next read instead of causing an overflow. */
+
+struct read_ahead_slot {
+	struct usbi_read_ahead *ra;
+	struct libusb_transfer *transfer;
+	/* size of the transfer buffer, which is allocated on first use and
+	 * grown when the autotuner increases the transfer size */
+	int buffer_size;
+	int in_flight;
+	/* submission time, for latency measurements */
+	struct timespec submitted;
+};
+
+/* number of completions and minimum duration of an autotuning window */
+#define AUTOTUNE_WINDOW_TRANSFERS	16
+#define AUTOTUNE_WINDOW_USECS		50000
+
+/* number of windows to stay put after going back on a change */
+#define AUTOTUNE_HOLD_WINDOWS		8
+
+/* a change must improve throughput by this many percent to be kept */
+#define AUTOTUNE_MIN_GAIN		5
+
+struct usbi_read_ahead {
+	struct list_head list;
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+
+	/* number of transfers to keep posted and their size. both may be
+	 * changed by the autotuner, num_transfers never exceeds num_slots. */
+	int num_transfers;
+	int transfer_size;
+	int num_slots;
+	struct read_ahead_slot *slots;
+
+	/* completed transfers, oldest first, in a ring of num_slots entries.
+	 * offset is the amount of data already consumed from the oldest one. */
+	struct read_ahead_slot **done;
+	int done_head;
+	int done_count;
+	int offset;
+
+	/* transfers that are neither in flight nor completed */
+	struct read_ahead_slot **idle;
+	int idle_count;
+
+	int in_flight;
+	int stopping;
+	/* set on each completion, for waiting readers */
+	int completed;
+	/* error returned by the last failed submission */
+	int submit_error;
+
+	/* autotuning, see libusb_set_bulk_read_ahead_autotune() */
+	int autotune;
+	int min_transfers;
+	int max_transfers;
+	int min_size;
+	int max_size;
+	int max_packet_size;
+	/* measurements of the current window */
+	struct timespec window_start;
+	int window_transfers;
+	int window_reads;
+	int window_waits;
+	uint64_t window_bytes;
+	uint64_t window_latency;
+	/* last change, and the setting it replaced */
+	int last_step;
+	int last_value;
+	uint64_t last_throughput;
+	int hold;
+
+	struct libusb_read_ahead_stats stats;
+};
+
+static int round_to_packets(int size, int max_packet_size)
+{
+	if (max_packet_size <= 0 || size % max_packet_size == 0)
+		return size;
+	if (size > INT_MAX - max_packet_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	return size + max_packet_size - size % max_packet_size;
+}
+
+static uint64_t usecs_between(const struct timespec *from,
+	const struct timespec *to)
+{
+	int64_t usecs = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+	return usecs > 0 ? (uint64_t)usecs : 0;
+}
+
+/* adjust the settings of an autotuned read-ahead at the end of a
+ * measurement window. must be called with ra->lock held.
+ *
+ * The tuner grows the queue depth first and then the transfer size while
+ * readers keep waiting for the device, as long as each change measurably
+ * improves throughput. A change that does not is undone, and the tuner then
+ * stays put for a while. When readers never wait, the read-ahead is larger
+ * than needed and is shrunk one step at a time. */
+static void read_ahead_tune(struct usbi_read_ahead *ra, uint64_t elapsed)
+{
+	uint64_t throughput = ra->window_bytes * 1000000 / elapsed;
+	int starved = ra->window_waits * 8 > ra->window_reads;
+	int step = LIBUSB_READ_AHEAD_TUNE_NONE;
+	int size;
+
+	if ((ra->last_step == LIBUSB_READ_AHEAD_TUNE_GROW_TRANSFERS ||
+	     ra->last_step == LIBUSB_READ_AHEAD_TUNE_GROW_SIZE) &&
+	    throughput * 100 < ra->last_throughput * (100 + AUTOTUNE_MIN_GAIN)) {
+		if (ra->last_step == LIBUSB_READ_AHEAD_TUNE_GROW_TRANSFERS)
+			ra->num_transfers = ra->last_value;
+		else
+			ra->transfer_size = ra->last_value;
+		step = LIBUSB_READ_AHEAD_TUNE_REVERT;
+		ra->hold = AUTOTUNE_HOLD_WINDOWS;
+	} else if (ra->hold) {
+		ra->hold--;
+	} else if (starved) {
+		if (ra->num_transfers < ra->max_transfers) {
+			ra->last_value = ra->num_transfers;
+			ra->num_transfers = ra->num_transfers > ra->max_transfers / 2 ?
+				ra->max_transfers : ra->num_transfers * 2;
+			step = LIBUSB_READ_AHEAD_TUNE_GROW_TRANSFERS;
+		} else if (ra->transfer_size < ra->max_size) {
+			ra->last_value = ra->transfer_size;
+			ra->transfer_size = ra->transfer_size > ra->max_size / 2 ?
+				ra->max_size : ra->transfer_size * 2;
+			step = LIBUSB_READ_AHEAD_TUNE_GROW_SIZE;
+		}
+	} else if (!ra->window_waits) {
+		if (ra->num_transfers > ra->min_transfers) {
+			ra->num_transfers--;
+			step = LIBUSB_READ_AHEAD_TUNE_SHRINK_TRANSFERS;
+		} else if (ra->transfer_size > ra->min_size) {
+			size = ra->transfer_size / 2;
+			if (ra->max_packet_size > 0)
+				size -= size % ra->max_packet_size;
+			ra->transfer_size = size > ra->min_size ? size : ra->min_size;
+			step = LIBUSB_READ_AHEAD_TUNE_SHRINK_SIZE;
+		}
+		/* give readers a chance to notice before shrinking further */
+		if (step != LIBUSB_READ_AHEAD_TUNE_NONE)
+			ra->hold = AUTOTUNE_HOLD_WINDOWS / 2;
+	}
+
+	ra->stats.throughput = throughput;
+	ra->stats.latency_usecs =
+		(unsigned int)(ra->window_latency / ra->window_transfers);
+	if (step != LIBUSB_READ_AHEAD_TUNE_NONE) {
+		usbi_dbg("ep %02x: %u B/s, step %d -> %d transfers of %d bytes",
+			ra->endpoint, (unsigned int)throughput, step,
+			ra->num_transfers, ra->transfer_size);
+		ra->stats.tune_steps++;
+		ra->stats.last_tune_step = step;
+	}
+	ra->last_step = step;
+	ra->last_throughput = throughput;
+}
+
+/* account a completed transfer to the current autotuning window. must be
+ * called with ra->lock held. */
+static void read_ahead_measure(struct usbi_read_ahead *ra,
+	struct read_ahead_slot *slot)
+{
+	struct timespec now;
+	uint64_t elapsed;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now) < 0)
+		return;
+
+	ra->window_transfers++;
+	ra->window_bytes += slot->transfer->actual_length;
+	ra->window_latency += usecs_between(&slot->submitted, &now);
+
+	elapsed = usecs_between(&ra->window_start, &now);
+	if (ra->window_transfers < AUTOTUNE_WINDOW_TRANSFERS ||
+	    elapsed < AUTOTUNE_WINDOW_USECS)
+		return;
+
+	read_ahead_tune(ra, elapsed);
+	ra->window_start = now;
+	ra->window_transfers = 0;
+	ra->window_reads = 0;
+	ra->window_waits = 0;
+	ra->window_bytes = 0;
+	ra->window_latency = 0;
+}
+
+static void read_ahead_arm(struct usbi_read_ahead *ra);
+
+static void LIBUSB_CALL read_ahead_cb(struct libusb_transfer *transfer)
+{
+	struct read_ahead_slot *slot = transfer->user_data;
+	struct usbi_read_ahead *ra = slot->ra;
+
+	usbi_mutex_lock(&ra->lock);
+	slot->in_flight = 0;
+	ra->in_flight--;
+	if (ra->stopping) {
+		ra->idle[ra->idle_count++] = slot;
+	} else {
+		ra->done[(ra->done_head + ra->done_count) % ra->num_slots] = slot;
+		ra->done_count++;
+		ra->stats.transfers++;
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+		    transfer->actual_length < transfer->length)
+			ra->stats.short_transfers++;
+		if (ra->autotune && transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			read_ahead_measure(ra, slot);
+			/* the queue may just have been deepened */
+			read_ahead_arm(ra);
+		}
+	}
+	ra->completed = 1;
+	usbi_mutex_unlock(&ra->lock);
+}
+
+/* submit idle transfers until num_transfers of them are posted or hold
+ * unread data. must be called with ra->lock held. */
+static void read_ahead_arm(struct usbi_read_ahead *ra)
+{
+	struct read_ahead_slot *slot;
+	unsigned char *buffer;
+	int r;
+
+	while (ra->idle_count && !ra->stopping &&
+	       ra->in_flight + ra->done_count < ra->num_transfers) {
+		slot = ra->idle[ra->idle_count - 1];
+		if (slot->buffer_size < ra->transfer_size) {
+			buffer = usbi_realloc(slot->transfer->buffer, slot->buffer_size,
+				ra->transfer_size, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+			if (!buffer) {
+				ra->submit_error = LIBUSB_ERROR_NO_MEM;
+				return;
+			}
+			slot->transfer->buffer = buffer;
+			slot->buffer_size = ra->transfer_size;
+		}
+		slot->transfer->length = ra->transfer_size;
+		if (ra->autotune)
+			usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+				&slot->submitted);
+		r = libusb_submit_transfer(slot->transfer);
+		if (r < 0) {
+			usbi_dbg("read-ahead submission failed: %d", r);
+			ra->submit_error = r;
+			return;
+		}
+		ra->idle_count--;
+		slot->in_flight = 1;
+		ra->in_flight++;
+	}
+}
+
+static int read_ahead_read(struct usbi_read_ahead *ra, unsigned char *data,
+	int length, int *transferred, unsigned int timeout)
+{
+	struct libusb_context *ctx = HANDLE_CTX(ra->dev_handle);
+	struct read_ahead_slot *slot;
+	struct libusb_transfer *transfer;
+	struct timespec deadline;
+	int copied = 0, waited = 0;
+	int n, boundary;
+	int r = 0;
+
+	if (timeout && get_deadline(timeout, &deadline) < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	usbi_mutex_lock(&ra->lock);
+	read_ahead_arm(ra);
+	while (copied < length) {
+		if (!ra->done_count) {
+			if (!ra->in_flight) {
+				/* nothing will ever complete */
+				r = ra->submit_error ? ra->submit_error : LIBUSB_ERROR_IO;
+				break;
+			}
+			ra->completed = 0;
+			usbi_mutex_unlock(&ra->lock);
+			r = wait_for_completion(ctx, &ra->completed,
+				timeout ? &deadline : NULL);
+			usbi_mutex_lock(&ra->lock);
+			waited = 1;
+			if (r < 0)
+				break;
+			continue;
+		}
+
+		slot = ra->done[ra->done_head];
+		transfer = slot->transfer;
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+			/* hand over any data read so far first, and report the error
+			 * on the next read */
+			if (copied == 0) {
+				r = bulk_status_to_error(ctx, transfer->status);
+				ra->done_head = (ra->done_head + 1) % ra->num_slots;
+				ra->done_count--;
+				ra->idle[ra->idle_count++] = slot;
+			}
+			break;
+		}
+
+		n = transfer->actual_length - ra->offset;
+		if (n > length - copied)
+			n = length - copied;
+		memcpy(data + copied, transfer->buffer + ra->offset, n);
+		copied += n;
+		ra->offset += n;
+		if (ra->offset < transfer->actual_length)
+			break;
+
+		/* this transfer is used up: recycle it */
+		boundary = transfer->actual_length < transfer->length;
+		ra->offset = 0;
+		ra->done_head = (ra->done_head + 1) % ra->num_slots;
+		ra->done_count--;
+		ra->idle[ra->idle_count++] = slot;
+		read_ahead_arm(ra);
+		if (boundary)
+			break;
+	}
+
+	ra->stats.reads++;
+	ra->window_reads++;
+	if (waited)
+		ra->window_waits++;
+	else
+		ra->stats.buffered_reads++;
+	ra->stats.bytes += copied;
+	usbi_mutex_unlock(&ra->lock);
+
+	*transferred = copied;
+	return r;
+}
+
+/* cancel and free a read-ahead, discarding any buffered data. the
+ * read-ahead must already be unlinked from its handle. */
+static void free_read_ahead(struct usbi_read_ahead *ra)
+{
+	struct libusb_context *ctx = HANDLE_CTX(ra->dev_handle);
+	int i;
+
+	usbi_mutex_lock(&ra->lock);
+	ra->stopping = 1;
+	for (i = 0; i < ra->num_slots; i++)
+		if (ra->slots[i].in_flight)
+			libusb_cancel_transfer(ra->slots[i].transfer);
+	while (ra->in_flight) {
+		ra->completed = 0;
+		usbi_mutex_unlock(&ra->lock);
+		if (libusb_handle_events_completed(ctx, &ra->completed) < 0)
+			usbi_dbg("event handling failed while stopping read-ahead");
+		usbi_mutex_lock(&ra->lock);
+	}
+	usbi_mutex_unlock(&ra->lock);
+
+	for (i = 0; i < ra->num_slots; i++)
+		libusb_free_transfer(ra->slots[i].transfer);
+	usbi_mutex_destroy(&ra->lock);
+	usbi_free(ra->slots, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(ra->done, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(ra->idle, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(ra, sizeof(*ra), LIBUSB_ALLOC_SITE_OTHER);
+}
+
+/* allocate a read-ahead with num_slots transfers. buffers are allocated
+ * when the transfers are first submitted. */
+static struct usbi_read_ahead *alloc_read_ahead(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int num_slots)
+{
+	struct usbi_read_ahead *ra;
+	struct libusb_transfer *transfer;
+	int i;
+
+	ra = usbi_calloc(1, sizeof(*ra), LIBUSB_ALLOC_SITE_OTHER);
+	if (!ra)
+		return NULL;
+
+	ra->dev_handle = dev_handle;
+	ra->endpoint = endpoint;
+	ra->num_slots = num_slots;
+	ra->slots = usbi_calloc(num_slots, sizeof(*ra->slots), LIBUSB_ALLOC_SITE_OTHER);
+	ra->done = usbi_calloc(num_slots, sizeof(*ra->done), LIBUSB_ALLOC_SITE_OTHER);
+	ra->idle = usbi_calloc(num_slots, sizeof(*ra->idle), LIBUSB_ALLOC_SITE_OTHER);
+	if (!ra->slots || !ra->done || !ra->idle)
+		goto err;
+	usbi_mutex_init(&ra->lock, NULL);
+
+	for (i = 0; i < num_slots; i++) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			break;
+		libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, NULL, 0,
+			read_ahead_cb, &ra->slots[i], 0);
+		set_internal_buffer(transfer);
+		ra->slots[i].ra = ra;
+		ra->slots[i].transfer = transfer;
+		ra->idle[ra->idle_count++] = &ra->slots[i];
+	}
+	if (i == num_slots)
+		return ra;
+
+	while (i--)
+		libusb_free_transfer(ra->slots[i].transfer);
+	usbi_mutex_destroy(&ra->lock);
+err:
+	usbi_free(ra->slots, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(ra->done, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(ra->idle, 0, LIBUSB_ALLOC_SITE_OTHER);
+	usbi_free(ra, sizeof(*ra), LIBUSB_ALLOC_SITE_OTHER);
+	return NULL;
+}
+
+static struct usbi_read_ahead *find_read_ahead(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	struct usbi_read_ahead *ra;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_for_each_entry(ra, &dev_handle->read_aheads, list, struct usbi_read_ahead) {
+		if (ra->endpoint == endpoint) {
+			usbi_mutex_unlock(&dev_handle->lock);
+			return ra;
+		}
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+	return NULL;
+}
+
+/* stop all read-aheads of a handle which is being closed */
+void usbi_free_read_aheads(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_read_ahead *ra;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	while (!list_empty(&dev_handle->read_aheads)) {
+		ra = list_entry(dev_handle->read_aheads.next, struct usbi_read_ahead, list);
+		list_del(&ra->list);
+		usbi_mutex_unlock(&dev_handle->lock);
+		free_read_ahead(ra);
+		usbi_mutex_lock(&dev_handle->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+/* disable the read-ahead on an endpoint, if any */
+static void remove_read_ahead(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	struct usbi_read_ahead *ra = find_read_ahead(dev_handle, endpoint);
+
+	if (!ra)
+		return;
+	usbi_mutex_lock(&dev_handle->lock);
+	list_del(&ra->list);
+	usbi_mutex_unlock(&dev_handle->lock);
+	free_read_ahead(ra);
+}
+
+/* post the initial transfers of a new read-ahead and make it visible to
+ * readers */
+static int start_read_ahead(struct usbi_read_ahead *ra)
+{
+	struct libusb_device_handle *dev_handle = ra->dev_handle;
+	int r;
+
+	usbi_mutex_lock(&ra->lock);
+	read_ahead_arm(ra);
+	r = ra->submit_error;
+	usbi_mutex_unlock(&ra->lock);
+	if (!ra->in_flight) {
+		free_read_ahead(ra);
+		return r ? r : LIBUSB_ERROR_OTHER;
+	}
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_add_tail(&ra->list, &dev_handle->read_aheads);
+	usbi_mutex_unlock(&dev_handle->lock);
+	return 0;
+}
+
+/** \ingroup syncio
+ * Enable, reconfigure or disable read-ahead on a bulk IN endpoint.
+ *
+ * Applications reading a device through many small libusb_bulk_transfer()
+ * calls pay for a full round trip to the device for each of them. With
+ * read-ahead enabled, libusbx keeps num_transfers transfers of up to
+ * transfer_size bytes each posted on the endpoint, and
+ * libusb_bulk_transfer() reads on that endpoint are served from the data
+ * they received, only waiting for the device when no data is buffered.
+ *
+ * Reads keep the semantics of a plain bulk read: a read returns when it has
+ * been filled, or at the end of a transfer from the device, i.e. after a
+ * short or zero-length packet. The only difference is that data sent by the
+ * device in excess of the size of a read is kept for the next read, rather
+ * than causing an overflow error. A read that times out still returns the
+ * data it received in <tt>transferred</tt>, and data arriving afterwards is
+ * kept for the next read.
+ *
+ * transfer_size is rounded up to a multiple of the endpoint's
+ * wMaxPacketSize. Transfers are posted with no timeout, and are resubmitted
+ * as soon as their data has been read. If a transfer fails, the error is
+ * returned by the read which reaches it, and the transfer is resubmitted on
+ * the next read.
+ *
+ * Reconfiguring or disabling read-ahead cancels the posted transfers and
+ * discards any data that has not been read yet. Read-ahead is disabled
+ * automatically when the handle is closed. This function must not be called
+ * concurrently with reads on the same endpoint.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of a bulk IN endpoint
+ * \param num_transfers number of transfers to keep posted, or 0 to disable
+ * read-ahead
+ * \param transfer_size size of each transfer, in bytes
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an IN endpoint or
+ * the sizes are invalid
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ * \see libusb_set_bulk_read_ahead_autotune()
+ */
+int API_EXPORTED libusb_set_bulk_read_ahead(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int num_transfers, int transfer_size)
+{
+	struct usbi_read_ahead *ra;
+	int max_packet_size;
+
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) || num_transfers < 0 ||
+	    (num_transfers && transfer_size <= 0))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	remove_read_ahead(dev_handle, endpoint);
+	if (!num_transfers)
+		return 0;
+
+	max_packet_size = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+	if (max_packet_size < 0)
+		return max_packet_size;
+	transfer_size = round_to_packets(transfer_size, max_packet_size);
+	if (transfer_size < 0)
+		return transfer_size;
+
+	usbi_dbg("ep %02x: %d transfers of %d bytes", endpoint, num_transfers,
+		transfer_size);
+	ra = alloc_read_ahead(dev_handle, endpoint, num_transfers);
+	if (!ra)
+		return LIBUSB_ERROR_NO_MEM;
+	ra->num_transfers = num_transfers;
+	ra->transfer_size = transfer_size;
+	return start_read_ahead(ra);
+}
+
+/** \ingroup syncio
+ * Enable read-ahead on a bulk IN endpoint, letting libusbx choose the
+ * number of transfers and their size.
+ *
+ * The best settings for libusb_set_bulk_read_ahead() depend on the device,
+ * the host controller, any hubs in between and the operating system, and
+ * are hard to guess. With autotuning, libusbx starts with min_transfers
+ * transfers of min_size bytes and measures the throughput and completion
+ * latency of the endpoint as it is being read. As long as readers have to
+ * wait for the device, it doubles the number of transfers, and then their
+ * size, within the given bounds, keeping each change only if it improves
+ * throughput by a few percent. When readers never wait, the read-ahead is
+ * shrunk again step by step. The measurements and decisions are reported
+ * by libusb_get_bulk_read_ahead_stats().
+ *
+ * Reads behave exactly as described for libusb_set_bulk_read_ahead(). The
+ * transfer buffers are allocated as needed, so up to max_transfers buffers
+ * of max_size bytes may eventually be allocated. Sizes are rounded up to a
+ * multiple of the endpoint's wMaxPacketSize. Large transfers may be split by
+ * the operating system backend; the autotuner then simply measures the
+ * resulting throughput.
+ *
+ * Any read-ahead previously set up on the endpoint is replaced, and its
+ * data discarded. Call libusb_set_bulk_read_ahead() to go back to fixed
+ * settings or to disable read-ahead. This function must not be called
+ * concurrently with reads on the same endpoint.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of a bulk IN endpoint
+ * \param min_transfers minimum number of transfers to keep posted
+ * \param max_transfers maximum number of transfers to keep posted
+ * \param min_size minimum size of each transfer, in bytes
+ * \param max_size maximum size of each transfer, in bytes
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an IN endpoint or
+ * the bounds are invalid
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_bulk_read_ahead_autotune(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int min_transfers, int max_transfers, int min_size, int max_size)
+{
+	struct usbi_read_ahead *ra;
+	int max_packet_size;
+
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) || min_transfers <= 0 ||
+	    max_transfers < min_transfers || min_size <= 0 || max_size < min_size)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	remove_read_ahead(dev_handle, endpoint);
+
+	max_packet_size = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+	if (max_packet_size < 0)
+		return max_packet_size;
+	min_size = round_to_packets(min_size, max_packet_size);
+	max_size = round_to_packets(max_size, max_packet_size);
+	if (min_size < 0 || max_size < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_dbg("ep %02x: %d-%d transfers of %d-%d bytes", endpoint,
+		min_transfers, max_transfers, min_size, max_size);
+	ra = alloc_read_ahead(dev_handle, endpoint, max_transfers);
+	if (!ra)
+		return LIBUSB_ERROR_NO_MEM;
+	ra->num_transfers = min_transfers;
+	ra->transfer_size = min_size;
+	ra->autotune = 1;
+	ra->min_transfers = min_transfers;
+	ra->max_transfers = max_transfers;
+	ra->min_size = min_size;
+	ra->max_size = max_size;
+	ra->max_packet_size = max_packet_size;
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC,
+			&ra->window_start) < 0) {
+		free_read_ahead(ra);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return start_read_ahead(ra);
+}
+
+/** \ingroup syncio
+ * Retrieve the statistics of the read-ahead on an endpoint.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if read-ahead is not enabled on the
+ * endpoint
+ * \see libusb_set_bulk_read_ahead()
+ */
+int API_EXPORTED libusb_get_bulk_read_ahead_stats(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	struct libusb_read_ahead_stats *stats)
+{
+	struct usbi_read_ahead *ra = find_read_ahead(dev_handle, endpoint);
+
+	if (!ra)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&ra->lock);
+	*stats = ra->stats;
+	stats->num_transfers = ra->num_transfers;
+	stats->transfer_size = ra->transfer_size;
+	usbi_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+/* Bulk OUT write combining.
+ *
+ * Synchronous writes on the endpoint are copied into the buffer of one of
+ * two transfers, which is submitted once it is full, when a write must end
+ * a batch, when the flush deadline expires, or on an explicit flush. While
+ * one transfer is in flight, writes fill the other one. Errors of combined
+ * transfers are reported by the next call on the endpoint. */
+
+struct usbi_write_combiner {
+	struct list_head list;
+	struct libusb_device_handle *dev_handle;
+	unsigned char endpoint;
+
+	/* protects everything below */
+	usbi_mutex_t lock;
+
+	int buffer_size;
+	unsigned int flush_usecs;
+	int flags;
+	int max_packet_size;
+
+	struct libusb_transfer *transfers[2];
+	int in_flight[2];
+	int num_in_flight;
+	/* the transfer being filled, and the amount of data in it */
+	int fill;
+	int fill_length;
+	/* a zero-length packet must be sent to mark a boundary, after the data
+	 * being filled if there is any */
+	int send_zlp;
+
+	int stopping;
+	/* set on each completion, for waiting writers */
+	int completed;
+	/* error of a combined transfer, not reported yet */
+	int error;
+
+	struct usbi_timer timer;
+};
+
+static void LIBUSB_CALL write_combiner_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_write_combiner *wc = transfer->user_data;
+	int i = (transfer == wc->transfers[1]);
+
+	usbi_mutex_lock(&wc->lock);
+	wc->in_flight[i] = 0;
+	wc->num_in_flight--;
+	if (!wc->stopping && !wc->error) {
+		wc->error = bulk_status_to_error(HANDLE_CTX(wc->dev_handle),
+			transfer->status);
+		if (!wc->error && transfer->actual_length < transfer->length)
+			wc->error = LIBUSB_ERROR_IO;
+	}
+	wc->completed = 1;
+	usbi_mutex_unlock(&wc->lock);
+}
+
+/* submit the transfer being filled, and switch to the other one. must be
+ * called with wc->lock held. */
+static int write_combiner_submit(struct usbi_write_combiner *wc)
+{
+	struct libusb_transfer *transfer = wc->transfers[wc->fill];
+	int zlp;
+	int r;
+
+	if (!wc->fill_length && !wc->send_zlp)
+		return 0;
+	if (wc->in_flight[wc->fill])
+		return LIBUSB_ERROR_BUSY;
+
+	/* data ending on a packet boundary needs a zero-length packet of its
+	 * own to end the transfer on the device side */
+	zlp = wc->send_zlp && wc->fill_length &&
+		!(wc->fill_length % wc->max_packet_size);
+
+	usbi_disarm_timer(HANDLE_CTX(wc->dev_handle), &wc->timer);
+	transfer->length = wc->fill_length;
+	if (zlp)
+		transfer->flags |= LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	else
+		transfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+	r = libusb_submit_transfer(transfer);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED && zlp) {
+		/* the backend cannot append it, it will be sent on its own by
+		 * write_combiner_send_zlp() */
+		transfer->flags &= ~LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+		r = libusb_submit_transfer(transfer);
+	} else {
+		zlp = 0;
+	}
+	if (r < 0) {
+		usbi_dbg("combined write submission failed: %d", r);
+		return r;
+	}
+	wc->in_flight[wc->fill] = 1;
+	wc->num_in_flight++;
+	wc->fill ^= 1;
+	wc->fill_length = 0;
+	wc->send_zlp = zlp;
+	return 0;
+}
+
+static void write_combiner_timer_cb(void *user_data)
+{
+	struct usbi_write_combiner *wc = user_data;
+	int r;
+
+	usbi_mutex_lock(&wc->lock);
+	if (!wc->stopping) {
+		r = write_combiner_submit(wc);
+		if (r < 0 && !wc->error)
+			wc->error = r;
+	}
+	usbi_mutex_unlock(&wc->lock);
+}
+
+/* wait until the transfer being filled is not in flight any more, or until
+ * everything has been sent if all is set. must be called with wc->lock
+ * held. */
+static int write_combiner_wait(struct usbi_write_combiner *wc, int all,
+	const struct timespec *deadline)
+{
+	int r = 0;
+
+	while (all ? wc->num_in_flight : wc->in_flight[wc->fill]) {
+		wc->completed = 0;
+		usbi_mutex_unlock(&wc->lock);
+		r = wait_for_completion(HANDLE_CTX(wc->dev_handle), &wc->completed,
+			deadline);
+		usbi_mutex_lock(&wc->lock);
+		if (r < 0)
+			break;
+	}
+	return r;
+}
+
+/* send a zero-length packet left pending by write_combiner_submit(), once
+ * the other transfer is available. must be called with wc->lock held. */
+static int write_combiner_send_zlp(struct usbi_write_combiner *wc,
+	const struct timespec *deadline)
+{
+	int r;
+
+	if (!wc->send_zlp || wc->fill_length)
+		return 0;
+	r = write_combiner_wait(wc, 0, deadline);
+	if (r == 0)
+		r = write_combiner_submit(wc);
+	return r;
+}
+
+static int write_combiner_write(struct usbi_write_combiner *wc,
+	unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
+{
+	struct timespec deadline, *dl = NULL;
+	int boundary, flush = 0;
+	int r;
+
+	*transferred = 0;
+	if (timeout) {
+		if (get_deadline(timeout, &deadline) < 0)
+			return LIBUSB_ERROR_OTHER;
+		dl = &deadline;
+	}
+
+	usbi_mutex_lock(&wc->lock);
+	if (wc->error) {
+		r = wc->error;
+		wc->error = 0;
+		goto out;
+	}
+
+	r = write_combiner_send_zlp(wc, dl);
+	if (r < 0)
+		goto out;
+
+	/* start a new buffer if this write does not fit */
+	if (length > wc->buffer_size - wc->fill_length) {
+		r = write_combiner_submit(wc);
+		if (r < 0)
+			goto out;
+	}
+
+	if (length >= wc->buffer_size) {
+		/* too large to be worth combining: send it as is, queued behind
+		 * whatever we have in flight */
+		usbi_mutex_unlock(&wc->lock);
+		return sync_transfer(wc->dev_handle, wc->endpoint, data, length,
+			transferred, timeout, LIBUSB_TRANSFER_TYPE_BULK);
+	}
+
+	r = write_combiner_wait(wc, 0, dl);
+	if (r < 0)
+		goto out;
+
+	memcpy(wc->transfers[wc->fill]->buffer + wc->fill_length, data, length);
+	if (!wc->fill_length && length && wc->flush_usecs &&
+	    usbi_arm_timer(HANDLE_CTX(wc->dev_handle), &wc->timer,
+		wc->flush_usecs) < 0) {
+		/* without a deadline the data could be held back indefinitely */
+		usbi_dbg("failed to arm the flush timer, sending now");
+		flush = 1;
+	}
+	wc->fill_length += length;
+	*transferred = length;
+
+	/* a write ending with a short packet ends a transfer on the device
+	 * side. when asked to keep those boundaries, it must not be merged with
+	 * what comes next. */
+	boundary = (wc->flags & LIBUSB_WRITE_COMBINING_KEEP_BOUNDARIES) &&
+		(length == 0 || length % wc->max_packet_size);
+	if (boundary && length == 0)
+		wc->send_zlp = 1;
+	if (boundary || flush || wc->fill_length == wc->buffer_size)
+		r = write_combiner_submit(wc);
+	if (r == 0)
+		r = write_combiner_send_zlp(wc, dl);
+
+out:
+	usbi_mutex_unlock(&wc->lock);
 	return r;
 }
 
+/* send everything and wait for it, returning any pending error. must be
+ * called with wc->lock held. */
+static int write_combiner_flush(struct usbi_write_combiner *wc,
+	unsigned int timeout)
+{
+	struct timespec deadline, *dl = NULL;
+	int r;
+
+	if (timeout) {
+		if (get_deadline(timeout, &deadline) < 0)
+			return LIBUSB_ERROR_OTHER;
+		dl = &deadline;
+	}
+
+	/* the buffer being filled may be waiting for the other one */
+	r = write_combiner_wait(wc, 0, dl);
+	if (r == 0)
+		r = write_combiner_submit(wc);
+	if (r == 0)
+		r = write_combiner_send_zlp(wc, dl);
+	if (r == 0)
+		r = write_combiner_wait(wc, 1, dl);
+	if (r == 0 && wc->error) {
+		r = wc->error;
+		wc->error = 0;
+	}
+	return r;
+}
+
+/* cancel and free a write combiner, discarding any buffered data. the
+ * combiner must already be unlinked from its handle. */
+static void free_write_combiner(struct usbi_write_combiner *wc)
+{
+	struct libusb_context *ctx = HANDLE_CTX(wc->dev_handle);
+	int i;
+
+	/* the timer callback takes wc->lock, it must not be held here */
+	usbi_stop_timer(ctx, &wc->timer);
+
+	usbi_mutex_lock(&wc->lock);
+	wc->stopping = 1;
+	for (i = 0; i < 2; i++)
+		if (wc->in_flight[i])
+			libusb_cancel_transfer(wc->transfers[i]);
+	while (wc->num_in_flight) {
+		wc->completed = 0;
+		usbi_mutex_unlock(&wc->lock);
+		if (libusb_handle_events_completed(ctx, &wc->completed) < 0)
+			usbi_dbg("event handling failed while stopping write combining");
+		usbi_mutex_lock(&wc->lock);
+	}
+	usbi_mutex_unlock(&wc->lock);
+
+	for (i = 0; i < 2; i++)
+		libusb_free_transfer(wc->transfers[i]);
+	usbi_mutex_destroy(&wc->lock);
+	usbi_free(wc, sizeof(*wc), LIBUSB_ALLOC_SITE_OTHER);
+}
+
+static struct usbi_write_combiner *alloc_write_combiner(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int buffer_size, int max_packet_size)
+{
+	struct usbi_write_combiner *wc;
+	unsigned char *buffer;
+	int i;
+
+	wc = usbi_calloc(1, sizeof(*wc), LIBUSB_ALLOC_SITE_OTHER);
+	if (!wc)
+		return NULL;
+
+	wc->dev_handle = dev_handle;
+	wc->endpoint = endpoint;
+	wc->buffer_size = buffer_size;
+	wc->max_packet_size = max_packet_size;
+	usbi_init_timer(&wc->timer, write_combiner_timer_cb, wc);
+
+	for (i = 0; i < 2; i++) {
+		wc->transfers[i] = libusb_alloc_transfer(0);
+		buffer = usbi_malloc(buffer_size, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+		if (!wc->transfers[i] || !buffer) {
+			usbi_free(buffer, buffer_size, LIBUSB_ALLOC_SITE_TRANSFER_BUFFER);
+			goto err;
+		}
+		libusb_fill_bulk_transfer(wc->transfers[i], dev_handle, endpoint,
+			buffer, buffer_size, write_combiner_cb, wc, 0);
+		set_internal_buffer(wc->transfers[i]);
+	}
+	usbi_mutex_init(&wc->lock, NULL);
+	return wc;
+
+err:
+	for (i = 0; i < 2; i++)
+		libusb_free_transfer(wc->transfers[i]);
+	usbi_free(wc, sizeof(*wc), LIBUSB_ALLOC_SITE_OTHER);
+	return NULL;
+}
+
+static struct usbi_write_combiner *find_write_combiner(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint)
+{
+	struct usbi_write_combiner *wc;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_for_each_entry(wc, &dev_handle->write_combiners, list, struct usbi_write_combiner) {
+		if (wc->endpoint == endpoint) {
+			usbi_mutex_unlock(&dev_handle->lock);
+			return wc;
+		}
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+	return NULL;
+}
+
+/* discard the write combining buffers of a handle which is being closed */
+void usbi_free_write_combiners(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_write_combiner *wc;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	while (!list_empty(&dev_handle->write_combiners)) {
+		wc = list_entry(dev_handle->write_combiners.next,
+			struct usbi_write_combiner, list);
+		list_del(&wc->list);
+		usbi_mutex_unlock(&dev_handle->lock);
+		free_write_combiner(wc);
+		usbi_mutex_lock(&dev_handle->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+/** \ingroup syncio
+ * Enable, reconfigure or disable write combining on a bulk OUT endpoint.
+ *
+ * Applications sending many small libusb_bulk_transfer() writes pay for a
+ * separate transfer, and usually a separate round trip, for each of them.
+ * With write combining enabled, writes on the endpoint are copied into a
+ * buffer of buffer_size bytes and return immediately. The buffer is sent to
+ * the device as a single transfer when it is full, when flush_usecs
+ * microseconds have passed since the first write into it, or when
+ * libusb_flush_bulk_writes() is called. A second buffer is filled while the
+ * first one is being sent. Writes larger than the buffer are sent directly,
+ * after any buffered data.
+ *
+ * Merging writes changes how the data is split into packets: a short write
+ * that would have ended with a short packet may be merged with the data
+ * that follows. If the device relies on short packets to delimit messages,
+ * pass \ref LIBUSB_WRITE_COMBINING_KEEP_BOUNDARIES, so that such writes
+ * (including zero-length writes) are always sent at the end of a transfer.
+ *
+ * Since writes return before the data is sent, errors are reported by the
+ * next write on the endpoint or by libusb_flush_bulk_writes(). A successful
+ * write only means that the data has been accepted into the buffer.
+ *
+ * Reconfiguring or disabling write combining first flushes the buffered
+ * data, waiting for it to be sent. Closing the handle on the other hand
+ * discards data that was not sent yet, so flush before closing. This
+ * function must not be called concurrently with writes on the same
+ * endpoint.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of a bulk OUT endpoint
+ * \param buffer_size size of each buffer in bytes, rounded up to a multiple
+ * of the endpoint's wMaxPacketSize, or 0 to disable write combining
+ * \param flush_usecs maximum time in microseconds that data may stay in the
+ * buffer before being sent, or 0 to only send it when the buffer is full or
+ * flushed
+ * \param flags a bitwise OR of \ref libusb_write_combining_flags values
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an OUT endpoint
+ * or the buffer size is invalid
+ * \returns LIBUSB_ERROR_NOT_FOUND if the endpoint does not exist
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns the error of a previous write, in which case the new settings
+ * were applied nevertheless
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_set_bulk_write_combining(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	int buffer_size, unsigned int flush_usecs, int flags)
+{
+	struct usbi_write_combiner *wc;
+	int max_packet_size;
+	int r = 0;
+
+	if ((endpoint & LIBUSB_ENDPOINT_IN) || buffer_size < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	wc = find_write_combiner(dev_handle, endpoint);
+	if (wc) {
+		usbi_mutex_lock(&dev_handle->lock);
+		list_del(&wc->list);
+		usbi_mutex_unlock(&dev_handle->lock);
+		usbi_mutex_lock(&wc->lock);
+		r = write_combiner_flush(wc, 0);
+		usbi_mutex_unlock(&wc->lock);
+		free_write_combiner(wc);
+	}
+	if (!buffer_size)
+		return r;
+
+	max_packet_size = libusb_get_max_packet_size(dev_handle->dev, endpoint);
+	if (max_packet_size < 0)
+		return max_packet_size;
+	if (max_packet_size == 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	buffer_size = round_to_packets(buffer_size, max_packet_size);
+	if (buffer_size < 0)
+		return buffer_size;
+
+	usbi_dbg("ep %02x: %d byte buffers, flush after %uus", endpoint,
+		buffer_size, flush_usecs);
+	wc = alloc_write_combiner(dev_handle, endpoint, buffer_size,
+		max_packet_size);
+	if (!wc)
+		return LIBUSB_ERROR_NO_MEM;
+	wc->flush_usecs = flush_usecs;
+	wc->flags = flags;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	list_add_tail(&wc->list, &dev_handle->write_combiners);
+	usbi_mutex_unlock(&dev_handle->lock);
+	return r;
+}
+
+/** \ingroup syncio
+ * Send any data buffered by write combining on an endpoint, and wait until
+ * all of it has been transferred.
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint
+ * \param timeout timeout (in millseconds) that this function should wait
+ * for the data to be sent. For an unlimited timeout, use value 0.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if write combining is not enabled on the
+ * endpoint
+ * \returns LIBUSB_ERROR_TIMEOUT if the data could not be sent in time. The
+ * data stays queued in that case.
+ * \returns the error of a previously buffered write, or another
+ * LIBUSB_ERROR code on other failure
+ * \see libusb_set_bulk_write_combining()
+ */
+int API_EXPORTED libusb_flush_bulk_writes(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	unsigned int timeout)
+{
+	struct usbi_write_combiner *wc = find_write_combiner(dev_handle, endpoint);
+	int r;
+
+	if (!wc)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&wc->lock);
+	r = write_combiner_flush(wc, timeout);
+	usbi_mutex_unlock(&wc->lock);
+	return r;
+}
+
+static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char *buffer, int length,
+	int *transferred, unsigned int timeout, unsigned char type)
+{
+	if (type == LIBUSB_TRANSFER_TYPE_BULK && (endpoint & LIBUSB_ENDPOINT_IN)
+			&& !list_empty(&dev_handle->read_aheads)) {
+		struct usbi_read_ahead *ra = find_read_ahead(dev_handle, endpoint);
+		if (ra)
+			return read_ahead_read(ra, buffer, length, transferred,
+				timeout);
+	}
+
+	if (type == LIBUSB_TRANSFER_TYPE_BULK && !(endpoint & LIBUSB_ENDPOINT_IN)
+			&& !list_empty(&dev_handle->write_combiners)) {
+		struct usbi_write_combiner *wc = find_write_combiner(dev_handle,
+			endpoint);
+		if (wc)
+			return write_combiner_write(wc, buffer, length, transferred,
+				timeout);
+	}
+
+	return sync_transfer(dev_handle, endpoint, buffer, length, transferred,
+		timeout, type);
+}
+
 /** \ingroup syncio
  * Perform a USB bulk transfer. The direction of the transfer is inferred from
  * the direction bits of the endpoint address.
@@ -264,6 +1759,7 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
  * \ref packetoverflow
  * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
  * \returns another LIBUSB_ERROR code on other failures
+ * \see libusb_set_bulk_read_ahead(), libusb_set_bulk_write_combining()
  */
 int API_EXPORTED libusb_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length, int *transferred,
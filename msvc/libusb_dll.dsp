@@ -93,6 +93,10 @@ LINK32=link.exe
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=..\libusb\capture.c
+# End Source File
+# Begin Source File
+
 SOURCE=..\libusb\core.c
 # End Source File
 # Begin Source File
@@ -0,0 +1,175 @@
+/*
+ * libusbx test program for the C++20 bindings
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdexcept>
+
+#include "libusb.hpp"
+
+/* the test library is C, and defines bool when it isn't a macro */
+extern "C" {
+#include "libusbx_testlib.h"
+}
+#undef bool
+#undef true
+#undef false
+
+namespace {
+
+/* Counts the coroutine frames allocated from it */
+class counting_resource : public std::pmr::memory_resource {
+public:
+	std::size_t allocated = 0;
+	std::size_t outstanding = 0;
+
+private:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		allocated++;
+		outstanding++;
+		return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+	}
+	void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+	{
+		outstanding--;
+		std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+	}
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+};
+
+libusb::task<int> add(std::allocator_arg_t, const std::pmr::polymorphic_allocator<> &,
+	int a, int b)
+{
+	co_return a + b;
+}
+
+struct adder {
+	int base;
+
+	libusb::task<int> add(std::allocator_arg_t, const std::pmr::polymorphic_allocator<> &,
+		int value)
+	{
+		co_return base + value;
+	}
+};
+
+libusb::task<int> twice(int value)
+{
+	co_return 2 * value;
+}
+
+libusb::task<void> compute(counting_resource &mr, int &result)
+{
+	adder a = { 100 };
+	int sum = co_await add(std::allocator_arg, &mr, 1, 2);
+
+	sum += co_await a.add(std::allocator_arg, &mr, sum);
+	result = co_await twice(sum);
+}
+
+libusb::task<void> fail()
+{
+	throw std::runtime_error("task failure");
+	co_return;
+}
+
+libusb::task<void> submit(libusb::transfer &t, libusb::transfer_result &result)
+{
+	result = co_await t.submit();
+}
+
+} // namespace
+
+/** Runs tasks that await other tasks, with frames from a memory resource,
+ * on an executor. */
+static libusbx_testlib_result test_task_executor(libusbx_testlib_ctx *tctx)
+{
+	try {
+		libusb::context ctx;
+		libusb::executor ex(ctx);
+		counting_resource mr;
+		int result = 0;
+
+		ex.spawn(compute(mr, result));
+		ex.run();
+		if (result != 2 * (3 + 103)) {
+			libusbx_testlib_logf(tctx, "Wrong result %d", result);
+			return TEST_STATUS_FAILURE;
+		}
+		if ((mr.allocated != 2) || (mr.outstanding != 0)) {
+			libusbx_testlib_logf(tctx, "%zu frames from the resource, %zu not released",
+				mr.allocated, mr.outstanding);
+			return TEST_STATUS_FAILURE;
+		}
+		if (ex.outstanding() != 0) {
+			libusbx_testlib_logf(tctx, "%zu tasks left", ex.outstanding());
+			return TEST_STATUS_FAILURE;
+		}
+
+		ex.spawn(fail());
+		try {
+			ex.run();
+			libusbx_testlib_logf(tctx, "Task exception was not rethrown");
+			return TEST_STATUS_FAILURE;
+		} catch (const std::runtime_error &) {
+		}
+	} catch (const libusb::error &e) {
+		libusbx_testlib_logf(tctx, "libusb error: %s", e.what());
+		return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Checks that the transfer awaiter refuses auto-resubmitted transfers,
+ * which would resume the coroutine once per completion. */
+static libusbx_testlib_result test_transfer_awaiter(libusbx_testlib_ctx *tctx)
+{
+	try {
+		libusb::context ctx;
+		libusb::executor ex(ctx);
+		libusb::transfer t;
+		libusb::transfer_result result;
+
+		t->flags = LIBUSB_TRANSFER_AUTO_RESUBMIT;
+		ex.spawn(submit(t, result));
+		ex.run();
+		if ((result.error != LIBUSB_ERROR_INVALID_PARAM) || result
+				|| (result.error_code() != libusb::make_error_code(LIBUSB_ERROR_INVALID_PARAM))) {
+			libusbx_testlib_logf(tctx, "Auto-resubmit transfer was not refused: %d",
+				result.error);
+			return TEST_STATUS_FAILURE;
+		}
+	} catch (const libusb::error &e) {
+		libusbx_testlib_logf(tctx, "libusb error: %s", e.what());
+		return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+static const libusbx_testlib_test tests[] = {
+	{"task_executor", &test_task_executor},
+	{"transfer_awaiter", &test_transfer_awaiter},
+	LIBUSBX_NULL_TEST
+};
+
+int main(int argc, char **argv)
+{
+	return libusbx_testlib_run_tests(argc, argv, tests);
+}
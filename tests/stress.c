@@ -19,8 +19,19 @@
 
 #include <stdio.h>
 #include <memory.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#endif
 
-#include "libusb.h"
+#include "libusbi.h"
 #include "libusbx_testlib.h"
 
 /** Test that creates and destroys a single concurrent context
@@ -144,12 +155,1058 @@ static libusbx_testlib_result test_default_context_change(libusbx_testlib_ctx *
 	return TEST_STATUS_SUCCESS;
 }
 
+static void sleep_ms(unsigned int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static uint64_t monotonic_usecs(void)
+{
+#ifdef _WIN32
+	return (uint64_t) GetTickCount() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/** Measures the wakeup latency of an internal event thread, running with
+ * real-time priority where the process is allowed to, and checks that the
+ * latency it reports is bounded by the time the test saw each wakeup take. */
+static libusbx_testlib_result test_event_thread_latency(libusbx_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	struct libusb_event_latency_stats stats;
+	uint64_t wakeups = 0;
+	uint64_t start, elapsed, max_elapsed = 0;
+	int i, r, waited;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_start_event_thread(ctx, 50, -1, 0);
+	if (r == LIBUSB_ERROR_ACCESS) {
+		libusbx_testlib_logf(tctx, "No real-time privileges, using default priority");
+		r = libusb_start_event_thread(ctx, 0, -1, 0);
+	}
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	} else if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start event thread: %d", r);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_start_event_thread(ctx, 0, -1, 0) != LIBUSB_ERROR_BUSY) {
+		libusbx_testlib_logf(tctx, "Second event thread was not refused");
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < 1000; ++i) {
+		start = monotonic_usecs();
+		libusb_interrupt_event_handler(ctx);
+		/* wait for the event thread to account for this wakeup */
+		for (waited = 0; waited < 1000; ++waited) {
+			sleep_ms(1);
+			libusb_get_event_latency_stats(ctx, &stats);
+			if (stats.wakeups > wakeups)
+				break;
+		}
+		elapsed = monotonic_usecs() - start;
+		if (stats.wakeups != wakeups + 1) {
+			libusbx_testlib_logf(tctx,
+				"Wakeup %d not seen by the event thread", i);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		if (elapsed > max_elapsed)
+			max_elapsed = elapsed;
+		wakeups = stats.wakeups;
+	}
+
+	libusb_stop_event_thread(ctx);
+	libusb_get_event_latency_stats(ctx, &stats);
+	libusbx_testlib_logf(tctx,
+		"%u wakeups, latency min %uus avg %uus max %uus, jitter %uus",
+		(unsigned int) stats.wakeups,
+		(unsigned int) (stats.min_latency_nsecs / 1000),
+		(unsigned int) (stats.total_latency_nsecs / stats.wakeups / 1000),
+		(unsigned int) (stats.max_latency_nsecs / 1000),
+		(unsigned int) ((stats.max_latency_nsecs - stats.min_latency_nsecs) / 1000));
+	libusb_exit(ctx);
+
+	/* each wakeup was noticed before the test saw it accounted for. allow
+	 * a millisecond for a coarser test clock. */
+	if (stats.wakeups != 1000 ||
+	    stats.max_latency_nsecs / 1000 > max_elapsed + 1000 ||
+	    stats.total_latency_nsecs / stats.wakeups < stats.min_latency_nsecs ||
+	    stats.total_latency_nsecs / stats.wakeups > stats.max_latency_nsecs) {
+		libusbx_testlib_logf(tctx,
+			"Latency stats inconsistent with %uus max observed wakeup time",
+			(unsigned int) max_elapsed);
+		return TEST_STATUS_FAILURE;
+	}
+	return TEST_STATUS_SUCCESS;
+}
+
+#ifndef _WIN32
+#define LAYOUT_THREADS 8
+#define LAYOUT_TRANSFERS (LAYOUT_THREADS / 2)
+#define LAYOUT_CYCLES 2000000
+
+/* struct usbi_transfer before its completion fields got a cache line of
+ * their own, followed by the libusb_transfer as it was allocated */
+struct layout_old_transfer {
+	int num_iso_packets;
+	int priority;
+	uint64_t timeout_nsecs;
+	struct list_head list;
+	uint8_t internal_buffer;
+	uint8_t throttle_state;
+	unsigned int throttle_bytes;
+	int iso_offsets_packets;
+	volatile unsigned int state;
+	int transferred;
+	struct list_head completion_list;
+	enum libusb_transfer_status deferred_status;
+	struct libusb_iso_packet_summary iso_summary;
+	unsigned char transfer[sizeof(struct libusb_transfer)];
+};
+
+/* the fields of one transfer that submission and completion write */
+struct layout_fields {
+	volatile uint64_t * timeout_nsecs;
+	volatile struct list_head * list;
+	volatile unsigned int * state;
+	volatile int * transferred;
+	volatile struct list_head * completion_list;
+	volatile enum libusb_transfer_status * deferred_status;
+	volatile struct libusb_iso_packet_summary * iso_summary;
+};
+
+#define LAYOUT_FIELDS(fields, transfer) do { \
+	(fields)->timeout_nsecs = &(transfer)->timeout_nsecs; \
+	(fields)->list = &(transfer)->list; \
+	(fields)->state = &(transfer)->state; \
+	(fields)->transferred = &(transfer)->transferred; \
+	(fields)->completion_list = &(transfer)->completion_list; \
+	(fields)->deferred_status = &(transfer)->deferred_status; \
+	(fields)->iso_summary = &(transfer)->iso_summary; \
+} while (0)
+
+/* what libusb_submit_transfer() writes: the expiry, and the entry in the
+ * flying list */
+static void * layout_submitter(void * arg)
+{
+	struct layout_fields * fields = arg;
+	int i;
+
+	for (i = 0; i < LAYOUT_CYCLES; ++i) {
+		*fields->timeout_nsecs = i;
+		fields->list->next = (struct list_head *) fields->list;
+		fields->list->prev = (struct list_head *) fields->list;
+	}
+	return NULL;
+}
+
+/* what the event handler writes as the transfer completes */
+static void * layout_completer(void * arg)
+{
+	struct layout_fields * fields = arg;
+	int i;
+
+	for (i = 0; i < LAYOUT_CYCLES; ++i) {
+		*fields->state = USBI_TRANSFER_COMPLETING;
+		*fields->transferred = i;
+		fields->completion_list->next = (struct list_head *) fields->completion_list;
+		fields->completion_list->prev = (struct list_head *) fields->completion_list;
+		*fields->deferred_status = LIBUSB_TRANSFER_COMPLETED;
+		fields->iso_summary->total_bytes = i;
+		*fields->state = USBI_TRANSFER_IDLE;
+	}
+	return NULL;
+}
+
+/* runs a submitting and a completing thread on each transfer, and returns
+ * the time per cycle */
+static double run_layout_threads(struct layout_fields * fields)
+{
+	pthread_t threads[LAYOUT_THREADS];
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < LAYOUT_TRANSFERS; ++i) {
+		pthread_create(&threads[2 * i], NULL, layout_submitter, &fields[i]);
+		pthread_create(&threads[2 * i + 1], NULL, layout_completer, &fields[i]);
+	}
+	for (i = 0; i < LAYOUT_THREADS; ++i)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec))
+		/ LAYOUT_CYCLES;
+}
+#endif
+
+/** Checks that transfers start on a cache line, and that the fields written
+ * on completion don't share one with those written on submission. Then
+ * times submission and completion updates to adjacent transfers on 8
+ * threads, with the old and the current layout. The timings depend on the
+ * machine, so they are only reported. */
+static libusbx_testlib_result test_transfer_layout(libusbx_testlib_ctx * tctx)
+{
+#ifdef _WIN32
+	return TEST_STATUS_SKIP;
+#else
+	libusb_context * ctx = NULL;
+	struct libusb_transfer * transfers[LAYOUT_TRANSFERS];
+	struct layout_fields fields[LAYOUT_TRANSFERS];
+	struct layout_old_transfer * old;
+	double old_ns, new_ns;
+	int i, r;
+	libusbx_testlib_result result = TEST_STATUS_SUCCESS;
+
+	if (offsetof(struct usbi_transfer, state) % USBI_CACHELINE_SIZE
+			|| offsetof(struct usbi_transfer, state)
+			< offsetof(struct usbi_transfer, iso_offsets_packets) + sizeof(int)) {
+		libusbx_testlib_logf(tctx, "Completion fields start at offset %d",
+			(int) offsetof(struct usbi_transfer, state));
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	memset(transfers, 0, sizeof(transfers));
+	for (i = 0; i < LAYOUT_TRANSFERS; ++i) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			libusbx_testlib_logf(tctx, "Failed to allocate transfer %d", i);
+			result = TEST_STATUS_FAILURE;
+			goto out;
+		}
+		if ((uintptr_t) transfers[i] % USBI_CACHELINE_SIZE) {
+			libusbx_testlib_logf(tctx, "Transfer %p is not cache line aligned",
+				transfers[i]);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	old = calloc(LAYOUT_TRANSFERS, sizeof(*old));
+	if (!old) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	for (i = 0; i < LAYOUT_TRANSFERS; ++i)
+		LAYOUT_FIELDS(&fields[i], &old[i]);
+	old_ns = run_layout_threads(fields);
+	free(old);
+
+	for (i = 0; i < LAYOUT_TRANSFERS; ++i)
+		LAYOUT_FIELDS(&fields[i], LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+	new_ns = run_layout_threads(fields);
+
+	libusbx_testlib_logf(tctx,
+		"%d threads: %.1fns per cycle with the old layout, %.1fns with the current one",
+		LAYOUT_THREADS, old_ns, new_ns);
+
+out:
+	for (i = 0; i < LAYOUT_TRANSFERS; ++i)
+		libusb_free_transfer(transfers[i]);
+	libusb_exit(ctx);
+	return result;
+#endif
+}
+
+#ifndef _WIN32
+#define RACE_ROUNDS 2000
+
+struct race_state {
+	struct libusb_transfer * transfer;
+	volatile int armed;
+	volatile int stop;
+	volatile int callbacks;
+	volatile int cancelled;
+};
+
+static void LIBUSB_CALL race_cb(struct libusb_transfer * transfer)
+{
+	struct race_state * race = transfer->user_data;
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+		race->cancelled++;
+	else if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		race->cancelled = -RACE_ROUNDS;
+	__sync_synchronize();
+	race->callbacks++;
+}
+
+/* cancels the transfer as soon as the submitter announces it */
+static void * race_canceller(void * arg)
+{
+	struct race_state * race = arg;
+
+	while (!race->stop) {
+		if (race->armed) {
+			libusb_cancel_transfer(race->transfer);
+			__sync_synchronize();
+			race->armed = 0;
+		}
+	}
+	return NULL;
+}
+
+static libusb_device_handle * open_any_device(libusb_context * ctx)
+{
+	libusb_device ** list;
+	libusb_device_handle * handle = NULL;
+	ssize_t i, n;
+
+	n = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < n && !handle; ++i)
+		if (libusb_open(list[i], &handle) != LIBUSB_SUCCESS)
+			handle = NULL;
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	return handle;
+}
+#endif
+
+/** Races libusb_cancel_transfer() against libusb_submit_transfer() and the
+ * completion of the transfer, with control transfers to the first device
+ * which can be opened. Each submission must complete exactly once. */
+static libusbx_testlib_result test_submit_cancel_race(libusbx_testlib_ctx * tctx)
+{
+#ifdef _WIN32
+	return TEST_STATUS_SKIP;
+#else
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct race_state race;
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + LIBUSB_DT_DEVICE_SIZE];
+	pthread_t canceller;
+	libusbx_testlib_result result = TEST_STATUS_SUCCESS;
+	int i, r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	handle = open_any_device(ctx);
+	if (!handle) {
+		libusbx_testlib_logf(tctx, "No device could be opened");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+	/* completions are reaped on another thread, so that they can also
+	 * race with the submission */
+	r = libusb_start_event_thread(ctx, 0, -1, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start event thread: %d", r);
+		libusb_close(handle);
+		libusb_exit(ctx);
+		return r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP
+			: TEST_STATUS_FAILURE;
+	}
+
+	memset(&race, 0, sizeof(race));
+	race.transfer = libusb_alloc_transfer(0);
+	if (!race.transfer) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_DEVICE << 8, 0,
+		LIBUSB_DT_DEVICE_SIZE);
+	libusb_fill_control_transfer(race.transfer, handle, buffer, race_cb,
+		&race, 1000);
+	pthread_create(&canceller, NULL, race_canceller, &race);
+
+	for (i = 0; i < RACE_ROUNDS && result == TEST_STATUS_SUCCESS; ++i) {
+		race.armed = 1;
+		__sync_synchronize();
+		r = libusb_submit_transfer(race.transfer);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Submission %d failed: %d", i, r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		while (race.callbacks != i + 1 || race.armed) {
+			if (race.callbacks > i + 1) {
+				libusbx_testlib_logf(tctx,
+					"Submission %d completed more than once", i);
+				result = TEST_STATUS_FAILURE;
+				break;
+			}
+			usleep(10);
+		}
+	}
+
+	race.stop = 1;
+	pthread_join(canceller, NULL);
+	/* a completion reported twice would show up late */
+	sleep_ms(100);
+	if (result == TEST_STATUS_SUCCESS &&
+	    (race.callbacks != RACE_ROUNDS || race.cancelled < 0)) {
+		libusbx_testlib_logf(tctx, "%d callbacks for %d submissions%s",
+			race.callbacks, RACE_ROUNDS,
+			race.cancelled < 0 ? ", some failed" : "");
+		result = TEST_STATUS_FAILURE;
+	}
+	libusbx_testlib_logf(tctx, "%d of %d submissions cancelled",
+		race.cancelled, RACE_ROUNDS);
+
+out:
+	libusb_stop_event_thread(ctx);
+	libusb_free_transfer(race.transfer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+#endif
+}
+
+#ifndef _WIN32
+/* Finds an IN endpoint address that the active configuration of the
+ * device doesn't have, and a bulk IN endpoint that it has, or 0, with its
+ * interface and alternate setting. */
+static void find_capture_endpoints(libusb_device_handle * handle,
+	unsigned char * missing, unsigned char * bulk, int * bulk_packet_size,
+	int * bulk_interface, int * bulk_altsetting)
+{
+	struct libusb_config_descriptor * config;
+	unsigned char used[16];
+	int i, a, e;
+
+	memset(used, 0, sizeof(used));
+	*missing = *bulk = 0;
+	if (libusb_get_active_config_descriptor(libusb_get_device(handle), &config)
+			!= LIBUSB_SUCCESS)
+		return;
+	for (i = 0; i < config->bNumInterfaces; ++i) {
+		for (a = 0; a < config->interface[i].num_altsetting; ++a) {
+			const struct libusb_interface_descriptor * alt =
+				&config->interface[i].altsetting[a];
+
+			for (e = 0; e < alt->bNumEndpoints; ++e) {
+				const struct libusb_endpoint_descriptor * ep = &alt->endpoint[e];
+
+				if (!(ep->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+					continue;
+				used[ep->bEndpointAddress & 0x0f] = 1;
+				if (!*bulk && (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+						== LIBUSB_TRANSFER_TYPE_BULK) {
+					*bulk = ep->bEndpointAddress;
+					*bulk_packet_size = ep->wMaxPacketSize & 0x7ff;
+					*bulk_interface = alt->bInterfaceNumber;
+					*bulk_altsetting = alt->bAlternateSetting;
+				}
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+	for (i = 1; i < 16 && !*missing; ++i)
+		if (!used[i])
+			*missing = (unsigned char) (LIBUSB_ENDPOINT_IN | i);
+}
+#endif
+
+/** Checks that libusb_capture_start() refuses invalid arguments and
+ * endpoints without starting anything, on the first device which can be
+ * opened. */
+static libusbx_testlib_result test_capture_validation(libusbx_testlib_ctx * tctx)
+{
+#ifdef _WIN32
+	return TEST_STATUS_SKIP;
+#else
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_capture * capture = NULL;
+	struct libusb_capture_config config;
+	struct libusb_capture_stats stats;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	unsigned char missing, bulk;
+	int bulk_packet_size = 0, bulk_interface, bulk_altsetting;
+	int fd, r;
+
+	r = libusb_capture_start(NULL, 0x81, 1, NULL, &capture);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusbx_testlib_logf(tctx, "Capture is not supported");
+		return TEST_STATUS_SKIP;
+	}
+	if (r != LIBUSB_ERROR_INVALID_PARAM
+			|| libusb_capture_get_stats(NULL, &stats) != LIBUSB_ERROR_INVALID_PARAM
+			|| libusb_capture_stop(NULL, &stats) != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "NULL arguments were not refused");
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	handle = open_any_device(ctx);
+	if (!handle) {
+		libusbx_testlib_logf(tctx, "No device could be opened");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		libusb_close(handle);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+	find_capture_endpoints(handle, &missing, &bulk, &bulk_packet_size,
+		&bulk_interface, &bulk_altsetting);
+
+	if (libusb_capture_start(handle, 0x01, fd, NULL, &capture) != LIBUSB_ERROR_INVALID_PARAM
+			|| libusb_capture_start(handle, 0x81, -1, NULL, &capture) != LIBUSB_ERROR_INVALID_PARAM
+			|| libusb_capture_start(handle, 0x81, fd, NULL, NULL) != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Invalid endpoint, file or output was not refused");
+		goto out;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.num_buffers = 1;
+	r = libusb_capture_start(handle, 0x81, fd, &config, &capture);
+	memset(&config, 0, sizeof(config));
+	config.num_transfers = -1;
+	if (r == LIBUSB_ERROR_INVALID_PARAM)
+		r = libusb_capture_start(handle, 0x81, fd, &config, &capture);
+	memset(&config, 0, sizeof(config));
+	config.flags = 1 << 7;
+	if (r == LIBUSB_ERROR_INVALID_PARAM)
+		r = libusb_capture_start(handle, 0x81, fd, &config, &capture);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Invalid configuration was not refused: %d", r);
+		goto out;
+	}
+
+	if (missing) {
+		r = libusb_capture_start(handle, missing, fd, NULL, &capture);
+		if (r != LIBUSB_ERROR_NOT_FOUND) {
+			libusbx_testlib_logf(tctx, "Missing endpoint 0x%02x was not refused: %d",
+				missing, r);
+			goto out;
+		}
+	}
+	if (bulk && bulk_packet_size > 1) {
+		memset(&config, 0, sizeof(config));
+		config.transfer_size = bulk_packet_size + 1;
+		r = libusb_capture_start(handle, bulk, fd, &config, &capture);
+		if (r != LIBUSB_ERROR_INVALID_PARAM) {
+			libusbx_testlib_logf(tctx, "Partial packet transfer size was not refused: %d", r);
+			goto out;
+		}
+	}
+	if (capture) {
+		libusbx_testlib_logf(tctx, "A refused capture was returned");
+		libusb_capture_stop(capture, NULL);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	close(fd);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+#endif
+}
+
+#ifndef _WIN32
+/* Opens the first device with a bulk IN endpoint on an interface that no
+ * kernel driver holds, and claims that interface. */
+static libusb_device_handle * open_bulk_in_endpoint(libusb_context * ctx,
+	unsigned char * endpoint, int * interface, int * altsetting)
+{
+	libusb_device ** list;
+	libusb_device_handle * handle = NULL;
+	unsigned char missing;
+	int packet_size;
+	ssize_t i, n;
+
+	n = libusb_get_device_list(ctx, &list);
+	for (i = 0; i < n && !handle; ++i) {
+		if (libusb_open(list[i], &handle) != LIBUSB_SUCCESS) {
+			handle = NULL;
+			continue;
+		}
+		find_capture_endpoints(handle, &missing, endpoint, &packet_size,
+			interface, altsetting);
+		if (!*endpoint || libusb_kernel_driver_active(handle, *interface) == 1
+				|| libusb_claim_interface(handle, *interface) != LIBUSB_SUCCESS) {
+			libusb_close(handle);
+			handle = NULL;
+		}
+	}
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	return handle;
+}
+
+struct pipe_reader {
+	int fd;
+	uint64_t bytes;
+};
+
+static void * pipe_reader(void * arg)
+{
+	struct pipe_reader * reader = arg;
+	unsigned char buffer[4096];
+	ssize_t r;
+
+	while ((r = read(reader->fd, buffer, sizeof(buffer))) != 0) {
+		if (r > 0)
+			reader->bytes += r;
+		else if (errno != EINTR)
+			break;
+	}
+	return NULL;
+}
+#endif
+
+/** Captures a bulk IN endpoint to a pipe, then selects its alternate
+ * setting again, which flushes the endpoint so that the transfers complete
+ * with LIBUSB_TRANSFER_NO_DEVICE. Whatever was captured before the error
+ * must still be written out. */
+static libusbx_testlib_result test_capture_flush(libusbx_testlib_ctx * tctx)
+{
+#ifdef _WIN32
+	return TEST_STATUS_SKIP;
+#else
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_capture * capture;
+	struct libusb_capture_stats stats;
+	struct pipe_reader reader;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	pthread_t thread;
+	unsigned char endpoint;
+	int interface, altsetting;
+	int fds[2], r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	handle = open_bulk_in_endpoint(ctx, &endpoint, &interface, &altsetting);
+	if (!handle) {
+		libusbx_testlib_logf(tctx, "No free bulk IN endpoint");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+	if (pipe(fds) != 0) {
+		result = TEST_STATUS_ERROR;
+		goto out_close;
+	}
+	r = libusb_start_event_thread(ctx, 0, -1, 0);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start event thread: %d", r);
+		result = r == LIBUSB_ERROR_NOT_SUPPORTED ? TEST_STATUS_SKIP
+			: TEST_STATUS_FAILURE;
+		goto out_pipe;
+	}
+	reader.fd = fds[0];
+	reader.bytes = 0;
+	pthread_create(&thread, NULL, pipe_reader, &reader);
+
+	r = libusb_capture_start(handle, endpoint, fds[1], NULL, &capture);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to start the capture: %d", r);
+		close(fds[1]);
+		pthread_join(thread, NULL);
+		fds[1] = -1;
+		goto out_thread;
+	}
+	sleep_ms(200);
+	r = libusb_set_interface_alt_setting(handle, interface, altsetting);
+	if (r != LIBUSB_SUCCESS)
+		libusbx_testlib_logf(tctx, "Failed to reselect the alternate setting: %d", r);
+	sleep_ms(100);
+	r = libusb_capture_stop(capture, &stats);
+	close(fds[1]);
+	fds[1] = -1;
+	pthread_join(thread, NULL);
+
+	libusbx_testlib_logf(tctx, "%s: %lu bytes captured, %lu written, %lu read back",
+		libusb_error_name(r), (unsigned long) stats.bytes_captured,
+		(unsigned long) stats.bytes_written, (unsigned long) reader.bytes);
+	if (stats.bytes_written != stats.bytes_captured || stats.bytes_dropped
+			|| reader.bytes != stats.bytes_written) {
+		libusbx_testlib_logf(tctx, "Captured data was not written out");
+		goto out_thread;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out_thread:
+	libusb_stop_event_thread(ctx);
+out_pipe:
+	close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+out_close:
+	libusb_release_interface(handle, interface);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+#endif
+}
+
+/** Checks the packet summary of an isochronous transfer whose results
+ * were not filled in by a backend. */
+static libusbx_testlib_result test_iso_packet_summary(libusbx_testlib_ctx * tctx)
+{
+	struct libusb_transfer *transfer;
+	struct libusb_iso_packet_summary summary;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	int i, r;
+
+	transfer = libusb_alloc_transfer(64);
+	if (!transfer) {
+		libusbx_testlib_logf(tctx, "Failed to allocate transfer");
+		return TEST_STATUS_FAILURE;
+	}
+
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	r = libusb_get_iso_packet_summary(transfer, &summary);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusbx_testlib_logf(tctx, "Bulk transfer was not refused: %d", r);
+		goto out;
+	}
+
+	transfer->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+	transfer->num_iso_packets = 64;
+	for (i = 0; i < 64; ++i) {
+		transfer->iso_packet_desc[i].actual_length = 100;
+		transfer->iso_packet_desc[i].status = LIBUSB_TRANSFER_COMPLETED;
+	}
+	transfer->iso_packet_desc[17].status = LIBUSB_TRANSFER_OVERFLOW;
+	transfer->iso_packet_desc[40].status = LIBUSB_TRANSFER_ERROR;
+
+	r = libusb_get_iso_packet_summary(transfer, &summary);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to get summary: %d", r);
+		goto out;
+	}
+	if (summary.total_bytes != 6400 || summary.error_count != 2
+			|| summary.first_error_index != 17
+			|| summary.first_error_status != LIBUSB_TRANSFER_OVERFLOW) {
+		libusbx_testlib_logf(tctx, "Wrong summary: %u bytes, %d errors, first %d (%d)",
+			summary.total_bytes, summary.error_count,
+			summary.first_error_index, summary.first_error_status);
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	return result;
+}
+
+#define ISO_TEST_PACKETS 32
+
+/* Looks for an isochronous IN endpoint on the devices of ctx, and opens
+ * the device with the interface claimed and the alternate setting of the
+ * endpoint selected. Returns NULL if there is no such device. */
+static libusb_device_handle * open_iso_in_endpoint(libusb_context * ctx,
+	unsigned char * endpoint, int * packet_size)
+{
+	libusb_device ** list;
+	libusb_device_handle * handle = NULL;
+	ssize_t n, d;
+
+	n = libusb_get_device_list(ctx, &list);
+	for (d = 0; d < n && !handle; ++d) {
+		struct libusb_config_descriptor * config;
+		int i, a, e;
+
+		if (libusb_get_active_config_descriptor(list[d], &config) != LIBUSB_SUCCESS)
+			continue;
+		for (i = 0; i < config->bNumInterfaces && !handle; ++i) {
+			const struct libusb_interface * iface = &config->interface[i];
+
+			for (a = 0; a < iface->num_altsetting && !handle; ++a) {
+				const struct libusb_interface_descriptor * alt =
+					&iface->altsetting[a];
+
+				for (e = 0; e < alt->bNumEndpoints && !handle; ++e) {
+					const struct libusb_endpoint_descriptor * ep =
+						&alt->endpoint[e];
+
+					if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+							!= LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+							|| !(ep->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+						continue;
+					*packet_size = libusb_get_max_iso_packet_size(list[d],
+						ep->bEndpointAddress);
+					if (*packet_size <= 0
+							|| libusb_open(list[d], &handle) != LIBUSB_SUCCESS) {
+						handle = NULL;
+						continue;
+					}
+					if (libusb_claim_interface(handle, alt->bInterfaceNumber)
+							!= LIBUSB_SUCCESS
+							|| libusb_set_interface_alt_setting(handle,
+								alt->bInterfaceNumber, alt->bAlternateSetting)
+							!= LIBUSB_SUCCESS) {
+						libusb_close(handle);
+						handle = NULL;
+						continue;
+					}
+					*endpoint = ep->bEndpointAddress;
+				}
+			}
+		}
+		libusb_free_config_descriptor(config);
+	}
+	if (n >= 0)
+		libusb_free_device_list(list, 1);
+	return handle;
+}
+
+static void LIBUSB_CALL iso_test_cb(struct libusb_transfer * transfer)
+{
+	*(int *) transfer->user_data = 1;
+}
+
+/** Checks the packet summary that the backend accumulates while copying
+ * back the results of isochronous transfers against the packet results,
+ * on the first isochronous IN endpoint which can be claimed. */
+static libusbx_testlib_result test_iso_packet_summary_device(libusbx_testlib_ctx * tctx)
+{
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfer;
+	struct libusb_iso_packet_summary summary, expected;
+	libusbx_testlib_result result = TEST_STATUS_SUCCESS;
+	unsigned char * buffer = NULL;
+	unsigned char endpoint = 0;
+	int packet_size = 0;
+	int round, i, r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusbx_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	handle = open_iso_in_endpoint(ctx, &endpoint, &packet_size);
+	if (!handle) {
+		libusbx_testlib_logf(tctx, "No isochronous IN endpoint could be claimed");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	transfer = libusb_alloc_transfer(ISO_TEST_PACKETS);
+	buffer = malloc(ISO_TEST_PACKETS * packet_size);
+	if (!transfer || !buffer) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	/* once with the results copied into the packet descriptors, once with
+	 * them left with the backend */
+	for (round = 0; round < 2 && result == TEST_STATUS_SUCCESS; ++round) {
+		int completed = 0;
+
+		libusb_fill_iso_transfer(transfer, handle, endpoint, buffer,
+			ISO_TEST_PACKETS * packet_size, ISO_TEST_PACKETS, iso_test_cb,
+			&completed, 1000);
+		libusb_set_iso_packet_lengths(transfer, packet_size);
+		if (round == 1) {
+			if (!libusb_has_capability(LIBUSB_CAP_SUPPORTS_UNIFORM_ISO))
+				break;
+			transfer->flags |= LIBUSB_TRANSFER_UNIFORM_ISO;
+		}
+
+		r = libusb_submit_transfer(transfer);
+		if (r != LIBUSB_SUCCESS) {
+			libusbx_testlib_logf(tctx, "Failed to submit: %d", r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		while (!completed)
+			libusb_handle_events_completed(ctx, &completed);
+
+		memset(&expected, 0, sizeof(expected));
+		expected.first_error_index = -1;
+		for (i = 0; i < ISO_TEST_PACKETS; ++i) {
+			unsigned int actual_length;
+			enum libusb_transfer_status status;
+
+			r = libusb_get_iso_packet_result(transfer, i, &actual_length,
+				&status);
+			if (r != LIBUSB_SUCCESS) {
+				libusbx_testlib_logf(tctx, "No result for packet %d: %d", i, r);
+				result = TEST_STATUS_FAILURE;
+				break;
+			}
+			expected.total_bytes += actual_length;
+			if (status != LIBUSB_TRANSFER_COMPLETED
+					&& expected.error_count++ == 0) {
+				expected.first_error_index = i;
+				expected.first_error_status = status;
+			}
+		}
+		if (result != TEST_STATUS_SUCCESS)
+			break;
+
+		r = libusb_get_iso_packet_summary(transfer, &summary);
+		if (r != LIBUSB_SUCCESS || summary.total_bytes != expected.total_bytes
+				|| summary.error_count != expected.error_count
+				|| summary.first_error_index != expected.first_error_index
+				|| (expected.error_count && summary.first_error_status
+					!= expected.first_error_status)) {
+			libusbx_testlib_logf(tctx, "Wrong summary in round %d: %d, %u/%u bytes, %d/%d errors, first %d/%d",
+				round, r, summary.total_bytes, expected.total_bytes,
+				summary.error_count, expected.error_count,
+				summary.first_error_index, expected.first_error_index);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+out:
+	libusb_free_transfer(transfer);
+	free(buffer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Walks the packets of an isochronous transfer with varying packet
+ * lengths, some of which carried no data. */
+static libusbx_testlib_result test_iso_packet_helpers(libusbx_testlib_ctx * tctx)
+{
+	struct libusb_transfer *transfer;
+	struct libusb_iso_packet_view views[16];
+	unsigned char buffer[16 * 15], out[16 * 15];
+	unsigned int actual_length;
+	enum libusb_transfer_status status;
+	libusbx_testlib_result result = TEST_STATUS_FAILURE;
+	int i, r, offset = 0, expected = 0;
+
+	transfer = libusb_alloc_transfer(16);
+	if (!transfer) {
+		libusbx_testlib_logf(tctx, "Failed to allocate transfer");
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (i = 0; i < (int)sizeof(buffer); ++i)
+		buffer[i] = (unsigned char)i;
+	libusb_fill_iso_transfer(transfer, NULL, 0x81, buffer, sizeof(buffer),
+		16, NULL, NULL, 0);
+	for (i = 0; i < 16; ++i) {
+		transfer->iso_packet_desc[i].length = i;
+		transfer->iso_packet_desc[i].actual_length = i % 3 ? i : 0;
+		transfer->iso_packet_desc[i].status = i == 5 ?
+			LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+	}
+
+	for (i = 0; i < 16; ++i) {
+		if (libusb_get_iso_packet_buffer_indexed(transfer, i)
+				!= libusb_get_iso_packet_buffer(transfer, i)) {
+			libusbx_testlib_logf(tctx, "Wrong address for packet %d", i);
+			goto out;
+		}
+	}
+	if (libusb_get_iso_packet_buffer_indexed(transfer, 16) != NULL) {
+		libusbx_testlib_logf(tctx, "Packet past the end was located");
+		goto out;
+	}
+
+	r = libusb_get_iso_packet_views(transfer, views, 16);
+	if (r != 10 || views[0].packet != 1 || views[3].packet != 5
+			|| views[3].status != LIBUSB_TRANSFER_ERROR
+			|| views[9].buffer != buffer + 91 || views[9].length != 14) {
+		libusbx_testlib_logf(tctx, "Wrong views: %d", r);
+		goto out;
+	}
+	if (libusb_get_iso_packet_views(transfer, views, 9) != LIBUSB_ERROR_OVERFLOW) {
+		libusbx_testlib_logf(tctx, "Short view array was not refused");
+		goto out;
+	}
+
+	r = libusb_gather_iso_packets(transfer, out, sizeof(out));
+	for (i = 0; i < 16; ++i) {
+		if (i % 3 && i != 5) {
+			if (memcmp(out + expected, buffer + offset, i) != 0)
+				break;
+			expected += i;
+		}
+		offset += i;
+	}
+	if (i != 16 || r != expected) {
+		libusbx_testlib_logf(tctx, "Wrong gathered data: %d bytes", r);
+		goto out;
+	}
+	if (libusb_gather_iso_packets(transfer, out, expected - 1)
+			!= LIBUSB_ERROR_OVERFLOW) {
+		libusbx_testlib_logf(tctx, "Short output buffer was not refused");
+		goto out;
+	}
+
+	r = libusb_get_iso_packet_result(transfer, 5, &actual_length, &status);
+	if (r != LIBUSB_SUCCESS || actual_length != 5
+			|| status != LIBUSB_TRANSFER_ERROR) {
+		libusbx_testlib_logf(tctx, "Wrong result for packet 5: %d", r);
+		goto out;
+	}
+
+	/* uniform transfers never submitted hold no results */
+	transfer->flags |= LIBUSB_TRANSFER_UNIFORM_ISO;
+	transfer->iso_packet_desc[0].length = 8;
+	if (libusb_get_iso_packet_buffer_indexed(transfer, 3) != buffer + 24
+			|| libusb_get_iso_packet_buffer(transfer, 3) != buffer + 24) {
+		libusbx_testlib_logf(tctx, "Wrong address for uniform packet 3");
+		goto out;
+	}
+	if (libusb_has_capability(LIBUSB_CAP_SUPPORTS_UNIFORM_ISO)
+			&& libusb_get_iso_packet_result(transfer, 0, &actual_length,
+				&status) != LIBUSB_ERROR_NOT_FOUND) {
+		libusbx_testlib_logf(tctx, "Unsubmitted uniform transfer had results");
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	libusb_free_transfer(transfer);
+	return result;
+}
+
 /* Fill in the list of tests. */
 static const libusbx_testlib_test tests[] = {
 	{"init_and_exit", &test_init_and_exit},
 	{"get_device_list", &test_get_device_list},
 	{"many_device_lists", &test_many_device_lists},
 	{"default_context_change", &test_default_context_change},
+	{"event_thread_latency", &test_event_thread_latency},
+	{"transfer_layout", &test_transfer_layout},
+	{"submit_cancel_race", &test_submit_cancel_race},
+	{"capture_validation", &test_capture_validation},
+	{"capture_flush", &test_capture_flush},
+	{"iso_packet_summary", &test_iso_packet_summary},
+	{"iso_packet_summary_device", &test_iso_packet_summary_device},
+	{"iso_packet_helpers", &test_iso_packet_helpers},
 	LIBUSBX_NULL_TEST
 };
 